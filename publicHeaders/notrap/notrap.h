@@ -27,6 +27,14 @@
 #include "notrap_osx.h"
 #endif
 
+#ifdef __linux__
+#define NTP_LIN
+#define NTP_STDLIB_AVAILABLE
+#define NTP_POSIX_SOCKETS
+#define NTP_POSIX_THREADS
+#include "notrap_linux.h"
+#endif
+
 #ifdef __CYGWIN__
 #define NTP_CYGWIN
 #define NTP_STDLIB_AVAILABLE
@@ -38,6 +46,10 @@
 #include "notrap_posix_sockets.h"
 #endif
 
+#ifdef NTP_POSIX_THREADS
+#include "notrap_posix_threads.h"
+#endif
+
 //The standard library is not available on all platforms.
 //But when it is, we can just use these functions directly.
 //All these will be the same as the normal stdlib, but
@@ -76,11 +88,221 @@
 #define NO 0
 #endif
 
+/**********************************************************************
+ * Section for atomics. For counters and flags shared between threads,
+ * where a lock would be overkill. Every operation takes one of the
+ * NTP_ORDER_ memory orders, which say what other memory the operation
+ * keeps in order:
+ *   NTP_ORDER_RELAXED  nothing, it's just atomic. Fine for counters.
+ *   NTP_ORDER_ACQUIRE  for loads. Reads after it can't move before it.
+ *   NTP_ORDER_RELEASE  for stores. Writes before it can't move after it.
+ *                      A thread that acquires the value it stored sees
+ *                      everything written before the release.
+ *   NTP_ORDER_ACQ_REL  both, for exchanges and compare-exchanges.
+ *   NTP_ORDER_SEQ_CST  everything, in one order all threads agree on.
+ *                      The safest, and the slowest.
+ *
+ * There are three types: NTPAtomicInt, NTPAtomicInt64 and NTPAtomicPtr.
+ * Initialize a static one with NTP_ATOMIC_INIT(value), or use Store.
+ * The functions have the type name in them, for example:
+ *
+ *    static NTPAtomicInt64 bytesSent = NTP_ATOMIC_INIT(0);
+ *    NTPAtomicFetchAddInt64(&bytesSent, len, NTP_ORDER_RELAXED);
+ *
+ *   Load(a, order)                  returns the value
+ *   Store(a, v, order)
+ *   Exchange(a, v, order)           stores v, returns the old value
+ *   CompareExchange(a, &expected, desired, order)
+ *                                   if the value is expected, stores
+ *                                   desired and returns TRUE. Otherwise
+ *                                   puts the value in expected and
+ *                                   returns FALSE.
+ *   FetchAdd(a, v, order)           adds v, returns the old value.
+ *                                   Not for NTPAtomicPtr.
+ * and NTPAtomicFence(order) on its own.
+ **********************************************************************/
+#include "notrap_atomic.h"
+
 /**********************************************************************
  * Section for utility functions
  **********************************************************************/
+
+/**Milliseconds since 1970, by the wall clock. The wall clock can jump
+ * when someone sets it, so to measure how long something took, use
+ * NTPMonotonicMillis() instead.*/
 time_t NTPcurrentTimeMillis();
 
+/**Time on a clock that never jumps or goes backwards, counting from
+ * some arbitrary point (usually boot). Only good for differences.
+ * On Linux none of these make a system call.*/
+int64_t NTPMonotonicNanos();
+int64_t NTPMonotonicMillis();
+
+/**Like NTPMonotonicMillis(), but even cheaper, because the OS only
+ * updates it every few milliseconds. Where there's no such clock it's
+ * the same as NTPMonotonicMillis(). Good for timestamps on lots of
+ * events, like the last time a connection did anything.*/
+int64_t NTPCoarseMillis();
+
+/**********************************************************************
+ * Section for timers. A timer wheel keeps track of a huge number of
+ * timeouts (an idle timeout for every connection, say), where most
+ * get stopped or started again before they go off. Starting and
+ * stopping a timer takes the same short time no matter how many there
+ * are, and doesn't allocate anything, since the NTPTimer is yours:
+ * usually it's a field in your connection struct.
+ *
+ * A wheel doesn't have a thread. You run it from your event loop,
+ * using how long until the next timer as the timeout for waiting:
+ *
+ *    NTPTimerWheel *wheel = NTPNewTimerWheel(10);
+ *    NTPInitTimer(&conn->idle, closeIdle, conn);
+ *    NTPStartTimer(wheel, &conn->idle, 30000);
+ *    while(1) {
+ *       n = NTPPollerWait(poller, events, max, NTPTimerWheelTimeout(wheel));
+ *       ... (for each event: NTPStartTimer(wheel, &conn->idle, 30000))
+ *       NTPRunTimers(wheel);
+ *    }
+ *
+ * Timers go off in the thread that calls NTPRunTimers(), and never
+ * before their time. Depending on how often you run the wheel, they
+ * can go off up to a tick or so late. A wheel is not thread safe.
+ **********************************************************************/
+typedef struct NTPTimerWheel_struct NTPTimerWheel;
+typedef struct NTPTimer_struct NTPTimer;
+
+/**Called when timer goes off. It's already stopped, so it can start
+ * itself again, or start and stop any other timers.*/
+typedef void (*NTPTimerFunc)(NTPTimer *timer, void *arg);
+
+//Don't touch these fields; use the functions below.
+struct NTPTimer_struct {
+	NTPTimer      *next, *prev;
+	NTPTimerWheel *wheel;    //NULL when it isn't started
+	uint64_t       expires;  //in ticks
+	NTPTimerFunc   func;
+	void          *arg;
+};
+
+/**tickMS is how precise the timers are, and should be the same order
+ * as how often you run the wheel. 10 is good for network timeouts.
+ * 0 or less means 1. A timer can be up to about 49 days times tickMS
+ * away; longer ones go off then.
+ * Returns NULL if there's no memory.*/
+NTPTimerWheel *NTPNewTimerWheel(int tickMS);
+
+/**Frees the wheel. Timers still in it are stopped, without going off.
+ * Sets *wheel to NULL.*/
+void NTPFreeTimerWheel(NTPTimerWheel **wheel);
+
+/**Sets up a timer. Call this once before using it.*/
+void NTPInitTimer(NTPTimer *timer, NTPTimerFunc func, void *arg);
+
+/**Makes the timer go off delayMS from now. If it was already started,
+ * it's moved, so this is also how to push a timeout back.*/
+void NTPStartTimer(NTPTimerWheel *wheel, NTPTimer *timer, int64_t delayMS);
+
+/**Stops the timer, if it was started. Always stop a timer before
+ * freeing the memory it's in.*/
+void NTPStopTimer(NTPTimer *timer);
+
+/**TRUE if the timer is started and hasn't gone off yet.*/
+BOOL NTPTimerPending(NTPTimer *timer);
+
+/**How many timers are started in the wheel.*/
+int NTPTimersPending(NTPTimerWheel *wheel);
+
+/**Calls the function of every timer whose time has come.
+ * Returns how many went off.*/
+int NTPRunTimers(NTPTimerWheel *wheel);
+
+/**How many milliseconds you can wait before you need to call
+ * NTPRunTimers(), or -1 if there are no timers. It can be earlier than
+ * the next timer, but never later. Pass it to NTPPollerWait() or
+ * NTPSelect() as the timeout.*/
+int NTPTimerWheelTimeout(NTPTimerWheel *wheel);
+
+
+/**********************************************************************
+ * Section for memory. malloc() is fine most of the time, but a server
+ * that makes and throws away lots of small things for every request
+ * spends a lot of time in it, and threads fight over it. These are
+ * for when that shows up in a profile.
+ **********************************************************************/
+
+/**An arena hands out memory by moving a pointer along a big chunk, and
+ * you free everything at once with NTPArenaReset(). Good for things
+ * that all live as long as one request. Memory is aligned like
+ * malloc(). An arena isn't thread safe; give each thread its own.
+ *
+ *    NTPArena *arena = NTPNewArena(0);
+ *    while(...) {
+ *       Header *h = NTPArenaAlloc(arena, sizeof(Header));
+ *       ...
+ *       NTPArenaReset(arena);  //everything from this request is gone
+ *    }
+ *
+ * chunkSize is how much is malloc()ed at a time, 0 for 64KB. Bigger
+ * allocations than a quarter chunk get their own block.
+ * Returns NULL if there's no memory. */
+typedef struct NTPArena_struct NTPArena;
+NTPArena *NTPNewArena(size_t chunkSize);
+void NTPFreeArena(NTPArena **arena);
+
+/**Returns NULL if there's no memory.*/
+void *NTPArenaAlloc(NTPArena *arena, size_t size);
+
+/**Frees everything allocated from the arena. The chunks are kept, so
+ * the next request doesn't need to malloc() them again.*/
+void NTPArenaReset(NTPArena *arena);
+
+/**How many bytes were allocated since the last reset, including
+ * padding for alignment.*/
+size_t NTPArenaBytes(NTPArena *arena);
+
+/**A pool hands out objects that are all the same size, and takes
+ * them back one at a time. Each thread keeps a few free objects to
+ * itself, so most allocs and frees don't take a lock. Any thread can
+ * free an object, even if another thread allocated it.
+ * Memory given to a pool isn't given back to the system until the
+ * pool is freed, which frees all its objects at once.
+ * objectsPerChunk is how many objects are malloc()ed at a time, 0 or
+ * less for 64. Each pool uses a pthread key, so don't make thousands.
+ * Returns NULL if there's no memory. */
+typedef struct NTPPool_struct NTPPool;
+NTPPool *NTPNewPool(size_t objectSize, int objectsPerChunk);
+void NTPFreePool(NTPPool **pool);
+
+/**Returns NULL if there's no memory.*/
+void *NTPPoolAlloc(NTPPool *pool);
+
+/**ptr must have come from NTPPoolAlloc() on the same pool. NULL is ok.*/
+void NTPPoolFree(NTPPool *pool, void *ptr);
+
+/**How many objects the pool has memory for, used or not.*/
+size_t NTPPoolCapacity(NTPPool *pool);
+
+/**To see how much memory you're using, build NOTRAP and your program
+ * with NTP_MALLOC_STATS defined. Then NTPmalloc() and NTPfree() go
+ * through NTPInstrumentedMalloc() and NTPInstrumentedFree(), which
+ * keep these counts. They cost two or three atomic adds per call.
+ * Memory from NTPInstrumentedMalloc() must be freed with
+ * NTPInstrumentedFree(), never free(). NOTRAP's own allocations
+ * aren't counted. */
+typedef struct {
+	uint64_t bytesInUse;
+	uint64_t peakBytes;     //the most bytesInUse has ever been
+	uint64_t allocations;
+	uint64_t frees;
+} NTPMallocStats;
+
+void *NTPInstrumentedMalloc(size_t size);
+void NTPInstrumentedFree(void *ptr);
+void NTPGetMallocStats(NTPMallocStats *stats);
+
+/**Prints the counts, e.g. NTPDumpMallocStats(stderr)*/
+void NTPDumpMallocStats(FILE *out);
+
 
 
 /**********************************************************************
@@ -99,6 +321,73 @@ typedef struct NTPSock_struct NTPSock;
  * connection, call NTPSockStatus(). Can return NULL if no memory.*/
 NTPSock *NTPConnectTCP(const char *destination, uint16_t port);
 
+/**The same as NTPConnectTCP(), but gives up if the connect hasn't
+ * finished after timeoutMS milliseconds (0 or less means never give up).
+ * As soon as the time is up, NTPSockStatus() returns NTPSOCK_ERROR and
+ * NTPSockTimedOut() returns TRUE, and any sockets that were still trying
+ * to connect are closed. A DNS lookup can't be stopped, though, so the
+ * lookup thread might keep working a little longer.*/
+NTPSock *NTPConnectTCPWithTimeout(const char *destination, uint16_t port,
+                                  int timeoutMS);
+
+/**NTPConnectTCP() does its DNS lookups and connects on a small pool
+ * of threads, which are started as they are needed. This sets the
+ * most threads the pool will use, and how many connects can wait for
+ * a free thread. When that many are already waiting, NTPConnectTCP()
+ * fails right away, and the sock it returns will be in NTPSOCK_ERROR.
+ * The defaults are 16 threads and 1024 waiting.
+ * Returns FALSE if either number is less than 1.*/
+BOOL NTPSetConnectPool(int maxThreads, int maxWaiting);
+
+/**NTPConnectTCP() remembers DNS lookups for a while, so connecting
+ * to the same place again doesn't wait on the resolver. Failed lookups
+ * are remembered too, but for a shorter time. IP addresses are never
+ * looked up, so they aren't cached.
+ * This sets how long, in milliseconds, successful and failed lookups
+ * are remembered. 0 turns caching off. The defaults are 60000 and 5000.*/
+void NTPSetDNSCacheTTL(int positiveMS, int negativeMS);
+
+/**Looks up destination right now (blocking) and puts the answer in
+ * the cache, replacing anything already there.
+ * Returns TRUE if the lookup succeeded.*/
+BOOL NTPDNSPrefill(const char *destination, uint16_t port);
+
+/**Forgets everything in the DNS cache.*/
+void NTPDNSFlush();
+
+/**Returns the number of addresses cached for destination and port,
+ * 0 if a failed lookup is cached, or -1 if nothing is cached.*/
+int NTPDNSCached(const char *destination, uint16_t port);
+
+/**Gets the number of cache hits and misses since the program started,
+ * and the number of entries in the cache. Any of these can be NULL.*/
+void NTPDNSCacheStats(uint64_t *hits, uint64_t *misses, int *entries);
+
+/**When a destination has more than one address (IPv6 and IPv4, say),
+ * NTPConnectTCP() doesn't wait for one to fail before trying the next.
+ * It starts a new attempt every delayMS until one connects, alternating
+ * address families, and the first to connect wins. The default delay
+ * is 250 milliseconds.*/
+void NTPSetConnectAttemptDelay(int delayMS);
+
+//What happened to one address during a connect
+#define NTPATTEMPT_CONNECTED 1 //This one won
+#define NTPATTEMPT_FAILED    2 //This one couldn't connect
+#define NTPATTEMPT_CANCELLED 3 //Another one won first
+typedef struct {
+	char address[64];  //the IP address, as text
+	BOOL ipv6;         //TRUE if IPv6, FALSE if IPv4
+	int  result;       //one of the NTPATTEMPT_ values
+	int  startMS;      //when it started, after the lookup finished
+	int  durationMS;   //how long it took to finish
+} NTPConnectAttempt;
+
+/**Once a connect is finished, tells you how each address attempt
+ * went, so you can see which ones are slow. Up to max attempts are
+ * stored in attempts, in the order they were started.
+ * Returns the total number of attempts, or -1 if still connecting.*/
+int NTPConnectAttempts(NTPSock *sock, NTPConnectAttempt *attempts, int max);
+
 //Returns the current status of the socket. This is especially
 //useful during connection.
 //Returns one of the following:
@@ -109,10 +398,21 @@ NTPSock *NTPConnectTCP(const char *destination, uint16_t port);
                                //For a string representation of the error.
 int NTPSockStatus(NTPSock *sock); 
 
+/**Sleeps until the connect finishes or timeoutMS goes by, then returns
+ * NTPSockStatus(). So NTPSOCK_CONNECTING means it timed out. A negative
+ * timeoutMS waits as long as the connect does. Use it instead of calling
+ * NTPSockStatus() in a loop. Don't NTPDisconnect() the sock from another
+ * thread while this is waiting on it.*/
+int NTPWaitConnected(NTPSock *sock, int timeoutMS);
+
 /**Returns a human readable error message to represent the last error.
  * sock can be NULL, which might possibly yield a more general error*/
 const char*NTPSockErr(NTPSock*sock);
 
+/**Returns TRUE if the connect failed because it took longer than
+ * the timeout given to NTPConnectTCPWithTimeout().*/
+BOOL NTPSockTimedOut(NTPSock *sock);
+
 /**Disconnects the sock and frees all associated resources.
  * Sets *sock to NULL.*/
 void NTPDisconnect(NTPSock **sock);
@@ -120,10 +420,83 @@ void NTPDisconnect(NTPSock **sock);
 /**Begins listening on a local port for incoming connections*/
 NTPSock*NTPListen(uint16_t port);
 
+/**The same as NTPListen(), but you choose how many connections can
+ * wait to be accepted (NTPListen() uses 100). The OS may limit it.*/
+NTPSock*NTPListenWithBacklog(uint16_t port, int backlog);
+
+/**Opens nShards listening socks on the same port, so each one can be
+ * given to its own thread. The OS spreads new connections across them,
+ * so the threads don't all fight over one accept queue.
+ * If steerByCPU is TRUE, a connection goes to the shard whose number is
+ * the number of the CPU that received it (mod nShards), so if you pin
+ * the thread for shards[i] to CPU i, a connection stays on one CPU.
+ * Where steering isn't available it is ignored.
+ * Stores the socks in shards, which must have room for nShards.
+ * Returns TRUE on SUCCESS. On ERROR returns FALSE, closes everything,
+ * and leaves a sock in shards[0] you can call NTPSockErr() on (and
+ * must NTPDisconnect()). If nShards is less than 1, returns FALSE
+ * without touching shards.*/
+BOOL NTPListenSharded(uint16_t port, int nShards, BOOL steerByCPU,
+                      NTPSock **shards);
+
+/**Unix domain socks, for talking to another program on the same
+ * machine. They skip DNS, the connect thread and the TCP stack, so
+ * they're a lot faster than connecting to localhost. They're ordinary
+ * NTPSocks: NTPAccept(), NTPSend(), NTPRecv(), NTPSelect(), the poller
+ * and NTPDisconnect() all work on them.
+ *
+ * name is the path of the socket file. On Linux, a name starting with
+ * '@' is in the abstract namespace instead, which doesn't make a file.
+ * type is one of these:*/
+#define NTPUNIX_STREAM    1 //a byte stream, like TCP
+#define NTPUNIX_SEQPACKET 2 //keeps the boundaries of each send, and
+                            //each NTPRecv() gets one whole message.
+                            //Not on every platform.
+
+/**Connects right away; there's nothing to wait for, so NTPSockStatus()
+ * is already NTPSOCK_CONNECTED or NTPSOCK_ERROR when this returns. If
+ * the listener has too many connections waiting to be accepted, that's
+ * an error, rather than waiting for it to catch up.
+ * Returns NULL only if there's no memory.*/
+NTPSock *NTPConnectUnix(const char *name, int type);
+
+/**Listens on name. If the socket file is left over from a program that
+ * didn't clean up, it's replaced, but not if somebody is still
+ * listening on it. The file is removed when the sock is disconnected.
+ * Returns NULL only if there's no memory.*/
+NTPSock *NTPListenUnix(const char *name, int type);
+
+/**Makes two socks connected to each other, for passing data between
+ * threads (or a child process) through the same code that talks to the
+ * network. Stores them in *a and *b.
+ * Returns FALSE if it couldn't, and sets them both to NULL.*/
+BOOL NTPSocketPair(int type, NTPSock **a, NTPSock **b);
+
+/**Wraps a file descriptor you already have, like a pipe, in an NTPSock,
+ * so it can go in NTPSelect() or a poller next to your other socks.
+ * NTPDisconnect() closes it. Returns NULL if there's no memory.*/
+NTPSock *NTPSockFromFD(int fd);
+
 /**Waits to accept a connection on a listening port.
  * Resources must be freed later by calling NTPDisconnect() */
 NTPSock*NTPAccept(NTPSock *listenSock);
 
+//One connection from NTPAcceptMany()
+typedef struct {
+	NTPSock *sock;
+	char     address[64];  //the IP address of the other end, as text
+	uint16_t port;         //and its port
+} NTPAccepted;
+
+/**Accepts every connection that is waiting on a listening port, up to
+ * max of them, without blocking. Use this with NTPSelect() or a poller
+ * when a lot of connections arrive at once.
+ * The new socks are non-blocking: NTPSend() and NTPRecv() return -1
+ * instead of waiting when there's no room or no data.
+ * Returns the number stored in accepted (0 if nobody is waiting),
+ * or -1 on error. Each sock must be freed with NTPDisconnect().*/
+int NTPAcceptMany(NTPSock *listenSock, NTPAccepted *accepted, int max);
+
 /**Sends bytes over the socket.
  * Returns the number of bytes written, or -1 if there is
  * an error. Not all bytes are guaranteed to be written.*/
@@ -133,6 +506,241 @@ int NTPSend(NTPSock *sock, void *bytes, int len);
  * in buf. Returns the number of bytes actually read. */
 int NTPRecv(NTPSock *sock, void *buf, int len);
 
+/**Scatter/gather versions of NTPSend() and NTPRecv(), so you can
+ * send a header and a payload (for example) without copying them into
+ * one buffer first, and without two system calls.
+ * An NTPIOVec has two fields you fill in:
+ *    base, a pointer to the bytes
+ *    len,  the number of bytes
+ * NTPSendv() sends the bytes from count NTPIOVecs, in order.
+ * NTPRecvv() fills the NTPIOVecs, in order.
+ * Both return the number of bytes sent or received, or -1 on error.
+ * Like NTPSend(), not all bytes are guaranteed to be written.*/
+typedef struct NTPIOVec_struct NTPIOVec;
+int NTPSendv(NTPSock *sock, NTPIOVec *vecs, int count);
+int NTPRecvv(NTPSock *sock, NTPIOVec *vecs, int count);
+
+/**After NTPSendv() or NTPRecvv() only did part of the work, call this
+ * with the number of bytes that were done. It moves *vecs and *count
+ * past the finished NTPIOVecs, and adjusts the first unfinished one
+ * (in place) so it starts with the first byte that's left.
+ * Returns the number of NTPIOVecs left, which is 0 when you're done.
+ *
+ * So sending a whole message looks like this:
+ *
+ *    while(count>0) {
+ *       int sent = NTPSendv(sock, vecs, count);
+ *       if(sent<0) //deal with error
+ *       NTPIOVecAdvance(&vecs, &count, sent);
+ *    }
+ */
+int NTPIOVecAdvance(NTPIOVec **vecs, int *count, int bytes);
+
+/**Buffered reading. Reading a protocol a few bytes at a time with
+ * NTPRecv() makes a system call for every read, and every caller needs
+ * its own loop for when recv comes back short. A reader keeps a buffer
+ * that it fills with as much as the kernel has in one recv, and reads
+ * come out of that.
+ *
+ *    NTPSockReader *reader = NTPNewSockReader(sock, 0);
+ *    char line[256];
+ *    while(NTPReadLine(reader, line, sizeof(line))>=0) {
+ *       ...
+ *    }
+ *
+ * These are for blocking socks. They return -1 on error, and also
+ * when the connection closes before they have what they need (call
+ * NTPSockErr() on the sock to find out which). After that, don't use
+ * the reader for anything but NTPFreeSockReader().
+ * Once you read through a reader, only read through it, since it has
+ * probably already taken bytes off the sock.
+ *
+ * bufferSize is how much it can hold, 0 for 16KB. Freeing the reader
+ * doesn't disconnect the sock. NULL if there's no memory.*/
+typedef struct NTPSockReader_struct NTPSockReader;
+NTPSockReader *NTPNewSockReader(NTPSock *sock, int bufferSize);
+void NTPFreeSockReader(NTPSockReader **reader);
+
+/**Reads exactly len bytes into buf. Returns len, or -1.*/
+int NTPReadExact(NTPSockReader *reader, void *buf, int len);
+
+/**Reads up to and including the first delim, and stores it in buf.
+ * Returns the number of bytes stored, or -1. Gives up with -1 if there's
+ * no delim within max bytes (or the reader's bufferSize, if that's
+ * smaller), without taking anything, so you can still NTPReadExact().*/
+int NTPReadUntil(NTPSockReader *reader, char delim, void *buf, int max);
+
+/**Reads a line ending in "\n" or "\r\n" into line, without the ending,
+ * and with a 0 after it. max includes room for the 0.
+ * Returns the length of the line (which can be 0), or -1.*/
+int NTPReadLine(NTPSockReader *reader, char *line, int max);
+
+/**Copies up to len of the next bytes into buf, without taking them,
+ * so the next read gets them again. If nothing is buffered, waits for
+ * one recv. Returns the number copied, or -1.*/
+int NTPPeek(NTPSockReader *reader, void *buf, int len);
+
+/**How many bytes the reader has that haven't been read. If it's more
+ * than 0, don't wait for the sock to be readable before reading, since
+ * the bytes may already be here.*/
+int NTPReaderBuffered(NTPSockReader *reader);
+
+/**Buffered writing. A writer copies small writes into its buffer, and
+ * sends them all together when it fills up, or when you NTPFlush().
+ * Always NTPFlush() when a message is done, or the other end might
+ * wait forever for the last piece.
+ * Like the reader, this is for blocking socks; writes and flushes
+ * send everything before returning.
+ * bufferSize is how much it holds before sending, 0 for 16KB. Freeing
+ * the writer doesn't flush it or disconnect the sock.*/
+typedef struct NTPSockWriter_struct NTPSockWriter;
+NTPSockWriter *NTPNewSockWriter(NTPSock *sock, int bufferSize);
+void NTPFreeSockWriter(NTPSockWriter **writer);
+
+/**Returns len, or -1 if sending failed (the bytes are lost then).*/
+int NTPWrite(NTPSockWriter *writer, const void *bytes, int len);
+
+/**Sends everything in the buffer. Returns TRUE on SUCCESS.*/
+BOOL NTPFlush(NTPSockWriter *writer);
+
+/**How many bytes are waiting to be sent.*/
+int NTPWriterBuffered(NTPSockWriter *writer);
+
+/**Sends up to length bytes from an open file, starting at *offset,
+ * without copying them through your memory first (where the OS allows
+ * that, otherwise it copies through a small buffer). *offset is moved
+ * forward by the number of bytes sent, and the file's own position
+ * isn't changed.
+ * Returns the number of bytes sent, which can be less than length.
+ * Call it again to send the rest. If the sock is non-blocking and has
+ * no room, returns 0. Returns -1 on error, including when the file
+ * ends before length bytes were sent.*/
+int64_t NTPSendFile(NTPSock *sock, int fileDescriptor, int64_t *offset,
+                    int64_t length);
+
+/**Opens the file at path and sends all of it, then closes it.
+ * Blocks until done, waiting for room if the sock is non-blocking.
+ * Returns TRUE on SUCCESS, FALSE on ERROR.*/
+BOOL NTPSendFilePath(NTPSock *sock, const char *path);
+
+/**Zero-copy sends, for big buffers. Normally NTPSend() copies your
+ * bytes into the OS before returning, so you can reuse the buffer
+ * right away. With zero-copy, the OS sends straight from your buffer,
+ * which saves the copy, but you can't touch the buffer until the OS
+ * tells you it's done with it. Only worth it for sends of more than
+ * a few kilobytes.
+ *
+ * The way to use this:
+ * Turn it on with NTPSetZeroCopy(). This fails where the OS can't do it,
+ * but NTPSendZeroCopy() still works there, it just copies.
+ * Send with NTPSendZeroCopy(). Each successful zero-copy send gets an
+ * id, counting up from 0. Sends made while it's off are copied, and get
+ * NTPZEROCOPY_NONE instead, since their buffer is free right away.
+ * When the sock is ready with NTPPOLL_ERROR (which a poller always
+ * reports), call NTPReapZeroCopy(). It calls your function once for
+ * each range of ids whose buffers can be reused.
+ * Turning it off fails while there are sends that haven't been reaped.*/
+BOOL NTPSetZeroCopy(NTPSock *sock, BOOL on);
+
+//The id of a send that was copied, so there's nothing to wait for
+#define NTPZEROCOPY_NONE 0xffffffff
+
+/**Like NTPSend(), and stores the id of this send in *sendId.*/
+int NTPSendZeroCopy(NTPSock *sock, void *bytes, int len, uint32_t *sendId);
+
+/**Called by NTPReapZeroCopy(). The buffers of sends firstId through
+ * lastId (inclusive) can be reused. 'copied' is TRUE if the OS ended
+ * up copying them anyway, which means zero-copy isn't helping.*/
+typedef void (*NTPZeroCopyDone)(NTPSock *sock, uint32_t firstId,
+                                uint32_t lastId, BOOL copied, void *userData);
+
+/**Collects finished zero-copy sends without blocking, and calls done
+ * for each range. Returns the number of ranges, or -1 on error.*/
+int NTPReapZeroCopy(NTPSock *sock, NTPZeroCopyDone done, void *userData);
+
+/**UDP. A UDP sock is an NTPSock, so NTPSockErr(), NTPDisconnect(),
+ * NTPSelect() and the poller work on it the same way. A sock from
+ * NTPUDPConnect() can also use NTPSend() and NTPRecv(), where each
+ * call is one datagram.
+ * Both of these return NULL only if there's no memory. Check
+ * NTPSockStatus(), which is NTPSOCK_CONNECTED when the sock is ready,
+ * or NTPSOCK_ERROR.*/
+
+/**Receives datagrams sent to port on any address, IPv4 or IPv6.
+ * 0 lets the OS pick a port; find out which with NTPSockLocalPort().*/
+NTPSock *NTPUDPBind(uint16_t port);
+
+/**Sends to, and only receives from, destination and port. Unlike
+ * NTPConnectTCP(), this looks destination up right away, and blocks
+ * until that's done. There's nothing else to wait for.*/
+NTPSock *NTPUDPConnect(const char *destination, uint16_t port);
+
+/**The local port the sock is using, or 0 if it doesn't have one.*/
+uint16_t NTPSockLocalPort(NTPSock *sock);
+
+/**Where a datagram goes to or comes from. Look one up once with
+ * NTPResolveAddress() and keep it, so you don't pay for a lookup on
+ * every send. The lookup blocks. Returns FALSE if it failed.*/
+typedef struct NTPAddress_struct NTPAddress;
+BOOL NTPResolveAddress(const char *destination, uint16_t port,
+                       NTPAddress *address);
+
+/**Writes the address as text in buf, and its port in *port (which can
+ * be NULL).*/
+void NTPAddressToString(const NTPAddress *address, char *buf, int len,
+                        uint16_t *port);
+
+/**Sends len bytes as one datagram to address. If address is NULL, it
+ * goes where the sock is connected. Returns len, or -1 on error.*/
+int NTPUDPSendTo(NTPSock *sock, const void *bytes, int len,
+                 const NTPAddress *to);
+
+/**Waits for one datagram, and puts up to len bytes of it in buf. If
+ * it's longer, the rest is thrown away. from gets who sent it, and can
+ * be NULL. Returns the number of bytes, or -1 on error.*/
+int NTPUDPRecvFrom(NTPSock *sock, void *buf, int len, NTPAddress *from);
+
+//One datagram for NTPUDPSendMany() or NTPUDPRecvMany()
+typedef struct {
+	void       *buf;
+	int         size;         //recv: room in buf
+	int         len;          //send: bytes to send. recv: bytes received
+	NTPAddress *address;      //send: where to (NULL if connected).
+	                          //recv: who from (NULL if you don't care)
+	int         segmentSize;  //recv: with GRO on, buf can hold several
+	                          //datagrams of this size, the last one maybe
+	                          //shorter. 0 if it's just one.
+} NTPDatagram;
+
+/**Sends count datagrams, with as few system calls as possible (on
+ * Linux, one for every 64).
+ * Returns how many were sent, which can be less than count when the
+ * OS is out of room, or -1 on error if none were.*/
+int NTPUDPSendMany(NTPSock *sock, NTPDatagram *dgrams, int count);
+
+/**Receives up to count datagrams (at most 64) in one system call where
+ * the OS can. If wait is TRUE, it waits for the first one, then takes
+ * whatever else is already there. If wait is FALSE, it returns 0 if
+ * nothing's there.
+ * Returns the number received, or -1 on error.*/
+int NTPUDPRecvMany(NTPSock *sock, NTPDatagram *dgrams, int count, BOOL wait);
+
+/**Segmentation offload (Linux only). Once this is set, a send of more
+ * than segmentSize bytes goes out as several datagrams of segmentSize
+ * (the last one maybe shorter), but costs the system call and trip
+ * through the network stack of one. Keep segmentSize under the path
+ * MTU and sends under 64KB. 0 turns it off.
+ * Returns FALSE if the OS can't do it.*/
+BOOL NTPUDPSetSegmentSize(NTPSock *sock, int segmentSize);
+
+/**Receive offload (Linux only). The OS can hand over several datagrams
+ * from the same sender in one buffer; NTPUDPRecvMany() tells you their
+ * size in segmentSize. Only turn this on if you use NTPUDPRecvMany(),
+ * since the other receives can't tell you where they split. Make the
+ * buffers 64KB so the biggest bundle fits.
+ * Returns FALSE if the OS can't do it.*/
+BOOL NTPUDPSetGRO(NTPSock *sock, BOOL on);
+
 /**Select is useful enough to include here, even if it is
  * the most confusing function ever written.*/
 typedef struct NTP_FD_SET_struct NTP_FD_SET;
@@ -144,7 +752,7 @@ void NTP_ZERO_SET(NTP_FD_SET *set);
 /**The way to use this:
  * Create a write set. Add NTPSocks to the write set using NTP_FD_ADD()
  * Create a read set.  Add NTPSocks to the read  set using NTP_FD_ADD()
- * Call NTPSelect() with a timeout.
+ * Call NTPSelect() with a timeout. A negative timeout waits forever.
  *
  * As soon as one of sockets in readSet has data available for reading,
  * or one of the sockets in writeSet has space available for writing,
@@ -155,11 +763,244 @@ void NTP_ZERO_SET(NTP_FD_SET *set);
  *
  * Be sure to call NTP_ZERO_SET() to clear the sets before calling NTP_FD_ADD()
  *
+ * A sock that is still connecting can be added too. It shows up as ready,
+ * in whichever set you added it to, once the connect has finished
+ * (successfully or not), or right away if it already failed. Then call
+ * NTPSockStatus() to see which.
+ *
  * RETURNS: a negative number on error (call NTPSockErr() to find out which
  * error), a positive number on success, or 0 on timeout. 
  * When a timeout occurs, it might not have taken up the entire timeoutMS
  * time period, so don't  rely on this as a timer.*/
 int NTPSelect(NTP_FD_SET *readSet, NTP_FD_SET *writeSet, int timeoutMS);
+//NTPSelect() is kept for compatibility. It is built on fd_set, so it
+//can't handle sockets numbered above FD_SETSIZE (usually 1024), and
+//NTP_FD_ADD() will silently ignore them. If you have a lot of sockets,
+//use the NTPPoller below.
+
+/**A poller is a persistent set of sockets you are waiting on. Unlike
+ * NTPSelect(), you register sockets once instead of rebuilding a set
+ * every call, and waiting gives you back only the sockets that are
+ * ready, so it stays fast with tens of thousands of sockets. On Linux
+ * it is backed by epoll.
+ *
+ * The way to use this:
+ * Create a poller with NTPNewPoller().
+ * Register sockets with NTPPollerAdd(), saying which events you want.
+ * Call NTPPollerWait() in a loop, and handle the ready events it returns.
+ *
+ * A poller should only be used from one thread at a time. Be sure to
+ * call NTPPollerRemove() before calling NTPDisconnect() on a sock.*/
+typedef struct NTPPoller_struct NTPPoller;
+
+//Events you can wait for. OR them together.
+#define NTPPOLL_READ   0x01 //Data available for reading (or accept)
+#define NTPPOLL_WRITE  0x02 //Space available for writing
+#define NTPPOLL_ERROR  0x04 //Only returned, never requested. Error or hangup.
+#define NTPPOLL_EDGE   0x08 //Only requested. Report an event once when
+                            //it becomes ready, instead of every wait
+                            //while it is ready (edge-triggered). Not
+                            //available on all platforms, where it is
+                            //ignored and you get the normal behavior.
+
+//One ready socket, as returned by NTPPollerWait()
+typedef struct {
+	NTPSock *sock;
+	int      events;    //NTPPOLL_ flags that are ready
+	void    *userData;  //whatever you passed to NTPPollerAdd()
+} NTPPollEvent;
+
+/**Creates a new poller. Returns NULL on error.*/
+NTPPoller *NTPNewPoller();
+
+/**Frees a poller. Does not disconnect the sockets in it.
+ * Sets *poller to NULL*/
+void NTPFreePoller(NTPPoller **poller);
+
+/**Starts watching sock for the NTPPOLL_ events in 'events'. userData
+ * is given back to you with every event on this sock.
+ * Returns TRUE on SUCCESS, FALSE on ERROR (call NTPPollerErr()).
+ *
+ * The sock can still be connecting. When the connect finishes, you get
+ * NTPPOLL_WRITE if it worked (if you asked for NTPPOLL_WRITE), and after
+ * that the poller watches the connected sock like any other. If the
+ * connect failed, even if it failed before you added it, you get
+ * NTPPOLL_ERROR until you remove the sock.*/
+BOOL NTPPollerAdd(NTPPoller *poller, NTPSock *sock, int events, void *userData);
+
+/**Changes the events and userData for a sock that was already added.*/
+BOOL NTPPollerModify(NTPPoller *poller, NTPSock *sock, int events,
+                     void *userData);
+
+/**Stops watching a sock.*/
+BOOL NTPPollerRemove(NTPPoller *poller, NTPSock *sock);
+
+/**Waits until at least one of the socks is ready, or timeoutMS goes by.
+ * A negative timeoutMS waits forever.
+ * Ready socks are stored in events, up to maxEvents of them.
+ * RETURNS: the number of events stored, 0 on timeout, or a negative
+ * number on error (call NTPPollerErr()).*/
+int NTPPollerWait(NTPPoller *poller, NTPPollEvent *events, int maxEvents,
+                  int timeoutMS);
+
+/**Returns a human readable error message for the last poller error.*/
+const char *NTPPollerErr(NTPPoller *poller);
+
+/**An IO ring lets you queue up a lot of sends, recvs and accepts on
+ * many socks, hand them all to the OS at once, and later collect the
+ * results in bulk. This saves a system call per operation. On Linux it
+ * is backed by io_uring. Where io_uring isn't available, it falls back
+ * to waiting for the socks to be ready and doing normal sends and recvs,
+ * so it works the same way everywhere, just slower.
+ *
+ * The way to use this:
+ * Create a ring with NTPNewIORing().
+ * Queue operations with NTPIORingRecv(), NTPIORingSend(), NTPIORingAccept().
+ * Call NTPIORingSubmit() to start them all.
+ * Call NTPIORingReap() to collect the ones that have completed.
+ *
+ * The buffers you pass in must stay valid until the operation completes,
+ * and you must not NTPDisconnect() a sock that has operations pending.
+ * A ring should only be used from one thread at a time.*/
+typedef struct NTPIORing_struct NTPIORing;
+
+//Operation types, found in NTPIOCompletion.op
+#define NTPIO_RECV    1
+#define NTPIO_SEND    2
+#define NTPIO_ACCEPT  3
+
+//One completed operation, as returned by NTPIORingReap()
+typedef struct {
+	int      op;        //NTPIO_RECV, NTPIO_SEND or NTPIO_ACCEPT
+	NTPSock *sock;      //the sock the operation was queued on
+	int      result;    //bytes sent or received, 0 on accept success,
+	                    //or -1 on error (call NTPSockErr() on sock)
+	NTPSock *accepted;  //for NTPIO_ACCEPT, the new sock. You must
+	                    //NTPDisconnect() it. Otherwise NULL.
+	void    *userData;  //whatever you passed when queueing
+} NTPIOCompletion;
+
+/**Creates a new ring that can have up to maxOps operations pending
+ * at once. Returns NULL on error.*/
+NTPIORing *NTPNewIORing(int maxOps);
+
+/**Frees a ring. Pending operations are abandoned.
+ * Sets *ring to NULL*/
+void NTPFreeIORing(NTPIORing **ring);
+
+/**Returns TRUE if the ring is using the OS completion mechanism
+ * (io_uring), FALSE if it is using the fallback.*/
+BOOL NTPIORingIsNative(NTPIORing *ring);
+
+/**Queue a recv or send of len bytes. Returns FALSE if the ring is full
+ * (reap some completions first) or the sock is not connected.*/
+BOOL NTPIORingRecv(NTPIORing *ring, NTPSock *sock, void *buf, int len,
+                   void *userData);
+BOOL NTPIORingSend(NTPIORing *ring, NTPSock *sock, void *bytes, int len,
+                   void *userData);
+
+/**Queue an accept on a listening sock.*/
+BOOL NTPIORingAccept(NTPIORing *ring, NTPSock *listenSock, void *userData);
+
+/**Starts all the queued operations.
+ * Returns the number started, or -1 on error (call NTPIORingErr()).*/
+int NTPIORingSubmit(NTPIORing *ring);
+
+/**Collects up to maxCompletions completed operations. Waits up to
+ * timeoutMS for at least one to complete (negative waits forever,
+ * 0 doesn't wait at all).
+ * Returns the number stored, 0 on timeout, or -1 on error.*/
+int NTPIORingReap(NTPIORing *ring, NTPIOCompletion *completions,
+                  int maxCompletions, int timeoutMS);
+
+/**Optional speedups, which do nothing (but succeed) on the fallback.
+ * Registering buffers lets the OS pin them once, instead of every
+ * operation. Any later send or recv that falls entirely inside a
+ * registered buffer uses it automatically. Can only be done once.*/
+BOOL NTPIORingRegisterBuffers(NTPIORing *ring, void **bufs, int *lens,
+                              int count);
+
+/**Registering a sock saves the OS looking it up every operation.
+ * You must unregister it before you NTPDisconnect() it.*/
+BOOL NTPIORingRegisterSock(NTPIORing *ring, NTPSock *sock);
+BOOL NTPIORingUnregisterSock(NTPIORing *ring, NTPSock *sock);
+
+/**Returns a human readable error message for the last ring error.*/
+const char *NTPIORingErr(NTPIORing *ring);
+
+
+
+/*************************************************************************
+ * Section for shared memory channels. For passing messages to another
+ * process on the same machine when even a Unix socket is too slow. A
+ * channel is a ring in memory that both processes map, so a message is
+ * copied straight into it, and the only system call is to wake the
+ * reader up when it has gone to sleep waiting.
+ *
+ * One process makes the channel with a name, which is the path of a
+ * file (put it in /dev/shm on Linux, so it stays in memory), and the
+ * others open it:
+ *
+ *    //the reader
+ *    NTPShmChannel *ch = NTPNewShmChannel("/dev/shm/quotes", 1<<20, NTPSHM_MPSC);
+ *    while((len = NTPShmRecv(ch, buf, sizeof(buf), -1)) > 0) ...
+ *
+ *    //the writers
+ *    NTPShmChannel *ch = NTPOpenShmChannel("/dev/shm/quotes");
+ *    NTPShmSend(ch, quote, quoteLen);
+ *
+ * Messages can be any length up to NTPShmMaxMessage(), and arrive
+ * whole and in order (from each writer, for NTPSHM_MPSC).
+ * Only one thread can receive. With NTPSHM_SPSC, only one thread can
+ * send; with NTPSHM_MPSC any number can, in any number of processes,
+ * but give each thread its own NTPOpenShmChannel().
+ *************************************************************************/
+typedef struct NTPShmChannel_struct NTPShmChannel;
+
+//Channel types for NTPNewShmChannel()
+#define NTPSHM_SPSC 1  //one sender
+#define NTPSHM_MPSC 2  //lots of senders
+
+/**Makes a channel with a ring of at least capacity bytes (rounded up to
+ * a power of 2, 4096 or more). If a program that didn't free its
+ * channel left one behind with that name, it's replaced, but not if
+ * anyone still has it open, or if the name is some other file; then
+ * this fails. name can be NULL for a channel with no name,
+ * which you can only share with child processes you fork() after.
+ * The files are removed when the maker frees the channel.
+ * Returns NULL on error.*/
+NTPShmChannel *NTPNewShmChannel(const char *name, int capacity, int type);
+
+/**Opens a channel someone else made. Returns NULL if there isn't one.*/
+NTPShmChannel *NTPOpenShmChannel(const char *name);
+
+/**Unmaps the channel. Sets *channel to NULL.*/
+void NTPFreeShmChannel(NTPShmChannel **channel);
+
+/**The longest message that fits, which is half the ring.*/
+int NTPShmMaxMessage(NTPShmChannel *channel);
+
+/**Puts a message in the channel, if there's room.
+ * Returns FALSE if it's full, or if len is too long.*/
+BOOL NTPShmTrySend(NTPShmChannel *channel, const void *msg, int len);
+
+/**Puts a message in the channel, waiting for room if it's full.
+ * Returns FALSE only if len is too long.*/
+BOOL NTPShmSend(NTPShmChannel *channel, const void *msg, int len);
+
+/**Takes the next message and copies it to buf. Waits up to timeoutMS for
+ * one (negative waits forever, 0 doesn't wait at all).
+ * Returns its length, 0 if there wasn't one, or -1 if it's longer than
+ * max. In that case it's left in the channel, so try again with a
+ * bigger buf.*/
+int NTPShmRecv(NTPShmChannel *channel, void *buf, int max, int timeoutMS);
+
+/**A sock that's readable when the channel might have a message, so the
+ * receiver can wait for it in NTPSelect() or a poller, next to its other
+ * socks. Call NTPShmRecv() with a timeout of 0 until it returns 0; only
+ * then does the sock wait for new messages again. Don't NTPDisconnect()
+ * it; it belongs to the channel. Returns NULL on error.*/
+NTPSock *NTPShmChannelSock(NTPShmChannel *channel);
 
 
 
@@ -192,18 +1033,252 @@ typedef struct NTPLock_struct NTPLock;
  */
 BOOL NTPStartThread(void *(*start_routine)(void *), void *arg);
 
+/**A thread you can join, and control a little more. NTPStartThread()
+ * is simpler if you don't need any of this.
+ *
+ * Pass NULL as the options to get the defaults. Otherwise, zero out
+ * an NTPThreadOptions and fill in what you want:
+ *   stackSize: in bytes. 0 for the platform default (often 8 MB).
+ *   name:      shows up in top and perf. Cut off at 15 characters.
+ *   cpus:      the new thread only runs on these CPUs. numCPUs of 0
+ *              lets it run anywhere. Only on Linux.
+ *   priority:  a nice value, -20 to 19, lower runs first. 0 leaves
+ *              it alone. Going below 0 usually needs root. Only on Linux.
+ * Returns NULL on error, including if any option can't be applied.*/
+typedef struct NTPThread_struct NTPThread;
+typedef struct {
+	size_t      stackSize;
+	const char *name;
+	const int  *cpus;
+	int         numCPUs;
+	int         priority;
+} NTPThreadOptions;
+
+NTPThread *NTPNewThread(void *(*start_routine)(void *), void *arg,
+                        const NTPThreadOptions *options);
+
+/**Waits for the thread to finish, and puts what start_routine() returned
+ * in *result, if result isn't NULL. Frees the thread and sets *thread
+ * to NULL. Returns TRUE on SUCCESS, FALSE on ERROR.*/
+BOOL NTPJoinThread(NTPThread **thread, void **result);
+
+/**Lets the thread run on its own, so you never have to join it. Frees
+ * the handle and sets *thread to NULL. Returns TRUE on SUCCESS.*/
+BOOL NTPDetachThread(NTPThread **thread);
+
+/**Changes which CPUs a running thread can use, or the current thread if
+ * thread is NULL. Returns TRUE on SUCCESS. Always FALSE except on Linux.*/
+BOOL NTPSetThreadAffinity(NTPThread *thread, const int *cpus, int numCPUs);
+
+/**Names a running thread, or the current thread if thread is NULL.
+ * Returns TRUE on SUCCESS. OSX can only name the current thread.*/
+BOOL NTPSetThreadName(NTPThread *thread, const char *name);
+
 /**Creates a new lock. Returns NULL on error*/
 NTPLock *NTPNewLock();
 
 /**Frees a lock. Sets *lock to NULL*/
 void NTPFreeLock(NTPLock **lock);
 
+/**If you want to put a lock inside your own struct instead of
+ * allocating it, declare an NTPLock (not a pointer) and use these
+ * instead of NTPNewLock() and NTPFreeLock().
+ * NTPInitLock() returns TRUE on SUCCESS, FALSE on ERROR.*/
+BOOL NTPInitLock(NTPLock *lock);
+void NTPDestroyLock(NTPLock *lock);
+
 /**Acquires the lock. Blocks until successful.*/
 BOOL NTPAcquireLock(NTPLock *lock);
 
 /**Releases a lock. */
 void NTPReleaseLock(NTPLock *lock);
 
+/**A lock declared statically can be initialized with this instead of
+ * calling NTPInitLock():
+ *    static NTPLock tableLock = NTP_LOCK_INITIALIZER;
+ * (NTP_LOCK_INITIALIZER is defined in the platform header.)
+ *
+ * To find hot locks, call NTPTrackLock() on the ones you care about.
+ * After that they count how often they're taken, how often someone
+ * had to wait, and for how long. Untracked locks don't pay for this.
+ * NTPTrackLock() returns FALSE if it runs out of memory. Tracking stops
+ * when the lock is destroyed. */
+typedef struct {
+	uint64_t acquisitions;
+	uint64_t contended;     //times someone had to wait for it
+	uint64_t waitNanos;     //total time spent waiting for it
+} NTPLockStats;
+
+BOOL NTPTrackLock(NTPLock *lock, const char *name);
+
+/**Copies a tracked lock's counts into *stats. FALSE if it's not tracked.*/
+BOOL NTPGetLockStats(NTPLock *lock, NTPLockStats *stats);
+
+/**Prints a line for every tracked lock, e.g. NTPDumpLockStats(stderr)*/
+void NTPDumpLockStats(FILE *out);
+
+/**A condition lets a thread sleep until another thread tells it
+ * something changed. Always use it with an NTPLock, and always check
+ * what you're waiting for in a loop, since wakeups can be spurious:
+ *
+ *    NTPAcquireLock(&lock);
+ *    while(queueIsEmpty)
+ *       NTPWaitCondition(&cond, &lock);
+ *    //take something from the queue
+ *    NTPReleaseLock(&lock);
+ *
+ * Like NTPLock, a condition can be embedded with NTPInitCondition(),
+ * or declared statically with NTP_CONDITION_INITIALIZER. */
+typedef struct NTPCondition_struct NTPCondition;
+
+/**Returns NULL on error*/
+NTPCondition *NTPNewCondition();
+
+/**Sets *cond to NULL*/
+void NTPFreeCondition(NTPCondition **cond);
+
+/**Returns TRUE on SUCCESS, FALSE on ERROR*/
+BOOL NTPInitCondition(NTPCondition *cond);
+void NTPDestroyCondition(NTPCondition *cond);
+
+/**Releases lock and sleeps until the condition is signaled, then
+ * takes the lock again before returning. You must hold the lock.*/
+void NTPWaitCondition(NTPCondition *cond, NTPLock *lock);
+
+/**Same, but gives up after timeoutMS milliseconds. Returns FALSE if it
+ * timed out. Either way, you hold the lock again when it returns.*/
+BOOL NTPWaitConditionTimeout(NTPCondition *cond, NTPLock *lock, int timeoutMS);
+
+/**Wakes one thread waiting on the condition.*/
+void NTPSignalCondition(NTPCondition *cond);
+
+/**Wakes every thread waiting on the condition.*/
+void NTPBroadcastCondition(NTPCondition *cond);
+
+/**A semaphore is a counter that threads can wait on. Posting adds one.
+ * Waiting blocks until it's above zero, then subtracts one.
+ * Can be embedded with NTPInitSemaphore(). */
+typedef struct NTPSemaphore_struct NTPSemaphore;
+
+/**Returns NULL on error*/
+NTPSemaphore *NTPNewSemaphore(int count);
+
+/**Sets *sem to NULL*/
+void NTPFreeSemaphore(NTPSemaphore **sem);
+
+/**Returns TRUE on SUCCESS, FALSE on ERROR*/
+BOOL NTPInitSemaphore(NTPSemaphore *sem, int count);
+void NTPDestroySemaphore(NTPSemaphore *sem);
+
+void NTPPostSemaphore(NTPSemaphore *sem);
+void NTPWaitSemaphore(NTPSemaphore *sem);
+
+/**Returns FALSE right away, instead of waiting, if the count is zero*/
+BOOL NTPTryWaitSemaphore(NTPSemaphore *sem);
+
+/**Returns FALSE if it's still zero after timeoutMS milliseconds*/
+BOOL NTPWaitSemaphoreTimeout(NTPSemaphore *sem, int timeoutMS);
+
+/**A reader-writer lock lets any number of readers in at once, or one
+ * writer. It's for data that's read far more often than it's written,
+ * like a routing table. Readers are counted in several places instead
+ * of one, so they don't slow each other down fighting over the same
+ * cache line. Once a writer
+ * is waiting, new readers wait behind it, so writers can't starve.
+ * Don't take a read lock you already hold; it can deadlock if a
+ * writer comes in between. */
+typedef struct NTPRWLock_struct NTPRWLock;
+
+/**Returns NULL on error*/
+NTPRWLock *NTPNewRWLock();
+
+/**Sets *lock to NULL*/
+void NTPFreeRWLock(NTPRWLock **lock);
+
+void NTPAcquireReadLock(NTPRWLock *lock);
+void NTPReleaseReadLock(NTPRWLock *lock);
+void NTPAcquireWriteLock(NTPRWLock *lock);
+void NTPReleaseWriteLock(NTPRWLock *lock);
+
+/**Lock-free queues, for handing things from one thread to another
+ * without a lock. They hold void pointers, and are a fixed size, given
+ * when you create them (rounded up to a power of 2).
+ *
+ * An NTPSPSCQueue is for exactly one thread pushing and one thread
+ * popping. It's the fastest. An NTPMPMCQueue can have any number of
+ * threads pushing and popping.
+ *
+ * For each kind:
+ *   TryPush returns FALSE right away if the queue is full.
+ *   TryPop  returns FALSE right away if the queue is empty.
+ *   Push and Pop wait until they can go ahead.
+ *   PushMany pushes as many of count items as fit, and PopMany pops up
+ *   to max items. They return how many, which can be 0. Doing a batch
+ *   at once is cheaper than one at a time.
+ * Create returns NULL on error. Free sets *queue to NULL.*/
+typedef struct NTPSPSCQueue_struct NTPSPSCQueue;
+typedef struct NTPMPMCQueue_struct NTPMPMCQueue;
+
+NTPSPSCQueue *NTPNewSPSCQueue(int capacity);
+void  NTPFreeSPSCQueue    (NTPSPSCQueue **queue);
+BOOL  NTPSPSCQueueTryPush (NTPSPSCQueue *queue, void *item);
+BOOL  NTPSPSCQueueTryPop  (NTPSPSCQueue *queue, void **item);
+void  NTPSPSCQueuePush    (NTPSPSCQueue *queue, void *item);
+void *NTPSPSCQueuePop     (NTPSPSCQueue *queue);
+int   NTPSPSCQueuePushMany(NTPSPSCQueue *queue, void **items, int count);
+int   NTPSPSCQueuePopMany (NTPSPSCQueue *queue, void **items, int max);
+
+NTPMPMCQueue *NTPNewMPMCQueue(int capacity);
+void  NTPFreeMPMCQueue    (NTPMPMCQueue **queue);
+BOOL  NTPMPMCQueueTryPush (NTPMPMCQueue *queue, void *item);
+BOOL  NTPMPMCQueueTryPop  (NTPMPMCQueue *queue, void **item);
+void  NTPMPMCQueuePush    (NTPMPMCQueue *queue, void *item);
+void *NTPMPMCQueuePop     (NTPMPMCQueue *queue);
+int   NTPMPMCQueuePushMany(NTPMPMCQueue *queue, void **items, int count);
+int   NTPMPMCQueuePopMany (NTPMPMCQueue *queue, void **items, int max);
+
+/**A thread pool runs lots of small tasks on a fixed set of worker
+ * threads, so you don't pay for starting a thread each time. Each
+ * worker keeps its own queue of tasks, and steals from the others
+ * when it runs out. Tasks submitted from inside a task go on the
+ * current worker's queue, which is the fastest way to submit.
+ *
+ * A task group lets you wait for a bunch of tasks to finish. Pass
+ * NULL as the group if you don't need to wait.
+ *
+ *    NTPThreadPool *pool = NTPNewThreadPool(0);
+ *    NTPTaskGroup *group = NTPNewTaskGroup();
+ *    for(i=0;i<100;i++)
+ *       NTPSubmitTask(pool, &doWork, &work[i], group);
+ *    NTPWaitTaskGroup(group);
+ */
+typedef struct NTPThreadPool_struct NTPThreadPool;
+typedef struct NTPTaskGroup_struct  NTPTaskGroup;
+
+/**Creates a pool with numThreads workers, or one per CPU if numThreads
+ * is 0. Returns NULL on error.*/
+NTPThreadPool *NTPNewThreadPool(int numThreads);
+
+/**Runs every task that's been submitted, then stops the workers and
+ * frees the pool. Sets *pool to NULL. Don't call it from inside a task.*/
+void NTPFreeThreadPool(NTPThreadPool **pool);
+
+/**Queues func(arg) to run on one of the workers. group can be NULL.
+ * Returns TRUE on SUCCESS, FALSE if we ran out of memory.*/
+BOOL NTPSubmitTask(NTPThreadPool *pool, void (*func)(void *arg), void *arg,
+                   NTPTaskGroup *group);
+
+/**Creates a task group. Returns NULL on error.*/
+NTPTaskGroup *NTPNewTaskGroup();
+
+/**Frees a task group. Sets *group to NULL. Wait for it first.*/
+void NTPFreeTaskGroup(NTPTaskGroup **group);
+
+/**Blocks until every task submitted with this group has finished.
+ * If called from inside a task, it runs other tasks while it waits,
+ * so it's safe to wait on tasks you submitted from inside a task.*/
+void NTPWaitTaskGroup(NTPTaskGroup *group);
+
 
 
 
@@ -0,0 +1,118 @@
+#ifndef NOTRAP_ATOMIC_H
+#define NOTRAP_ATOMIC_H
+
+/***************************************************************
+ * The atomics, mapped onto whatever the compiler has. GCC and
+ * clang have the __atomic builtins, which work on ordinary
+ * variables. Anything else has to be a C11 compiler with
+ * <stdatomic.h>. These are all inline, since the whole point is
+ * to be as cheap as a single instruction.
+ *
+ * Copyright Andrew 2013 Usable under the GPL 3.0 or greater
+ ***************************************************************/
+#include <stdint.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define NTP_ATOMIC_BUILTINS
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__>=201112L && !defined(__STDC_NO_ATOMICS__)
+#define NTP_ATOMIC_C11
+#include <stdatomic.h>
+#else
+#error "NOTRAP needs GCC, clang, or a C11 compiler with atomics"
+#endif
+
+#ifdef NTP_ATOMIC_BUILTINS
+#define NTP_ORDER_RELAXED __ATOMIC_RELAXED
+#define NTP_ORDER_ACQUIRE __ATOMIC_ACQUIRE
+#define NTP_ORDER_RELEASE __ATOMIC_RELEASE
+#define NTP_ORDER_ACQ_REL __ATOMIC_ACQ_REL
+#define NTP_ORDER_SEQ_CST __ATOMIC_SEQ_CST
+#define NTP_ATOMIC_MEMBER(type) type
+//The order has to be a constant by the time the builtin sees it, or
+//GCC quietly makes it SEQ_CST, so these must always be inlined.
+#define NTP_ATOMIC_INLINE static inline __attribute__((always_inline))
+#else
+#define NTP_ORDER_RELAXED memory_order_relaxed
+#define NTP_ORDER_ACQUIRE memory_order_acquire
+#define NTP_ORDER_RELEASE memory_order_release
+#define NTP_ORDER_ACQ_REL memory_order_acq_rel
+#define NTP_ORDER_SEQ_CST memory_order_seq_cst
+#define NTP_ATOMIC_MEMBER(type) _Atomic type
+#define NTP_ATOMIC_INLINE static inline
+#endif
+
+//They're structs so they can't be read or written by accident
+//without going through these functions.
+typedef struct { NTP_ATOMIC_MEMBER(int)     value; } NTPAtomicInt;
+typedef struct { NTP_ATOMIC_MEMBER(int64_t) value; } NTPAtomicInt64;
+typedef struct { NTP_ATOMIC_MEMBER(void*)   value; } NTPAtomicPtr;
+
+#define NTP_ATOMIC_INIT(v) { (v) }
+
+//A compare and swap can't release anything when it fails, since it
+//didn't write anything, so the failure order has to be weaker.
+NTP_ATOMIC_INLINE int ntpFailureOrder(int order) {
+	if(order==NTP_ORDER_ACQ_REL) return NTP_ORDER_ACQUIRE;
+	if(order==NTP_ORDER_RELEASE) return NTP_ORDER_RELAXED;
+	return order;
+}
+
+#ifdef NTP_ATOMIC_BUILTINS
+#define NTP_ATOMIC_FUNCTIONS(Name, atype, type)                                 \
+NTP_ATOMIC_INLINE type NTPAtomicLoad##Name(atype *a, int order) {               \
+	return __atomic_load_n(&a->value, order);                                   \
+}                                                                               \
+NTP_ATOMIC_INLINE void NTPAtomicStore##Name(atype *a, type v, int order) {      \
+	__atomic_store_n(&a->value, v, order);                                      \
+}                                                                               \
+NTP_ATOMIC_INLINE type NTPAtomicExchange##Name(atype *a, type v, int order) {   \
+	return __atomic_exchange_n(&a->value, v, order);                            \
+}                                                                               \
+NTP_ATOMIC_INLINE BOOL NTPAtomicCompareExchange##Name(atype *a,                 \
+                                   type *expected, type desired, int order) {   \
+	return __atomic_compare_exchange_n(&a->value, expected, desired, 0,         \
+	                                   order, ntpFailureOrder(order));          \
+}
+#define NTP_ATOMIC_ARITHMETIC(Name, atype, type)                                \
+NTP_ATOMIC_INLINE type NTPAtomicFetchAdd##Name(atype *a, type v, int order) {   \
+	return __atomic_fetch_add(&a->value, v, order);                             \
+}
+NTP_ATOMIC_INLINE void NTPAtomicFence(int order) {
+	__atomic_thread_fence(order);
+}
+#else
+#define NTP_ATOMIC_FUNCTIONS(Name, atype, type)                                 \
+NTP_ATOMIC_INLINE type NTPAtomicLoad##Name(atype *a, int order) {               \
+	return atomic_load_explicit(&a->value, order);                              \
+}                                                                               \
+NTP_ATOMIC_INLINE void NTPAtomicStore##Name(atype *a, type v, int order) {      \
+	atomic_store_explicit(&a->value, v, order);                                 \
+}                                                                               \
+NTP_ATOMIC_INLINE type NTPAtomicExchange##Name(atype *a, type v, int order) {   \
+	return atomic_exchange_explicit(&a->value, v, order);                       \
+}                                                                               \
+NTP_ATOMIC_INLINE BOOL NTPAtomicCompareExchange##Name(atype *a,                 \
+                                   type *expected, type desired, int order) {   \
+	return atomic_compare_exchange_strong_explicit(&a->value, expected,         \
+	                             desired, order, ntpFailureOrder(order));       \
+}
+#define NTP_ATOMIC_ARITHMETIC(Name, atype, type)                                \
+NTP_ATOMIC_INLINE type NTPAtomicFetchAdd##Name(atype *a, type v, int order) {   \
+	return atomic_fetch_add_explicit(&a->value, v, order);                      \
+}
+NTP_ATOMIC_INLINE void NTPAtomicFence(int order) {
+	atomic_thread_fence(order);
+}
+#endif
+
+NTP_ATOMIC_FUNCTIONS (Int,   NTPAtomicInt,   int)
+NTP_ATOMIC_ARITHMETIC(Int,   NTPAtomicInt,   int)
+NTP_ATOMIC_FUNCTIONS (Int64, NTPAtomicInt64, int64_t)
+NTP_ATOMIC_ARITHMETIC(Int64, NTPAtomicInt64, int64_t)
+NTP_ATOMIC_FUNCTIONS (Ptr,   NTPAtomicPtr,   void*)
+
+#undef NTP_ATOMIC_FUNCTIONS
+#undef NTP_ATOMIC_ARITHMETIC
+#undef NTP_ATOMIC_INLINE
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef NOTRAP_LINUX_H
+#define NOTRAP_LINUX_H
+
+
+
+
+
+
+
+
+#endif
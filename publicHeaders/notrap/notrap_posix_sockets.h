@@ -14,11 +14,28 @@
 #ifdef NTP_POSIX_SOCKETS
 
 #include <stdint.h>
+#include <stddef.h>
 #include <sys/select.h>
+#include <sys/socket.h>
 
 struct NTP_FD_SET_struct {
 	fd_set set;
-	uint16_t max;
+	int max;
+	//connect events for socks that were still connecting when added
+	fd_set connecting;
+	int numConnecting;
+};
+
+//This has the same layout as struct iovec, so an array of them
+//can be handed straight to the kernel.
+struct NTPIOVec_struct {
+	void  *base;
+	size_t len;
+};
+
+struct NTPAddress_struct {
+	struct sockaddr_storage addr;
+	socklen_t len;
 };
 
 
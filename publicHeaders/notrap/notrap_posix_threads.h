@@ -0,0 +1,67 @@
+#ifndef NOTRAP_POSIX_THREADS_H
+#define NOTRAP_POSIX_THREADS_H
+
+/***************************************************************
+ * Defines for the threading section that the compiler needs to
+ * know about, so locks can be embedded in other structs, but
+ * that the end user doesn't need to look at.
+ *
+ * Copyright Andrew 2013 Usable under the GPL 3.0 or greater
+ ***************************************************************/
+
+
+//only use this file if NTP_POSIX_THREADS is defined
+#ifdef NTP_POSIX_THREADS
+
+#include <pthread.h>
+
+struct NTPLockTracker_struct;
+
+//On Linux a lock is a futex word: 0 is unlocked, 1 is locked,
+//2 is locked with someone sleeping on it.
+struct NTPLock_struct {
+#ifdef NTP_LIN
+	int state;
+#else
+	pthread_mutex_t mutex;
+#endif
+	int spins;                          //how long to spin before sleeping
+	struct NTPLockTracker_struct *stats; //NULL unless NTPTrackLock() was called
+};
+
+#ifdef NTP_LIN
+#define NTP_LOCK_INITIALIZER { 0, 0, NULL }
+#else
+#define NTP_LOCK_INITIALIZER { PTHREAD_MUTEX_INITIALIZER, 0, NULL }
+#endif
+
+//On Linux, a condition is a futex that changes every time it's signaled
+struct NTPCondition_struct {
+#ifdef NTP_LIN
+	int seq;
+#else
+	pthread_cond_t cond;
+#endif
+};
+
+#ifdef NTP_LIN
+#define NTP_CONDITION_INITIALIZER { 0 }
+#else
+#define NTP_CONDITION_INITIALIZER { PTHREAD_COND_INITIALIZER }
+#endif
+
+//OSX doesn't have unnamed POSIX semaphores, so elsewhere we build one
+struct NTPSemaphore_struct {
+#ifdef NTP_LIN
+	int count;
+	int waiters;
+#else
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;
+	int count;
+#endif
+};
+
+
+#endif
+#endif
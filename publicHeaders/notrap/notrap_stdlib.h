@@ -12,9 +12,16 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdio.h>
-#include <string.h>
+#include <time.h>
+//Define NTP_MALLOC_STATS to count what NTPmalloc() is doing,
+//see NTPGetMallocStats()
+#ifdef NTP_MALLOC_STATS
+#define NTPmalloc NTPInstrumentedMalloc
+#define NTPfree   NTPInstrumentedFree
+#else
 #define NTPmalloc malloc
 #define NTPfree   free
+#endif
 #define NTPstrlen strlen
 #define NTPmemcpy memcpy
 #define NTPstrcpy strcpy
@@ -0,0 +1,450 @@
+#include <notrap/notrap.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef NTP_POSIX_THREADS
+#include <pthread.h>
+#endif
+
+//Everything we hand out is aligned like malloc() would align it
+#define MAX_ALIGN   (sizeof(max_align_t))
+#define ALIGN_UP(n) (((n) + MAX_ALIGN-1) & ~(MAX_ALIGN-1))
+
+//------------------------------------------------------------------
+// Arenas. A list of chunks, and we bump a pointer through the current
+// one. Reset just moves back to the first chunk, so after the first
+// few requests an arena doesn't call malloc() at all.
+//------------------------------------------------------------------
+
+#define DEFAULT_ARENA_CHUNK (64*1024)
+
+struct NTPArenaChunk {
+	struct NTPArenaChunk *next;
+	size_t size;   //bytes in data
+	size_t used;
+	max_align_t data[];
+};
+
+struct NTPArena_struct {
+	size_t chunkSize;
+	struct NTPArenaChunk *first;
+	struct NTPArenaChunk *current;
+
+	//Allocations too big for a chunk get their own, and are freed
+	//on reset instead of being kept around
+	struct NTPArenaChunk *big;
+
+	size_t bytes;  //handed out since the last reset
+};
+
+static struct NTPArenaChunk *newArenaChunk(size_t size) {
+	struct NTPArenaChunk *rv = malloc(sizeof(struct NTPArenaChunk) + size);
+	if(rv!=NULL) {
+		rv->next = NULL;
+		rv->size = size;
+		rv->used = 0;
+	}
+	return rv;
+}
+
+NTPArena *NTPNewArena(size_t chunkSize) {
+	NTPArena *rv = malloc(sizeof(NTPArena));
+	if(rv==NULL) return NULL;
+
+	if(chunkSize==0) chunkSize = DEFAULT_ARENA_CHUNK;
+	rv->chunkSize = ALIGN_UP(chunkSize);
+	rv->big       = NULL;
+	rv->bytes     = 0;
+	rv->first     = newArenaChunk(rv->chunkSize);
+	if(rv->first==NULL) {
+		free(rv);
+		return NULL;
+	}
+	rv->current = rv->first;
+	return rv;
+}
+
+static void freeArenaChunks(struct NTPArenaChunk *chunk) {
+	struct NTPArenaChunk *next;
+	for(;chunk!=NULL;chunk=next) {
+		next = chunk->next;
+		free(chunk);
+	}
+}
+
+void NTPFreeArena(NTPArena **arena) {
+	if(arena==NULL || *arena==NULL) return;
+	freeArenaChunks((*arena)->first);
+	freeArenaChunks((*arena)->big);
+	free(*arena);
+	*arena = NULL;
+}
+
+void *NTPArenaAlloc(NTPArena *arena, size_t size) {
+	struct NTPArenaChunk *chunk;
+	void *rv;
+
+	if(size==0) size = 1;
+	if(size > ((size_t)-1)/2) return NULL;
+	size = ALIGN_UP(size);
+
+	//Anything bigger than a quarter chunk would waste too much of it
+	if(size > arena->chunkSize/4) {
+		chunk = newArenaChunk(size);
+		if(chunk==NULL) return NULL;
+		chunk->used = size;
+		chunk->next = arena->big;
+		arena->big  = chunk;
+		arena->bytes += size;
+		return chunk->data;
+	}
+
+	chunk = arena->current;
+	if(chunk->used + size > chunk->size) {
+		//Use the next chunk if an earlier reset left one, or make one
+		if(chunk->next==NULL) {
+			chunk->next = newArenaChunk(arena->chunkSize);
+			if(chunk->next==NULL) return NULL;
+		}
+		chunk = chunk->next;
+		arena->current = chunk;
+	}
+
+	rv = (char*)chunk->data + chunk->used;
+	chunk->used  += size;
+	arena->bytes += size;
+	return rv;
+}
+
+void NTPArenaReset(NTPArena *arena) {
+	struct NTPArenaChunk *chunk;
+
+	for(chunk=arena->first;chunk!=NULL;chunk=chunk->next)
+		chunk->used = 0;
+	freeArenaChunks(arena->big);
+	arena->big     = NULL;
+	arena->current = arena->first;
+	arena->bytes   = 0;
+}
+
+size_t NTPArenaBytes(NTPArena *arena) {
+	return arena->bytes;
+}
+
+#ifdef NTP_POSIX_THREADS
+//------------------------------------------------------------------
+// Pools. Objects are carved out of chunks and kept on a free list.
+// Each thread has its own small cache of free objects, so most
+// allocs and frees are a couple of pointer moves with no lock. The
+// cache only goes to the shared list, under the lock, in batches.
+//------------------------------------------------------------------
+
+#define POOL_CACHE_MAX 64  //a thread's cache is flushed past this
+#define POOL_BATCH     32  //objects moved to or from the shared list
+
+//The first word of a free object points at the next free one
+struct NTPPoolObject {
+	struct NTPPoolObject *next;
+};
+
+struct NTPPoolChunk {
+	struct NTPPoolChunk *next;
+	max_align_t data[];
+};
+
+struct NTPPoolCache {
+	NTPPool *pool;
+	struct NTPPoolObject *head;
+	int count;
+	struct NTPPoolCache *prev, *next;
+};
+
+struct NTPPool_struct {
+	size_t objectSize;
+	int perChunk;
+
+	//Everything below is protected by lock
+	NTPLock lock;
+	struct NTPPoolObject *freeList;
+	struct NTPPoolChunk *chunks;
+	struct NTPPoolCache *caches;  //every thread's cache
+	size_t numChunks;
+
+	pthread_key_t key;  //finds this thread's cache
+};
+
+//Give all the cache's objects back. Called with the pool locked.
+static void returnCache(struct NTPPoolCache *c) {
+	struct NTPPoolObject *obj;
+	while((obj = c->head)!=NULL) {
+		c->head = obj->next;
+		obj->next = c->pool->freeList;
+		c->pool->freeList = obj;
+	}
+	c->count = 0;
+}
+
+//Runs when a thread exits, so its cache isn't lost
+static void cacheDestructor(void *arg) {
+	struct NTPPoolCache *c = (struct NTPPoolCache*)arg;
+	NTPPool *pool = c->pool;
+
+	NTPAcquireLock(&pool->lock);
+	returnCache(c);
+	if(c->prev!=NULL) c->prev->next = c->next;
+	else              pool->caches  = c->next;
+	if(c->next!=NULL) c->next->prev = c->prev;
+	NTPReleaseLock(&pool->lock);
+	free(c);
+}
+
+NTPPool *NTPNewPool(size_t objectSize, int objectsPerChunk) {
+	NTPPool *rv;
+
+	if(objectSize==0 || objectSize > ((size_t)-1)/2) return NULL;
+	if(objectsPerChunk<=0) objectsPerChunk = 64;
+
+	rv = malloc(sizeof(NTPPool));
+	if(rv==NULL) return NULL;
+
+	//Big enough for the free list pointer, and aligned for whatever
+	//goes in it
+	if(objectSize < sizeof(struct NTPPoolObject))
+		objectSize = sizeof(struct NTPPoolObject);
+	if(objectSize >= MAX_ALIGN) objectSize = ALIGN_UP(objectSize);
+	else objectSize = (objectSize + sizeof(void*)-1) & ~(sizeof(void*)-1);
+	rv->objectSize = objectSize;
+	rv->perChunk   = objectsPerChunk;
+	rv->freeList   = NULL;
+	rv->chunks     = NULL;
+	rv->caches     = NULL;
+	rv->numChunks  = 0;
+
+	if(!NTPInitLock(&rv->lock)) goto error_lock;
+	if(pthread_key_create(&rv->key, cacheDestructor)!=0) goto error_key;
+	return rv;
+
+error_key:
+	NTPDestroyLock(&rv->lock);
+error_lock:
+	free(rv);
+	return NULL;
+}
+
+void NTPFreePool(NTPPool **pool) {
+	struct NTPPoolChunk *chunk, *nextChunk;
+	struct NTPPoolCache *c, *nextCache;
+
+	if(pool==NULL || *pool==NULL) return;
+
+	//After this, no thread's destructor will run for this pool
+	pthread_key_delete((*pool)->key);
+
+	for(c=(*pool)->caches;c!=NULL;c=nextCache) {
+		nextCache = c->next;
+		free(c);
+	}
+	for(chunk=(*pool)->chunks;chunk!=NULL;chunk=nextChunk) {
+		nextChunk = chunk->next;
+		free(chunk);
+	}
+	NTPDestroyLock(&(*pool)->lock);
+	free(*pool);
+	*pool = NULL;
+}
+
+//Puts a new chunk's objects on the free list. Called with the pool
+//locked. Returns FALSE if there's no memory.
+static BOOL growPool(NTPPool *pool) {
+	struct NTPPoolChunk *chunk;
+	struct NTPPoolObject *obj;
+	char *p;
+	int i;
+
+	if((size_t)pool->perChunk > (((size_t)-1)/2 - sizeof(struct NTPPoolChunk))
+	                            / pool->objectSize) return FALSE;
+	chunk = malloc(sizeof(struct NTPPoolChunk) +
+	               pool->objectSize * pool->perChunk);
+	if(chunk==NULL) return FALSE;
+	chunk->next  = pool->chunks;
+	pool->chunks = chunk;
+	pool->numChunks++;
+
+	//Backwards, so they come off the list in address order
+	p = (char*)chunk->data;
+	for(i=pool->perChunk-1;i>=0;i--) {
+		obj = (struct NTPPoolObject*)(p + i*pool->objectSize);
+		obj->next = pool->freeList;
+		pool->freeList = obj;
+	}
+	return TRUE;
+}
+
+//Takes one object off the shared list. Called with the pool locked.
+static void *takeShared(NTPPool *pool) {
+	struct NTPPoolObject *obj;
+	if(pool->freeList==NULL && !growPool(pool)) return NULL;
+	obj = pool->freeList;
+	pool->freeList = obj->next;
+	return obj;
+}
+
+//This thread's cache, making it the first time. NULL if no memory,
+//in which case the caller goes straight to the shared list.
+static struct NTPPoolCache *getCache(NTPPool *pool) {
+	struct NTPPoolCache *c = pthread_getspecific(pool->key);
+	if(c!=NULL) return c;
+
+	c = malloc(sizeof(struct NTPPoolCache));
+	if(c==NULL) return NULL;
+	c->pool  = pool;
+	c->head  = NULL;
+	c->count = 0;
+	c->prev  = NULL;
+	if(pthread_setspecific(pool->key, c)!=0) {
+		free(c);
+		return NULL;
+	}
+
+	NTPAcquireLock(&pool->lock);
+	c->next = pool->caches;
+	if(pool->caches!=NULL) pool->caches->prev = c;
+	pool->caches = c;
+	NTPReleaseLock(&pool->lock);
+	return c;
+}
+
+void *NTPPoolAlloc(NTPPool *pool) {
+	struct NTPPoolCache *c = getCache(pool);
+	struct NTPPoolObject *obj;
+	void *rv;
+
+	if(c==NULL) {
+		NTPAcquireLock(&pool->lock);
+		rv = takeShared(pool);
+		NTPReleaseLock(&pool->lock);
+		return rv;
+	}
+
+	if(c->head==NULL) {
+		//Refill a batch at a time, so we don't take the lock every time
+		NTPAcquireLock(&pool->lock);
+		while(c->count<POOL_BATCH && (obj = takeShared(pool))!=NULL) {
+			obj->next = c->head;
+			c->head = obj;
+			c->count++;
+		}
+		NTPReleaseLock(&pool->lock);
+		if(c->head==NULL) return NULL;
+	}
+
+	obj = c->head;
+	c->head = obj->next;
+	c->count--;
+	return obj;
+}
+
+void NTPPoolFree(NTPPool *pool, void *ptr) {
+	struct NTPPoolCache *c;
+	struct NTPPoolObject *obj = (struct NTPPoolObject*)ptr;
+
+	if(ptr==NULL) return;
+	c = getCache(pool);
+	if(c==NULL) {
+		NTPAcquireLock(&pool->lock);
+		obj->next = pool->freeList;
+		pool->freeList = obj;
+		NTPReleaseLock(&pool->lock);
+		return;
+	}
+
+	obj->next = c->head;
+	c->head = obj;
+	c->count++;
+	if(c->count<=POOL_CACHE_MAX) return;
+
+	//Too many; give a batch back so other threads can have them
+	NTPAcquireLock(&pool->lock);
+	while(c->count>POOL_CACHE_MAX-POOL_BATCH) {
+		obj = c->head;
+		c->head = obj->next;
+		c->count--;
+		obj->next = pool->freeList;
+		pool->freeList = obj;
+	}
+	NTPReleaseLock(&pool->lock);
+}
+
+size_t NTPPoolCapacity(NTPPool *pool) {
+	size_t rv;
+	NTPAcquireLock(&pool->lock);
+	rv = pool->numChunks * pool->perChunk;
+	NTPReleaseLock(&pool->lock);
+	return rv;
+}
+#endif
+
+//------------------------------------------------------------------
+// The instrumented malloc(). Each block has a header in front of it
+// that remembers its size, so free() knows how much to take off.
+// Compile with NTP_MALLOC_STATS defined and NTPmalloc()/NTPfree()
+// come here.
+//------------------------------------------------------------------
+
+static NTPAtomicInt64 mallocBytes       = NTP_ATOMIC_INIT(0);
+static NTPAtomicInt64 mallocPeak        = NTP_ATOMIC_INIT(0);
+static NTPAtomicInt64 mallocAllocations = NTP_ATOMIC_INIT(0);
+static NTPAtomicInt64 mallocFrees       = NTP_ATOMIC_INIT(0);
+
+//The header is a full alignment unit so the block after it is still
+//aligned the way malloc() would align it
+union NTPMallocHeader {
+	size_t size;
+	max_align_t align;
+};
+
+void *NTPInstrumentedMalloc(size_t size) {
+	union NTPMallocHeader *h;
+	int64_t inUse, peak;
+
+	if(size > ((size_t)-1) - sizeof(union NTPMallocHeader)) return NULL;
+	h = malloc(sizeof(union NTPMallocHeader) + size);
+	if(h==NULL) return NULL;
+	h->size = size;
+
+	NTPAtomicFetchAddInt64(&mallocAllocations, 1, NTP_ORDER_RELAXED);
+	inUse = NTPAtomicFetchAddInt64(&mallocBytes, size, NTP_ORDER_RELAXED) + size;
+	peak  = NTPAtomicLoadInt64(&mallocPeak, NTP_ORDER_RELAXED);
+	while(inUse>peak &&
+	      !NTPAtomicCompareExchangeInt64(&mallocPeak, &peak, inUse, NTP_ORDER_RELAXED))
+		;
+	return h+1;
+}
+
+void NTPInstrumentedFree(void *ptr) {
+	union NTPMallocHeader *h;
+
+	if(ptr==NULL) return;
+	h = (union NTPMallocHeader*)ptr - 1;
+	NTPAtomicFetchAddInt64(&mallocFrees, 1, NTP_ORDER_RELAXED);
+	NTPAtomicFetchAddInt64(&mallocBytes, -(int64_t)h->size, NTP_ORDER_RELAXED);
+	free(h);
+}
+
+void NTPGetMallocStats(NTPMallocStats *stats) {
+	stats->bytesInUse  = NTPAtomicLoadInt64(&mallocBytes,       NTP_ORDER_RELAXED);
+	stats->peakBytes   = NTPAtomicLoadInt64(&mallocPeak,        NTP_ORDER_RELAXED);
+	stats->allocations = NTPAtomicLoadInt64(&mallocAllocations, NTP_ORDER_RELAXED);
+	stats->frees       = NTPAtomicLoadInt64(&mallocFrees,       NTP_ORDER_RELAXED);
+}
+
+void NTPDumpMallocStats(FILE *out) {
+	NTPMallocStats s;
+	NTPGetMallocStats(&s);
+	fprintf(out, "%14s %14s %14s %14s\n",
+	        "bytes in use", "peak bytes", "allocations", "frees");
+	fprintf(out, "%14llu %14llu %14llu %14llu\n",
+	        (unsigned long long)s.bytesInUse, (unsigned long long)s.peakBytes,
+	        (unsigned long long)s.allocations, (unsigned long long)s.frees);
+}
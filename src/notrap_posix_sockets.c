@@ -5,36 +5,75 @@
  * -AT Copyright 2013 Usable under the GPL 3.0 or later           *
  ******************************************************************/
 
+//accept4() needs this on Linux. It has to come before any system header.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <notrap/notrap.h>
 #ifdef NTP_POSIX_THREADS
 
 #include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <limits.h>
 #include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef NTP_LIN
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+//io_uring is only used if our kernel headers know about it.
+//Define NTP_NO_IO_URING to always use the fallback.
+#if defined(__NR_io_uring_setup) && !defined(NTP_NO_IO_URING)
+#include <linux/io_uring.h>
+#define NTP_IO_URING
+#endif
+#endif
 
 static const char *CONNECTING_ERR_MSG = "Waiting for connect.....";
+static const char *TIMEOUT_ERR_MSG    = "Connect timed out";
+static const char *NO_ERR_MSG         = "No error, yet";
+
+#define ERR_MSG_LEN 256
+#define DEFAULT_LISTEN_BACKLOG 100
 
 //------------------------------------------------------------------
 // Our data structures
 //------------------------------------------------------------------
 
+//The fields needed to send, recv and poll come first, so they all
+//sit in the first cache line. Everything else is cold.
 struct NTPSock_struct {
 	int sock;
-	char destination[5000];
-	int  port;
-
-	//errMsg holds the most recent error in a human
-	//readable format
-	char errMsg[2000];
 
 	//Indicates the connect thread is running.
 	//No other thread than the connec thread 
 	//has a right to modify the NTPSock_struct 
-	//while this is true.
-	volatile BOOL doingConnect;
+	//while this is true. It's set to FALSE with a release, so
+	//whoever sees it with isConnecting() also sees the results.
+	NTPAtomicInt doingConnect;
+
+	//indicates NTPDisconnect() was called while the connect
+	//thread was running
+	NTPAtomicInt shouldInterruptConnect;
 
 	//True if this is a server socket, used for listening
 	BOOL listenSock; 
@@ -44,87 +83,734 @@ struct NTPSock_struct {
 
 	//True if there was an error while trying to listen on a port
 	BOOL listenError;
-	
-	//indicates NTPDisconnect() was called while the connect
-	//thread was running
-	volatile BOOL shouldInterruptConnect;
 
-	//This lock protects the 'doingConnect' variable. No access
-	//should be done to that variable outside of that lock.
-	//It also protects 'shouldInterruptConnect.' No writes should
-	//be done to that variable outside of that lock.
-	NTPLock *connectLock;
+	//True if the connect failed because it ran out of time
+	BOOL timedOut;
+
+	int  port;
 
+	//AF_INET6 or AF_INET for a UDP sock, so sending knows whether to
+	//map IPv4 addresses. AF_UNSPEC for everything else.
+	int  family;
+
+	//When the connect has to be finished, in NTPMonotonicMillis() time.
+	//0 if there is no timeout.
+	int64_t connectDeadline;
+
+	//errMsg holds the most recent error in a human readable
+	//format. It's only allocated once there is an error.
+	char *errMsg;
+
+	//Where we are connecting to. NULL for accepted and
+	//listening socks, except Unix ones, where it's the name.
+	char *destination;
+
+	//TRUE if destination is a socket file we made, which has to be
+	//removed when we close
+	BOOL unlinkPath;
+
+	//Next sock waiting in the connect pool queue. Only touched
+	//while holding the pool lock. Also links free socks together.
+	NTPSock *nextPending;
+
+	//What happened to each address we tried while connecting.
+	//Written by the connect thread, NULL if there were none.
+	NTPConnectAttempt *attempts;
+	int                numAttempts;
+
+	//For zero-copy sends. zcSent is the id the next zero-copy send will
+	//get, which is what the kernel counts too, zcReaped is the first id
+	//that hasn't been reported done.
+	BOOL     zeroCopy;
+	uint32_t zcSent;
+	uint32_t zcReaped;
+
+	//Becomes readable once the connect finishes, so a connecting
+	//sock can be waited on with select or a poller. Only created when
+	//someone asks for it, -1 until then. On Linux it's an eventfd and
+	//both are the same, elsewhere it's a pipe.
+	int connectEvent;
+	int connectEventWrite;
+
+	//Writes to 'doingConnect' that end the connect are made while
+	//holding this lock, so a thread that checks it under the lock
+	//can wait on connectDone without missing the wakeup. Reads can
+	//be done anywhere through isConnecting().
+	//It also protects creating connectEvent.
+	NTPLock connectLock;
+
+	//Broadcast, with connectLock held, when doingConnect becomes NO
+	NTPCondition connectDone;
 };
 
+//Acquire loads, pairing with the release stores in the connect thread
+//and NTPDisconnect().
+static BOOL isConnecting(NTPSock *sock) {
+	return NTPAtomicLoadInt(&sock->doingConnect, NTP_ORDER_ACQUIRE);
+}
+
+static BOOL wasInterrupted(NTPSock *sock) {
+	return NTPAtomicLoadInt(&sock->shouldInterruptConnect, NTP_ORDER_ACQUIRE);
+}
+
+//Stores a printf() style error message in sock, allocating space
+//for it the first time. If there's no memory, the message is lost.
+static void setSockErr(NTPSock *sock, const char *format, ...) {
+	va_list args;
+	if(sock->errMsg==NULL && (sock->errMsg = malloc(ERR_MSG_LEN))==NULL)
+		return;
+	va_start(args, format);
+	vsnprintf(sock->errMsg, ERR_MSG_LEN, format, args);
+	va_end(args);
+}
 
 //-----------------------------------------------------------------
 // Function for initializing general networking. Only gets run
 // once the first time a socket is created.
 // Mainly we use it to handle SIGPIPE
 //-----------------------------------------------------------------
-static BOOL networkInitialized = FALSE;
-static void initNetwork() {
-	if(networkInitialized) return;
-	
+static pthread_once_t networkInitialized = PTHREAD_ONCE_INIT;
+static void doInitNetwork() {
 	signal(SIGPIPE, SIG_IGN);
-	networkInitialized = TRUE;
+}
+
+static void initNetwork() {
+	pthread_once(&networkInitialized, doInitNetwork);
 }
 
 //------------------------------------------------------------------
-// Functions for doing DNS Lookup. This is insane
+// The DNS cache. Connection churn tends to look up the same names
+// over and over, so we remember the answers (and the failures) for
+// a while. The cache is split into shards, each with its own lock,
+// so threads connecting to different places don't fight.
 //------------------------------------------------------------------
 
-//There's no reasonable way to do DNS lookups in a non-blocking way,
-//so we're going to simulate it with a single thread
-static void *doLookupAndConnectInSeparateThread(void *obj) {
-	NTPSock *sock = (NTPSock*)obj;
-	struct addrinfo hints, *servinfo, *p;
-	int rv;
-	char port[50];
+//One resolved address, copied out of an addrinfo
+struct NTPDNSAddr {
+	int family;
+	int socktype;
+	int protocol;
+	socklen_t addrLen;
+	struct sockaddr_storage addr;
+};
+
+//The result of a lookup, which is just a list of addresses
+struct NTPDNSResult {
+	int count;
+	struct NTPDNSAddr addrs[];
+};
+
+struct NTPDNSEntry {
+	char    *destination;
+	int      port;
+	int64_t  expires;   //in NTPMonotonicMillis() time
+	int      gaiErr;    //0 if the lookup worked
+	struct NTPDNSResult *result;  //NULL if it didn't
+	struct NTPDNSEntry  *next;
+};
+
+#define DNS_SHARDS            16
+#define DNS_SHARD_MAX_ENTRIES 256
+
+struct NTPDNSShard {
+	NTPLock             lock;
+	struct NTPDNSEntry *head;    //newest first
+	int                 count;
+};
+
+static struct NTPDNSShard dnsShards[DNS_SHARDS];
+static pthread_once_t dnsOnce = PTHREAD_ONCE_INIT;
+
+//These are read and written with atomic builtins, since any
+//thread can be connecting while someone changes them.
+static NTPAtomicInt   dnsPositiveTTL = NTP_ATOMIC_INIT(60000);
+static NTPAtomicInt   dnsNegativeTTL = NTP_ATOMIC_INIT(5000);
+static NTPAtomicInt64 dnsHits   = NTP_ATOMIC_INIT(0);
+static NTPAtomicInt64 dnsMisses = NTP_ATOMIC_INIT(0);
+
+static void initDNSCache() {
+	int i;
+	for(i=0;i<DNS_SHARDS;i++) {
+		NTPInitLock(&dnsShards[i].lock);
+		dnsShards[i].head  = NULL;
+		dnsShards[i].count = 0;
+	}
+}
+
+//True if sock has a connect timeout, and it has passed
+static BOOL connectExpired(NTPSock *sock) {
+	return sock->connectDeadline!=0 && NTPMonotonicMillis() >= sock->connectDeadline;
+}
+
+static struct NTPDNSShard *dnsShardFor(const char *destination, int port) {
+	//FNV-1a, mixing in the port at the end
+	uint32_t hash = 2166136261u;
+	for(;*destination;destination++) {
+		hash ^= (unsigned char)*destination;
+		hash *= 16777619u;
+	}
+	hash ^= (uint32_t)port;
+	hash *= 16777619u;
+
+	pthread_once(&dnsOnce, initDNSCache);
+	return &dnsShards[hash % DNS_SHARDS];
+}
+
+static void freeDNSEntry(struct NTPDNSEntry *entry) {
+	free(entry->destination);
+	free(entry->result);
+	free(entry);
+}
+
+static size_t dnsResultSize(int count) {
+	return sizeof(struct NTPDNSResult) + count*sizeof(struct NTPDNSAddr);
+}
+
+static struct NTPDNSResult *copyDNSResult(struct NTPDNSResult *from) {
+	struct NTPDNSResult *rv = malloc(dnsResultSize(from->count));
+	if(rv!=NULL) memcpy(rv, from, dnsResultSize(from->count));
+	return rv;
+}
+
+//Copies a list from getaddrinfo() into one block of memory
+static struct NTPDNSResult *fromAddrinfo(struct addrinfo *servinfo) {
+	struct NTPDNSResult *rv;
+	struct addrinfo *p;
+	int count = 0;
+
+	for(p=servinfo;p!=NULL;p=p->ai_next) count++;
+	rv = malloc(dnsResultSize(count));
+	if(rv==NULL) return NULL;
+
+	rv->count = 0;
+	for(p=servinfo;p!=NULL;p=p->ai_next) {
+		struct NTPDNSAddr *a = &rv->addrs[rv->count];
+		if(p->ai_addrlen > sizeof(a->addr)) continue;
+		a->family   = p->ai_family;
+		a->socktype = p->ai_socktype;
+		a->protocol = p->ai_protocol;
+		a->addrLen  = p->ai_addrlen;
+		memcpy(&a->addr, p->ai_addr, p->ai_addrlen);
+		rv->count++;
+	}
+	return rv;
+}
+
+//Finds an unexpired entry in the shard. The shard must be locked.
+//Expired entries we come across are thrown away.
+static struct NTPDNSEntry *findDNSEntry(struct NTPDNSShard *shard,
+                                        const char *destination, int port) {
+	struct NTPDNSEntry **pp = &shard->head, *entry;
+	int64_t now = NTPMonotonicMillis();
+
+	while((entry = *pp)!=NULL) {
+		if(entry->expires <= now) {
+			*pp = entry->next;
+			shard->count--;
+			freeDNSEntry(entry);
+			continue;
+		}
+		if(entry->port==port && strcmp(entry->destination, destination)==0)
+			return entry;
+		pp = &entry->next;
+	}
+	return NULL;
+}
+
+//Remembers a lookup. result can be NULL if gaiErr is set.
+//Only failures that will probably fail again are remembered.
+static void storeDNSEntry(const char *destination, int port, int gaiErr,
+                          struct NTPDNSResult *result) {
+	struct NTPDNSShard *shard = dnsShardFor(destination, port);
+	struct NTPDNSEntry *entry, **pp;
+	int ttl;
+
+	if(gaiErr==0) {
+		ttl = NTPAtomicLoadInt(&dnsPositiveTTL, NTP_ORDER_RELAXED);
+	}
+	else if(gaiErr==EAI_NONAME || gaiErr==EAI_FAIL
+#ifdef EAI_NODATA
+	        || gaiErr==EAI_NODATA
+#endif
+	       ) {
+		ttl = NTPAtomicLoadInt(&dnsNegativeTTL, NTP_ORDER_RELAXED);
+	}
+	else {
+		return;
+	}
+	if(ttl<=0) return;
+
+	entry = malloc(sizeof(struct NTPDNSEntry));
+	if(entry==NULL) return;
+	entry->destination = strdup(destination);
+	entry->result      = result==NULL ? NULL : copyDNSResult(result);
+	if(entry->destination==NULL || (result!=NULL && entry->result==NULL)) {
+		freeDNSEntry(entry);
+		return;
+	}
+	entry->port    = port;
+	entry->gaiErr  = gaiErr;
+	entry->expires = NTPMonotonicMillis() + ttl;
+
+	NTPAcquireLock(&shard->lock);
+
+	//replace any old answer
+	for(pp=&shard->head;*pp!=NULL;pp=&(*pp)->next) {
+		if((*pp)->port==port && strcmp((*pp)->destination, destination)==0) {
+			struct NTPDNSEntry *old = *pp;
+			*pp = old->next;
+			shard->count--;
+			freeDNSEntry(old);
+			break;
+		}
+	}
+
+	//when the shard is full, forget the oldest entry
+	if(shard->count >= DNS_SHARD_MAX_ENTRIES) {
+		for(pp=&shard->head;(*pp)->next!=NULL;pp=&(*pp)->next);
+		freeDNSEntry(*pp);
+		*pp = NULL;
+		shard->count--;
+	}
+
+	entry->next = shard->head;
+	shard->head = entry;
+	shard->count++;
+	NTPReleaseLock(&shard->lock);
+}
+
+//Does the actual getaddrinfo(), without looking at the cache.
+static struct NTPDNSResult *resolveNow(const char *destination, int port,
+                                       int flags, int *gaiErr) {
+	struct addrinfo hints, *servinfo;
+	struct NTPDNSResult *rv;
+	char portStr[50];
 
 	//Please Lord, may I never have to write one of these again.
-	//Here is where we actually do the lookup.
 	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC;
+	hints.ai_family   = AF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
-	sprintf(port, "%d",sock->port);
-	if((rv = getaddrinfo(sock->destination, port, &hints, &servinfo))!=0){
-		//deal with error
-		snprintf(sock->errMsg, sizeof(sock->errMsg), "DNS lookup, %s",
-		         gai_strerror(rv));
-		sock->errMsg[sizeof(sock->errMsg)-1]=0;
-		goto ERR;
+	hints.ai_flags    = flags;
+	sprintf(portStr, "%d", port);
+	if((*gaiErr = getaddrinfo(destination, portStr, &hints, &servinfo))!=0)
+		return NULL;
+
+	rv = fromAddrinfo(servinfo);
+	freeaddrinfo(servinfo);
+	if(rv==NULL) *gaiErr = EAI_MEMORY;
+	return rv;
+}
+
+//Looks up destination, using the cache if we can. Returns a result
+//the caller must free(), or NULL with gaiErr set.
+static struct NTPDNSResult *lookupAddresses(const char *destination, int port,
+                                            int *gaiErr) {
+	struct NTPDNSShard *shard;
+	struct NTPDNSEntry *entry;
+	struct NTPDNSResult *rv;
+
+	//IP addresses don't need a lookup, or a cache
+	if((rv = resolveNow(destination, port, AI_NUMERICHOST, gaiErr))!=NULL)
+		return rv;
+
+	shard = dnsShardFor(destination, port);
+	NTPAcquireLock(&shard->lock);
+	if((entry = findDNSEntry(shard, destination, port))!=NULL) {
+		*gaiErr = entry->gaiErr;
+		rv = entry->result==NULL ? NULL : copyDNSResult(entry->result);
+		if(entry->result!=NULL && rv==NULL) *gaiErr = EAI_MEMORY;
+		NTPReleaseLock(&shard->lock);
+		NTPAtomicFetchAddInt64(&dnsHits, 1, NTP_ORDER_RELAXED);
+		return rv;
 	}
-	
-	//got the lookup, now get ourselves a socket
-	for(p = servinfo; p != NULL; p = p->ai_next) {
-		if((sock->sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol))<0){
-			snprintf(sock->errMsg, sizeof(sock->errMsg), "sock() failed, %s",
-			           strerror(errno));
-			sock->errMsg[sizeof(sock->errMsg)-1]=0;
-			//we can try again until we run out of p->ai_next
+	NTPReleaseLock(&shard->lock);
+	NTPAtomicFetchAddInt64(&dnsMisses, 1, NTP_ORDER_RELAXED);
+
+	rv = resolveNow(destination, port, 0, gaiErr);
+	storeDNSEntry(destination, port, *gaiErr, rv);
+	return rv;
+}
+
+void NTPSetDNSCacheTTL(int positiveMS, int negativeMS) {
+	NTPAtomicStoreInt(&dnsPositiveTTL, positiveMS, NTP_ORDER_RELAXED);
+	NTPAtomicStoreInt(&dnsNegativeTTL, negativeMS, NTP_ORDER_RELAXED);
+}
+
+BOOL NTPDNSPrefill(const char *destination, uint16_t port) {
+	struct NTPDNSResult *result;
+	int gaiErr;
+
+	result = resolveNow(destination, port, 0, &gaiErr);
+	storeDNSEntry(destination, port, gaiErr, result);
+	free(result);
+	return gaiErr==0;
+}
+
+void NTPDNSFlush() {
+	int i;
+	pthread_once(&dnsOnce, initDNSCache);
+	for(i=0;i<DNS_SHARDS;i++) {
+		struct NTPDNSEntry *entry, *next;
+		NTPAcquireLock(&dnsShards[i].lock);
+		for(entry=dnsShards[i].head;entry!=NULL;entry=next) {
+			next = entry->next;
+			freeDNSEntry(entry);
+		}
+		dnsShards[i].head  = NULL;
+		dnsShards[i].count = 0;
+		NTPReleaseLock(&dnsShards[i].lock);
+	}
+}
+
+int NTPDNSCached(const char *destination, uint16_t port) {
+	struct NTPDNSShard *shard = dnsShardFor(destination, port);
+	struct NTPDNSEntry *entry;
+	int rv = -1;
+
+	NTPAcquireLock(&shard->lock);
+	if((entry = findDNSEntry(shard, destination, port))!=NULL)
+		rv = entry->result==NULL ? 0 : entry->result->count;
+	NTPReleaseLock(&shard->lock);
+	return rv;
+}
+
+void NTPDNSCacheStats(uint64_t *hits, uint64_t *misses, int *entries) {
+	int i;
+	if(hits!=NULL)   *hits   = (uint64_t)NTPAtomicLoadInt64(&dnsHits,   NTP_ORDER_RELAXED);
+	if(misses!=NULL) *misses = (uint64_t)NTPAtomicLoadInt64(&dnsMisses, NTP_ORDER_RELAXED);
+	if(entries==NULL) return;
+
+	pthread_once(&dnsOnce, initDNSCache);
+	*entries = 0;
+	for(i=0;i<DNS_SHARDS;i++) {
+		NTPAcquireLock(&dnsShards[i].lock);
+		*entries += dnsShards[i].count;
+		NTPReleaseLock(&dnsShards[i].lock);
+	}
+}
+
+//------------------------------------------------------------------
+// Happy Eyeballs (RFC 8305). Rather than trying each address until
+// the kernel gives up on it, we start a non-blocking connect to the
+// first address, and if it hasn't finished after a short delay,
+// start the next one as well, alternating IPv6 and IPv4. Whichever
+// connects first wins, and the rest get closed.
+//------------------------------------------------------------------
+#define DEFAULT_ATTEMPT_DELAY 250
+
+//how often we wake up to check if NTPDisconnect() was called
+#define INTERRUPT_CHECK_MS 100
+
+static NTPAtomicInt attemptDelayMS = NTP_ATOMIC_INIT(DEFAULT_ATTEMPT_DELAY);
+
+void NTPSetConnectAttemptDelay(int delayMS) {
+	if(delayMS<0) delayMS = 0;
+	NTPAtomicStoreInt(&attemptDelayMS, delayMS, NTP_ORDER_RELAXED);
+}
+
+//Reorders the addresses so the families alternate, starting with
+//whichever family the resolver liked best. Otherwise keeps the order.
+static void interleaveFamilies(struct NTPDNSResult *addrs) {
+	struct NTPDNSAddr *sorted;
+	int firstFamily, i, a, b, n;
+
+	if(addrs->count<3) return;
+	sorted = malloc(addrs->count * sizeof(struct NTPDNSAddr));
+	if(sorted==NULL) return; //the original order works too
+
+	firstFamily = addrs->addrs[0].family;
+	a = b = n = 0;
+	while(n<addrs->count) {
+		//next one from the first family, then next one from the rest
+		while(a<addrs->count && addrs->addrs[a].family!=firstFamily) a++;
+		if(a<addrs->count) sorted[n++] = addrs->addrs[a++];
+		while(b<addrs->count && addrs->addrs[b].family==firstFamily) b++;
+		if(b<addrs->count) sorted[n++] = addrs->addrs[b++];
+	}
+
+	for(i=0;i<addrs->count;i++) addrs->addrs[i] = sorted[i];
+	free(sorted);
+}
+
+//Writes the IP address in addr as text. port can be NULL.
+static void formatAddress(struct sockaddr_storage *addr, char *buf,
+                          size_t len, uint16_t *port) {
+	void *raw;
+	uint16_t p;
+	if(addr->ss_family==AF_INET6) {
+		raw = &((struct sockaddr_in6*)addr)->sin6_addr;
+		p   =  ((struct sockaddr_in6*)addr)->sin6_port;
+	} else if(addr->ss_family==AF_INET) {
+		raw = &((struct sockaddr_in*)addr)->sin_addr;
+		p   =  ((struct sockaddr_in*)addr)->sin_port;
+	} else {
+		//a Unix socket, say, which has no port
+		raw = NULL;
+		p   = 0;
+	}
+	if(port!=NULL) *port = ntohs(p);
+	if((addr->ss_family!=AF_INET && addr->ss_family!=AF_INET6) ||
+	   inet_ntop(addr->ss_family, raw, buf, len)==NULL)
+		strcpy(buf, "unknown");
+}
+
+static void describeAddress(struct NTPDNSAddr *addr, NTPConnectAttempt *att) {
+	att->ipv6 = addr->family==AF_INET6;
+	formatAddress(&addr->addr, att->address, sizeof(att->address), NULL);
+}
+
+static BOOL setBlocking(int fd, BOOL blocking) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if(flags<0) return FALSE;
+	flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+	return fcntl(fd, F_SETFL, flags)==0;
+}
+
+//Marks an attempt as finished
+static void finishAttempt(NTPConnectAttempt *att, int64_t start, int result) {
+	att->result     = result;
+	att->durationMS = (int)(NTPMonotonicMillis() - start) - att->startMS;
+}
+
+//Starts a non-blocking connect. Returns the socket, or -1 if it
+//failed right away. Sets *done if it connected right away.
+static int startAttempt(NTPSock *sock, struct NTPDNSAddr *p, BOOL *done) {
+	int fd;
+
+	*done = FALSE;
+	if((fd = socket(p->family, p->socktype, p->protocol))<0) {
+		setSockErr(sock, "sock() failed, %s",
+		         strerror(errno));
+		return -1;
+	}
+	if(!setBlocking(fd, FALSE)) {
+		setSockErr(sock, "fcntl() failed, %s",
+		         strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if(connect(fd, (struct sockaddr*)&p->addr, p->addrLen)==0) {
+		*done = TRUE;
+	}
+	else if(errno!=EINPROGRESS) {
+		setSockErr(sock, "connect to %s failed, %s", sock->destination,
+		         strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+//Races connects to all the addresses. Returns the connected socket,
+//in blocking mode, or -1 with sock->errMsg set. Fills in
+//sock->attempts as it goes.
+static int connectHappyEyeballs(NTPSock *sock, struct NTPDNSResult *addrs) {
+	struct pollfd *pfds;
+	int *which;       //which attempt each pfd belongs to
+	int pending = 0, next = 0, winner = -1, i, err;
+	int delay = NTPAtomicLoadInt(&attemptDelayMS, NTP_ORDER_RELAXED);
+	int64_t start = NTPMonotonicMillis(), nextStart = start, now;
+	socklen_t errLen;
+	BOOL done;
+
+	interleaveFamilies(addrs);
+	pfds  = malloc(addrs->count * sizeof(struct pollfd));
+	which = malloc(addrs->count * sizeof(int));
+	sock->attempts = calloc(addrs->count, sizeof(NTPConnectAttempt));
+	if(pfds==NULL || which==NULL || sock->attempts==NULL) {
+		setSockErr(sock, "no memory");
+		goto DONE;
+	}
+	sock->numAttempts = 0;
+
+	while(winner<0 && !wasInterrupted(sock)) {
+		now = NTPMonotonicMillis();
+		if(sock->connectDeadline!=0 && now >= sock->connectDeadline) {
+			sock->timedOut = TRUE;
+			break;
+		}
+
+		//time to start another attempt?
+		if(next<addrs->count && now>=nextStart) {
+			NTPConnectAttempt *att = &sock->attempts[next];
+			int fd;
+
+			describeAddress(&addrs->addrs[next], att);
+			att->startMS = (int)(now - start);
+			sock->numAttempts++;
+
+			fd = startAttempt(sock, &addrs->addrs[next], &done);
+			if(fd<0) {
+				finishAttempt(att, start, NTPATTEMPT_FAILED);
+				nextStart = now; //no point waiting, try the next one
+			}
+			else if(done) {
+				finishAttempt(att, start, NTPATTEMPT_CONNECTED);
+				winner = fd;
+			}
+			else {
+				pfds[pending].fd     = fd;
+				pfds[pending].events = POLLOUT;
+				which[pending]       = next;
+				pending++;
+				nextStart = now + delay;
+			}
+			next++;
 			continue;
 		}
 
-		//and if we got the socket, try to connect
-		if(connect(sock->sock, p->ai_addr, p->ai_addrlen) <0) {
-			snprintf(sock->errMsg, sizeof(sock->errMsg), 
-			        "connect to %s failed, %s\n", sock->destination,strerror(errno));
-			sock->errMsg[sizeof(sock->errMsg)-1]=0;
-			close(sock->sock);
-			//we can try again until we run out of p->ai_next
+		if(pending==0) {
+			if(next>=addrs->count) break; //nothing left to try
+			nextStart = now;
 			continue;
 		}
-		
-		break; //connection successful! p has our value,
-		       //but if we don't have success, p will be NULL
+
+		//wait for something to finish, or until it's time to start
+		//the next attempt
+		i = INTERRUPT_CHECK_MS;
+		if(next<addrs->count && nextStart-now < i) i = (int)(nextStart-now);
+		if(sock->connectDeadline!=0 && sock->connectDeadline-now < i)
+			i = (int)(sock->connectDeadline-now);
+		if(poll(pfds, pending, i)<0 && errno!=EINTR) {
+			setSockErr(sock, "poll, %s",
+			         strerror(errno));
+			break;
+		}
+
+		for(i=0;i<pending && winner<0;i++) {
+			if(pfds[i].revents==0) continue;
+
+			errLen = sizeof(err);
+			if(getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &errLen)<0)
+				err = errno;
+			if(err==0) {
+				finishAttempt(&sock->attempts[which[i]], start,
+				              NTPATTEMPT_CONNECTED);
+				winner = pfds[i].fd;
+			} else {
+				setSockErr(sock, "connect to %s failed, %s", sock->destination,
+				         strerror(err));
+				finishAttempt(&sock->attempts[which[i]], start,
+				              NTPATTEMPT_FAILED);
+				close(pfds[i].fd);
+				nextStart = NTPMonotonicMillis();
+			}
+
+			//take it out of the list
+			pending--;
+			pfds[i]  = pfds[pending];
+			which[i] = which[pending];
+			i--;
+		}
 	}
 
-	//don't dereference 'p' after this
-	freeaddrinfo(servinfo);
+	//whatever is still going lost the race
+	for(i=0;i<pending;i++) {
+		finishAttempt(&sock->attempts[which[i]], start, NTPATTEMPT_CANCELLED);
+		close(pfds[i].fd);
+	}
+
+	if(winner>=0 && !setBlocking(winner, TRUE)) {
+		setSockErr(sock, "fcntl() failed, %s",
+		         strerror(errno));
+		close(winner);
+		winner = -1;
+	}
+	if(winner<0 && wasInterrupted(sock))
+		setSockErr(sock, "Connect interrupted");
+	else if(winner<0 && sock->timedOut)
+		setSockErr(sock, "%s", TIMEOUT_ERR_MSG);
+
+DONE:
+	free(pfds);
+	free(which);
+	return winner;
+}
+
+int NTPConnectAttempts(NTPSock *sock, NTPConnectAttempt *attempts, int max) {
+	if(isConnecting(sock)) return -1;
+	if(max > sock->numAttempts) max = sock->numAttempts;
+	if(max>0) memcpy(attempts, sock->attempts, max*sizeof(NTPConnectAttempt));
+	return sock->numAttempts;
+}
+
+//------------------------------------------------------------------
+// Functions for doing DNS Lookup. This is insane
+//------------------------------------------------------------------
+
+//Makes connectEvent readable. Call with connectLock held.
+static void signalConnectEvent(NTPSock *sock) {
+	if(sock->connectEvent>=0) {
+#ifdef NTP_LIN
+		uint64_t one = 1;
+#else
+		char one = 1;
+#endif
+		if(write(sock->connectEventWrite, &one, sizeof(one))<0) {
+			//it's non-blocking and never read, so it's already readable
+		}
+	}
+}
+
+//Returns an fd that becomes readable when the connect finishes, or
+//-1 if the sock isn't connecting (or we couldn't make one). A connect
+//that already failed gets one too, that's readable right away, so
+//failures are reported the same way no matter how fast they happen.
+static int connectEventFD(NTPSock *sock) {
+	int rv = -1;
+
+	NTPAcquireLock(&sock->connectLock);
+	if((isConnecting(sock) || sock->connectError) && sock->connectEvent<0) {
+#ifdef NTP_LIN
+		sock->connectEvent = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+		sock->connectEventWrite = sock->connectEvent;
+#else
+		int fds[2];
+		if(pipe(fds)==0) {
+			fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+			fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+			fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+			sock->connectEvent      = fds[0];
+			sock->connectEventWrite = fds[1];
+		}
+#endif
+		if(!isConnecting(sock)) signalConnectEvent(sock);
+	}
+	if(isConnecting(sock) || sock->connectError) rv = sock->connectEvent;
+	NTPReleaseLock(&sock->connectLock);
+	return rv;
+}
+
+//There's no reasonable way to do DNS lookups in a non-blocking way,
+//so we're going to simulate it with a separate thread. This gets
+//run by one of the threads in the connect pool.
+static void *doLookupAndConnectInSeparateThread(void *obj) {
+	NTPSock *sock = (NTPSock*)obj;
+	struct NTPDNSResult *addrs;
+	int rv;
+
+	//If NTPDisconnect() was called while we were waiting in the
+	//queue, or we ran out of time, don't bother looking anything up.
+	if(wasInterrupted(sock)) {
+		sock->connectError = TRUE;
+		goto SIGNAL_CONNECTION_COMPLETE;
+	}
+	if(connectExpired(sock)) goto ERR;
+
+	//Here is where we actually do the lookup.
+	if((addrs = lookupAddresses(sock->destination, sock->port, &rv))==NULL){
+		//deal with error
+		setSockErr(sock, "DNS lookup, %s",
+		         gai_strerror(rv));
+		goto ERR;
+	}
+	
+	//got the lookup, now race connects to the addresses
+	sock->sock = connectHappyEyeballs(sock, addrs);
+	free(addrs);
 
-	if(p==NULL) {
+	if(sock->sock<0) {
 		//connection unsuccessful on all attempts!
 		//we already stored the error message of the last error
 		goto ERR;
@@ -141,77 +827,264 @@ ERR:
 	sock->connectError = TRUE;	
 
 SIGNAL_CONNECTION_COMPLETE:
+	//NTPSockStatus() already says we timed out once the deadline
+	//passes, so anything that finished after it has to fail, even
+	//a lookup that took too long to even get to connecting.
+	if(connectExpired(sock) && !wasInterrupted(sock)) {
+		if(sock->sock>=0) close(sock->sock);
+		sock->sock         = -1;
+		sock->timedOut     = TRUE;
+		sock->connectError = TRUE;
+		setSockErr(sock, "%s", TIMEOUT_ERR_MSG);
+	}
+
 	//Check to see if our connect got interrupted by a disconnect
 	//If it did, we need to cleanup ourselves.
-	NTPAcquireLock(sock->connectLock);  {
+	NTPAcquireLock(&sock->connectLock);  {
 
 		//The 'sock' is guaranteed to not be freed until
 		//this is set to NO. And it can only be set while
 		//we hold this lock.
-		sock->doingConnect = NO;
-		if(sock->shouldInterruptConnect==YES) {
-			NTPReleaseLock(sock->connectLock);
+		NTPAtomicStoreInt(&sock->doingConnect, NO, NTP_ORDER_RELEASE);
+		signalConnectEvent(sock);
+		NTPBroadcastCondition(&sock->connectDone);
+		if(wasInterrupted(sock)) {
+			NTPReleaseLock(&sock->connectLock);
 			NTPDisconnect(&sock);
 		}
 		else{
-			NTPReleaseLock(sock->connectLock);
+			NTPReleaseLock(&sock->connectLock);
 		}
 	}
 
 	return NULL;
 }
 
+//------------------------------------------------------------------
+// The connect pool. Instead of starting a thread for every connect,
+// we queue them up and let a limited number of threads work through
+// them. Threads are started as they are needed, up to the maximum,
+// and then wait around for more work.
+//------------------------------------------------------------------
+#define DEFAULT_CONNECT_THREADS 16
+#define DEFAULT_CONNECT_WAITING 1024
+
+static NTPLock      poolLock = NTP_LOCK_INITIALIZER;
+static NTPCondition poolCond = NTP_CONDITION_INITIALIZER;
+static NTPSock *poolHead = NULL, *poolTail = NULL;
+static int poolWaiting    = 0;  //socks in the queue
+static int poolThreads    = 0;  //threads running
+static int poolIdle       = 0;  //threads waiting for work
+static int poolMaxThreads = DEFAULT_CONNECT_THREADS;
+static int poolMaxWaiting = DEFAULT_CONNECT_WAITING;
+
+static void *connectPoolThread(void *arg) {
+	NTPSock *sock;
+
+	NTPAcquireLock(&poolLock);
+	for(;;) {
+		//leave if the pool got shrunk
+		if(poolThreads > poolMaxThreads) break;
+
+		if(poolHead==NULL) {
+			poolIdle++;
+			NTPWaitCondition(&poolCond, &poolLock);
+			poolIdle--;
+			continue;
+		}
+
+		sock = poolHead;
+		poolHead = sock->nextPending;
+		if(poolHead==NULL) poolTail = NULL;
+		poolWaiting--;
+
+		NTPReleaseLock(&poolLock);
+		doLookupAndConnectInSeparateThread(sock);
+		NTPAcquireLock(&poolLock);
+	}
+	poolThreads--;
+	NTPReleaseLock(&poolLock);
+	return NULL;
+}
+
+BOOL NTPSetConnectPool(int maxThreads, int maxWaiting) {
+	if(maxThreads<1 || maxWaiting<1) return FALSE;
+
+	NTPAcquireLock(&poolLock);
+	poolMaxThreads = maxThreads;
+	poolMaxWaiting = maxWaiting;
+	//wake everyone up so extra threads can exit
+	NTPBroadcastCondition(&poolCond);
+	NTPReleaseLock(&poolLock);
+	return TRUE;
+}
+
+//Puts sock in the queue to be connected. Returns FALSE if the
+//queue is full, or there are no threads to run it.
+static BOOL queueConnect(NTPSock *sock) {
+	NTPAcquireLock(&poolLock);
+	if(poolWaiting >= poolMaxWaiting) {
+		NTPReleaseLock(&poolLock);
+		setSockErr(sock, "Too many connects waiting");
+		return FALSE;
+	}
+
+	sock->nextPending = NULL;
+	if(poolTail==NULL) poolHead = sock;
+	else               poolTail->nextPending = sock;
+	poolTail = sock;
+	poolWaiting++;
+
+	//start another thread if nobody is free to take this one
+	if(poolWaiting > poolIdle && poolThreads < poolMaxThreads) {
+		if(NTPStartThread(connectPoolThread, NULL)) {
+			poolThreads++;
+		}
+		else if(poolThreads==0) {
+			//nobody will ever get to it, so take it back out
+			poolHead = poolTail = NULL;
+			poolWaiting--;
+			NTPReleaseLock(&poolLock);
+			setSockErr(sock, "Couldn't start connect thread");
+			return FALSE;
+		}
+	}
+	NTPSignalCondition(&poolCond);
+	NTPReleaseLock(&poolLock);
+	return TRUE;
+}
+
+//------------------------------------------------------------------
+// The NTPSock allocator. Socks come and go a lot on a busy server,
+// so rather than malloc() each one, we carve them out of bigger
+// slabs and keep the free ones on a list. Slabs are never given
+// back to the system.
+//------------------------------------------------------------------
+#define SOCKS_PER_SLAB 64
+#define CACHE_LINE     64
+
+//Each sock starts on its own cache line
+#define SOCK_STRIDE ((sizeof(NTPSock)+CACHE_LINE-1) & ~(size_t)(CACHE_LINE-1))
+
+static NTPLock  sockFreeLock = NTP_LOCK_INITIALIZER;
+static NTPSock *sockFreeList = NULL;
+
+static NTPSock *takeNTPSock() {
+	NTPSock *rv;
+	void *slab;
+	int i;
+
+	NTPAcquireLock(&sockFreeLock);
+	if(sockFreeList==NULL &&
+	   posix_memalign(&slab, CACHE_LINE, SOCKS_PER_SLAB*SOCK_STRIDE)==0) {
+		for(i=0;i<SOCKS_PER_SLAB;i++) {
+			NTPSock *sock = (NTPSock*)((char*)slab + i*SOCK_STRIDE);
+			sock->nextPending = sockFreeList;
+			sockFreeList = sock;
+		}
+	}
+	rv = sockFreeList;
+	if(rv!=NULL) sockFreeList = rv->nextPending;
+	NTPReleaseLock(&sockFreeLock);
+	return rv;
+}
+
+static void giveBackNTPSock(NTPSock *sock) {
+	NTPAcquireLock(&sockFreeLock);
+	sock->nextPending = sockFreeList;
+	sockFreeList = sock;
+	NTPReleaseLock(&sockFreeLock);
+}
+
 //------------------------------------------------------------------
 // Functions for connecting and disconnecting
 //------------------------------------------------------------------
 
 /**Allocates memory for an NTPSock and fills it in with some
- * good defaults.*/
+ * good defaults. destination can be NULL.*/
 static NTPSock *allocNTPSock(const char *destination, uint16_t port) {
 	initNetwork();
 
-	NTPSock *rv = (NTPSock*)malloc(sizeof(NTPSock));
+	NTPSock *rv = takeNTPSock();
 	if(rv!=NULL) {
-		rv->shouldInterruptConnect = FALSE;
+		NTPAtomicStoreInt(&rv->shouldInterruptConnect, FALSE, NTP_ORDER_RELAXED);
 		rv->sock         = -1   ;
 		rv->port         = port ;
+		rv->family       = AF_UNSPEC;
 		rv->connectError = FALSE;
 		rv->listenError  = FALSE;
 		rv->listenSock   = FALSE;
-		rv->doingConnect = FALSE;
-		strncpy(rv->destination, destination, sizeof(rv->destination)-1);
-		rv->destination[sizeof(rv->destination)-1] = 0;
-		strcpy(rv->errMsg, "No error, yet");
-	
-		rv->connectLock = NTPNewLock();
-		if(rv->connectLock==NULL) {
-			free(rv);
-			rv = NULL;
+		NTPAtomicStoreInt(&rv->doingConnect, FALSE, NTP_ORDER_RELAXED);
+		rv->timedOut     = FALSE;
+		rv->connectDeadline = 0;
+		rv->errMsg       = NULL;
+		rv->destination  = NULL;
+		rv->unlinkPath   = FALSE;
+		rv->nextPending  = NULL;
+		rv->attempts     = NULL;
+		rv->numAttempts  = 0;
+		rv->zeroCopy     = FALSE;
+		rv->zcSent       = 0;
+		rv->zcReaped     = 0;
+		rv->connectEvent      = -1;
+		rv->connectEventWrite = -1;
+
+		if(!NTPInitLock(&rv->connectLock)) {
+			giveBackNTPSock(rv);
+			return NULL;
+		}
+		if(!NTPInitCondition(&rv->connectDone)) {
+			NTPDestroyLock(&rv->connectLock);
+			giveBackNTPSock(rv);
+			return NULL;
+		}
+		if(destination!=NULL && (rv->destination = strdup(destination))==NULL) {
+			NTPDestroyCondition(&rv->connectDone);
+			NTPDestroyLock(&rv->connectLock);
+			giveBackNTPSock(rv);
+			return NULL;
 		}
 	}
 
 	return rv;
 }
 
+/**Frees everything allocNTPSock() did, and closes the socket*/
+static void freeNTPSock(NTPSock *sock) {
+	NTPDestroyCondition(&sock->connectDone);
+	NTPDestroyLock(&sock->connectLock);
+	if(sock->sock >=0) close(sock->sock);
+	if(sock->unlinkPath) unlink(sock->destination);
+	if(sock->connectEvent>=0) close(sock->connectEvent);
+	if(sock->connectEventWrite>=0 && sock->connectEventWrite!=sock->connectEvent)
+		close(sock->connectEventWrite);
+	free(sock->attempts);
+	free(sock->errMsg);
+	free(sock->destination);
+	giveBackNTPSock(sock);
+}
 
 NTPSock *NTPConnectTCP(const char *destination, uint16_t port) {
+	return NTPConnectTCPWithTimeout(destination, port, 0);
+}
+
+NTPSock *NTPConnectTCPWithTimeout(const char *destination, uint16_t port,
+                                  int timeoutMS) {
 	NTPSock *rv = allocNTPSock(destination, port);
 	if(rv==NULL) goto ERR_NO_MEM;
 
+	if(timeoutMS>0) rv->connectDeadline = NTPMonotonicMillis() + timeoutMS;
 
 
-	//begin the asynchronous connect
-	rv->doingConnect = TRUE;
-	if(!NTPStartThread(doLookupAndConnectInSeparateThread,rv))
-		goto ERR_START_THREAD;
+	//begin the asynchronous connect. If we can't, the caller
+	//finds out through NTPSockStatus(), like any other connect error
+	NTPAtomicStoreInt(&rv->doingConnect, TRUE, NTP_ORDER_RELAXED);
+	if(!queueConnect(rv)) {
+		rv->connectError = TRUE;
+		NTPAtomicStoreInt(&rv->doingConnect, FALSE, NTP_ORDER_RELEASE);
+	}
 	
-	return rv; //success
-
-
-ERR_START_THREAD:
-	NTPFreeLock(&rv->connectLock);
-	free(rv);
-	rv=NULL;
+	return rv;
 
 ERR_NO_MEM:
 	return rv;
@@ -219,7 +1092,7 @@ ERR_NO_MEM:
 
 void NTPDisconnect(NTPSock **sock) {
 	if(sock==NULL || *sock==NULL) return;
-	NTPLock *lock = (*sock)->connectLock;
+	NTPLock *lock = &(*sock)->connectLock;
 
 	//Complications always come when you're using threads,
 	//and here's ours. If we're connecting while the thread
@@ -228,18 +1101,16 @@ void NTPDisconnect(NTPSock **sock) {
 	//because otherwise we have a race condition. If we weren't
 	//using threads, we wouldn't need to do all this locking
 	NTPAcquireLock(lock);
-	if((*sock)->doingConnect==YES) {
+	if(isConnecting(*sock)) {
 		//we are still connecting, so tell our thread to free it
-		(*sock)->shouldInterruptConnect = YES;
+		NTPAtomicStoreInt(&(*sock)->shouldInterruptConnect, YES, NTP_ORDER_RELEASE);
 		NTPReleaseLock(lock);
 	} else{
 		//we are no longer connecting, so we can free everything ourselves
 		NTPReleaseLock(lock);
 		
 		//Here is where we actually free everything
-		NTPFreeLock(&(*sock)->connectLock);
-		if((*sock)->sock >=0) close((*sock)->sock);
-		free(*sock);
+		freeNTPSock(*sock);
 	}
 
 	//In either case, set *sock to NULL so the end user
@@ -248,12 +1119,24 @@ void NTPDisconnect(NTPSock **sock) {
 }
 
 
+static NTPSock *listenOn(uint16_t port, int backlog, BOOL reusePort);
+
 NTPSock*NTPListen(uint16_t port) {
+	return NTPListenWithBacklog(port, DEFAULT_LISTEN_BACKLOG);
+}
+
+NTPSock*NTPListenWithBacklog(uint16_t port, int backlog) {
+	return listenOn(port, backlog, FALSE);
+}
+
+//Does the work of listening. If reusePort is TRUE, other sockets
+//can listen on the same port, and the OS shares connections among them.
+static NTPSock *listenOn(uint16_t port, int backlog, BOOL reusePort) {
 	struct addrinfo hints, *servinfo, *p;
 	int ev;
 	char portStr[20];
 
-	NTPSock *rv = allocNTPSock("", port);
+	NTPSock *rv = allocNTPSock(NULL, port);
 	if(rv==NULL) return NULL;
 	rv->listenSock = TRUE;
 	
@@ -264,7 +1147,7 @@ NTPSock*NTPListen(uint16_t port) {
 	hints.ai_flags = AI_PASSIVE;
 	if((ev=getaddrinfo(NULL, portStr, &hints, &servinfo))!=0) {
 		rv->listenError = TRUE;
-		snprintf(rv->errMsg, sizeof(rv->errMsg), "GetAddrInfo Err, %s",
+		setSockErr(rv, "GetAddrInfo Err, %s",
 		         gai_strerror(ev));
 		return rv;
 	}
@@ -273,7 +1156,7 @@ NTPSock*NTPListen(uint16_t port) {
 	for(p=servinfo; p!=NULL; p = p->ai_next) {
 		int optval = 1;
 		if((rv->sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol))<0) {
-			snprintf(rv->errMsg, sizeof(rv->errMsg), "Socket not created, %s",
+			setSockErr(rv, "Socket not created, %s",
 			         strerror(errno));
 			continue;
 		}
@@ -281,8 +1164,18 @@ NTPSock*NTPListen(uint16_t port) {
 		//if this one fails, it's alright, can keep going
 		setsockopt(rv->sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
 
+		//but this one can't, or the other shards won't be able to bind
+		if(reusePort && setsockopt(rv->sock, SOL_SOCKET, SO_REUSEPORT, &optval,
+		                           sizeof(optval))<0) {
+			setSockErr(rv, "Couldn't reuse port, %s",
+			         strerror(errno));
+			close(rv->sock);
+			rv->sock = -1;
+			continue;
+		}
+
 		if(bind(rv->sock, p->ai_addr, p->ai_addrlen) <0) {
-			snprintf(rv->errMsg, sizeof(rv->errMsg), "Couldn't bind, %s",
+			setSockErr(rv, "Couldn't bind, %s",
 			         strerror(errno));
 			close(rv->sock);
 			rv->sock = -1;
@@ -295,9 +1188,10 @@ NTPSock*NTPListen(uint16_t port) {
 	
 	if(rv->sock>=0) {
 
-		//this one needs to work, though
-		if(listen(rv->sock, 100)<0) {
-			snprintf(rv->errMsg, sizeof(rv->errMsg), "couldn't listen, %s",
+		//this one needs to work, though. The socket is non-blocking
+		//so NTPAcceptMany() can drain it, NTPAccept() waits by itself.
+		if(listen(rv->sock, backlog)<0 || !setBlocking(rv->sock, FALSE)) {
+			setSockErr(rv, "couldn't listen, %s",
 		   	      strerror(errno));
 			close(rv->sock);
 			rv->sock = -1;
@@ -312,26 +1206,121 @@ NTPSock*NTPListen(uint16_t port) {
 }
 
 
-NTPSock *NTPAccept(NTPSock *sock) {
-	int acceptedSock;
-	struct sockaddr address;
+#if defined(NTP_LIN) && defined(SO_ATTACH_REUSEPORT_CBPF)
+#include <linux/filter.h>
+
+//Attaches a tiny BPF program to the group of sockets sharing the port,
+//which picks the socket by the number of the CPU the packet came in on.
+static BOOL steerByCPU(NTPSock *shard, int nShards) {
+	struct sock_filter code[] = {
+		//A = the current CPU
+		{ BPF_LD  | BPF_W   | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+		//A = A % nShards
+		{ BPF_ALU | BPF_MOD | BPF_K,   0, 0, (uint32_t)nShards },
+		//return A, which is the index of the socket in the group
+		{ BPF_RET | BPF_A,             0, 0, 0 },
+	};
+	struct sock_fprog prog;
+
+	prog.len    = sizeof(code)/sizeof(code[0]);
+	prog.filter = code;
+	if(setsockopt(shard->sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+	              sizeof(prog))<0) {
+		setSockErr(shard, "Couldn't attach CPU steering, %s", strerror(errno));
+		return FALSE;
+	}
+	return TRUE;
+}
+#else
+static BOOL steerByCPU(NTPSock *shard, int nShards) {
+	return TRUE; //there's nothing to steer with, so let the OS decide
+}
+#endif
+
+BOOL NTPListenSharded(uint16_t port, int nShards, BOOL steerCPU,
+                      NTPSock **shards) {
+	char err[ERR_MSG_LEN];
+	int i, failed;
+
+	//There's no room in shards for an error sock either
+	if(nShards<1) return FALSE;
+
+	for(i=0;i<nShards;i++) shards[i] = NULL;
+	for(failed=0;failed<nShards;failed++) {
+		shards[failed] = listenOn(port, DEFAULT_LISTEN_BACKLOG, TRUE);
+		if(shards[failed]==NULL) {
+			strcpy(err, "no memory");
+			goto ERR;
+		}
+		if(NTPSockStatus(shards[failed])!=NTPSOCK_LISTENING) {
+			snprintf(err, sizeof(err), "%s", NTPSockErr(shards[failed]));
+			goto ERR;
+		}
+	}
+	if(steerCPU && !steerByCPU(shards[0], nShards)) {
+		snprintf(err, sizeof(err), "%s", NTPSockErr(shards[0]));
+		goto ERR;
+	}
+	return TRUE;
+
+ERR:
+	//close everything, and leave an error sock in shards[0]
+	//so the caller can find out what went wrong
+	for(i=0;i<nShards;i++) NTPDisconnect(&shards[i]);
+	if((shards[0] = allocNTPSock(NULL, port))!=NULL) {
+		shards[0]->listenSock  = TRUE;
+		shards[0]->listenError = TRUE;
+		setSockErr(shards[0], "%s", err);
+	}
+	return FALSE;
+}
+
+//accept()s a socket, with the given flags on platforms that have
+//accept4(). Everywhere else, we set them afterwards.
+static int acceptWithFlags(int listenFd, struct sockaddr_storage *address,
+                           socklen_t *addressLen, BOOL nonBlocking) {
+	int fd;
+	*addressLen = sizeof(*address);
+#ifdef NTP_LIN
+	fd = accept4(listenFd, (struct sockaddr*)address, addressLen,
+	             SOCK_CLOEXEC | (nonBlocking ? SOCK_NONBLOCK : 0));
+#else
+	fd = accept(listenFd, (struct sockaddr*)address, addressLen);
+	if(fd>=0) {
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		if(nonBlocking) setBlocking(fd, FALSE);
+	}
+#endif
+	return fd;
+}
+
+NTPSock *NTPAccept(NTPSock *sock) {
+	int acceptedSock;
+	struct sockaddr_storage address;
+	socklen_t addressLen;
+	struct pollfd pfd;
 	NTPSock *rv;
-	socklen_t address_len;
 
 	if(!sock->listenSock) {
-		snprintf(sock->errMsg, sizeof(sock->errMsg), "Socket is not listening");
+		setSockErr(sock, "Socket is not listening");
 		return NULL;
 	}
 	
-	acceptedSock = accept(sock->sock, &address, &address_len);
-	if(acceptedSock<0) {
-		snprintf(sock->errMsg,sizeof(sock->errMsg),"accepting, %s",strerror(errno));
-		return NULL;
+	//the listening socket is non-blocking, so wait
+	//for a connection ourselves
+	while((acceptedSock = acceptWithFlags(sock->sock, &address, &addressLen, FALSE))<0) {
+		if(errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR) {
+			setSockErr(sock, "accepting, %s",strerror(errno));
+			return NULL;
+		}
+		pfd.fd     = sock->sock;
+		pfd.events = POLLIN;
+		poll(&pfd, 1, -1);
 	}
 	
-	rv = allocNTPSock("", -1);
+	rv = allocNTPSock(NULL, -1);
 	if(rv==NULL) {
-		snprintf(sock->errMsg, sizeof(sock->errMsg), "no memory");
+		setSockErr(sock, "no memory");
 		close(acceptedSock);
 		return NULL;
 	}
@@ -340,6 +1329,572 @@ NTPSock *NTPAccept(NTPSock *sock) {
 	return rv;
 }
 
+int NTPAcceptMany(NTPSock *listenSock, NTPAccepted *accepted, int max) {
+	struct sockaddr_storage address;
+	socklen_t addressLen;
+	int count = 0, fd;
+
+	if(!listenSock->listenSock) {
+		setSockErr(listenSock, "Socket is not listening");
+		return -1;
+	}
+
+	while(count<max) {
+		if((fd = acceptWithFlags(listenSock->sock, &address, &addressLen, TRUE))<0) {
+			if(errno==EINTR) continue;
+			//the backlog is empty, we're done
+			if(errno==EAGAIN || errno==EWOULDBLOCK) break;
+			//a connection that died in the backlog isn't our problem
+			if(errno==ECONNABORTED) continue;
+
+			setSockErr(listenSock, "accepting, %s",strerror(errno));
+			return count>0 ? count : -1;
+		}
+
+		if((accepted[count].sock = allocNTPSock(NULL, -1))==NULL) {
+			setSockErr(listenSock, "no memory");
+			close(fd);
+			return count>0 ? count : -1;
+		}
+		accepted[count].sock->sock = fd;
+		formatAddress(&address, accepted[count].address,
+		              sizeof(accepted[count].address), &accepted[count].port);
+		count++;
+	}
+	return count;
+}
+
+//------------------------------------------------------------------
+// Unix domain sockets. These are for talking to something on the
+// same machine, without DNS, a thread, or the TCP stack. A name that
+// starts with '@' is in Linux's abstract namespace, which has no
+// file, so there's nothing to clean up.
+//------------------------------------------------------------------
+
+//Fills in addr for name. Returns FALSE, with the reason in sock, if
+//it can't be done.
+static BOOL unixAddress(NTPSock *sock, const char *name,
+                        struct sockaddr_un *addr, socklen_t *len) {
+	size_t nameLen = strlen(name);
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if(nameLen==0 || nameLen>=sizeof(addr->sun_path)) {
+		setSockErr(sock, "Bad socket name, it must be 1 to %d characters",
+		           (int)sizeof(addr->sun_path)-1);
+		return FALSE;
+	}
+
+	if(name[0]=='@') {
+#ifdef NTP_LIN
+		//the leading 0 is what makes it abstract, and the length is
+		//exact, since there's no terminating 0
+		memcpy(addr->sun_path+1, name+1, nameLen-1);
+		*len = offsetof(struct sockaddr_un, sun_path) + nameLen;
+		return TRUE;
+#else
+		setSockErr(sock, "Abstract socket names are only on Linux");
+		return FALSE;
+#endif
+	}
+
+	memcpy(addr->sun_path, name, nameLen);
+	*len = offsetof(struct sockaddr_un, sun_path) + nameLen + 1;
+	return TRUE;
+}
+
+static int unixType(int type) {
+	return type==NTPUNIX_SEQPACKET ? SOCK_SEQPACKET : SOCK_STREAM;
+}
+
+NTPSock *NTPConnectUnix(const char *name, int type) {
+	struct sockaddr_un addr;
+	socklen_t len;
+	NTPSock *rv = allocNTPSock(name, 0);
+	if(rv==NULL) return NULL;
+
+	if(!unixAddress(rv, name, &addr, &len)) {
+		rv->connectError = TRUE;
+		return rv;
+	}
+	if((rv->sock = socket(AF_UNIX, unixType(type), 0))<0) {
+		setSockErr(rv, "Socket not created, %s", strerror(errno));
+		rv->connectError = TRUE;
+		return rv;
+	}
+	fcntl(rv->sock, F_SETFD, FD_CLOEXEC);
+
+	//It's local, so this doesn't take long enough to need a thread.
+	//The one thing that could make us wait is a listener whose backlog
+	//is full, so don't block, and call that an error.
+	if(!setBlocking(rv->sock, FALSE)) {
+		setSockErr(rv, "Couldn't connect to %s, %s", name, strerror(errno));
+		goto ERR;
+	}
+	if(connect(rv->sock, (struct sockaddr*)&addr, len)<0) {
+		if(errno==EAGAIN || errno==EWOULDBLOCK || errno==EINPROGRESS)
+			setSockErr(rv, "Couldn't connect to %s, it's too busy", name);
+		else
+			setSockErr(rv, "Couldn't connect to %s, %s", name, strerror(errno));
+		goto ERR;
+	}
+	if(!setBlocking(rv->sock, TRUE)) {
+		setSockErr(rv, "Couldn't connect to %s, %s", name, strerror(errno));
+		goto ERR;
+	}
+	return rv;
+
+ERR:
+	close(rv->sock);
+	rv->sock = -1;
+	rv->connectError = TRUE;
+	return rv;
+}
+
+//TRUE if nobody is listening on the socket file at addr anymore
+static BOOL staleSocketFile(const char *path, struct sockaddr_un *addr,
+                            socklen_t len, int sockType) {
+	struct stat st;
+	int fd;
+	BOOL stale;
+
+	if(stat(path, &st)<0 || !S_ISSOCK(st.st_mode)) return FALSE;
+	if((fd = socket(AF_UNIX, sockType, 0))<0) return FALSE;
+
+	//don't block, a listener with a full backlog is still a listener
+	stale = setBlocking(fd, FALSE) &&
+	        connect(fd, (struct sockaddr*)addr, len)<0 && errno==ECONNREFUSED;
+	close(fd);
+	return stale;
+}
+
+NTPSock *NTPListenUnix(const char *name, int type) {
+	struct sockaddr_un addr;
+	socklen_t len;
+	int err;
+	NTPSock *rv = allocNTPSock(name, 0);
+	if(rv==NULL) return NULL;
+	rv->listenSock = TRUE;
+
+	if(!unixAddress(rv, name, &addr, &len)) {
+		rv->listenError = TRUE;
+		return rv;
+	}
+	if((rv->sock = socket(AF_UNIX, unixType(type), 0))<0) {
+		setSockErr(rv, "Socket not created, %s", strerror(errno));
+		rv->listenError = TRUE;
+		return rv;
+	}
+	fcntl(rv->sock, F_SETFD, FD_CLOEXEC);
+
+	//A file left behind by a program that died stops us from binding,
+	//but one that somebody is still listening on is theirs. Checking
+	//means connecting, so only do it when we have to.
+	if(bind(rv->sock, (struct sockaddr*)&addr, len)<0) {
+		err = errno;
+		if(err!=EADDRINUSE || name[0]=='@' ||
+		   !staleSocketFile(name, &addr, len, unixType(type)) ||
+		   unlink(name)<0 || bind(rv->sock, (struct sockaddr*)&addr, len)<0) {
+			setSockErr(rv, "Couldn't bind %s, %s", name, strerror(err));
+			goto ERR;
+		}
+	}
+	if(name[0]!='@') rv->unlinkPath = TRUE;
+
+	//non-blocking for the same reason as listenOn()
+	if(listen(rv->sock, DEFAULT_LISTEN_BACKLOG)<0 || !setBlocking(rv->sock, FALSE)) {
+		setSockErr(rv, "couldn't listen, %s", strerror(errno));
+		goto ERR;
+	}
+	return rv;
+
+ERR:
+	close(rv->sock);
+	rv->sock = -1;
+	rv->listenError = TRUE;
+	return rv;
+}
+
+NTPSock *NTPSockFromFD(int fd) {
+	NTPSock *rv = allocNTPSock(NULL, 0);
+	if(rv!=NULL) rv->sock = fd;
+	return rv;
+}
+
+BOOL NTPSocketPair(int type, NTPSock **a, NTPSock **b) {
+	int fds[2];
+
+	*a = allocNTPSock(NULL, 0);
+	*b = allocNTPSock(NULL, 0);
+	if(*a==NULL || *b==NULL) goto ERR;
+	if(socketpair(AF_UNIX, unixType(type), 0, fds)<0) goto ERR;
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	(*a)->sock = fds[0];
+	(*b)->sock = fds[1];
+	return TRUE;
+
+ERR:
+	if(*a!=NULL) freeNTPSock(*a);
+	if(*b!=NULL) freeNTPSock(*b);
+	*a = NULL;
+	*b = NULL;
+	return FALSE;
+}
+
+//------------------------------------------------------------------
+// UDP. A UDP sock is an ordinary NTPSock with a datagram socket in
+// it, so the poller, select and NTPDisconnect() all work on it. Where
+// we can, the socket is IPv6 with IPv4 mapped in, so one sock can
+// talk to both; addresses are unmapped on the way in and mapped
+// again on the way out, so the user only ever sees plain IPv4.
+// On Linux the batch functions are one sendmmsg()/recvmmsg() each.
+//------------------------------------------------------------------
+
+#ifdef NTP_LIN
+#include <netinet/udp.h>
+//Older headers don't have these, but the kernel might
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#endif
+
+//The most datagrams we hand the kernel in one call
+#define UDP_BATCH 64
+
+//Makes a UDP socket, IPv6 if we can so it takes both kinds
+static int udpSocket(int *family) {
+	int fd, off = 0;
+
+	fd = socket(AF_INET6, SOCK_DGRAM, 0);
+	if(fd>=0 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off))==0) {
+		*family = AF_INET6;
+	} else {
+		if(fd>=0) close(fd);
+		fd = socket(AF_INET, SOCK_DGRAM, 0);
+		*family = AF_INET;
+	}
+	if(fd>=0) fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return fd;
+}
+
+//Turns an IPv4 address into what an IPv6 socket needs, in out
+static void mapAddress(int family, const NTPAddress *in, NTPAddress *out) {
+	struct sockaddr_in  *v4 = (struct sockaddr_in*) &in->addr;
+	struct sockaddr_in6 *v6 = (struct sockaddr_in6*)&out->addr;
+
+	if(family!=AF_INET6 || in->addr.ss_family!=AF_INET) {
+		*out = *in;
+		return;
+	}
+	memset(out, 0, sizeof(NTPAddress));
+	v6->sin6_family = AF_INET6;
+	v6->sin6_port   = v4->sin_port;
+	v6->sin6_addr.s6_addr[10] = 0xff;
+	v6->sin6_addr.s6_addr[11] = 0xff;
+	memcpy(&v6->sin6_addr.s6_addr[12], &v4->sin_addr, 4);
+	out->len = sizeof(struct sockaddr_in6);
+}
+
+//The other way, in place
+static void unmapAddress(NTPAddress *address) {
+	struct sockaddr_in6 *v6 = (struct sockaddr_in6*)&address->addr;
+	struct sockaddr_in v4;
+
+	if(address->addr.ss_family!=AF_INET6 || !IN6_IS_ADDR_V4MAPPED(&v6->sin6_addr))
+		return;
+	memset(&v4, 0, sizeof(v4));
+	v4.sin_family = AF_INET;
+	v4.sin_port   = v6->sin6_port;
+	memcpy(&v4.sin_addr, &v6->sin6_addr.s6_addr[12], 4);
+	memset(&address->addr, 0, sizeof(address->addr));
+	memcpy(&address->addr, &v4, sizeof(v4));
+	address->len = sizeof(v4);
+}
+
+BOOL NTPResolveAddress(const char *destination, uint16_t port,
+                       NTPAddress *address) {
+	struct addrinfo hints, *res;
+	char portStr[20];
+
+	initNetwork();
+	sprintf(portStr, "%d", port);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags    = AI_NUMERICSERV;
+	if(getaddrinfo(destination, portStr, &hints, &res)!=0) return FALSE;
+	if(res==NULL || res->ai_addrlen>sizeof(address->addr)) {
+		if(res!=NULL) freeaddrinfo(res);
+		return FALSE;
+	}
+	memset(address, 0, sizeof(NTPAddress));
+	memcpy(&address->addr, res->ai_addr, res->ai_addrlen);
+	address->len = res->ai_addrlen;
+	freeaddrinfo(res);
+	return TRUE;
+}
+
+void NTPAddressToString(const NTPAddress *address, char *buf, int len,
+                        uint16_t *port) {
+	struct sockaddr_storage copy = address->addr;
+	char text[INET6_ADDRSTRLEN];
+	formatAddress(&copy, text, sizeof(text), port);
+	snprintf(buf, len, "%s", text);
+}
+
+NTPSock *NTPUDPBind(uint16_t port) {
+	struct sockaddr_storage addr;
+	socklen_t len;
+	NTPSock *rv = allocNTPSock(NULL, port);
+	if(rv==NULL) return NULL;
+
+	if((rv->sock = udpSocket(&rv->family))<0) {
+		setSockErr(rv, "Socket not created, %s", strerror(errno));
+		rv->listenError = TRUE;
+		return rv;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	if(rv->family==AF_INET6) {
+		((struct sockaddr_in6*)&addr)->sin6_family = AF_INET6;
+		((struct sockaddr_in6*)&addr)->sin6_port   = htons(port);
+		((struct sockaddr_in6*)&addr)->sin6_addr   = in6addr_any;
+		len = sizeof(struct sockaddr_in6);
+	} else {
+		((struct sockaddr_in*)&addr)->sin_family      = AF_INET;
+		((struct sockaddr_in*)&addr)->sin_port        = htons(port);
+		((struct sockaddr_in*)&addr)->sin_addr.s_addr = htonl(INADDR_ANY);
+		len = sizeof(struct sockaddr_in);
+	}
+	if(bind(rv->sock, (struct sockaddr*)&addr, len)<0) {
+		setSockErr(rv, "Couldn't bind, %s", strerror(errno));
+		close(rv->sock);
+		rv->sock = -1;
+		rv->listenError = TRUE;
+	}
+	return rv;
+}
+
+NTPSock *NTPUDPConnect(const char *destination, uint16_t port) {
+	NTPAddress to, mapped;
+	NTPSock *rv = NTPUDPBind(0);
+	if(rv==NULL || rv->listenError) return rv;
+
+	if(!NTPResolveAddress(destination, port, &to)) {
+		setSockErr(rv, "Couldn't look up %s", destination);
+		rv->connectError = TRUE;
+		return rv;
+	}
+	mapAddress(rv->family, &to, &mapped);
+	if(connect(rv->sock, (struct sockaddr*)&mapped.addr, mapped.len)<0) {
+		setSockErr(rv, "Couldn't connect, %s", strerror(errno));
+		rv->connectError = TRUE;
+	}
+	return rv;
+}
+
+uint16_t NTPSockLocalPort(NTPSock *sock) {
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	uint16_t port;
+	char text[INET6_ADDRSTRLEN];
+
+	if(sock->sock<0 || getsockname(sock->sock, (struct sockaddr*)&addr, &len)<0)
+		return 0;
+	formatAddress(&addr, text, sizeof(text), &port);
+	return port;
+}
+
+int NTPUDPSendTo(NTPSock *sock, const void *bytes, int len,
+                 const NTPAddress *to) {
+	NTPAddress mapped;
+	int rv;
+
+	if(to==NULL) {
+		rv = send(sock->sock, bytes, len, 0);
+	} else {
+		mapAddress(sock->family, to, &mapped);
+		rv = sendto(sock->sock, bytes, len, 0,
+		            (struct sockaddr*)&mapped.addr, mapped.len);
+	}
+	if(rv<0) {
+		setSockErr(sock, "sending, %s", strerror(errno));
+		return -1;
+	}
+	return rv;
+}
+
+int NTPUDPRecvFrom(NTPSock *sock, void *buf, int len, NTPAddress *from) {
+	NTPAddress ignored;
+	int rv;
+
+	if(from==NULL) from = &ignored;
+	from->len = sizeof(from->addr);
+	rv = recvfrom(sock->sock, buf, len, 0,
+	              (struct sockaddr*)&from->addr, &from->len);
+	if(rv<0) {
+		setSockErr(sock, "recving, %s", strerror(errno));
+		return -1;
+	}
+	unmapAddress(from);
+	return rv;
+}
+
+#ifdef NTP_LIN
+int NTPUDPSendMany(NTPSock *sock, NTPDatagram *dgrams, int count) {
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iovs[UDP_BATCH];
+	NTPAddress mapped[UDP_BATCH];
+	int done = 0, n, i, sent;
+
+	while(done<count) {
+		n = count-done<UDP_BATCH ? count-done : UDP_BATCH;
+		memset(msgs, 0, n*sizeof(struct mmsghdr));
+		for(i=0;i<n;i++) {
+			iovs[i].iov_base = dgrams[done+i].buf;
+			iovs[i].iov_len  = dgrams[done+i].len;
+			msgs[i].msg_hdr.msg_iov    = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			if(dgrams[done+i].address!=NULL) {
+				mapAddress(sock->family, dgrams[done+i].address, &mapped[i]);
+				msgs[i].msg_hdr.msg_name    = &mapped[i].addr;
+				msgs[i].msg_hdr.msg_namelen = mapped[i].len;
+			}
+		}
+		if((sent = sendmmsg(sock->sock, msgs, n, 0))<0) {
+			if(errno==EINTR) continue;
+			setSockErr(sock, "sending, %s", strerror(errno));
+			return done>0 ? done : -1;
+		}
+		done += sent;
+		if(sent<n) break;  //no room for the rest right now
+	}
+	return done;
+}
+
+int NTPUDPRecvMany(NTPSock *sock, NTPDatagram *dgrams, int count, BOOL wait) {
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iovs[UDP_BATCH];
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} ctrl[UDP_BATCH];
+	struct cmsghdr *cmsg;
+	NTPDatagram *d;
+	int n, i, got;
+
+	//One batch is plenty; if there's more, the caller will be back
+	n = count<UDP_BATCH ? count : UDP_BATCH;
+	memset(msgs, 0, n*sizeof(struct mmsghdr));
+	for(i=0;i<n;i++) {
+		iovs[i].iov_base = dgrams[i].buf;
+		iovs[i].iov_len  = dgrams[i].size;
+		msgs[i].msg_hdr.msg_iov        = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen     = 1;
+		msgs[i].msg_hdr.msg_control    = ctrl[i].buf;
+		msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i].buf);
+		if(dgrams[i].address!=NULL) {
+			msgs[i].msg_hdr.msg_name    = &dgrams[i].address->addr;
+			msgs[i].msg_hdr.msg_namelen = sizeof(dgrams[i].address->addr);
+		}
+	}
+
+	do {
+		got = recvmmsg(sock->sock, msgs, n,
+		               wait ? MSG_WAITFORONE : MSG_DONTWAIT, NULL);
+	} while(got<0 && errno==EINTR);
+	if(got<0) {
+		if(!wait && (errno==EAGAIN || errno==EWOULDBLOCK)) return 0;
+		setSockErr(sock, "recving, %s", strerror(errno));
+		return -1;
+	}
+
+	for(i=0;i<got;i++) {
+		d = &dgrams[i];
+		d->len = msgs[i].msg_len;
+		d->segmentSize = 0;
+		if(d->address!=NULL) {
+			d->address->len = msgs[i].msg_hdr.msg_namelen;
+			unmapAddress(d->address);
+		}
+		for(cmsg=CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg!=NULL;
+		    cmsg=CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+			if(cmsg->cmsg_level==SOL_UDP && cmsg->cmsg_type==UDP_GRO)
+				memcpy(&d->segmentSize, CMSG_DATA(cmsg), sizeof(int));
+		}
+	}
+	return got;
+}
+
+BOOL NTPUDPSetSegmentSize(NTPSock *sock, int segmentSize) {
+	if(setsockopt(sock->sock, SOL_UDP, UDP_SEGMENT, &segmentSize,
+	              sizeof(segmentSize))<0) {
+		setSockErr(sock, "Couldn't set segment size, %s", strerror(errno));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+BOOL NTPUDPSetGRO(NTPSock *sock, BOOL on) {
+	int val = on ? 1 : 0;
+	if(setsockopt(sock->sock, SOL_UDP, UDP_GRO, &val, sizeof(val))<0) {
+		setSockErr(sock, "Couldn't set GRO, %s", strerror(errno));
+		return FALSE;
+	}
+	return TRUE;
+}
+#else
+//No batch calls here, so it's one system call per datagram
+int NTPUDPSendMany(NTPSock *sock, NTPDatagram *dgrams, int count) {
+	int i;
+	for(i=0;i<count;i++) {
+		if(NTPUDPSendTo(sock, dgrams[i].buf, dgrams[i].len, dgrams[i].address)<0)
+			return i>0 ? i : -1;
+	}
+	return count;
+}
+
+int NTPUDPRecvMany(NTPSock *sock, NTPDatagram *dgrams, int count, BOOL wait) {
+	NTPAddress ignored, *from;
+	int i, got;
+
+	for(i=0;i<count;i++) {
+		from = dgrams[i].address!=NULL ? dgrams[i].address : &ignored;
+		from->len = sizeof(from->addr);
+		//only the first one waits
+		do {
+			got = recvfrom(sock->sock, dgrams[i].buf, dgrams[i].size,
+			               (wait && i==0) ? 0 : MSG_DONTWAIT,
+			               (struct sockaddr*)&from->addr, &from->len);
+		} while(got<0 && errno==EINTR);
+		if(got<0) {
+			if(errno==EAGAIN || errno==EWOULDBLOCK) return i;
+			setSockErr(sock, "recving, %s", strerror(errno));
+			return i>0 ? i : -1;
+		}
+		unmapAddress(from);
+		dgrams[i].len = got;
+		dgrams[i].segmentSize = 0;
+	}
+	return count;
+}
+
+BOOL NTPUDPSetSegmentSize(NTPSock *sock, int segmentSize) {
+	setSockErr(sock, "Segmentation offload isn't available here");
+	return FALSE;
+}
+
+BOOL NTPUDPSetGRO(NTPSock *sock, BOOL on) {
+	if(!on) return TRUE;
+	setSockErr(sock, "Receive offload isn't available here");
+	return FALSE;
+}
+#endif
+
 //------------------------------------------------------------------
 // Status methods
 //------------------------------------------------------------------
@@ -351,7 +1906,10 @@ int NTPSockStatus(NTPSock *sock) {
 	}
 
 	//If we get here, we're not in an error state (yet)
-	else if(sock->doingConnect) {
+	else if(isConnecting(sock)) {
+		//the connect thread might be stuck in a DNS lookup, but
+		//as far as the user is concerned, we've given up
+		if(connectExpired(sock)) return NTPSOCK_ERROR;
 		return NTPSOCK_CONNECTING;
 	}
 	else if(sock->listenSock) {
@@ -363,13 +1921,46 @@ int NTPSockStatus(NTPSock *sock) {
 }
 
 const char*NTPSockErr(NTPSock*sock) {
-	if(sock->doingConnect) 
-		return CONNECTING_ERR_MSG;
+	if(isConnecting(sock)) 
+		return connectExpired(sock) ? TIMEOUT_ERR_MSG : CONNECTING_ERR_MSG;
 	
+	else if(sock->errMsg==NULL)
+		return NO_ERR_MSG;
+
 	else
 		return sock->errMsg;
 }
 
+int NTPWaitConnected(NTPSock *sock, int timeoutMS) {
+	int64_t now, deadline = -1, wait;
+
+	if(timeoutMS>=0) deadline = NTPMonotonicMillis() + timeoutMS;
+	//no point waiting past the time the connect gives up
+	if(sock->connectDeadline>0 && (deadline<0 || sock->connectDeadline<deadline))
+		deadline = sock->connectDeadline;
+
+	NTPAcquireLock(&sock->connectLock);
+	while(isConnecting(sock)) {
+		if(deadline<0) {
+			NTPWaitCondition(&sock->connectDone, &sock->connectLock);
+			continue;
+		}
+		now = NTPMonotonicMillis();
+		if(now>=deadline) break;
+		wait = deadline - now;
+		NTPWaitConditionTimeout(&sock->connectDone, &sock->connectLock,
+		                        wait>INT_MAX ? INT_MAX : (int)wait);
+	}
+	NTPReleaseLock(&sock->connectLock);
+
+	return NTPSockStatus(sock);
+}
+
+BOOL NTPSockTimedOut(NTPSock *sock) {
+	if(isConnecting(sock)) return connectExpired(sock);
+	return sock->timedOut;
+}
+
 
 //------------------------------------------------------------------
 // Methods for sending and receiving
@@ -377,10 +1968,10 @@ const char*NTPSockErr(NTPSock*sock) {
 int NTPSend(NTPSock *sock, void *bytes, int len) {
 	int rv;
 
-	if(sock->doingConnect) return -1;
+	if(isConnecting(sock)) return -1;
 
 	if((rv=send(sock->sock, bytes, len, 0))<0) {
-		snprintf(sock->errMsg, sizeof(sock->errMsg),"sending, %s",strerror(errno));
+		setSockErr(sock, "sending, %s",strerror(errno));
 		return -1;
 	}
 
@@ -389,55 +1980,1583 @@ int NTPSend(NTPSock *sock, void *bytes, int len) {
 
 int NTPRecv(NTPSock *sock, void *buf, int len) {
 	int rv;
-	if(sock->doingConnect) return -1;
+	if(isConnecting(sock)) return -1;
 
 	if((rv=recv(sock->sock, buf, len, 0))<0) {
-		snprintf(sock->errMsg,sizeof(sock->errMsg),"recving, %s",strerror(errno));
+		setSockErr(sock, "recving, %s",strerror(errno));
 		return -1;
 	}
 
 	return rv;
 }
 
-//------------------------------------------------------------------
-// Methods for select
-//------------------------------------------------------------------
-//If you're interested in NTP_FD_SET, it's defined in notrap_posix_sockets.h
-
-void NTP_ZERO_SET(NTP_FD_SET *set) {
-	memset(set, 0, sizeof(struct NTP_FD_SET_struct));
+//Make sure an NTPIOVec really is a struct iovec
+typedef char NTPIOVecMatchesIovec[
+	(sizeof(NTPIOVec)==sizeof(struct iovec) &&
+	 offsetof(NTPIOVec, base)==offsetof(struct iovec, iov_base) &&
+	 offsetof(NTPIOVec, len) ==offsetof(struct iovec, iov_len)) ? 1 : -1];
+
+//We can't hand the kernel more than IOV_MAX at once. That's fine,
+//since sends and recvs are allowed to be partial anyway.
+static int clampIOVecCount(int count) {
+#ifdef IOV_MAX
+	if(count>IOV_MAX) return IOV_MAX;
+#endif
+	return count;
 }
 
-void NTP_FD_ADD(NTPSock *sock, NTP_FD_SET *set) {
-	FD_SET(sock->sock, &set->set);
-	if(sock->sock>set->max) 
-		set->max = sock->sock;
-}
+int NTPSendv(NTPSock *sock, NTPIOVec *vecs, int count) {
+	struct msghdr msg;
+	int rv;
 
-BOOL NTP_FD_ISSET(NTPSock *sock, NTP_FD_SET *set) {
-	return (FD_ISSET(sock->sock, &set->set)!=0);
+	if(isConnecting(sock)) return -1;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov    = (struct iovec*)vecs;
+	msg.msg_iovlen = clampIOVecCount(count);
+	if((rv=sendmsg(sock->sock, &msg, 0))<0) {
+		setSockErr(sock, "sending, %s",strerror(errno));
+		return -1;
+	}
+
+	return rv;
 }
 
-int NTPSelect(NTP_FD_SET *readSet, NTP_FD_SET *writeSet, int timeoutMS) {
-	struct timeval tv;
-	int max = 0;
-	fd_set *wSet=NULL, *rSet=NULL;
+int NTPRecvv(NTPSock *sock, NTPIOVec *vecs, int count) {
+	struct msghdr msg;
+	int rv;
 
-	if(readSet!=NULL && writeSet!=NULL)
-		max = (readSet->max>writeSet->max) ? readSet->max : writeSet->max;
-	else if(readSet!=NULL)  
-		max = readSet->max;
-	else if(writeSet!=NULL) 
-		max = writeSet->max;
+	if(isConnecting(sock)) return -1;
 
-	tv.tv_sec  = timeoutMS / 1000;
-	tv.tv_usec = (timeoutMS%1000)*1000;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov    = (struct iovec*)vecs;
+	msg.msg_iovlen = clampIOVecCount(count);
+	if((rv=recvmsg(sock->sock, &msg, 0))<0) {
+		setSockErr(sock, "recving, %s",strerror(errno));
+		return -1;
+	}
 
-	if(readSet!=NULL)  rSet = &readSet ->set; 
-	if(writeSet!=NULL) wSet = &writeSet->set;
-	return select(max + 1, rSet, wSet, NULL, &tv);
+	return rv;
 }
 
+int NTPIOVecAdvance(NTPIOVec **vecs, int *count, int bytes) {
+	//skip the ones that are completely done
+	while(*count>0 && bytes>=0 && (size_t)bytes>=(*vecs)->len) {
+		bytes -= (*vecs)->len;
+		(*vecs)++;
+		(*count)--;
+	}
 
-#endif
+	//and move the start of the partly done one
+	if(*count>0 && bytes>0) {
+		(*vecs)->base = (char*)(*vecs)->base + bytes;
+		(*vecs)->len -= bytes;
+	}
+	return *count;
+}
+
+//------------------------------------------------------------------
+// Buffered reading and writing. The reader keeps a ring buffer and
+// fills all of its free space with one recv, so a protocol that reads
+// a few bytes at a time only makes a system call when it runs out.
+// The writer copies small writes together and sends them at once.
+//------------------------------------------------------------------
 
+#define DEFAULT_STREAM_BUFFER (16*1024)
+
+struct NTPSockReader_struct {
+	NTPSock *sock;
+	char *buf;
+	int size;
+	int start;   //where the buffered bytes start
+	int count;   //how many are buffered
+};
+
+struct NTPSockWriter_struct {
+	NTPSock *sock;
+	char *buf;
+	int size;
+	int count;
+};
+
+NTPSockReader *NTPNewSockReader(NTPSock *sock, int bufferSize) {
+	NTPSockReader *rv = malloc(sizeof(NTPSockReader));
+	if(rv==NULL) return NULL;
+
+	if(bufferSize<=0) bufferSize = DEFAULT_STREAM_BUFFER;
+	if((rv->buf = malloc(bufferSize))==NULL) {
+		free(rv);
+		return NULL;
+	}
+	rv->sock  = sock;
+	rv->size  = bufferSize;
+	rv->start = 0;
+	rv->count = 0;
+	return rv;
+}
+
+void NTPFreeSockReader(NTPSockReader **reader) {
+	if(reader==NULL || *reader==NULL) return;
+	free((*reader)->buf);
+	free(*reader);
+	*reader = NULL;
+}
+
+int NTPReaderBuffered(NTPSockReader *reader) {
+	return reader->count;
+}
+
+//Reads as much as the kernel has, up to the free space, with one
+//recv. Returns FALSE if the connection closed or failed.
+static BOOL fillReader(NTPSockReader *r) {
+	NTPIOVec vecs[2];
+	int end, n, got;
+
+	if(r->count==0) r->start = 0;  //keep it in one piece when we can
+	end = (r->start + r->count) % r->size;
+	n = 0;
+	if(end >= r->start) {
+		vecs[n].base  = r->buf + end;
+		vecs[n++].len = r->size - end;
+		if(r->start>0) {
+			vecs[n].base  = r->buf;
+			vecs[n++].len = r->start;
+		}
+	} else {
+		vecs[n].base  = r->buf + end;
+		vecs[n++].len = r->start - end;
+	}
+
+	got = NTPRecvv(r->sock, vecs, n);
+	if(got<0) return FALSE;
+	if(got==0) {
+		setSockErr(r->sock, "connection closed");
+		return FALSE;
+	}
+	r->count += got;
+	return TRUE;
+}
+
+//Copies len buffered bytes (which must be there) into buf, and
+//consumes them if consume is TRUE
+static void copyFromReader(NTPSockReader *r, void *buf, int len, BOOL consume) {
+	int first = r->size - r->start;
+	if(first>len) first = len;
+	memcpy(buf, r->buf + r->start, first);
+	memcpy((char*)buf + first, r->buf, len - first);
+	if(consume) {
+		r->start  = (r->start + len) % r->size;
+		r->count -= len;
+	}
+}
+
+int NTPReadExact(NTPSockReader *reader, void *buf, int len) {
+	int have, got;
+
+	if(len<=reader->size) {
+		while(reader->count<len)
+			if(!fillReader(reader)) return -1;
+		copyFromReader(reader, buf, len, TRUE);
+		return len;
+	}
+
+	//Too big to buffer, so take what we have and read the rest
+	//straight into buf
+	have = reader->count;
+	copyFromReader(reader, buf, have, TRUE);
+	while(have<len) {
+		got = NTPRecv(reader->sock, (char*)buf + have, len - have);
+		if(got<0) return -1;
+		if(got==0) {
+			setSockErr(reader->sock, "connection closed");
+			return -1;
+		}
+		have += got;
+	}
+	return len;
+}
+
+//Index (from start) of the first delim in the buffered bytes,
+//not looking before from, or -1
+static int findInReader(NTPSockReader *r, char delim, int from) {
+	int first = r->size - r->start;
+	char *p;
+
+	if(first>r->count) first = r->count;
+	if(from<first) {
+		p = memchr(r->buf + r->start + from, delim, first - from);
+		if(p!=NULL) return p - (r->buf + r->start);
+		from = first;
+	}
+	if(from<r->count) {
+		p = memchr(r->buf + (from-first), delim, r->count - from);
+		if(p!=NULL) return first + (p - r->buf);
+	}
+	return -1;
+}
+
+int NTPReadUntil(NTPSockReader *reader, char delim, void *buf, int max) {
+	int limit = max<reader->size ? max : reader->size;
+	int searched = 0, found;
+
+	while((found = findInReader(reader, delim, searched))<0) {
+		searched = reader->count;
+		if(searched>=limit) {
+			setSockErr(reader->sock, "no delimiter in %d bytes", limit);
+			return -1;
+		}
+		if(!fillReader(reader)) return -1;
+	}
+	if(found+1>limit) {
+		setSockErr(reader->sock, "no delimiter in %d bytes", limit);
+		return -1;
+	}
+
+	copyFromReader(reader, buf, found+1, TRUE);
+	return found+1;
+}
+
+int NTPReadLine(NTPSockReader *reader, char *line, int max) {
+	int len;
+
+	if(max<2) {
+		setSockErr(reader->sock, "no room for a line");
+		return -1;
+	}
+
+	//leave room for the terminating 0
+	if((len = NTPReadUntil(reader, '\n', line, max-1))<0) return -1;
+	len--;
+	if(len>0 && line[len-1]=='\r') len--;
+	line[len] = 0;
+	return len;
+}
+
+int NTPPeek(NTPSockReader *reader, void *buf, int len) {
+	if(reader->count==0 && !fillReader(reader)) return -1;
+	if(len>reader->count) len = reader->count;
+	copyFromReader(reader, buf, len, FALSE);
+	return len;
+}
+
+NTPSockWriter *NTPNewSockWriter(NTPSock *sock, int bufferSize) {
+	NTPSockWriter *rv = malloc(sizeof(NTPSockWriter));
+	if(rv==NULL) return NULL;
+
+	if(bufferSize<=0) bufferSize = DEFAULT_STREAM_BUFFER;
+	if((rv->buf = malloc(bufferSize))==NULL) {
+		free(rv);
+		return NULL;
+	}
+	rv->sock  = sock;
+	rv->size  = bufferSize;
+	rv->count = 0;
+	return rv;
+}
+
+void NTPFreeSockWriter(NTPSockWriter **writer) {
+	if(writer==NULL || *writer==NULL) return;
+	free((*writer)->buf);
+	free(*writer);
+	*writer = NULL;
+}
+
+int NTPWriterBuffered(NTPSockWriter *writer) {
+	return writer->count;
+}
+
+//Sends every byte in vecs, however many sends it takes
+static BOOL sendAllv(NTPSock *sock, NTPIOVec *vecs, int count) {
+	int sent;
+	while(count>0) {
+		if((sent = NTPSendv(sock, vecs, count))<0) return FALSE;
+		NTPIOVecAdvance(&vecs, &count, sent);
+	}
+	return TRUE;
+}
+
+int NTPWrite(NTPSockWriter *writer, const void *bytes, int len) {
+	NTPIOVec vecs[2];
+
+	if(len<0) return -1;
+	if(writer->count + len < writer->size) {
+		memcpy(writer->buf + writer->count, bytes, len);
+		writer->count += len;
+		return len;
+	}
+
+	//It's full, so send what we have and the new bytes together,
+	//without copying the new ones first
+	vecs[0].base = writer->buf;
+	vecs[0].len  = writer->count;
+	vecs[1].base = (void*)bytes;
+	vecs[1].len  = len;
+	writer->count = 0;
+	if(!sendAllv(writer->sock, vecs, 2)) return -1;
+	return len;
+}
+
+BOOL NTPFlush(NTPSockWriter *writer) {
+	NTPIOVec vec;
+
+	if(writer->count==0) return TRUE;
+	vec.base = writer->buf;
+	vec.len  = writer->count;
+	writer->count = 0;
+	return sendAllv(writer->sock, &vec, 1);
+}
+
+//------------------------------------------------------------------
+// Methods for sending files. On Linux the kernel can copy straight
+// from the page cache to the socket. Everywhere else we go through
+// a buffer.
+//------------------------------------------------------------------
+#define SENDFILE_BUF_LEN 65536
+
+//Reads a buffer's worth and sends it. For where the OS can't send
+//straight from the file.
+static int64_t copyFileChunk(NTPSock *sock, int fd, int64_t *offset,
+                             int64_t length) {
+	char buf[SENDFILE_BUF_LEN];
+	ssize_t got, rv;
+
+	if(length > SENDFILE_BUF_LEN) length = SENDFILE_BUF_LEN;
+	if((got = pread(fd, buf, (size_t)length, (off_t)*offset))<=0) return got;
+
+	//only count what actually went out, the rest gets read again
+	if((rv = send(sock->sock, buf, got, 0))>0) *offset += rv;
+	return rv;
+}
+
+#ifdef NTP_LIN
+static int64_t sendFileChunk(NTPSock *sock, int fd, int64_t *offset,
+                             int64_t length) {
+	off_t off = (off_t)*offset;
+	ssize_t rv;
+
+	if(length > 0x7ffff000) length = 0x7ffff000; //the most sendfile() does
+	rv = sendfile(sock->sock, fd, &off, (size_t)length);
+	if(rv>0) *offset = off;
+
+	//Some files (and some kernels) can't be sent this way
+	if(rv<0 && (errno==EINVAL || errno==ENOSYS))
+		return copyFileChunk(sock, fd, offset, length);
+	return rv;
+}
+#else
+#define sendFileChunk copyFileChunk
+#endif
+
+int64_t NTPSendFile(NTPSock *sock, int fileDescriptor, int64_t *offset,
+                    int64_t length) {
+	int64_t rv;
+
+	if(isConnecting(sock)) return -1;
+	if(length<=0) return 0;
+
+	rv = sendFileChunk(sock, fileDescriptor, offset, length);
+	if(rv<0) {
+		if(errno==EAGAIN || errno==EWOULDBLOCK) return 0;
+		setSockErr(sock, "sending file, %s", strerror(errno));
+		return -1;
+	}
+	if(rv==0) {
+		setSockErr(sock, "sending file, reached the end of the file");
+		return -1;
+	}
+	return rv;
+}
+
+//Blocks until there's room to send on sock. Returns FALSE on error.
+static BOOL waitWritable(NTPSock *sock) {
+	struct pollfd pfd;
+
+	pfd.fd     = sock->sock;
+	pfd.events = POLLOUT;
+	while(poll(&pfd, 1, -1)<0) {
+		if(errno==EINTR) continue;
+		setSockErr(sock, "waiting to send, %s", strerror(errno));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+BOOL NTPSendFilePath(NTPSock *sock, const char *path) {
+	struct stat st;
+	int64_t offset = 0, sent;
+	int fd;
+
+	if(isConnecting(sock)) return FALSE;
+
+	if((fd = open(path, O_RDONLY))<0) {
+		setSockErr(sock, "opening %s, %s", path, strerror(errno));
+		return FALSE;
+	}
+	if(fstat(fd, &st)<0) {
+		setSockErr(sock, "opening %s, %s", path, strerror(errno));
+		close(fd);
+		return FALSE;
+	}
+
+	while(offset < st.st_size) {
+		sent = NTPSendFile(sock, fd, &offset, st.st_size - offset);
+		if(sent<0) goto ERR;
+
+		//A non-blocking sock is full, so wait for room
+		if(sent==0 && !waitWritable(sock)) goto ERR;
+	}
+	close(fd);
+	return TRUE;
+
+ERR:
+	close(fd);
+	return FALSE;
+}
+
+//------------------------------------------------------------------
+// Methods for zero-copy sends. Linux has MSG_ZEROCOPY, which reports
+// finished sends on the socket's error queue. Everywhere else (or
+// when it's off) we do a normal send, which is finished as soon as
+// it returns.
+//------------------------------------------------------------------
+#if defined(NTP_LIN) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define NTP_ZEROCOPY
+#endif
+
+BOOL NTPSetZeroCopy(NTPSock *sock, BOOL on) {
+#ifdef NTP_ZEROCOPY
+	int optval = on ? 1 : 0;
+	if(isConnecting(sock)) return FALSE;
+
+	//The kernel still has those buffers, and only reports them done
+	//while it's on
+	if(!on && sock->zcReaped!=sock->zcSent) {
+		setSockErr(sock, "zero-copy, sends are still outstanding");
+		return FALSE;
+	}
+	if(setsockopt(sock->sock, SOL_SOCKET, SO_ZEROCOPY, &optval,
+	              sizeof(optval))<0) {
+		setSockErr(sock, "zero-copy, %s", strerror(errno));
+		return FALSE;
+	}
+	sock->zeroCopy = on;
+	return TRUE;
+#else
+	if(on) {
+		setSockErr(sock, "zero-copy, not available on this platform");
+		return FALSE;
+	}
+	return TRUE;
+#endif
+}
+
+int NTPSendZeroCopy(NTPSock *sock, void *bytes, int len, uint32_t *sendId) {
+	int rv, flags = 0;
+
+	if(isConnecting(sock)) return -1;
+
+#ifdef NTP_ZEROCOPY
+	if(sock->zeroCopy) flags = MSG_ZEROCOPY;
+#endif
+	if((rv=send(sock->sock, bytes, len, flags))<0) {
+		setSockErr(sock, "sending, %s",strerror(errno));
+		return -1;
+	}
+
+	//Only sends made with MSG_ZEROCOPY get an id, since those are all
+	//the kernel counts. A copied one is done already.
+	if(flags==0) {
+		if(sendId!=NULL) *sendId = NTPZEROCOPY_NONE;
+		return rv;
+	}
+	if(sendId!=NULL) *sendId = sock->zcSent;
+	sock->zcSent++;
+	return rv;
+}
+
+int NTPReapZeroCopy(NTPSock *sock, NTPZeroCopyDone done, void *userData) {
+	int count = 0;
+
+	if(isConnecting(sock)) return -1;
+	if(sock->zcReaped==sock->zcSent) return 0;
+
+#ifdef NTP_ZEROCOPY
+	for(;;) {
+		struct msghdr msg;
+		struct cmsghdr *cm;
+		char control[128];
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control    = control;
+		msg.msg_controllen = sizeof(control);
+		if(recvmsg(sock->sock, &msg, MSG_ERRQUEUE|MSG_DONTWAIT)<0) {
+			if(errno==EAGAIN || errno==EWOULDBLOCK) break;
+			setSockErr(sock, "zero-copy, %s", strerror(errno));
+			return -1;
+		}
+
+		for(cm=CMSG_FIRSTHDR(&msg);cm!=NULL;cm=CMSG_NXTHDR(&msg, cm)) {
+			struct sock_extended_err *ee;
+			if(!((cm->cmsg_level==SOL_IP   && cm->cmsg_type==IP_RECVERR) ||
+			     (cm->cmsg_level==SOL_IPV6 && cm->cmsg_type==IPV6_RECVERR)))
+				continue;
+
+			ee = (struct sock_extended_err*)CMSG_DATA(cm);
+			if(ee->ee_origin!=SO_EE_ORIGIN_ZEROCOPY || ee->ee_errno!=0)
+				continue;
+
+			done(sock, ee->ee_info, ee->ee_data,
+			     (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)!=0, userData);
+			sock->zcReaped = ee->ee_data+1;
+			count++;
+		}
+	}
+#endif
+	return count;
+}
+
+//------------------------------------------------------------------
+// Methods for select
+//------------------------------------------------------------------
+//If you're interested in NTP_FD_SET, it's defined in notrap_posix_sockets.h
+
+void NTP_ZERO_SET(NTP_FD_SET *set) {
+	memset(set, 0, sizeof(struct NTP_FD_SET_struct));
+}
+
+void NTP_FD_ADD(NTPSock *sock, NTP_FD_SET *set) {
+	int fd = sock->sock;
+
+	//A connecting sock is watched through its connect event instead
+	if(isConnecting(sock) || sock->connectError) {
+		fd = connectEventFD(sock);
+		if(fd<0) fd = sock->sock;  //it finished while we were looking
+		else {
+			if(fd>=FD_SETSIZE) return;
+			FD_SET(fd, &set->connecting);
+			set->numConnecting++;
+		}
+	}
+
+	//FD_SET() on a bigger socket would write past the end of the set
+	if(fd<0 || fd>=FD_SETSIZE) return;
+	FD_SET(fd, &set->set);
+	if(fd>set->max) 
+		set->max = fd;
+}
+
+BOOL NTP_FD_ISSET(NTPSock *sock, NTP_FD_SET *set) {
+	int event = sock->connectEvent;
+	if(event>=0 && event<FD_SETSIZE && FD_ISSET(event, &set->set)) return TRUE;
+	if(isConnecting(sock)) return FALSE;
+	if(sock->sock<0 || sock->sock>=FD_SETSIZE) return FALSE;
+	return (FD_ISSET(sock->sock, &set->set)!=0);
+}
+
+//Connect events are only ever readable, but a connecting sock may have
+//been put in the write set. So we move those to the read side for the
+//select, then put back whatever fired.
+static int selectConnecting(int max, NTP_FD_SET *readSet, NTP_FD_SET *writeSet,
+                            struct timeval *tv) {
+	fd_set r, w;
+	int fd, rv;
+
+	FD_ZERO(&r);
+	if(readSet!=NULL) r = readSet->set;
+	w = writeSet->set;
+	for(fd=0;fd<=max;fd++) {
+		if(FD_ISSET(fd, &writeSet->connecting)) {
+			FD_CLR(fd, &w);
+			FD_SET(fd, &r);
+		}
+	}
+
+	if((rv = select(max + 1, &r, &w, NULL, tv))<=0) return rv;
+
+	//count ready descriptors the way select() does, once per set
+	rv = 0;
+	for(fd=0;fd<=max;fd++) {
+		if(FD_ISSET(fd, &writeSet->connecting) && FD_ISSET(fd, &r)) {
+			FD_SET(fd, &w);
+			if(readSet==NULL || !FD_ISSET(fd, &readSet->set)) FD_CLR(fd, &r);
+		}
+		if(FD_ISSET(fd, &r)) rv++;
+		if(FD_ISSET(fd, &w)) rv++;
+	}
+	if(readSet!=NULL) readSet->set = r;
+	writeSet->set = w;
+	return rv;
+}
+
+int NTPSelect(NTP_FD_SET *readSet, NTP_FD_SET *writeSet, int timeoutMS) {
+	struct timeval tv, *tvp = NULL;
+	int max = 0;
+	fd_set *wSet=NULL, *rSet=NULL;
+
+	if(readSet!=NULL && writeSet!=NULL)
+		max = (readSet->max>writeSet->max) ? readSet->max : writeSet->max;
+	else if(readSet!=NULL)  
+		max = readSet->max;
+	else if(writeSet!=NULL) 
+		max = writeSet->max;
+
+	//negative waits forever
+	if(timeoutMS>=0) {
+		tv.tv_sec  = timeoutMS / 1000;
+		tv.tv_usec = (timeoutMS%1000)*1000;
+		tvp = &tv;
+	}
+
+	if(readSet!=NULL)  rSet = &readSet ->set; 
+	if(writeSet!=NULL) wSet = &writeSet->set;
+	if(writeSet==NULL || writeSet->numConnecting==0)
+		return select(max + 1, rSet, wSet, NULL, tvp);
+	return selectConnecting(max, readSet, writeSet, tvp);
+}
+
+//------------------------------------------------------------------
+// Methods for the poller
+//------------------------------------------------------------------
+//We keep one registration per file descriptor, in an array indexed
+//by the descriptor. Descriptors are small, dense integers, so this
+//gives us O(1) lookups without allocating anything per socket.
+struct NTPPollReg {
+	NTPSock *sock;     //NULL if this descriptor isn't registered
+	void    *userData;
+	int      events;
+	BOOL     connecting; //this is the sock's connect event, not the sock
+};
+
+struct NTPPoller_struct {
+	struct NTPPollReg *regs;
+	int regsLen;
+
+#ifdef NTP_LIN
+	int epfd;
+	struct epoll_event *readyBuf;
+#else
+	//Without epoll, we rebuild a pollfd array every wait
+	struct pollfd *readyBuf;
+#endif
+	int readyBufLen;
+
+	char errMsg[200];
+};
+
+NTPPoller *NTPNewPoller() {
+	NTPPoller *rv;
+	initNetwork();
+
+	rv = (NTPPoller*)malloc(sizeof(NTPPoller));
+	if(rv==NULL) return NULL;
+
+	rv->regs        = NULL;
+	rv->regsLen     = 0;
+	rv->readyBuf    = NULL;
+	rv->readyBufLen = 0;
+	strcpy(rv->errMsg, "No error, yet");
+
+#ifdef NTP_LIN
+	if((rv->epfd = epoll_create1(EPOLL_CLOEXEC))<0) {
+		free(rv);
+		return NULL;
+	}
+#endif
+	return rv;
+}
+
+void NTPFreePoller(NTPPoller **poller) {
+	if(poller==NULL || *poller==NULL) return;
+#ifdef NTP_LIN
+	close((*poller)->epfd);
+#endif
+	free((*poller)->regs);
+	free((*poller)->readyBuf);
+	free(*poller);
+	*poller = NULL;
+}
+
+const char *NTPPollerErr(NTPPoller *poller) {
+	return poller->errMsg;
+}
+
+//Makes sure the regs array is big enough to hold fd
+static BOOL growPollRegs(NTPPoller *poller, int fd) {
+	struct NTPPollReg *newRegs;
+	int newLen;
+
+	if(fd < poller->regsLen) return TRUE;
+
+	newLen = poller->regsLen==0 ? 64 : poller->regsLen;
+	while(newLen <= fd) newLen *= 2;
+
+	newRegs = realloc(poller->regs, newLen * sizeof(struct NTPPollReg));
+	if(newRegs==NULL) {
+		snprintf(poller->errMsg, sizeof(poller->errMsg), "no memory");
+		return FALSE;
+	}
+	memset(newRegs + poller->regsLen, 0,
+	       (newLen - poller->regsLen) * sizeof(struct NTPPollReg));
+	poller->regs    = newRegs;
+	poller->regsLen = newLen;
+	return TRUE;
+}
+
+//Makes sure the buffer we get ready events into can hold len of them
+static BOOL growPollReadyBuf(NTPPoller *poller, int len) {
+	void *newBuf;
+	if(len <= poller->readyBufLen) return TRUE;
+
+	newBuf = realloc(poller->readyBuf, len * sizeof(*poller->readyBuf));
+	if(newBuf==NULL) {
+		snprintf(poller->errMsg, sizeof(poller->errMsg), "no memory");
+		return FALSE;
+	}
+	poller->readyBuf    = newBuf;
+	poller->readyBufLen = len;
+	return TRUE;
+}
+
+#ifdef NTP_LIN
+static uint32_t toEpollEvents(int events) {
+	uint32_t rv = 0;
+	if(events & NTPPOLL_READ)  rv |= EPOLLIN;
+	if(events & NTPPOLL_WRITE) rv |= EPOLLOUT;
+	if(events & NTPPOLL_EDGE)  rv |= EPOLLET;
+	return rv;
+}
+
+static BOOL pollerCtl(NTPPoller *poller, int op, int fd, int events) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events  = toEpollEvents(events);
+	ev.data.fd = fd;
+	if(epoll_ctl(poller->epfd, op, fd, &ev)<0) {
+		snprintf(poller->errMsg, sizeof(poller->errMsg), "epoll_ctl, %s",
+		         strerror(errno));
+		return FALSE;
+	}
+	return TRUE;
+}
+#endif
+
+//Finds where sock is registered: its own descriptor, or its connect
+//event if it was added while connecting. -1 if it isn't registered.
+static int pollRegFD(NTPPoller *poller, NTPSock *sock) {
+	int fd = sock->sock;
+	if(fd>=0 && fd<poller->regsLen && poller->regs[fd].sock==sock &&
+	   !poller->regs[fd].connecting)
+		return fd;
+	fd = sock->connectEvent;
+	if(fd>=0 && fd<poller->regsLen && poller->regs[fd].sock==sock &&
+	   poller->regs[fd].connecting)
+		return fd;
+	return -1;
+}
+
+//Registers fd for sock. A connect event is only ever readable.
+static BOOL pollerAddFD(NTPPoller *poller, int fd, NTPSock *sock, int events,
+                        void *userData, BOOL connecting) {
+	if(!growPollRegs(poller, fd)) return FALSE;
+
+#ifdef NTP_LIN
+	if(!pollerCtl(poller, EPOLL_CTL_ADD, fd, connecting ? NTPPOLL_READ : events))
+		return FALSE;
+#else
+	if(poller->regs[fd].sock!=NULL) {
+		snprintf(poller->errMsg, sizeof(poller->errMsg), "Already added");
+		return FALSE;
+	}
+#endif
+
+	poller->regs[fd].sock       = sock;
+	poller->regs[fd].userData   = userData;
+	poller->regs[fd].events     = events;
+	poller->regs[fd].connecting = connecting;
+	return TRUE;
+}
+
+static BOOL pollerRemoveFD(NTPPoller *poller, int fd) {
+#ifdef NTP_LIN
+	if(!pollerCtl(poller, EPOLL_CTL_DEL, fd, 0)) return FALSE;
+#endif
+	memset(&poller->regs[fd], 0, sizeof(struct NTPPollReg));
+	return TRUE;
+}
+
+BOOL NTPPollerAdd(NTPPoller *poller, NTPSock *sock, int events, void *userData) {
+	int fd;
+
+	if((isConnecting(sock) || sock->connectError) &&
+	   (fd = connectEventFD(sock))>=0)
+		return pollerAddFD(poller, fd, sock, events, userData, TRUE);
+
+	if(sock->sock<0) {
+		snprintf(poller->errMsg, sizeof(poller->errMsg),
+		         "Socket is not connected or listening");
+		return FALSE;
+	}
+	return pollerAddFD(poller, sock->sock, sock, events, userData, FALSE);
+}
+
+BOOL NTPPollerModify(NTPPoller *poller, NTPSock *sock, int events,
+                     void *userData) {
+	int fd = pollRegFD(poller, sock);
+
+	if(fd<0) {
+		snprintf(poller->errMsg, sizeof(poller->errMsg), "Socket not added");
+		return FALSE;
+	}
+
+#ifdef NTP_LIN
+	if(!poller->regs[fd].connecting &&
+	   !pollerCtl(poller, EPOLL_CTL_MOD, fd, events)) return FALSE;
+#endif
+
+	poller->regs[fd].userData = userData;
+	poller->regs[fd].events   = events;
+	return TRUE;
+}
+
+BOOL NTPPollerRemove(NTPPoller *poller, NTPSock *sock) {
+	int fd = pollRegFD(poller, sock);
+
+	if(fd<0) {
+		snprintf(poller->errMsg, sizeof(poller->errMsg), "Socket not added");
+		return FALSE;
+	}
+	return pollerRemoveFD(poller, fd);
+}
+
+//The connect event at fd fired, so the connect is done. If it worked,
+//move the registration over to the sock itself. Returns the events
+//to report: WRITE (if they asked for it) for a new connection, like a
+//non-blocking connect would, or ERROR if it failed.
+static int finishPollConnect(NTPPoller *poller, int fd) {
+	struct NTPPollReg reg = poller->regs[fd];
+
+	if(NTPSockStatus(reg.sock)!=NTPSOCK_CONNECTED) return NTPPOLL_ERROR;
+
+	if(!pollerRemoveFD(poller, fd) ||
+	   !pollerAddFD(poller, reg.sock->sock, reg.sock, reg.events,
+	                reg.userData, FALSE))
+		return NTPPOLL_ERROR;
+	return reg.events & NTPPOLL_WRITE;
+}
+
+#ifdef NTP_LIN
+int NTPPollerWait(NTPPoller *poller, NTPPollEvent *events, int maxEvents,
+                  int timeoutMS) {
+	int i, n, count = 0;
+	if(timeoutMS<0) timeoutMS = -1;
+	if(!growPollReadyBuf(poller, maxEvents)) return -1;
+
+	n = epoll_wait(poller->epfd, poller->readyBuf, maxEvents, timeoutMS);
+	if(n<0) {
+		//A signal isn't really an error, it's just a short timeout
+		if(errno==EINTR) return 0;
+		snprintf(poller->errMsg, sizeof(poller->errMsg), "epoll_wait, %s",
+		         strerror(errno));
+		return -1;
+	}
+
+	for(i=0;i<n;i++) {
+		uint32_t ev = poller->readyBuf[i].events;
+		int      fd = poller->readyBuf[i].data.fd;
+		if(fd>=poller->regsLen || poller->regs[fd].sock==NULL) continue;
+
+		events[count].sock     = poller->regs[fd].sock;
+		events[count].userData = poller->regs[fd].userData;
+		events[count].events   = 0;
+		if(poller->regs[fd].connecting) {
+			if((events[count].events = finishPollConnect(poller, fd))!=0)
+				count++;
+			continue;
+		}
+		if(ev & EPOLLIN)             events[count].events |= NTPPOLL_READ;
+		if(ev & EPOLLOUT)            events[count].events |= NTPPOLL_WRITE;
+		if(ev & (EPOLLERR|EPOLLHUP)) events[count].events |= NTPPOLL_ERROR;
+		count++;
+	}
+	return count;
+}
+#else
+int NTPPollerWait(NTPPoller *poller, NTPPollEvent *events, int maxEvents,
+                  int timeoutMS) {
+	int fd, i, n, nfds = 0, count = 0;
+	if(timeoutMS<0) timeoutMS = -1;
+
+	//count up our sockets so we know how big to make the pollfd array
+	for(fd=0;fd<poller->regsLen;fd++)
+		if(poller->regs[fd].sock!=NULL) nfds++;
+	if(!growPollReadyBuf(poller, nfds>0 ? nfds : 1)) return -1;
+
+	for(fd=0,i=0;fd<poller->regsLen;fd++) {
+		if(poller->regs[fd].sock==NULL) continue;
+		poller->readyBuf[i].fd      = fd;
+		poller->readyBuf[i].revents = 0;
+		poller->readyBuf[i].events  = 0;
+		if(poller->regs[fd].connecting)
+			poller->readyBuf[i].events  = POLLIN;
+		else {
+			if(poller->regs[fd].events & NTPPOLL_READ)
+				poller->readyBuf[i].events |= POLLIN;
+			if(poller->regs[fd].events & NTPPOLL_WRITE)
+				poller->readyBuf[i].events |= POLLOUT;
+		}
+		i++;
+	}
+
+	n = poll(poller->readyBuf, nfds, timeoutMS);
+	if(n<0) {
+		if(errno==EINTR) return 0;
+		snprintf(poller->errMsg, sizeof(poller->errMsg), "poll, %s",
+		         strerror(errno));
+		return -1;
+	}
+
+	for(i=0;i<nfds && count<maxEvents;i++) {
+		short ev = poller->readyBuf[i].revents;
+		fd = poller->readyBuf[i].fd;
+		if(ev==0) continue;
+
+		events[count].sock     = poller->regs[fd].sock;
+		events[count].userData = poller->regs[fd].userData;
+		events[count].events   = 0;
+		if(poller->regs[fd].connecting) {
+			if((events[count].events = finishPollConnect(poller, fd))!=0)
+				count++;
+			continue;
+		}
+		if(ev & POLLIN)  events[count].events |= NTPPOLL_READ;
+		if(ev & POLLOUT) events[count].events |= NTPPOLL_WRITE;
+		if(ev & (POLLERR|POLLHUP|POLLNVAL))
+			events[count].events |= NTPPOLL_ERROR;
+		count++;
+	}
+	return count;
+}
+#endif
+
+
+//------------------------------------------------------------------
+// Methods for the IO ring
+//------------------------------------------------------------------
+//Every queued operation gets one of these. They live in a fixed array
+//so the addresses we hand to the kernel stay put until completion.
+struct NTPIOOp {
+	int      op;       //0 if this slot is free
+	NTPSock *sock;
+	void    *buf;
+	int      len;
+	void    *userData;
+	BOOL     submitted;
+	struct sockaddr_storage addr;   //for accept
+	socklen_t               addrLen;
+	int      nextFree;
+};
+
+struct NTPIORing_struct {
+	struct NTPIOOp *ops;
+	int maxOps;
+	int firstFree;     //head of the free list of ops, -1 if full
+
+	BOOL native;
+	char errMsg[200];
+
+#ifdef NTP_IO_URING
+	int ringFd;
+
+	//submission queue, shared with the kernel
+	void     *sqRing;
+	size_t    sqRingLen;
+	unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+	struct io_uring_sqe *sqes;
+	size_t    sqesLen;
+	unsigned  sqEntries;
+	unsigned  toSubmit;   //queued, but not yet handed to the kernel
+
+	//completion queue, shared with the kernel
+	void     *cqRing;
+	size_t    cqRingLen;
+	unsigned *cqHead, *cqTail, *cqMask;
+	struct io_uring_cqe *cqes;
+
+	//registered buffers
+	struct iovec *bufs;
+	int           numBufs;
+
+	//registered socks. fixedSlots is indexed by file descriptor,
+	//and holds the fixed file index plus one, or 0 if not registered.
+	int  *fixedSlots;
+	int   fixedSlotsLen;
+	BOOL *fixedUsed;
+	BOOL  fixedAvailable;
+#endif
+};
+
+//The size of the fixed file table we register with the kernel
+#define NTP_IORING_FIXED_FILES 1024
+
+#ifdef NTP_IO_URING
+static int ioUringSetup(unsigned entries, struct io_uring_params *p) {
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete,
+                        unsigned flags) {
+	return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete,
+	                    flags, NULL, 0);
+}
+
+static int ioUringRegister(int fd, unsigned opcode, void *arg,
+                           unsigned nrArgs) {
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+static void freeNativeRing(NTPIORing *ring) {
+	if(ring->sqes!=NULL && ring->sqes!=MAP_FAILED)
+		munmap(ring->sqes, ring->sqesLen);
+	if(ring->cqRing!=NULL && ring->cqRing!=MAP_FAILED &&
+	   ring->cqRing!=ring->sqRing)
+		munmap(ring->cqRing, ring->cqRingLen);
+	if(ring->sqRing!=NULL && ring->sqRing!=MAP_FAILED)
+		munmap(ring->sqRing, ring->sqRingLen);
+	if(ring->ringFd>=0) close(ring->ringFd);
+	free(ring->bufs);
+	free(ring->fixedSlots);
+	free(ring->fixedUsed);
+}
+
+//Sets up io_uring. Returns FALSE if it's not available, in which
+//case we'll use the fallback.
+static BOOL initNativeRing(NTPIORing *ring) {
+	struct io_uring_params p;
+	char *sq, *cq;
+	int i, *fds;
+
+	ring->ringFd = -1;
+	ring->sqRing = ring->cqRing = ring->sqes = NULL;
+	ring->bufs       = NULL;
+	ring->numBufs    = 0;
+	ring->fixedSlots = NULL;
+	ring->fixedSlotsLen = 0;
+	ring->fixedUsed  = NULL;
+	ring->fixedAvailable = FALSE;
+	ring->toSubmit   = 0;
+
+	memset(&p, 0, sizeof(p));
+	//make sure the completion queue can hold every pending op
+	p.flags      = IORING_SETUP_CQSIZE;
+	p.cq_entries = ring->maxOps*2;
+	if((ring->ringFd = ioUringSetup(ring->maxOps, &p))<0) return FALSE;
+
+	ring->sqEntries = p.sq_entries;
+	ring->sqRingLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cqRingLen = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(ring->cqRingLen > ring->sqRingLen) ring->sqRingLen = ring->cqRingLen;
+		ring->cqRingLen = ring->sqRingLen;
+	}
+
+	ring->sqRing = mmap(NULL, ring->sqRingLen, PROT_READ|PROT_WRITE,
+	                    MAP_SHARED|MAP_POPULATE, ring->ringFd, IORING_OFF_SQ_RING);
+	if(ring->sqRing==MAP_FAILED) goto ERR;
+
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cqRing = ring->sqRing;
+	} else {
+		ring->cqRing = mmap(NULL, ring->cqRingLen, PROT_READ|PROT_WRITE,
+		                    MAP_SHARED|MAP_POPULATE, ring->ringFd, IORING_OFF_CQ_RING);
+		if(ring->cqRing==MAP_FAILED) goto ERR;
+	}
+
+	ring->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqesLen, PROT_READ|PROT_WRITE,
+	                  MAP_SHARED|MAP_POPULATE, ring->ringFd, IORING_OFF_SQES);
+	if(ring->sqes==MAP_FAILED) goto ERR;
+
+	sq = (char*)ring->sqRing;
+	cq = (char*)ring->cqRing;
+	ring->sqHead  = (unsigned*)(sq + p.sq_off.head);
+	ring->sqTail  = (unsigned*)(sq + p.sq_off.tail);
+	ring->sqMask  = (unsigned*)(sq + p.sq_off.ring_mask);
+	ring->sqArray = (unsigned*)(sq + p.sq_off.array);
+	ring->cqHead  = (unsigned*)(cq + p.cq_off.head);
+	ring->cqTail  = (unsigned*)(cq + p.cq_off.tail);
+	ring->cqMask  = (unsigned*)(cq + p.cq_off.ring_mask);
+	ring->cqes    = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+	//Try to set up an empty fixed file table. If the kernel is too
+	//old for that, we just don't use fixed files.
+	fds = malloc(NTP_IORING_FIXED_FILES * sizeof(int));
+	ring->fixedUsed = calloc(NTP_IORING_FIXED_FILES, sizeof(BOOL));
+	if(fds!=NULL && ring->fixedUsed!=NULL) {
+		for(i=0;i<NTP_IORING_FIXED_FILES;i++) fds[i] = -1;
+		if(ioUringRegister(ring->ringFd, IORING_REGISTER_FILES, fds,
+		                   NTP_IORING_FIXED_FILES)==0)
+			ring->fixedAvailable = TRUE;
+	}
+	free(fds);
+
+	return TRUE;
+
+ERR:
+	freeNativeRing(ring);
+	return FALSE;
+}
+
+//Gets the next submission queue entry, or NULL if the queue is full
+static struct io_uring_sqe *getSqe(NTPIORing *ring) {
+	unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+	unsigned tail = *ring->sqTail + ring->toSubmit;
+	struct io_uring_sqe *sqe;
+
+	if(tail - head >= ring->sqEntries) return NULL;
+	sqe = &ring->sqes[tail & *ring->sqMask];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sqArray[tail & *ring->sqMask] = tail & *ring->sqMask;
+	ring->toSubmit++;
+	return sqe;
+}
+
+//Returns the index of the registered buffer that holds all of
+//[buf, buf+len), or -1 if there isn't one
+static int findRegisteredBuf(NTPIORing *ring, void *buf, int len) {
+	int i;
+	for(i=0;i<ring->numBufs;i++) {
+		char *start = (char*)ring->bufs[i].iov_base;
+		if((char*)buf>=start &&
+		   (char*)buf+len <= start+ring->bufs[i].iov_len)
+			return i;
+	}
+	return -1;
+}
+
+static BOOL queueNative(NTPIORing *ring, int index) {
+	struct NTPIOOp *op = &ring->ops[index];
+	struct io_uring_sqe *sqe = getSqe(ring);
+	int fd = op->sock->sock, buf;
+
+	if(sqe==NULL) {
+		snprintf(ring->errMsg, sizeof(ring->errMsg), "Ring is full");
+		return FALSE;
+	}
+	sqe->user_data = (uint64_t)index;
+
+	if(fd<ring->fixedSlotsLen && ring->fixedSlots[fd]>0) {
+		sqe->fd     = ring->fixedSlots[fd]-1;
+		sqe->flags |= IOSQE_FIXED_FILE;
+	} else {
+		sqe->fd = fd;
+	}
+
+	switch(op->op) {
+	case NTPIO_RECV:
+	case NTPIO_SEND:
+		sqe->addr = (uint64_t)(uintptr_t)op->buf;
+		sqe->len  = op->len;
+		if((buf = findRegisteredBuf(ring, op->buf, op->len))>=0) {
+			sqe->opcode    = op->op==NTPIO_RECV ? IORING_OP_READ_FIXED
+			                                    : IORING_OP_WRITE_FIXED;
+			sqe->buf_index = buf;
+		} else {
+			sqe->opcode    = op->op==NTPIO_RECV ? IORING_OP_RECV
+			                                    : IORING_OP_SEND;
+			sqe->msg_flags = op->op==NTPIO_SEND ? MSG_NOSIGNAL : 0;
+		}
+		break;
+	case NTPIO_ACCEPT:
+		sqe->opcode       = IORING_OP_ACCEPT;
+		sqe->addr         = (uint64_t)(uintptr_t)&op->addr;
+		sqe->addr2        = (uint64_t)(uintptr_t)&op->addrLen;
+		sqe->accept_flags = SOCK_CLOEXEC;
+		break;
+	}
+	return TRUE;
+}
+#endif
+
+NTPIORing *NTPNewIORing(int maxOps) {
+	NTPIORing *rv;
+	int i;
+	initNetwork();
+
+	if(maxOps<1) return NULL;
+	rv = (NTPIORing*)malloc(sizeof(NTPIORing));
+	if(rv==NULL) return NULL;
+
+	rv->ops = (struct NTPIOOp*)calloc(maxOps, sizeof(struct NTPIOOp));
+	if(rv->ops==NULL) {
+		free(rv);
+		return NULL;
+	}
+	for(i=0;i<maxOps;i++)
+		rv->ops[i].nextFree = (i+1<maxOps) ? i+1 : -1;
+	rv->firstFree = 0;
+	rv->maxOps    = maxOps;
+	strcpy(rv->errMsg, "No error, yet");
+
+#ifdef NTP_IO_URING
+	rv->native = initNativeRing(rv);
+#else
+	rv->native = FALSE;
+#endif
+	return rv;
+}
+
+void NTPFreeIORing(NTPIORing **ring) {
+	if(ring==NULL || *ring==NULL) return;
+#ifdef NTP_IO_URING
+	if((*ring)->native) freeNativeRing(*ring);
+#endif
+	free((*ring)->ops);
+	free(*ring);
+	*ring = NULL;
+}
+
+BOOL NTPIORingIsNative(NTPIORing *ring) {
+	return ring->native;
+}
+
+const char *NTPIORingErr(NTPIORing *ring) {
+	return ring->errMsg;
+}
+
+//Grabs a free op, fills it in and queues it. Returns FALSE if full.
+static BOOL queueIOOp(NTPIORing *ring, int opType, NTPSock *sock,
+                      void *buf, int len, void *userData) {
+	struct NTPIOOp *op;
+	int index = ring->firstFree;
+
+	if(isConnecting(sock) || sock->sock<0) {
+		snprintf(ring->errMsg, sizeof(ring->errMsg),
+		         "Socket is not connected or listening");
+		return FALSE;
+	}
+	if(index<0) {
+		snprintf(ring->errMsg, sizeof(ring->errMsg), "Ring is full");
+		return FALSE;
+	}
+
+	op = &ring->ops[index];
+	op->op        = opType;
+	op->sock      = sock;
+	op->buf       = buf;
+	op->len       = len;
+	op->userData  = userData;
+	op->submitted = FALSE;
+	op->addrLen   = sizeof(op->addr);
+
+#ifdef NTP_IO_URING
+	if(ring->native && !queueNative(ring, index)) {
+		op->op = 0;
+		return FALSE;
+	}
+#endif
+
+	ring->firstFree = op->nextFree;
+	return TRUE;
+}
+
+BOOL NTPIORingRecv(NTPIORing *ring, NTPSock *sock, void *buf, int len,
+                   void *userData) {
+	return queueIOOp(ring, NTPIO_RECV, sock, buf, len, userData);
+}
+
+BOOL NTPIORingSend(NTPIORing *ring, NTPSock *sock, void *bytes, int len,
+                   void *userData) {
+	return queueIOOp(ring, NTPIO_SEND, sock, bytes, len, userData);
+}
+
+BOOL NTPIORingAccept(NTPIORing *ring, NTPSock *listenSock, void *userData) {
+	if(!listenSock->listenSock) {
+		snprintf(ring->errMsg, sizeof(ring->errMsg), "Socket is not listening");
+		return FALSE;
+	}
+	return queueIOOp(ring, NTPIO_ACCEPT, listenSock, NULL, 0, userData);
+}
+
+int NTPIORingSubmit(NTPIORing *ring) {
+	int i, count = 0;
+
+#ifdef NTP_IO_URING
+	if(ring->native) {
+		int rv;
+		if(ring->toSubmit==0) return 0;
+		__atomic_store_n(ring->sqTail, *ring->sqTail + ring->toSubmit,
+		                 __ATOMIC_RELEASE);
+		ring->toSubmit = 0;
+		//the kernel consumes everything up to the new tail
+		rv = ioUringEnter(ring->ringFd, *ring->sqTail -
+		                  __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE), 0, 0);
+		if(rv<0) {
+			snprintf(ring->errMsg, sizeof(ring->errMsg), "io_uring_enter, %s",
+			         strerror(errno));
+			return -1;
+		}
+		return rv;
+	}
+#endif
+
+	//On the fallback, operations actually happen when we reap
+	for(i=0;i<ring->maxOps;i++) {
+		if(ring->ops[i].op!=0 && !ring->ops[i].submitted) {
+			ring->ops[i].submitted = TRUE;
+			count++;
+		}
+	}
+	return count;
+}
+
+//Fills in a completion for op, and puts op back on the free list.
+//result is the return value of the system call, or -errno.
+static void completeIOOp(NTPIORing *ring, int index, int result,
+                         NTPIOCompletion *c) {
+	struct NTPIOOp *op = &ring->ops[index];
+	NTPSock *sock = op->sock;
+
+	c->op       = op->op;
+	c->sock     = sock;
+	c->userData = op->userData;
+	c->accepted = NULL;
+	c->result   = result;
+
+	if(result<0) {
+		const char *what = op->op==NTPIO_RECV ? "recving" :
+		                   op->op==NTPIO_SEND ? "sending" : "accepting";
+		setSockErr(sock, "%s, %s", what,
+		         strerror(-result));
+		c->result = -1;
+	}
+	else if(op->op==NTPIO_ACCEPT) {
+		c->accepted = allocNTPSock(NULL, -1);
+		if(c->accepted==NULL) {
+			setSockErr(sock, "no memory");
+			close(result);
+			c->result = -1;
+		} else {
+			c->accepted->sock = result;
+			c->result = 0;
+		}
+	}
+
+	op->op          = 0;
+	op->nextFree    = ring->firstFree;
+	ring->firstFree = index;
+}
+
+#ifdef NTP_IO_URING
+static int reapNative(NTPIORing *ring, NTPIOCompletion *completions,
+                      int maxCompletions, int timeoutMS) {
+	unsigned head, tail;
+	int count = 0;
+
+	head = *ring->cqHead;
+	tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+	if(head==tail && timeoutMS!=0) {
+		//the ring fd becomes readable when completions are waiting
+		struct pollfd pfd;
+		pfd.fd     = ring->ringFd;
+		pfd.events = POLLIN;
+		if(poll(&pfd, 1, timeoutMS<0 ? -1 : timeoutMS)<0 && errno!=EINTR) {
+			snprintf(ring->errMsg, sizeof(ring->errMsg), "poll, %s",
+			         strerror(errno));
+			return -1;
+		}
+		tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+	}
+
+	while(head!=tail && count<maxCompletions) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+		completeIOOp(ring, (int)cqe->user_data, cqe->res, &completions[count]);
+		count++;
+		head++;
+	}
+	__atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+	return count;
+}
+#endif
+
+//Without io_uring, we poll() the socks with submitted operations,
+//and do a non-blocking system call for each one that is ready.
+static int reapFallback(NTPIORing *ring, NTPIOCompletion *completions,
+                        int maxCompletions, int timeoutMS) {
+	struct pollfd *pfds;
+	int *indexes;
+	int i, n = 0, count = 0, result;
+
+	pfds    = malloc(ring->maxOps * sizeof(struct pollfd));
+	indexes = malloc(ring->maxOps * sizeof(int));
+	if(pfds==NULL || indexes==NULL) {
+		snprintf(ring->errMsg, sizeof(ring->errMsg), "no memory");
+		free(pfds);
+		free(indexes);
+		return -1;
+	}
+
+	for(i=0;i<ring->maxOps;i++) {
+		struct NTPIOOp *op = &ring->ops[i];
+		if(op->op==0 || !op->submitted) continue;
+		pfds[n].fd      = op->sock->sock;
+		pfds[n].events  = op->op==NTPIO_SEND ? POLLOUT : POLLIN;
+		pfds[n].revents = 0;
+		indexes[n]      = i;
+		n++;
+	}
+
+	if(n>0 && poll(pfds, n, timeoutMS<0 ? -1 : timeoutMS)<0 && errno!=EINTR) {
+		snprintf(ring->errMsg, sizeof(ring->errMsg), "poll, %s",
+		         strerror(errno));
+		count = -1;
+		n = 0;
+	}
+
+	for(i=0;i<n && count<maxCompletions;i++) {
+		struct NTPIOOp *op = &ring->ops[indexes[i]];
+		if(pfds[i].revents==0) continue;
+
+		switch(op->op) {
+		case NTPIO_RECV:
+			result = recv(op->sock->sock, op->buf, op->len, MSG_DONTWAIT);
+			break;
+		case NTPIO_SEND:
+			result = send(op->sock->sock, op->buf, op->len,
+			              MSG_DONTWAIT|MSG_NOSIGNAL);
+			break;
+		default:
+			//the same flags the kernel ring asks for
+			result = acceptWithFlags(op->sock->sock, &op->addr, &op->addrLen,
+			                         FALSE);
+			break;
+		}
+
+		if(result<0) {
+			//someone else got there first, try again next time
+			if(errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR) continue;
+			result = -errno;
+		}
+		completeIOOp(ring, indexes[i], result, &completions[count]);
+		count++;
+	}
+
+	free(pfds);
+	free(indexes);
+	return count;
+}
+
+int NTPIORingReap(NTPIORing *ring, NTPIOCompletion *completions,
+                  int maxCompletions, int timeoutMS) {
+#ifdef NTP_IO_URING
+	if(ring->native)
+		return reapNative(ring, completions, maxCompletions, timeoutMS);
+#endif
+	return reapFallback(ring, completions, maxCompletions, timeoutMS);
+}
+
+BOOL NTPIORingRegisterBuffers(NTPIORing *ring, void **bufs, int *lens,
+                              int count) {
+#ifdef NTP_IO_URING
+	int i;
+	if(!ring->native) return TRUE;
+	if(ring->bufs!=NULL) {
+		snprintf(ring->errMsg, sizeof(ring->errMsg), "Already registered");
+		return FALSE;
+	}
+
+	ring->bufs = malloc(count * sizeof(struct iovec));
+	if(ring->bufs==NULL) {
+		snprintf(ring->errMsg, sizeof(ring->errMsg), "no memory");
+		return FALSE;
+	}
+	for(i=0;i<count;i++) {
+		ring->bufs[i].iov_base = bufs[i];
+		ring->bufs[i].iov_len  = lens[i];
+	}
+
+	if(ioUringRegister(ring->ringFd, IORING_REGISTER_BUFFERS,
+	                   ring->bufs, count)<0) {
+		snprintf(ring->errMsg, sizeof(ring->errMsg), "registering buffers, %s",
+		         strerror(errno));
+		free(ring->bufs);
+		ring->bufs = NULL;
+		return FALSE;
+	}
+	ring->numBufs = count;
+#endif
+	return TRUE;
+}
+
+#ifdef NTP_IO_URING
+//Puts fd into fixed file slot 'slot'. fd can be -1 to clear the slot.
+static BOOL updateFixedFile(NTPIORing *ring, int slot, int fd) {
+	struct io_uring_files_update update;
+	memset(&update, 0, sizeof(update));
+	update.offset = slot;
+	update.fds    = (uint64_t)(uintptr_t)&fd;
+	if(ioUringRegister(ring->ringFd, IORING_REGISTER_FILES_UPDATE,
+	                   &update, 1)<0) {
+		snprintf(ring->errMsg, sizeof(ring->errMsg), "updating files, %s",
+		         strerror(errno));
+		return FALSE;
+	}
+	return TRUE;
+}
+#endif
+
+BOOL NTPIORingRegisterSock(NTPIORing *ring, NTPSock *sock) {
+#ifdef NTP_IO_URING
+	int fd = sock->sock, slot;
+	if(!ring->native || !ring->fixedAvailable) return TRUE;
+	if(fd<0) {
+		snprintf(ring->errMsg, sizeof(ring->errMsg),
+		         "Socket is not connected or listening");
+		return FALSE;
+	}
+
+	//grow the fd to slot map if necessary
+	if(fd>=ring->fixedSlotsLen) {
+		int newLen = ring->fixedSlotsLen==0 ? 64 : ring->fixedSlotsLen;
+		int *newSlots;
+		while(newLen<=fd) newLen *= 2;
+		newSlots = realloc(ring->fixedSlots, newLen*sizeof(int));
+		if(newSlots==NULL) {
+			snprintf(ring->errMsg, sizeof(ring->errMsg), "no memory");
+			return FALSE;
+		}
+		memset(newSlots+ring->fixedSlotsLen, 0,
+		       (newLen-ring->fixedSlotsLen)*sizeof(int));
+		ring->fixedSlots    = newSlots;
+		ring->fixedSlotsLen = newLen;
+	}
+	if(ring->fixedSlots[fd]>0) return TRUE;
+
+	for(slot=0;slot<NTP_IORING_FIXED_FILES && ring->fixedUsed[slot];slot++);
+	if(slot==NTP_IORING_FIXED_FILES) {
+		//out of slots isn't an error, the sock just won't be fixed
+		return TRUE;
+	}
+
+	if(!updateFixedFile(ring, slot, fd)) return FALSE;
+	ring->fixedUsed[slot] = TRUE;
+	ring->fixedSlots[fd]  = slot+1;
+#endif
+	return TRUE;
+}
+
+BOOL NTPIORingUnregisterSock(NTPIORing *ring, NTPSock *sock) {
+#ifdef NTP_IO_URING
+	int fd = sock->sock, slot;
+	if(!ring->native || fd<0 || fd>=ring->fixedSlotsLen ||
+	   ring->fixedSlots[fd]==0)
+		return TRUE;
+
+	slot = ring->fixedSlots[fd]-1;
+	if(!updateFixedFile(ring, slot, -1)) return FALSE;
+	ring->fixedUsed[slot] = FALSE;
+	ring->fixedSlots[fd]  = 0;
+#endif
+	return TRUE;
+}
+
+#endif
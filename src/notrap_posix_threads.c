@@ -1,13 +1,26 @@
+//The thread affinity and naming functions need this on Linux.
+//It has to come before any system header.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <notrap/notrap.h>
 #ifdef NTP_POSIX_THREADS
 
 #include <pthread.h>
+#include <limits.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
-
-struct NTPLock_struct {
-	pthread_mutex_t mutex;
-};
+#include <string.h>
+#include <time.h>
+#ifdef NTP_LIN
+#include <linux/futex.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
 
 BOOL NTPStartThread(void *(*start_routine)(void *), void *arg) {
 	pthread_t thread;
@@ -20,10 +33,141 @@ BOOL NTPStartThread(void *(*start_routine)(void *), void *arg) {
 	return FALSE;
 }
 
+//------------------------------------------------------------------
+// Locks. On Linux these are built straight on a futex, so an
+// uncontended lock or unlock is one atomic instruction and never
+// enters the kernel. A contended lock spins for a little while
+// before going to sleep, since most critical sections are short.
+// How long it spins adapts to how long it took to get the lock
+// in the past (the same idea as glibc's adaptive mutexes).
+//------------------------------------------------------------------
+#define MAX_SPINS 100
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define CPU_RELAX() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define CPU_RELAX() do {} while(0)
+#endif
+
+//Spinning only helps if whoever we're waiting for is running on
+//another CPU. With one CPU, it just burns the rest of our time slice.
+static int spinCPUs = 0;
+
+static BOOL shouldSpin() {
+	int cpus = __atomic_load_n(&spinCPUs, __ATOMIC_RELAXED);
+	if(cpus==0) {
+		cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		if(cpus<1) cpus = 1;
+		__atomic_store_n(&spinCPUs, cpus, __ATOMIC_RELAXED);
+	}
+	return cpus>1;
+}
+
+//Only locks that have been passed to NTPTrackLock() have one of these
+struct NTPLockTracker_struct {
+	char name[48];
+	uint64_t acquisitions;
+	uint64_t contended;
+	uint64_t waitNanos;
+	struct NTPLockTracker_struct *next, *prev;
+};
+
+static pthread_mutex_t trackedMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct NTPLockTracker_struct *trackedLocks = NULL;
+
+#ifdef NTP_LIN
+static void futexWait(int *addr, int val) {
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futexWake(int *addr, int count) {
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static BOOL tryLock(NTPLock *lock) {
+	int expected = 0;
+	return __atomic_compare_exchange_n(&lock->state, &expected, 1, FALSE,
+	                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+//Marks the lock as having sleepers, and sleeps until we get it
+static BOOL sleepLock(NTPLock *lock) {
+	while(__atomic_exchange_n(&lock->state, 2, __ATOMIC_ACQUIRE)!=0)
+		futexWait(&lock->state, 2);
+	return TRUE;
+}
+
+static void unlock(NTPLock *lock) {
+	if(__atomic_exchange_n(&lock->state, 0, __ATOMIC_RELEASE)==2)
+		futexWake(&lock->state, 1);
+}
+
+static BOOL initLock(NTPLock *lock) {
+	lock->state = 0;
+	return TRUE;
+}
+
+static void destroyLock(NTPLock *lock) {
+}
+
+#else
+
+static BOOL tryLock(NTPLock *lock) {
+	return pthread_mutex_trylock(&lock->mutex) == 0;
+}
+
+static BOOL sleepLock(NTPLock *lock) {
+	//errors are so rare here, I almost don't
+	//want to force users to check them.
+	//What will they do exactly? But you can't
+	//write super-stable software if your locks
+	//are leaking, so...........
+	return pthread_mutex_lock(&lock->mutex)==0;
+}
+
+static void unlock(NTPLock *lock) {
+	pthread_mutex_unlock(&lock->mutex);
+}
+
+static BOOL initLock(NTPLock *lock) {
+	return pthread_mutex_init(&lock->mutex, NULL) == 0;
+}
+
+static void destroyLock(NTPLock *lock) {
+	pthread_mutex_destroy(&lock->mutex);
+}
+#endif
+
+BOOL NTPInitLock(NTPLock *lock) {
+	lock->spins = 0;
+	lock->stats = NULL;
+	return initLock(lock);
+}
+
+//Takes a tracker off the list and frees it
+static void freeTracker(struct NTPLockTracker_struct *t) {
+	pthread_mutex_lock(&trackedMutex);
+	if(t->prev!=NULL) t->prev->next = t->next;
+	else              trackedLocks  = t->next;
+	if(t->next!=NULL) t->next->prev = t->prev;
+	pthread_mutex_unlock(&trackedMutex);
+	free(t);
+}
+
+void NTPDestroyLock(NTPLock *lock) {
+	if(lock->stats!=NULL) {
+		freeTracker(lock->stats);
+		lock->stats = NULL;
+	}
+	destroyLock(lock);
+}
+
 NTPLock *NTPNewLock() {
 	NTPLock *rv = malloc(sizeof(NTPLock));
 	if(rv!=NULL) {
-		if( pthread_mutex_init(&rv->mutex, NULL)  == 0) {
+		if(NTPInitLock(rv)) {
 			return rv;  //success
 		}
 
@@ -37,25 +181,1369 @@ NTPLock *NTPNewLock() {
 
 void NTPFreeLock(NTPLock **lock) {
 	if(lock==NULL || *lock == NULL) return;
-	pthread_mutex_destroy(&(*lock)->mutex);
+	NTPDestroyLock(*lock);
 	free(*lock);
 	*lock = NULL;
 }
 
+//The lock is taken, so spin for a bit, then sleep.
+//Returns FALSE if we couldn't get it.
+static BOOL lockContended(NTPLock *lock) {
+	int spins    = __atomic_load_n(&lock->spins, __ATOMIC_RELAXED);
+	int maxSpins = spins*2 + 10;
+	int i;
+
+	if(maxSpins>MAX_SPINS) maxSpins = MAX_SPINS;
+	if(!shouldSpin()) maxSpins = 0;
+	for(i=0;i<maxSpins;i++) {
+		CPU_RELAX();
+		if(tryLock(lock)) break;
+	}
+	if(i==maxSpins && !sleepLock(lock)) return FALSE;
+
+	//Move the spin count a little towards what it took this time.
+	//It's only a hint, so it doesn't matter if two threads race here.
+	__atomic_store_n(&lock->spins, spins + (i-spins)/8, __ATOMIC_RELAXED);
+	return TRUE;
+}
+
 BOOL NTPAcquireLock(NTPLock *lock) {
-	if(pthread_mutex_lock(&lock->mutex)!=0) {
-		//errors are so rare here, I almost don't
-		//want to force users to check them.
-		//What will they do exactly? But you can't
-		//write super-stable software if your locks
-		//are leaking, so...........
-		return FALSE;
+	struct NTPLockTracker_struct *t;
+	uint64_t start;
+
+	if(tryLock(lock)) {
+		t = lock->stats;
+		if(t!=NULL) __atomic_add_fetch(&t->acquisitions, 1, __ATOMIC_RELAXED);
+		return TRUE;
 	}
+
+	//Only look at the clock when we have to wait anyway
+	t = lock->stats;
+	if(t==NULL) return lockContended(lock);
+	start = NTPMonotonicNanos();
+	if(!lockContended(lock)) return FALSE;
+	__atomic_add_fetch(&t->acquisitions, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&t->contended, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&t->waitNanos, NTPMonotonicNanos()-start, __ATOMIC_RELAXED);
 	return TRUE;
 }
 
 void NTPReleaseLock(NTPLock *lock) {
-	pthread_mutex_unlock(&lock->mutex);
+	unlock(lock);
+}
+
+BOOL NTPTrackLock(NTPLock *lock, const char *name) {
+	struct NTPLockTracker_struct *t, *expected = NULL;
+
+	if(lock->stats!=NULL) return TRUE;  //already tracked
+	t = malloc(sizeof(struct NTPLockTracker_struct));
+	if(t==NULL) return FALSE;
+	memset(t, 0, sizeof(struct NTPLockTracker_struct));
+	strncpy(t->name, name==NULL ? "(unnamed)" : name, sizeof(t->name)-1);
+
+	pthread_mutex_lock(&trackedMutex);
+	t->next = trackedLocks;
+	if(trackedLocks!=NULL) trackedLocks->prev = t;
+	trackedLocks = t;
+	pthread_mutex_unlock(&trackedMutex);
+
+	//Someone else could be tracking it at the same time. Whoever
+	//gets there second throws theirs away.
+	if(!__atomic_compare_exchange_n(&lock->stats, &expected, t, FALSE,
+	                                __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		freeTracker(t);
+	return TRUE;
+}
+
+BOOL NTPGetLockStats(NTPLock *lock, NTPLockStats *stats) {
+	struct NTPLockTracker_struct *t = lock->stats;
+	if(t==NULL) return FALSE;
+	stats->acquisitions = __atomic_load_n(&t->acquisitions, __ATOMIC_RELAXED);
+	stats->contended    = __atomic_load_n(&t->contended,    __ATOMIC_RELAXED);
+	stats->waitNanos    = __atomic_load_n(&t->waitNanos,    __ATOMIC_RELAXED);
+	return TRUE;
+}
+
+void NTPDumpLockStats(FILE *out) {
+	struct NTPLockTracker_struct *t;
+
+	pthread_mutex_lock(&trackedMutex);
+	fprintf(out, "%-32s %14s %14s %12s\n",
+	        "lock", "acquisitions", "contended", "wait ms");
+	for(t=trackedLocks;t!=NULL;t=t->next) {
+		fprintf(out, "%-32s %14llu %14llu %12.3f\n", t->name,
+		  (unsigned long long)__atomic_load_n(&t->acquisitions, __ATOMIC_RELAXED),
+		  (unsigned long long)__atomic_load_n(&t->contended,    __ATOMIC_RELAXED),
+		  __atomic_load_n(&t->waitNanos, __ATOMIC_RELAXED)/1000000.0);
+	}
+	pthread_mutex_unlock(&trackedMutex);
+}
+
+//------------------------------------------------------------------
+// Conditions and semaphores. On Linux they are futexes too, so they
+// work with our futex locks. Elsewhere they're the pthreads versions.
+//------------------------------------------------------------------
+
+#ifdef NTP_LIN
+//Like futexWait(), but gives up at deadline (from NTPMonotonicNanos()),
+//if it isn't 0. Returns FALSE if it timed out.
+static BOOL futexWaitUntil(int *addr, int val, uint64_t deadline) {
+	struct timespec ts;
+	uint64_t now;
+
+	if(deadline==0) {
+		futexWait(addr, val);
+		return TRUE;
+	}
+	now = NTPMonotonicNanos();
+	if(now>=deadline) return FALSE;
+	ts.tv_sec  = (deadline-now) / 1000000000ull;
+	ts.tv_nsec = (deadline-now) % 1000000000ull;
+	if(syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, &ts, NULL, 0)==-1 &&
+	   errno==ETIMEDOUT)
+		return FALSE;
+	return TRUE;
+}
+#else
+static struct timespec realtimeDeadline(int timeoutMS) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec  += timeoutMS / 1000;
+	ts.tv_nsec += (long)(timeoutMS % 1000) * 1000000;
+	if(ts.tv_nsec>=1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	return ts;
+}
+#endif
+
+static uint64_t deadlineAfter(int timeoutMS) {
+	if(timeoutMS<0) timeoutMS = 0;
+	return NTPMonotonicNanos() + (uint64_t)timeoutMS*1000000ull;
+}
+
+BOOL NTPInitCondition(NTPCondition *cond) {
+#ifdef NTP_LIN
+	cond->seq = 0;
+	return TRUE;
+#else
+	return pthread_cond_init(&cond->cond, NULL) == 0;
+#endif
+}
+
+void NTPDestroyCondition(NTPCondition *cond) {
+#ifndef NTP_LIN
+	pthread_cond_destroy(&cond->cond);
+#endif
+}
+
+NTPCondition *NTPNewCondition() {
+	NTPCondition *rv = malloc(sizeof(NTPCondition));
+	if(rv!=NULL && !NTPInitCondition(rv)) {
+		free(rv);
+		rv = NULL;
+	}
+	return rv;
+}
+
+void NTPFreeCondition(NTPCondition **cond) {
+	if(cond==NULL || *cond==NULL) return;
+	NTPDestroyCondition(*cond);
+	free(*cond);
+	*cond = NULL;
+}
+
+#ifdef NTP_LIN
+static BOOL waitCondition(NTPCondition *cond, NTPLock *lock, uint64_t deadline) {
+	//We read seq while we still hold the lock, so if anyone signals
+	//after we let go, it won't match and the futex won't sleep.
+	int seq = __atomic_load_n(&cond->seq, __ATOMIC_RELAXED);
+	BOOL rv;
+
+	NTPReleaseLock(lock);
+	rv = futexWaitUntil(&cond->seq, seq, deadline);
+	//Other waiters may be woken with us, so take the lock the way a
+	//sleeper would, which makes sure whoever releases it wakes the next.
+	sleepLock(lock);
+	return rv;
+}
+#endif
+
+void NTPWaitCondition(NTPCondition *cond, NTPLock *lock) {
+#ifdef NTP_LIN
+	waitCondition(cond, lock, 0);
+#else
+	pthread_cond_wait(&cond->cond, &lock->mutex);
+#endif
+}
+
+BOOL NTPWaitConditionTimeout(NTPCondition *cond, NTPLock *lock, int timeoutMS) {
+#ifdef NTP_LIN
+	return waitCondition(cond, lock, deadlineAfter(timeoutMS));
+#else
+	struct timespec ts = realtimeDeadline(timeoutMS);
+	return pthread_cond_timedwait(&cond->cond, &lock->mutex, &ts) != ETIMEDOUT;
+#endif
+}
+
+void NTPSignalCondition(NTPCondition *cond) {
+#ifdef NTP_LIN
+	__atomic_add_fetch(&cond->seq, 1, __ATOMIC_RELEASE);
+	futexWake(&cond->seq, 1);
+#else
+	pthread_cond_signal(&cond->cond);
+#endif
+}
+
+void NTPBroadcastCondition(NTPCondition *cond) {
+#ifdef NTP_LIN
+	__atomic_add_fetch(&cond->seq, 1, __ATOMIC_RELEASE);
+	futexWake(&cond->seq, INT_MAX);
+#else
+	pthread_cond_broadcast(&cond->cond);
+#endif
+}
+
+BOOL NTPInitSemaphore(NTPSemaphore *sem, int count) {
+	if(count<0) return FALSE;
+#ifdef NTP_LIN
+	sem->count   = count;
+	sem->waiters = 0;
+	return TRUE;
+#else
+	sem->count = count;
+	if(pthread_mutex_init(&sem->mutex, NULL)!=0) return FALSE;
+	if(pthread_cond_init(&sem->cond, NULL)!=0) {
+		pthread_mutex_destroy(&sem->mutex);
+		return FALSE;
+	}
+	return TRUE;
+#endif
+}
+
+void NTPDestroySemaphore(NTPSemaphore *sem) {
+#ifndef NTP_LIN
+	pthread_mutex_destroy(&sem->mutex);
+	pthread_cond_destroy(&sem->cond);
+#endif
+}
+
+NTPSemaphore *NTPNewSemaphore(int count) {
+	NTPSemaphore *rv = malloc(sizeof(NTPSemaphore));
+	if(rv!=NULL && !NTPInitSemaphore(rv, count)) {
+		free(rv);
+		rv = NULL;
+	}
+	return rv;
+}
+
+void NTPFreeSemaphore(NTPSemaphore **sem) {
+	if(sem==NULL || *sem==NULL) return;
+	NTPDestroySemaphore(*sem);
+	free(*sem);
+	*sem = NULL;
+}
+
+void NTPPostSemaphore(NTPSemaphore *sem) {
+#ifdef NTP_LIN
+	//Waiters say they're waiting before sleeping, and we add to the
+	//count before looking for waiters, so one of us always notices.
+	__atomic_add_fetch(&sem->count, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&sem->waiters, __ATOMIC_SEQ_CST)>0)
+		futexWake(&sem->count, 1);
+#else
+	pthread_mutex_lock(&sem->mutex);
+	sem->count++;
+	pthread_cond_signal(&sem->cond);
+	pthread_mutex_unlock(&sem->mutex);
+#endif
+}
+
+BOOL NTPTryWaitSemaphore(NTPSemaphore *sem) {
+#ifdef NTP_LIN
+	int count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+	while(count>0) {
+		if(__atomic_compare_exchange_n(&sem->count, &count, count-1, FALSE,
+		                               __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return TRUE;
+	}
+	return FALSE;
+#else
+	BOOL rv = FALSE;
+	pthread_mutex_lock(&sem->mutex);
+	if(sem->count>0) {
+		sem->count--;
+		rv = TRUE;
+	}
+	pthread_mutex_unlock(&sem->mutex);
+	return rv;
+#endif
+}
+
+#ifdef NTP_LIN
+static BOOL waitSemaphore(NTPSemaphore *sem, uint64_t deadline) {
+	BOOL stillWaiting;
+	for(;;) {
+		if(NTPTryWaitSemaphore(sem)) return TRUE;
+		__atomic_add_fetch(&sem->waiters, 1, __ATOMIC_SEQ_CST);
+		stillWaiting = futexWaitUntil(&sem->count, 0, deadline);
+		__atomic_sub_fetch(&sem->waiters, 1, __ATOMIC_SEQ_CST);
+		if(!stillWaiting) return NTPTryWaitSemaphore(sem);
+	}
+}
+#endif
+
+void NTPWaitSemaphore(NTPSemaphore *sem) {
+#ifdef NTP_LIN
+	waitSemaphore(sem, 0);
+#else
+	pthread_mutex_lock(&sem->mutex);
+	while(sem->count==0)
+		pthread_cond_wait(&sem->cond, &sem->mutex);
+	sem->count--;
+	pthread_mutex_unlock(&sem->mutex);
+#endif
+}
+
+BOOL NTPWaitSemaphoreTimeout(NTPSemaphore *sem, int timeoutMS) {
+#ifdef NTP_LIN
+	return waitSemaphore(sem, deadlineAfter(timeoutMS));
+#else
+	struct timespec ts = realtimeDeadline(timeoutMS);
+	BOOL rv = TRUE;
+	pthread_mutex_lock(&sem->mutex);
+	while(sem->count==0) {
+		if(pthread_cond_timedwait(&sem->cond, &sem->mutex, &ts)==ETIMEDOUT) {
+			rv = FALSE;
+			break;
+		}
+	}
+	if(rv) sem->count--;
+	pthread_mutex_unlock(&sem->mutex);
+	return rv;
+#endif
+}
+
+//------------------------------------------------------------------
+// Reader-writer locks. Readers don't share a counter, because then
+// every read would fight over the same cache line. Instead each
+// thread counts itself in one of several slots, each on its own
+// cache line. A writer raises a flag, which stops new readers, then
+// waits for every slot to empty out. That also makes it prefer
+// writers: once a writer is waiting, new readers wait behind it.
+// Read locks aren't recursive, since a writer could get in between.
+//------------------------------------------------------------------
+#define RW_SLOTS 16  //must be a power of 2
+
+#ifdef NTP_LIN
+typedef struct {
+	int readers;
+	char pad[64-sizeof(int)];
+} NTPReaderSlot;
+
+struct NTPRWLock_struct {
+	NTPReaderSlot slots[RW_SLOTS];
+	int writer;     //TRUE while a writer holds or wants the lock
+	int writerSeq;  //changes every time a writer lets go, so readers can wait on it
+	NTPLock writerLock;  //only one writer at a time
+};
+
+static int nextReadSlot = 0;
+static __thread int readSlot = -1;
+
+static NTPReaderSlot *myReadSlot(NTPRWLock *lock) {
+	if(readSlot<0)
+		readSlot = __atomic_fetch_add(&nextReadSlot, 1, __ATOMIC_RELAXED) & (RW_SLOTS-1);
+	return &lock->slots[readSlot];
+}
+#else
+struct NTPRWLock_struct {
+	pthread_rwlock_t rwlock;
+};
+#endif
+
+NTPRWLock *NTPNewRWLock() {
+	NTPRWLock *rv;
+#ifdef NTP_LIN
+	if(posix_memalign((void**)&rv, 64, sizeof(NTPRWLock))!=0) return NULL;
+	memset(rv, 0, sizeof(NTPRWLock));
+	if(!NTPInitLock(&rv->writerLock)) {
+		free(rv);
+		return NULL;
+	}
+#else
+	rv = malloc(sizeof(NTPRWLock));
+	if(rv==NULL) return NULL;
+	if(pthread_rwlock_init(&rv->rwlock, NULL)!=0) {
+		free(rv);
+		return NULL;
+	}
+#endif
+	return rv;
+}
+
+void NTPFreeRWLock(NTPRWLock **lock) {
+	if(lock==NULL || *lock==NULL) return;
+#ifdef NTP_LIN
+	NTPDestroyLock(&(*lock)->writerLock);
+#else
+	pthread_rwlock_destroy(&(*lock)->rwlock);
+#endif
+	free(*lock);
+	*lock = NULL;
+}
+
+void NTPAcquireReadLock(NTPRWLock *lock) {
+#ifdef NTP_LIN
+	NTPReaderSlot *slot = myReadSlot(lock);
+	int seq;
+
+	for(;;) {
+		//Count ourselves in, then look for a writer. The writer raises
+		//its flag, then counts readers, so one of us sees the other.
+		__atomic_add_fetch(&slot->readers, 1, __ATOMIC_SEQ_CST);
+		if(!__atomic_load_n(&lock->writer, __ATOMIC_SEQ_CST)) return;
+
+		//There's a writer, so get out of its way
+		NTPReleaseReadLock(lock);
+		seq = __atomic_load_n(&lock->writerSeq, __ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&lock->writer, __ATOMIC_SEQ_CST))
+			futexWait(&lock->writerSeq, seq);
+	}
+#else
+	pthread_rwlock_rdlock(&lock->rwlock);
+#endif
+}
+
+void NTPReleaseReadLock(NTPRWLock *lock) {
+#ifdef NTP_LIN
+	NTPReaderSlot *slot = myReadSlot(lock);
+	__atomic_sub_fetch(&slot->readers, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&lock->writer, __ATOMIC_SEQ_CST))
+		futexWake(&slot->readers, 1);  //the writer may be waiting on us
+#else
+	pthread_rwlock_unlock(&lock->rwlock);
+#endif
+}
+
+void NTPAcquireWriteLock(NTPRWLock *lock) {
+#ifdef NTP_LIN
+	int i, readers, spins;
+
+	NTPAcquireLock(&lock->writerLock);
+	__atomic_store_n(&lock->writer, TRUE, __ATOMIC_SEQ_CST);
+	for(i=0;i<RW_SLOTS;i++) {
+		spins = 0;
+		while((readers=__atomic_load_n(&lock->slots[i].readers, __ATOMIC_SEQ_CST))!=0) {
+			if(spins++<MAX_SPINS && shouldSpin()) CPU_RELAX();
+			else futexWait(&lock->slots[i].readers, readers);
+		}
+	}
+#else
+	pthread_rwlock_wrlock(&lock->rwlock);
+#endif
+}
+
+void NTPReleaseWriteLock(NTPRWLock *lock) {
+#ifdef NTP_LIN
+	__atomic_store_n(&lock->writer, FALSE, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&lock->writerSeq, 1, __ATOMIC_RELEASE);
+	futexWake(&lock->writerSeq, INT_MAX);
+	NTPReleaseLock(&lock->writerLock);
+#else
+	pthread_rwlock_unlock(&lock->rwlock);
+#endif
+}
+
+//------------------------------------------------------------------
+// Joinable threads. The new thread starts in threadTrampoline(),
+// which applies the settings that can only be changed from inside
+// the thread, then tells NTPNewThread() whether that worked before
+// calling the user's function.
+//------------------------------------------------------------------
+struct NTPThread_struct {
+	pthread_t thread;
+	void *(*startRoutine)(void *);
+	void *arg;
+	char name[16];     //Linux won't take more than 15 characters
+	int  priority;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t  started;
+	int  startState;   //0 while starting, 1 on success, -1 on failure
+};
+
+static BOOL setThreadName(pthread_t thread, const char *name) {
+#if defined(NTP_OSX)
+	//OSX can only name the thread it's called from
+	if(!pthread_equal(thread, pthread_self())) return FALSE;
+	return pthread_setname_np(name) == 0;
+#else
+	return pthread_setname_np(thread, name) == 0;
+#endif
+}
+
+static void *threadTrampoline(void *arg) {
+	NTPThread *t = (NTPThread*)arg;
+	void *(*startRoutine)(void *) = t->startRoutine;
+	void *startArg = t->arg;
+	BOOL ok = TRUE;
+
+	if(t->name[0]!='\0') ok = setThreadName(pthread_self(), t->name);
+#ifdef NTP_LIN
+	//On Linux, niceness is per thread
+	if(ok && t->priority!=0)
+		ok = setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), t->priority)==0;
+#else
+	if(t->priority!=0) ok = FALSE;
+#endif
+
+	//Once we say we've started, t belongs to the caller, so don't touch it
+	pthread_mutex_lock(&t->mutex);
+	t->startState = ok ? 1 : -1;
+	pthread_cond_signal(&t->started);
+	pthread_mutex_unlock(&t->mutex);
+
+	if(!ok) return NULL;
+	return startRoutine(startArg);
+}
+
+NTPThread *NTPNewThread(void *(*start_routine)(void *), void *arg,
+                        const NTPThreadOptions *options) {
+	NTPThread *rv;
+	pthread_attr_t attr;
+	BOOL attrInit = FALSE, mutexInit = FALSE;
+	int startState;
+
+	rv = malloc(sizeof(NTPThread));
+	if(rv==NULL) return NULL;
+	memset(rv, 0, sizeof(NTPThread));
+	rv->startRoutine = start_routine;
+	rv->arg          = arg;
+
+	if(pthread_attr_init(&attr)!=0) goto ERR;
+	attrInit = TRUE;
+	if(pthread_mutex_init(&rv->mutex, NULL)!=0) goto ERR;
+	if(pthread_cond_init(&rv->started, NULL)!=0) {
+		pthread_mutex_destroy(&rv->mutex);
+		goto ERR;
+	}
+	mutexInit = TRUE;
+
+	if(options!=NULL) {
+		if(options->stackSize>0) {
+			size_t stackSize = options->stackSize;
+			if(stackSize<PTHREAD_STACK_MIN) stackSize = PTHREAD_STACK_MIN;
+			if(pthread_attr_setstacksize(&attr, stackSize)!=0) goto ERR;
+		}
+		if(options->name!=NULL) {
+			strncpy(rv->name, options->name, sizeof(rv->name)-1);
+		}
+		rv->priority = options->priority;
+
+		if(options->numCPUs>0) {
+#ifdef NTP_LIN
+			//Set it before the thread starts, so it never runs anywhere else
+			cpu_set_t cpus;
+			int i;
+			CPU_ZERO(&cpus);
+			for(i=0;i<options->numCPUs;i++) {
+				if(options->cpus[i]<0 || options->cpus[i]>=CPU_SETSIZE) goto ERR;
+				CPU_SET(options->cpus[i], &cpus);
+			}
+			if(pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus)!=0) goto ERR;
+#else
+			goto ERR;  //not supported here
+#endif
+		}
+	}
+
+	if(pthread_create(&rv->thread, &attr, threadTrampoline, rv)!=0) goto ERR;
+	pthread_attr_destroy(&attr);
+	attrInit = FALSE;
+
+	pthread_mutex_lock(&rv->mutex);
+	while(rv->startState==0)
+		pthread_cond_wait(&rv->started, &rv->mutex);
+	startState = rv->startState;
+	pthread_mutex_unlock(&rv->mutex);
+
+	if(startState<0) {
+		pthread_join(rv->thread, NULL);
+		goto ERR;
+	}
+	return rv;
+
+ERR:
+	if(attrInit) pthread_attr_destroy(&attr);
+	if(mutexInit) {
+		pthread_mutex_destroy(&rv->mutex);
+		pthread_cond_destroy(&rv->started);
+	}
+	free(rv);
+	return NULL;
+}
+
+static void freeThread(NTPThread **thread) {
+	pthread_mutex_destroy(&(*thread)->mutex);
+	pthread_cond_destroy(&(*thread)->started);
+	free(*thread);
+	*thread = NULL;
+}
+
+BOOL NTPJoinThread(NTPThread **thread, void **result) {
+	void *rv;
+	if(thread==NULL || *thread==NULL) return FALSE;
+	if(pthread_join((*thread)->thread, &rv)!=0) return FALSE;
+	if(result!=NULL) *result = rv;
+	freeThread(thread);
+	return TRUE;
+}
+
+BOOL NTPDetachThread(NTPThread **thread) {
+	if(thread==NULL || *thread==NULL) return FALSE;
+	if(pthread_detach((*thread)->thread)!=0) return FALSE;
+	freeThread(thread);
+	return TRUE;
+}
+
+BOOL NTPSetThreadAffinity(NTPThread *thread, const int *cpus, int numCPUs) {
+#ifdef NTP_LIN
+	pthread_t target = thread==NULL ? pthread_self() : thread->thread;
+	cpu_set_t set;
+	int i;
+
+	if(numCPUs<=0) return FALSE;
+	CPU_ZERO(&set);
+	for(i=0;i<numCPUs;i++) {
+		if(cpus[i]<0 || cpus[i]>=CPU_SETSIZE) return FALSE;
+		CPU_SET(cpus[i], &set);
+	}
+	return pthread_setaffinity_np(target, sizeof(set), &set) == 0;
+#else
+	return FALSE;
+#endif
+}
+
+BOOL NTPSetThreadName(NTPThread *thread, const char *name) {
+	char shortName[16];
+	strncpy(shortName, name, sizeof(shortName)-1);
+	shortName[sizeof(shortName)-1] = '\0';
+	return setThreadName(thread==NULL ? pthread_self() : thread->thread,
+	                     shortName);
+}
+
+
+//------------------------------------------------------------------
+// Lock-free queues. Both hold void pointers in a ring whose size is
+// a power of 2, and keep the producer's and consumer's positions on
+// separate cache lines so they don't slow each other down.
+//
+// The blocking versions spin on the lock-free path for a while, then
+// sleep on a condition. Whoever makes progress checks for sleepers
+// after it publishes, and sleepers say they're sleeping before they
+// look one last time, so one of them always notices the other.
+//------------------------------------------------------------------
+#define QUEUE_SPINS 200
+
+typedef struct {
+	NTPLock lock;
+	NTPCondition cond;
+	int waiters;  //atomic
+} NTPQueueWaiters;
+
+static BOOL initWaiters(NTPQueueWaiters *w) {
+	w->waiters = 0;
+	if(!NTPInitLock(&w->lock)) return FALSE;
+	if(!NTPInitCondition(&w->cond)) {
+		NTPDestroyLock(&w->lock);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void destroyWaiters(NTPQueueWaiters *w) {
+	NTPDestroyCondition(&w->cond);
+	NTPDestroyLock(&w->lock);
+}
+
+//Call after pushing or popping something
+static void wakeWaiters(NTPQueueWaiters *w) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&w->waiters, __ATOMIC_RELAXED)>0) {
+		NTPAcquireLock(&w->lock);
+		NTPBroadcastCondition(&w->cond);
+		NTPReleaseLock(&w->lock);
+	}
+}
+
+//Keeps calling attempt(queue, item) until it returns TRUE. attempt
+//mustn't wake anyone itself, since we might be holding the lock.
+static void waitUntil(NTPQueueWaiters *w, BOOL (*attempt)(void*, void*),
+                      void *queue, void *item) {
+	int i, spins = shouldSpin() ? QUEUE_SPINS : 1;
+	for(i=0;i<spins;i++) {
+		if(attempt(queue, item)) {
+			wakeWaiters(w);
+			return;
+		}
+		CPU_RELAX();
+	}
+
+	NTPAcquireLock(&w->lock);
+	__atomic_add_fetch(&w->waiters, 1, __ATOMIC_SEQ_CST);
+	while(!attempt(queue, item))
+		NTPWaitCondition(&w->cond, &w->lock);
+	//we made room (or took something), which someone else may be
+	//waiting for. Waiters only sign up while holding the lock.
+	if(__atomic_sub_fetch(&w->waiters, 1, __ATOMIC_SEQ_CST)>0)
+		NTPBroadcastCondition(&w->cond);
+	NTPReleaseLock(&w->lock);
+}
+
+static int roundUpPow2(int n) {
+	int rv = 2;
+	while(rv<n && rv<(1<<30)) rv *= 2;
+	return rv;
+}
+
+//---------------- single producer, single consumer ----------------
+//Each side keeps a copy of the other's position, and only reads the
+//real one when its copy says the ring is full (or empty). So most of
+//the time neither side touches the other's cache line.
+struct NTPSPSCQueue_struct {
+	uint64_t tail;        //next slot to push into, written by the producer
+	uint64_t cachedHead;  //the producer's copy of head
+	char pad1[64-2*sizeof(uint64_t)];
+	uint64_t head;        //next slot to pop from, written by the consumer
+	uint64_t cachedTail;  //the consumer's copy of tail
+	char pad2[64-2*sizeof(uint64_t)];
+	void **slots;
+	uint64_t mask;
+	NTPQueueWaiters waiters;
+};
+
+NTPSPSCQueue *NTPNewSPSCQueue(int capacity) {
+	NTPSPSCQueue *rv;
+
+	if(capacity<1) return NULL;
+	capacity = roundUpPow2(capacity);
+	if(posix_memalign((void**)&rv, 64, sizeof(NTPSPSCQueue))!=0) return NULL;
+	memset(rv, 0, sizeof(NTPSPSCQueue));
+	rv->mask  = capacity-1;
+	rv->slots = malloc(capacity * sizeof(void*));
+	if(rv->slots==NULL) goto ERR;
+	if(!initWaiters(&rv->waiters)) goto ERR;
+	return rv;
+
+ERR:
+	free(rv->slots);
+	free(rv);
+	return NULL;
+}
+
+void NTPFreeSPSCQueue(NTPSPSCQueue **queue) {
+	if(queue==NULL || *queue==NULL) return;
+	destroyWaiters(&(*queue)->waiters);
+	free((*queue)->slots);
+	free(*queue);
+	*queue = NULL;
+}
+
+//How many slots the producer can fill, at most max
+static int spscFree(NTPSPSCQueue *q, uint64_t tail, int max) {
+	uint64_t capacity = q->mask+1;
+	if(tail - q->cachedHead + max > capacity)
+		q->cachedHead = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	if(tail - q->cachedHead + max > capacity)
+		return (int)(capacity - (tail - q->cachedHead));
+	return max;
+}
+
+//How many slots the consumer can take, at most max
+static int spscUsed(NTPSPSCQueue *q, uint64_t head, int max) {
+	if(q->cachedTail - head < (uint64_t)max)
+		q->cachedTail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+	if(q->cachedTail - head < (uint64_t)max)
+		return (int)(q->cachedTail - head);
+	return max;
+}
+
+static int spscPush(NTPSPSCQueue *queue, void **items, int count) {
+	uint64_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+	int i, n = count>0 ? spscFree(queue, tail, count) : 0;
+
+	if(n<=0) return 0;
+	for(i=0;i<n;i++)
+		queue->slots[(tail+i) & queue->mask] = items[i];
+	__atomic_store_n(&queue->tail, tail+n, __ATOMIC_RELEASE);
+	return n;
+}
+
+static int spscPop(NTPSPSCQueue *queue, void **items, int max) {
+	uint64_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+	int i, n = max>0 ? spscUsed(queue, head, max) : 0;
+
+	if(n<=0) return 0;
+	for(i=0;i<n;i++)
+		items[i] = queue->slots[(head+i) & queue->mask];
+	__atomic_store_n(&queue->head, head+n, __ATOMIC_RELEASE);
+	return n;
+}
+
+int NTPSPSCQueuePushMany(NTPSPSCQueue *queue, void **items, int count) {
+	int n = spscPush(queue, items, count);
+	if(n>0) wakeWaiters(&queue->waiters);
+	return n;
+}
+
+int NTPSPSCQueuePopMany(NTPSPSCQueue *queue, void **items, int max) {
+	int n = spscPop(queue, items, max);
+	if(n>0) wakeWaiters(&queue->waiters);
+	return n;
+}
+
+BOOL NTPSPSCQueueTryPush(NTPSPSCQueue *queue, void *item) {
+	return NTPSPSCQueuePushMany(queue, &item, 1)==1;
+}
+
+BOOL NTPSPSCQueueTryPop(NTPSPSCQueue *queue, void **item) {
+	return NTPSPSCQueuePopMany(queue, item, 1)==1;
+}
+
+static BOOL spscPushAttempt(void *queue, void *item) {
+	return spscPush((NTPSPSCQueue*)queue, (void**)item, 1)==1;
+}
+
+static BOOL spscPopAttempt(void *queue, void *item) {
+	return spscPop((NTPSPSCQueue*)queue, (void**)item, 1)==1;
+}
+
+void NTPSPSCQueuePush(NTPSPSCQueue *queue, void *item) {
+	waitUntil(&queue->waiters, spscPushAttempt, queue, &item);
+}
+
+void *NTPSPSCQueuePop(NTPSPSCQueue *queue) {
+	void *item;
+	waitUntil(&queue->waiters, spscPopAttempt, queue, &item);
+	return item;
+}
+
+//---------------- multiple producers, multiple consumers ----------------
+//This is Dmitry Vyukov's bounded MPMC queue. Every slot has a sequence
+//number that says whether it's ready to be pushed into (seq == pos) or
+//popped from (seq == pos+1), for the position that will use it next.
+//Producers and consumers claim positions with a compare and swap.
+typedef struct {
+	uint64_t seq;
+	void *item;
+} NTPQueueCell;
+
+struct NTPMPMCQueue_struct {
+	uint64_t enqueuePos;
+	char pad1[64-sizeof(uint64_t)];
+	uint64_t dequeuePos;
+	char pad2[64-sizeof(uint64_t)];
+	NTPQueueCell *cells;
+	uint64_t mask;
+	NTPQueueWaiters waiters;
+};
+
+NTPMPMCQueue *NTPNewMPMCQueue(int capacity) {
+	NTPMPMCQueue *rv;
+	int i;
+
+	if(capacity<1) return NULL;
+	capacity = roundUpPow2(capacity);
+	if(posix_memalign((void**)&rv, 64, sizeof(NTPMPMCQueue))!=0) return NULL;
+	memset(rv, 0, sizeof(NTPMPMCQueue));
+	rv->mask  = capacity-1;
+	rv->cells = malloc(capacity * sizeof(NTPQueueCell));
+	if(rv->cells==NULL) goto ERR;
+	for(i=0;i<capacity;i++) rv->cells[i].seq = i;
+	if(!initWaiters(&rv->waiters)) goto ERR;
+	return rv;
+
+ERR:
+	free(rv->cells);
+	free(rv);
+	return NULL;
+}
+
+void NTPFreeMPMCQueue(NTPMPMCQueue **queue) {
+	if(queue==NULL || *queue==NULL) return;
+	destroyWaiters(&(*queue)->waiters);
+	free((*queue)->cells);
+	free(*queue);
+	*queue = NULL;
+}
+
+//Claims up to max positions, starting at *pos, whose cells have
+//seq == *pos+i+offset. offset is 0 for pushing, 1 for popping.
+//Once we own a position, nobody else can touch its cell until we
+//bump its seq, so checking them all before the claim is safe.
+static int mpmcClaim(NTPMPMCQueue *q, uint64_t *posVar, int max, int offset,
+                     uint64_t *pos) {
+	int n;
+	int64_t dif = 0;
+
+	if(max<=0) return 0;
+	*pos = __atomic_load_n(posVar, __ATOMIC_RELAXED);
+	for(;;) {
+		for(n=0;n<max;n++) {
+			NTPQueueCell *cell = &q->cells[(*pos+n) & q->mask];
+			dif = (int64_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) -
+			                (*pos+n+offset));
+			if(dif!=0) break;
+		}
+		if(n==0 && dif<0) return 0;  //full, or empty
+		if(n>0 && __atomic_compare_exchange_n(posVar, pos, *pos+n, TRUE,
+		                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			return n;
+		//someone else got there first. The failed compare and swap
+		//already reloaded *pos, otherwise we have to.
+		if(n==0) *pos = __atomic_load_n(posVar, __ATOMIC_RELAXED);
+	}
+}
+
+static int mpmcPush(NTPMPMCQueue *queue, void **items, int count) {
+	uint64_t pos;
+	int i, n = mpmcClaim(queue, &queue->enqueuePos, count, 0, &pos);
+
+	for(i=0;i<n;i++) {
+		NTPQueueCell *cell = &queue->cells[(pos+i) & queue->mask];
+		cell->item = items[i];
+		__atomic_store_n(&cell->seq, pos+i+1, __ATOMIC_RELEASE);
+	}
+	return n;
+}
+
+static int mpmcPop(NTPMPMCQueue *queue, void **items, int max) {
+	uint64_t pos;
+	int i, n = mpmcClaim(queue, &queue->dequeuePos, max, 1, &pos);
+
+	for(i=0;i<n;i++) {
+		NTPQueueCell *cell = &queue->cells[(pos+i) & queue->mask];
+		items[i] = cell->item;
+		__atomic_store_n(&cell->seq, pos+i+queue->mask+1, __ATOMIC_RELEASE);
+	}
+	return n;
+}
+
+int NTPMPMCQueuePushMany(NTPMPMCQueue *queue, void **items, int count) {
+	int n = mpmcPush(queue, items, count);
+	if(n>0) wakeWaiters(&queue->waiters);
+	return n;
+}
+
+int NTPMPMCQueuePopMany(NTPMPMCQueue *queue, void **items, int max) {
+	int n = mpmcPop(queue, items, max);
+	if(n>0) wakeWaiters(&queue->waiters);
+	return n;
+}
+
+BOOL NTPMPMCQueueTryPush(NTPMPMCQueue *queue, void *item) {
+	return NTPMPMCQueuePushMany(queue, &item, 1)==1;
+}
+
+BOOL NTPMPMCQueueTryPop(NTPMPMCQueue *queue, void **item) {
+	return NTPMPMCQueuePopMany(queue, item, 1)==1;
+}
+
+static BOOL mpmcPushAttempt(void *queue, void *item) {
+	return mpmcPush((NTPMPMCQueue*)queue, (void**)item, 1)==1;
+}
+
+static BOOL mpmcPopAttempt(void *queue, void *item) {
+	return mpmcPop((NTPMPMCQueue*)queue, (void**)item, 1)==1;
+}
+
+void NTPMPMCQueuePush(NTPMPMCQueue *queue, void *item) {
+	waitUntil(&queue->waiters, mpmcPushAttempt, queue, &item);
+}
+
+void *NTPMPMCQueuePop(NTPMPMCQueue *queue) {
+	void *item;
+	waitUntil(&queue->waiters, mpmcPopAttempt, queue, &item);
+	return item;
+}
+
+//------------------------------------------------------------------
+// The thread pool. Every worker has its own deque of tasks. A worker
+// pushes and pops at the bottom of its own deque without locking,
+// and when it runs out, it steals from the top of someone else's
+// (this is the Chase-Lev deque). Tasks submitted from outside the
+// pool go into a shared queue with a lock, which workers also check.
+//------------------------------------------------------------------
+#define DEQUE_SIZE   1024  //must be a power of 2
+#define STEAL_ROUNDS 64    //how hard to look for work before sleeping
+
+typedef struct {
+	void (*func)(void *arg);
+	void *arg;
+	NTPTaskGroup *group;
+} NTPTask;
+
+struct NTPTaskGroup_struct {
+	int pending;   //tasks submitted but not finished, atomic
+	pthread_mutex_t mutex;
+	pthread_cond_t  done;
+};
+
+//Each worker's deque gets its own cache lines, so workers
+//don't slow each other down by writing next to each other.
+typedef struct {
+	int64_t top;         //thieves take from here
+	char    pad1[64-sizeof(int64_t)];
+	int64_t bottom;      //the owner pushes and pops here
+	char    pad2[64-sizeof(int64_t)];
+	NTPTask tasks[DEQUE_SIZE];
+	NTPThreadPool *pool;
+	pthread_t thread;
+	uint32_t  seed;      //for picking who to steal from
+} NTPWorker;
+
+struct NTPThreadPool_struct {
+	NTPWorker *workers;
+	int numWorkers;
+
+	//Tasks from outside the pool. A growable ring, protected by 'mutex'.
+	NTPTask *shared;
+	int sharedCap, sharedHead, sharedLen;
+
+	//Workers sleep on 'wake' when there's nothing to do
+	pthread_mutex_t mutex;
+	pthread_cond_t  wake;
+	int sleepers;        //atomic
+	int queued;          //tasks waiting to be run, atomic
+	BOOL shuttingDown;   //atomic
+};
+
+//The worker the current thread is, if it is one
+static __thread NTPWorker *currentWorker = NULL;
+
+//Pushes onto the bottom of our own deque. Returns FALSE if it's full.
+static BOOL dequePush(NTPWorker *w, NTPTask *task) {
+	int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+	int64_t t = __atomic_load_n(&w->top,    __ATOMIC_ACQUIRE);
+	NTPTask *slot;
+
+	if(b - t >= DEQUE_SIZE) return FALSE;
+	slot = &w->tasks[b & (DEQUE_SIZE-1)];
+	__atomic_store_n(&slot->func,  task->func,  __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->arg,   task->arg,   __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->group, task->group, __ATOMIC_RELAXED);
+	__atomic_store_n(&w->bottom, b+1, __ATOMIC_RELEASE);
+	return TRUE;
+}
+
+//Pops from the bottom of our own deque. Returns FALSE if it's empty.
+static BOOL dequePop(NTPWorker *w, NTPTask *task) {
+	int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+	int64_t t;
+	BOOL rv = TRUE;
+
+	__atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+
+	if(t > b) {
+		//it was empty
+		__atomic_store_n(&w->bottom, b+1, __ATOMIC_RELAXED);
+		return FALSE;
+	}
+
+	*task = w->tasks[b & (DEQUE_SIZE-1)];
+	if(t == b) {
+		//this was the last one, so we have to race the thieves for it
+		if(!__atomic_compare_exchange_n(&w->top, &t, t+1, FALSE,
+		                                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			rv = FALSE;
+		__atomic_store_n(&w->bottom, b+1, __ATOMIC_RELAXED);
+	}
+	return rv;
+}
+
+//Takes from the top of someone else's deque. Returns FALSE if it's
+//empty, or another thief beat us to it.
+static BOOL dequeSteal(NTPWorker *w, NTPTask *task) {
+	int64_t t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+	int64_t b;
+	NTPTask *slot;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+	if(t >= b) return FALSE;
+
+	//The owner can't overwrite this slot unless someone takes it
+	//first, in which case our compare and swap fails anyway.
+	slot = &w->tasks[t & (DEQUE_SIZE-1)];
+	task->func  = __atomic_load_n(&slot->func,  __ATOMIC_RELAXED);
+	task->arg   = __atomic_load_n(&slot->arg,   __ATOMIC_RELAXED);
+	task->group = __atomic_load_n(&slot->group, __ATOMIC_RELAXED);
+	return __atomic_compare_exchange_n(&w->top, &t, t+1, FALSE,
+	                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+//Takes a task from the shared queue. Returns FALSE if it's empty.
+static BOOL sharedTake(NTPThreadPool *pool, NTPTask *task) {
+	BOOL rv = FALSE;
+	pthread_mutex_lock(&pool->mutex);
+	if(pool->sharedLen>0) {
+		*task = pool->shared[pool->sharedHead];
+		pool->sharedHead = (pool->sharedHead+1) % pool->sharedCap;
+		pool->sharedLen--;
+		rv = TRUE;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return rv;
+}
+
+static BOOL sharedPush(NTPThreadPool *pool, NTPTask *task) {
+	pthread_mutex_lock(&pool->mutex);
+	if(pool->sharedLen==pool->sharedCap) {
+		//full, so double it, straightening out the ring as we go
+		int i, newCap = pool->sharedCap*2;
+		NTPTask *bigger = malloc(newCap * sizeof(NTPTask));
+		if(bigger==NULL) {
+			pthread_mutex_unlock(&pool->mutex);
+			return FALSE;
+		}
+		for(i=0;i<pool->sharedLen;i++)
+			bigger[i] = pool->shared[(pool->sharedHead+i) % pool->sharedCap];
+		free(pool->shared);
+		pool->shared     = bigger;
+		pool->sharedCap  = newCap;
+		pool->sharedHead = 0;
+	}
+	pool->shared[(pool->sharedHead+pool->sharedLen) % pool->sharedCap] = *task;
+	pool->sharedLen++;
+	pthread_mutex_unlock(&pool->mutex);
+	return TRUE;
+}
+
+//Finds something to do: our own deque first, then the shared queue,
+//then other workers' deques. Returns FALSE if there's nothing.
+static BOOL findTask(NTPWorker *w, NTPTask *task) {
+	NTPThreadPool *pool = w->pool;
+	int i, start;
+
+	if(dequePop(w, task)) return TRUE;
+	if(__atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE)==0) return FALSE;
+	if(sharedTake(pool, task)) return TRUE;
+
+	//start somewhere random, so thieves spread out
+	w->seed ^= w->seed << 13;
+	w->seed ^= w->seed >> 17;
+	w->seed ^= w->seed << 5;
+	start = w->seed % pool->numWorkers;
+	for(i=0;i<pool->numWorkers;i++) {
+		NTPWorker *victim = &pool->workers[(start+i) % pool->numWorkers];
+		if(victim!=w && dequeSteal(victim, task)) return TRUE;
+	}
+	return FALSE;
+}
+
+//The last task in a group finishes while holding the group's lock, so
+//that a waiter can't see it finished and free the group while we're
+//still using it.
+static void finishGroupTask(NTPTaskGroup *group) {
+	int pending = __atomic_load_n(&group->pending, __ATOMIC_RELAXED);
+	while(pending>1) {
+		if(__atomic_compare_exchange_n(&group->pending, &pending, pending-1,
+		             FALSE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			return;
+	}
+
+	pthread_mutex_lock(&group->mutex);
+	if(__atomic_sub_fetch(&group->pending, 1, __ATOMIC_ACQ_REL)==0)
+		pthread_cond_broadcast(&group->done);
+	pthread_mutex_unlock(&group->mutex);
+}
+
+static void runTask(NTPThreadPool *pool, NTPTask *task) {
+	NTPTaskGroup *group = task->group;
+
+	__atomic_sub_fetch(&pool->queued, 1, __ATOMIC_RELEASE);
+	task->func(task->arg);
+
+	if(group!=NULL) finishGroupTask(group);
+}
+
+static void *workerThread(void *arg) {
+	NTPWorker *w = (NTPWorker*)arg;
+	NTPThreadPool *pool = w->pool;
+	NTPTask task;
+	int rounds, maxRounds = shouldSpin() ? STEAL_ROUNDS : 1;
+
+	currentWorker = w;
+	for(;;) {
+		for(rounds=0;rounds<maxRounds;rounds++) {
+			if(findTask(w, &task)) break;
+		}
+		if(rounds<maxRounds) {
+			runTask(pool, &task);
+			continue;
+		}
+
+		//Nothing to do, so go to sleep. We say we're sleeping before
+		//checking for work one last time, and submitters add work
+		//before checking for sleepers, so one of us always notices.
+		pthread_mutex_lock(&pool->mutex);
+		__atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST)==0) {
+			if(__atomic_load_n(&pool->shuttingDown, __ATOMIC_SEQ_CST)) {
+				__atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+				pthread_mutex_unlock(&pool->mutex);
+				break;
+			}
+			pthread_cond_wait(&pool->wake, &pool->mutex);
+		}
+		__atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&pool->mutex);
+	}
+
+	currentWorker = NULL;
+	return NULL;
+}
+
+NTPThreadPool *NTPNewThreadPool(int numThreads) {
+	NTPThreadPool *rv;
+	int i;
+
+	if(numThreads<=0) numThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if(numThreads<=0) numThreads = 1;
+
+	rv = malloc(sizeof(NTPThreadPool));
+	if(rv==NULL) return NULL;
+	memset(rv, 0, sizeof(NTPThreadPool));
+
+	rv->sharedCap = 64;
+	rv->shared  = malloc(rv->sharedCap * sizeof(NTPTask));
+	if(posix_memalign((void**)&rv->workers, 64,
+	                  numThreads*sizeof(NTPWorker))!=0)
+		rv->workers = NULL;
+	if(rv->shared==NULL || rv->workers==NULL) goto ERR;
+	memset(rv->workers, 0, numThreads*sizeof(NTPWorker));
+
+	pthread_mutex_init(&rv->mutex, NULL);
+	pthread_cond_init(&rv->wake, NULL);
+
+	for(i=0;i<numThreads;i++) {
+		rv->workers[i].pool = rv;
+		rv->workers[i].seed = 2463534242u + i*7919u;
+		if(pthread_create(&rv->workers[i].thread, NULL, workerThread,
+		                  &rv->workers[i])!=0)
+			break;
+	}
+	rv->numWorkers = i;
+	if(i<numThreads) {
+		//shut down the ones that did start
+		NTPFreeThreadPool(&rv);
+		return NULL;
+	}
+	return rv;
+
+ERR:
+	free(rv->shared);
+	free(rv->workers);
+	free(rv);
+	return NULL;
+}
+
+void NTPFreeThreadPool(NTPThreadPool **pool) {
+	int i;
+	if(pool==NULL || *pool==NULL) return;
+
+	pthread_mutex_lock(&(*pool)->mutex);
+	__atomic_store_n(&(*pool)->shuttingDown, TRUE, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&(*pool)->wake);
+	pthread_mutex_unlock(&(*pool)->mutex);
+
+	for(i=0;i<(*pool)->numWorkers;i++)
+		pthread_join((*pool)->workers[i].thread, NULL);
+
+	pthread_mutex_destroy(&(*pool)->mutex);
+	pthread_cond_destroy(&(*pool)->wake);
+	free((*pool)->shared);
+	free((*pool)->workers);
+	free(*pool);
+	*pool = NULL;
+}
+
+BOOL NTPSubmitTask(NTPThreadPool *pool, void (*func)(void *arg), void *arg,
+                   NTPTaskGroup *group) {
+	NTPTask task;
+	BOOL ok;
+
+	task.func  = func;
+	task.arg   = arg;
+	task.group = group;
+
+	if(group!=NULL) __atomic_add_fetch(&group->pending, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+
+	//From inside the pool, our own deque is fastest
+	if(currentWorker!=NULL && currentWorker->pool==pool &&
+	   dequePush(currentWorker, &task))
+		ok = TRUE;
+	else
+		ok = sharedPush(pool, &task);
+
+	if(!ok) {
+		__atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+		if(group!=NULL) __atomic_sub_fetch(&group->pending, 1, __ATOMIC_RELAXED);
+		return FALSE;
+	}
+
+	if(__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST)>0) {
+		pthread_mutex_lock(&pool->mutex);
+		pthread_cond_signal(&pool->wake);
+		pthread_mutex_unlock(&pool->mutex);
+	}
+	return TRUE;
+}
+
+NTPTaskGroup *NTPNewTaskGroup() {
+	NTPTaskGroup *rv = malloc(sizeof(NTPTaskGroup));
+	if(rv==NULL) return NULL;
+	rv->pending = 0;
+	pthread_mutex_init(&rv->mutex, NULL);
+	pthread_cond_init(&rv->done, NULL);
+	return rv;
+}
+
+void NTPFreeTaskGroup(NTPTaskGroup **group) {
+	if(group==NULL || *group==NULL) return;
+	pthread_mutex_destroy(&(*group)->mutex);
+	pthread_cond_destroy(&(*group)->done);
+	free(*group);
+	*group = NULL;
+}
+
+void NTPWaitTaskGroup(NTPTaskGroup *group) {
+	NTPTask task;
+
+	//A worker can't just sleep, or a pool full of waiting workers
+	//would never get anything done. So it helps out instead.
+	if(currentWorker!=NULL) {
+		while(__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE)>0) {
+			if(findTask(currentWorker, &task))
+				runTask(currentWorker->pool, &task);
+			else
+				sched_yield();
+		}
+		//wait for whoever finished the last task to let go of the group
+		pthread_mutex_lock(&group->mutex);
+		pthread_mutex_unlock(&group->mutex);
+		return;
+	}
+
+	pthread_mutex_lock(&group->mutex);
+	while(__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE)>0)
+		pthread_cond_wait(&group->done, &group->mutex);
+	pthread_mutex_unlock(&group->mutex);
 }
 
 #endif
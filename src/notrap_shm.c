@@ -0,0 +1,491 @@
+/******************************************************************
+ * notrap_shm.c                                                   *
+ * Shared memory channels. Messages go through a ring in memory   *
+ * that both processes have mapped, so sending one is a copy and  *
+ * a couple of atomic operations. The kernel only gets involved   *
+ * to wake the consumer when it has gone to sleep.                *
+ ******************************************************************/
+
+//memfd_create() needs this on Linux. It has to come before any system header.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <notrap/notrap.h>
+#ifdef NTP_POSIX_SOCKETS
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef NTP_LIN
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+
+#define SHM_MAGIC   0x4e545053  //"NTPS"
+#define SHM_VERSION 1
+
+//The header gets a page to itself, then the ring starts
+#define SHM_HEADER_SIZE 4096
+#define SHM_MIN_RING    4096
+
+//Every message starts with a header word: the length in the low 32
+//bits and these flags in the high 32. A zero word means nothing has
+//been written there yet, which is why the consumer zeroes everything
+//it's done with.
+#define RECORD_COMMITTED 1  //it's all written
+#define RECORD_PAD       2  //skip to the start of the ring
+#define RECORD_HEADER    8
+#define RECORD_ALIGN(n)  (((n) + 7) & ~(uint64_t)7)
+
+//This is what lives in the shared memory, so it's the same for every
+//process that maps it. Each counter is on its own cache line, so the
+//producers and the consumer don't slow each other down.
+struct NTPShmHeader {
+	NTPAtomicInt magic;   //written last, so an opener knows it's ready
+	uint32_t version;
+	uint32_t type;
+	uint32_t unused;
+	uint64_t capacity;    //bytes in the ring, a power of 2
+	char pad0[64-sizeof(NTPAtomicInt)-3*sizeof(uint32_t)-sizeof(uint64_t)];
+
+	NTPAtomicInt64 head;  //where the next message will go
+	char pad1[64-sizeof(NTPAtomicInt64)];
+
+	NTPAtomicInt64 tail;  //the next message the consumer reads
+	char pad2[64-sizeof(NTPAtomicInt64)];
+
+	NTPAtomicInt waiting; //the consumer is asleep, or about to be
+	char pad3[64-sizeof(NTPAtomicInt)];
+};
+
+struct NTPShmChannel_struct {
+	struct NTPShmHeader *header;
+	char *ring;
+	uint64_t capacity;
+	size_t mapSize;
+
+	//The consumer sleeps on notifyRead, and a producer that sees it
+	//waiting writes to notifyWrite. It's a FIFO next to the file for
+	//a named channel, which anyone can open; an eventfd (or a pipe)
+	//for an anonymous one, which is shared by fork().
+	int notifyRead;
+	int notifyWrite;
+	BOOL isEventFD;
+
+	//The channel's file, kept open with a shared flock() on it for as
+	//long as we use the channel, so a new creator can tell if anyone
+	//still is. -1 for an anonymous channel.
+	int lockFD;
+
+	//For a creator, the names to remove when it's freed
+	char *path;
+	char *fifoPath;
+
+	NTPSock *sock;  //made the first time someone asks
+};
+
+static char *fifoName(const char *name) {
+	char *rv = malloc(strlen(name) + sizeof(".notify"));
+	if(rv!=NULL) sprintf(rv, "%s.notify", name);
+	return rv;
+}
+
+static uint64_t ringSize(int capacity) {
+	uint64_t rv = SHM_MIN_RING;
+	while(rv<(uint64_t)capacity) rv <<= 1;
+	return rv;
+}
+
+//Maps fd, and fills in the channel's pointers. Returns FALSE if it
+//couldn't.
+static BOOL mapChannel(NTPShmChannel *ch, int fd, size_t size) {
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(mem==MAP_FAILED) return FALSE;
+	ch->header  = (struct NTPShmHeader*)mem;
+	ch->ring    = (char*)mem + SHM_HEADER_SIZE;
+	ch->mapSize = size;
+	return TRUE;
+}
+
+static NTPShmChannel *allocChannel() {
+	NTPShmChannel *rv = malloc(sizeof(NTPShmChannel));
+	if(rv==NULL) return NULL;
+	memset(rv, 0, sizeof(NTPShmChannel));
+	rv->notifyRead  = -1;
+	rv->notifyWrite = -1;
+	rv->lockFD      = -1;
+	return rv;
+}
+
+//Makes an fd for the anonymous ring. Linux has memfd, elsewhere we
+//make a file and remove it right away.
+static int anonymousFD() {
+#if defined(NTP_LIN) && defined(SYS_memfd_create)
+	return syscall(SYS_memfd_create, "NTPShmChannel", 0);
+#else
+	char path[] = "/tmp/NTPShmChannelXXXXXX";
+	int fd = mkstemp(path);
+	if(fd>=0) unlink(path);
+	return fd;
+#endif
+}
+
+//The eventfd or pipe for an anonymous channel
+static BOOL anonymousNotify(NTPShmChannel *ch) {
+	int fds[2];
+#ifdef NTP_LIN
+	if((ch->notifyRead = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))>=0) {
+		ch->notifyWrite = ch->notifyRead;
+		ch->isEventFD   = TRUE;
+		return TRUE;
+	}
+#endif
+	if(pipe(fds)<0) return FALSE;
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	ch->notifyRead  = fds[0];
+	ch->notifyWrite = fds[1];
+	return TRUE;
+}
+
+//Opens the FIFO. Read-write, so opening never blocks waiting for the
+//other end, and it never looks closed.
+static BOOL openFIFO(NTPShmChannel *ch, const char *fifoPath) {
+	int fd = open(fifoPath, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if(fd<0) return FALSE;
+	ch->notifyRead  = fd;
+	ch->notifyWrite = fd;
+	return TRUE;
+}
+
+//Removes the file at path if it's a channel that nobody has open
+//anymore, left behind by a creator that didn't free it. Anything else
+//there, we leave alone. Returns TRUE if it was removed.
+static BOOL removeStaleChannel(const char *path) {
+	uint32_t magic = 0;
+	struct stat st;
+	BOOL stale = FALSE;
+	int fd;
+
+	if((fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW))<0) return FALSE;
+	if(fstat(fd, &st)==0 && S_ISREG(st.st_mode) &&
+	   st.st_size>=SHM_HEADER_SIZE+SHM_MIN_RING &&
+	   pread(fd, &magic, sizeof(magic), 0)==sizeof(magic) && magic==SHM_MAGIC &&
+	   flock(fd, LOCK_EX | LOCK_NB)==0) {
+		//Still holding the lock, so nobody can start using it first
+		stale = unlink(path)==0;
+	}
+	close(fd);
+	return stale;
+}
+
+//Makes the FIFO for a new channel. One can be left over from a stale
+//channel, which is replaced; anything else with that name isn't.
+static BOOL makeFIFO(const char *fifoPath) {
+	struct stat st;
+
+	if(mkfifo(fifoPath, 0600)==0) return TRUE;
+	if(errno!=EEXIST || lstat(fifoPath, &st)<0 || !S_ISFIFO(st.st_mode))
+		return FALSE;
+	unlink(fifoPath);
+	return mkfifo(fifoPath, 0600)==0;
+}
+
+//Creates the file for a named channel, replacing a stale one. Returns
+//the fd, locked, or -1.
+static int createChannelFile(const char *name) {
+	int fd = open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+
+	if(fd<0 && errno==EEXIST && removeStaleChannel(name))
+		fd = open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if(fd>=0 && flock(fd, LOCK_SH | LOCK_NB)<0) {
+		close(fd);
+		unlink(name);
+		fd = -1;
+	}
+	return fd;
+}
+
+NTPShmChannel *NTPNewShmChannel(const char *name, int capacity, int type) {
+	NTPShmChannel *rv;
+	struct NTPShmHeader *h;
+	uint64_t ringBytes = ringSize(capacity);
+	size_t size = SHM_HEADER_SIZE + ringBytes;
+	int fd = -1;
+
+	if(type!=NTPSHM_SPSC && type!=NTPSHM_MPSC) return NULL;
+	if((rv = allocChannel())==NULL) return NULL;
+
+	if(name==NULL) {
+		fd = anonymousFD();
+		if(fd<0 || !anonymousNotify(rv)) goto ERR;
+	} else {
+		//Only remember the names once they're ours, since freeing the
+		//channel removes them
+		char *fifoPath = fifoName(name);
+		if(fifoPath==NULL) goto ERR;
+		if((rv->lockFD = createChannelFile(name))<0) {
+			free(fifoPath);
+			goto ERR;
+		}
+		if((rv->path = strdup(name))==NULL) {
+			unlink(name);
+			free(fifoPath);
+			goto ERR;
+		}
+		if(!makeFIFO(fifoPath)) {
+			free(fifoPath);
+			goto ERR;
+		}
+		rv->fifoPath = fifoPath;
+		if(!openFIFO(rv, rv->fifoPath)) goto ERR;
+		fd = rv->lockFD;
+	}
+
+	//ftruncate() fills it with zeros, which is what the ring needs
+	if(ftruncate(fd, size)<0 || !mapChannel(rv, fd, size)) goto ERR;
+	if(fd!=rv->lockFD) close(fd);
+	fd = -1;
+
+	h = rv->header;
+	h->version  = SHM_VERSION;
+	h->type     = type;
+	h->capacity = ringBytes;
+	NTPAtomicStoreInt64(&h->head, 0, NTP_ORDER_RELAXED);
+	NTPAtomicStoreInt64(&h->tail, 0, NTP_ORDER_RELAXED);
+	NTPAtomicStoreInt(&h->waiting, 0, NTP_ORDER_RELAXED);
+	rv->capacity = ringBytes;
+	NTPAtomicStoreInt(&h->magic, SHM_MAGIC, NTP_ORDER_RELEASE);
+	return rv;
+
+ERR:
+	if(fd>=0 && fd!=rv->lockFD) close(fd);
+	NTPFreeShmChannel(&rv);
+	return NULL;
+}
+
+NTPShmChannel *NTPOpenShmChannel(const char *name) {
+	NTPShmChannel *rv;
+	struct stat st, named;
+	char *fifoPath = NULL;
+	int fd;
+
+	if((rv = allocChannel())==NULL) return NULL;
+	if((fd = rv->lockFD = open(name, O_RDWR | O_CLOEXEC))<0) goto ERR;
+
+	//Our lock tells a new creator we're still using it. If a creator
+	//is busy replacing it, or already has, this isn't the channel.
+	if(flock(fd, LOCK_SH | LOCK_NB)<0 || fstat(fd, &st)<0 ||
+	   stat(name, &named)<0 || st.st_ino!=named.st_ino || st.st_dev!=named.st_dev)
+		goto ERR;
+	if(st.st_size<SHM_HEADER_SIZE+SHM_MIN_RING || !mapChannel(rv, fd, st.st_size))
+		goto ERR;
+
+	if(NTPAtomicLoadInt(&rv->header->magic, NTP_ORDER_ACQUIRE)!=SHM_MAGIC ||
+	   rv->header->version!=SHM_VERSION ||
+	   (rv->header->capacity & (rv->header->capacity-1))!=0 ||
+	   rv->header->capacity+SHM_HEADER_SIZE!=(uint64_t)st.st_size)
+		goto ERR;
+	rv->capacity = rv->header->capacity;
+
+	if((fifoPath = fifoName(name))==NULL || !openFIFO(rv, fifoPath)) goto ERR;
+	free(fifoPath);
+	return rv;
+
+ERR:
+	free(fifoPath);
+	NTPFreeShmChannel(&rv);
+	return NULL;
+}
+
+void NTPFreeShmChannel(NTPShmChannel **channel) {
+	NTPShmChannel *ch;
+	if(channel==NULL || *channel==NULL) return;
+	ch = *channel;
+
+	NTPDisconnect(&ch->sock);
+	if(ch->header!=NULL) munmap(ch->header, ch->mapSize);
+	if(ch->notifyRead>=0) close(ch->notifyRead);
+	if(ch->notifyWrite>=0 && ch->notifyWrite!=ch->notifyRead)
+		close(ch->notifyWrite);
+	if(ch->path!=NULL)     unlink(ch->path);
+	if(ch->lockFD>=0)      close(ch->lockFD);
+	if(ch->fifoPath!=NULL) unlink(ch->fifoPath);
+	free(ch->path);
+	free(ch->fifoPath);
+	free(ch);
+	*channel = NULL;
+}
+
+int NTPShmMaxMessage(NTPShmChannel *channel) {
+	return (int)(channel->capacity/2) - RECORD_HEADER;
+}
+
+//The header word at a position in the ring
+static NTPAtomicInt64 *recordAt(NTPShmChannel *ch, uint64_t pos) {
+	return (NTPAtomicInt64*)(ch->ring + (pos & (ch->capacity-1)));
+}
+
+static void wakeConsumer(NTPShmChannel *ch) {
+	uint64_t one = 1;
+
+	//Pairs with the fence in armWait(): either we see it waiting, or it
+	//sees our message when it checks again
+	NTPAtomicFence(NTP_ORDER_SEQ_CST);
+	if(NTPAtomicLoadInt(&ch->header->waiting, NTP_ORDER_RELAXED)==0) return;
+	if(NTPAtomicExchangeInt(&ch->header->waiting, 0, NTP_ORDER_ACQ_REL)==0) return;
+
+	//If it's full, there's already a wakeup in it
+	if(write(ch->notifyWrite, &one, ch->isEventFD ? sizeof(one) : 1)<0) {}
+}
+
+BOOL NTPShmTrySend(NTPShmChannel *channel, const void *msg, int len) {
+	struct NTPShmHeader *h = channel->header;
+	uint64_t need, pad, pos, off, tail;
+	char *dest;
+
+	if(len<=0 || len>NTPShmMaxMessage(channel)) return FALSE;
+	need = RECORD_ALIGN(RECORD_HEADER + len);
+
+	do {
+		pos  = NTPAtomicLoadInt64(&h->head, NTP_ORDER_RELAXED);
+		off  = pos & (channel->capacity-1);
+		pad  = off+need > channel->capacity ? channel->capacity-off : 0;
+		tail = NTPAtomicLoadInt64(&h->tail, NTP_ORDER_ACQUIRE);
+		if(pos + pad + need - tail > channel->capacity) return FALSE;  //full
+
+		//With one producer, nobody else moves head
+		if(h->type==NTPSHM_SPSC) {
+			NTPAtomicStoreInt64(&h->head, pos+pad+need, NTP_ORDER_RELAXED);
+			break;
+		}
+	} while(!NTPAtomicCompareExchangeInt64(&h->head, (int64_t*)&pos,
+	                                       pos+pad+need, NTP_ORDER_RELAXED));
+
+	//The space is ours now. Fill it in, then commit the header, which
+	//is what the consumer looks at.
+	if(pad>0) {
+		NTPAtomicStoreInt64(recordAt(channel, pos),
+		    ((int64_t)(RECORD_COMMITTED|RECORD_PAD)<<32) | (pad-RECORD_HEADER),
+		    NTP_ORDER_RELEASE);
+		pos += pad;
+	}
+	dest = (char*)recordAt(channel, pos);
+	memcpy(dest + RECORD_HEADER, msg, len);
+	NTPAtomicStoreInt64(recordAt(channel, pos),
+	                    ((int64_t)RECORD_COMMITTED<<32) | (uint32_t)len,
+	                    NTP_ORDER_RELEASE);
+
+	wakeConsumer(channel);
+	return TRUE;
+}
+
+BOOL NTPShmSend(NTPShmChannel *channel, const void *msg, int len) {
+	struct timespec nap = {0, 50000};
+	int tries = 0;
+
+	if(len<=0 || len>NTPShmMaxMessage(channel)) return FALSE;
+
+	//Nothing tells us when the consumer makes room, so back off: yield
+	//for a while, then take short naps
+	while(!NTPShmTrySend(channel, msg, len)) {
+		if(++tries<100) sched_yield();
+		else nanosleep(&nap, NULL);
+	}
+	return TRUE;
+}
+
+//Takes the next message, if there is one. Returns its length, 0 if
+//there isn't one, or -1 if it doesn't fit in max.
+static int takeMessage(NTPShmChannel *ch, void *buf, int max) {
+	struct NTPShmHeader *h = ch->header;
+	uint64_t pos = NTPAtomicLoadInt64(&h->tail, NTP_ORDER_RELAXED);
+	uint64_t word, len, size;
+	char *rec;
+
+	while(1) {
+		word = NTPAtomicLoadInt64(recordAt(ch, pos), NTP_ORDER_ACQUIRE);
+		if(((word>>32) & RECORD_COMMITTED)==0) return 0;
+
+		len  = word & 0xffffffff;
+		size = RECORD_ALIGN(RECORD_HEADER + len);
+		rec  = (char*)recordAt(ch, pos);
+		if(((word>>32) & RECORD_PAD)==0) break;
+
+		//Padding at the end of the ring; the message is at the start
+		memset(rec, 0, size);
+		pos += size;
+		NTPAtomicStoreInt64(&h->tail, pos, NTP_ORDER_RELEASE);
+	}
+
+	if((int)len>max) return -1;
+	memcpy(buf, rec + RECORD_HEADER, len);
+
+	//Leave it all zeros for the next time around, then give it back
+	memset(rec, 0, size);
+	NTPAtomicStoreInt64(&h->tail, pos+size, NTP_ORDER_RELEASE);
+	return (int)len;
+}
+
+//Empties the notify fd, so it only becomes readable for a new wakeup
+static void drainNotify(NTPShmChannel *ch) {
+	char junk[64];
+	while(read(ch->notifyRead, junk, sizeof(junk))>0) {}
+}
+
+//Tells producers we're going to sleep. Returns what takeMessage() did
+//when it looked again afterwards, so a message that came in just
+//before isn't missed.
+static int armWait(NTPShmChannel *ch, void *buf, int max) {
+	int n;
+
+	drainNotify(ch);
+	NTPAtomicStoreInt(&ch->header->waiting, 1, NTP_ORDER_RELAXED);
+	NTPAtomicFence(NTP_ORDER_SEQ_CST);
+	if((n = takeMessage(ch, buf, max))!=0)
+		NTPAtomicStoreInt(&ch->header->waiting, 0, NTP_ORDER_RELAXED);
+	return n;
+}
+
+int NTPShmRecv(NTPShmChannel *channel, void *buf, int max, int timeoutMS) {
+	struct pollfd pfd;
+	int64_t deadline = 0, left;
+	int n;
+
+	if(timeoutMS>0) deadline = NTPMonotonicMillis() + timeoutMS;
+	while(1) {
+		if((n = takeMessage(channel, buf, max))!=0) return n;
+		if((n = armWait(channel, buf, max))!=0) return n;
+		if(timeoutMS==0) return 0;
+
+		left = -1;
+		if(timeoutMS>0 && (left = deadline - NTPMonotonicMillis())<=0) return 0;
+		pfd.fd     = channel->notifyRead;
+		pfd.events = POLLIN;
+		if(poll(&pfd, 1, (int)left)<0 && errno!=EINTR) return 0;
+	}
+}
+
+NTPSock *NTPShmChannelSock(NTPShmChannel *channel) {
+	int fd;
+	if(channel->sock!=NULL) return channel->sock;
+	if((fd = dup(channel->notifyRead))<0) return NULL;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	if((channel->sock = NTPSockFromFD(fd))==NULL) close(fd);
+	return channel->sock;
+}
+
+#endif
@@ -0,0 +1,289 @@
+#include <notrap/notrap.h>
+#include <stdlib.h>
+#include <time.h>
+
+//------------------------------------------------------------------
+// Clocks. clock_gettime() on these clocks is handled in the vDSO on
+// Linux, so it's a few nanoseconds and no system call.
+//------------------------------------------------------------------
+
+//Updated once a tick by the kernel, so it's even cheaper to read
+#ifdef CLOCK_MONOTONIC_COARSE
+#define NTP_COARSE_CLOCK CLOCK_MONOTONIC_COARSE
+#else
+#define NTP_COARSE_CLOCK CLOCK_MONOTONIC
+#endif
+
+time_t NTPcurrentTimeMillis() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (time_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+int64_t NTPMonotonicNanos() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+int64_t NTPMonotonicMillis() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+int64_t NTPCoarseMillis() {
+	struct timespec ts;
+	clock_gettime(NTP_COARSE_CLOCK, &ts);
+	return (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+//------------------------------------------------------------------
+// The timer wheel. This is the classic hierarchical wheel: the first
+// level has a slot for each of the next 256 ticks, and each level
+// after that has 64 slots, each covering a whole turn of the level
+// below it. A timer goes in the slot for its expiry at the lowest
+// level that reaches that far. Every time the first level wraps
+// around, the next slot of the level above is emptied back into the
+// wheel, which moves those timers down to where they belong.
+// Each slot is a circular list with the slot's head as the sentinel,
+// so starting and stopping a timer is a few pointer moves.
+//------------------------------------------------------------------
+
+#define WHEEL_BITS0  8
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS0 (1<<WHEEL_BITS0)
+#define WHEEL_SLOTS  (1<<WHEEL_BITS)
+#define WHEEL_LEVELS 4  //above the first one
+
+//The furthest ahead a timer can be, in ticks. Later ones wait here.
+#define WHEEL_MAX_TICKS ((1ull<<(WHEEL_BITS0 + WHEEL_LEVELS*WHEEL_BITS)) - 1)
+
+struct NTPTimerWheel_struct {
+	int tickMS;
+	int64_t start;     //NTPMonotonicMillis() when made
+	uint64_t current;  //the next tick to run
+	int pending;
+	NTPTimer first[WHEEL_SLOTS0];
+	NTPTimer levels[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+static void initSlot(NTPTimer *slot) {
+	slot->next = slot;
+	slot->prev = slot;
+}
+
+static void unlinkTimer(NTPTimer *timer) {
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = NULL;
+	timer->prev = NULL;
+}
+
+static void linkTimer(NTPTimer *slot, NTPTimer *timer) {
+	timer->prev = slot->prev;
+	timer->next = slot;
+	slot->prev->next = timer;
+	slot->prev = timer;
+}
+
+//Puts the timer in the right slot for its expiry
+static void placeTimer(NTPTimerWheel *wheel, NTPTimer *timer) {
+	uint64_t expires = timer->expires;
+	uint64_t delta;
+	int level, shift;
+
+	if(expires < wheel->current) expires = wheel->current;
+	delta = expires - wheel->current;
+	if(delta < WHEEL_SLOTS0) {
+		linkTimer(&wheel->first[expires & (WHEEL_SLOTS0-1)], timer);
+		return;
+	}
+
+	if(delta > WHEEL_MAX_TICKS) {
+		expires = wheel->current + WHEEL_MAX_TICKS;
+		delta = WHEEL_MAX_TICKS;
+	}
+	shift = WHEEL_BITS0;
+	for(level=0;level<WHEEL_LEVELS-1;level++) {
+		if(delta < (1ull<<(shift + WHEEL_BITS))) break;
+		shift += WHEEL_BITS;
+	}
+	linkTimer(&wheel->levels[level][(expires>>shift) & (WHEEL_SLOTS-1)], timer);
+}
+
+//Empties a slot of a higher level back into the wheel. Returns the
+//slot's index, so the caller knows if this level wrapped too.
+static int cascade(NTPTimerWheel *wheel, int level) {
+	int shift = WHEEL_BITS0 + level*WHEEL_BITS;
+	int index = (wheel->current>>shift) & (WHEEL_SLOTS-1);
+	NTPTimer *slot = &wheel->levels[level][index];
+	NTPTimer list, *timer;
+
+	if(slot->next==slot) return index;
+
+	//Move them to our own list first, since placing them again could
+	//put them right back in this slot
+	list.next = slot->next;
+	list.prev = slot->prev;
+	list.next->prev = &list;
+	list.prev->next = &list;
+	initSlot(slot);
+
+	while((timer = list.next)!=&list) {
+		unlinkTimer(timer);
+		placeTimer(wheel, timer);
+	}
+	return index;
+}
+
+NTPTimerWheel *NTPNewTimerWheel(int tickMS) {
+	NTPTimerWheel *rv = malloc(sizeof(NTPTimerWheel));
+	int i, level;
+
+	if(rv==NULL) return NULL;
+	rv->tickMS  = tickMS<=0 ? 1 : tickMS;
+	rv->start   = NTPMonotonicMillis();
+	rv->current = 0;
+	rv->pending = 0;
+	for(i=0;i<WHEEL_SLOTS0;i++) initSlot(&rv->first[i]);
+	for(level=0;level<WHEEL_LEVELS;level++)
+		for(i=0;i<WHEEL_SLOTS;i++) initSlot(&rv->levels[level][i]);
+	return rv;
+}
+
+void NTPFreeTimerWheel(NTPTimerWheel **wheel) {
+	NTPTimer *slot, *timer;
+	int i;
+
+	if(wheel==NULL || *wheel==NULL) return;
+
+	//Leave the timers looking stopped, since they belong to the caller
+	for(i=0;i<WHEEL_SLOTS0 + WHEEL_LEVELS*WHEEL_SLOTS;i++) {
+		slot = i<WHEEL_SLOTS0 ? &(*wheel)->first[i]
+		     : &(*wheel)->levels[(i-WHEEL_SLOTS0)/WHEEL_SLOTS]
+		                        [(i-WHEEL_SLOTS0)%WHEEL_SLOTS];
+		while((timer = slot->next)!=slot) {
+			unlinkTimer(timer);
+			timer->wheel = NULL;
+		}
+	}
+	free(*wheel);
+	*wheel = NULL;
+}
+
+void NTPInitTimer(NTPTimer *timer, NTPTimerFunc func, void *arg) {
+	timer->next    = NULL;
+	timer->prev    = NULL;
+	timer->wheel   = NULL;
+	timer->expires = 0;
+	timer->func    = func;
+	timer->arg     = arg;
+}
+
+//The tick that's running at time now
+static uint64_t tickAt(NTPTimerWheel *wheel, int64_t now) {
+	if(now<=wheel->start) return 0;
+	return (uint64_t)(now - wheel->start) / wheel->tickMS;
+}
+
+void NTPStartTimer(NTPTimerWheel *wheel, NTPTimer *timer, int64_t delayMS) {
+	int64_t since;
+
+	NTPStopTimer(timer);
+	if(delayMS<0) delayMS = 0;
+
+	//Round up, so it never goes off early
+	since = NTPMonotonicMillis() - wheel->start;
+	if(since<0) since = 0;
+	timer->expires = (uint64_t)(since + delayMS + wheel->tickMS-1) / wheel->tickMS;
+	timer->wheel   = wheel;
+	placeTimer(wheel, timer);
+	wheel->pending++;
+}
+
+void NTPStopTimer(NTPTimer *timer) {
+	if(timer->wheel==NULL) return;
+	unlinkTimer(timer);
+	timer->wheel->pending--;
+	timer->wheel = NULL;
+}
+
+BOOL NTPTimerPending(NTPTimer *timer) {
+	return timer->wheel!=NULL;
+}
+
+int NTPTimersPending(NTPTimerWheel *wheel) {
+	return wheel->pending;
+}
+
+int NTPRunTimers(NTPTimerWheel *wheel) {
+	uint64_t target = tickAt(wheel, NTPMonotonicMillis());
+	NTPTimer list, *slot, *timer;
+	int fired = 0, level, index;
+
+	while(wheel->current<=target) {
+		//Nothing to do, so skip ahead. The levels are all empty, so
+		//there's nothing to cascade either.
+		if(wheel->pending==0) {
+			wheel->current = target+1;
+			break;
+		}
+
+		index = wheel->current & (WHEEL_SLOTS0-1);
+		if(index==0) {
+			for(level=0;level<WHEEL_LEVELS;level++)
+				if(cascade(wheel, level)!=0) break;
+		}
+
+		slot = &wheel->first[index];
+		wheel->current++;
+		if(slot->next==slot) continue;
+
+		//A timer function can start or stop any timer, including ones
+		//in this slot, so take the whole slot first
+		list.next = slot->next;
+		list.prev = slot->prev;
+		list.next->prev = &list;
+		list.prev->next = &list;
+		initSlot(slot);
+
+		while((timer = list.next)!=&list) {
+			unlinkTimer(timer);
+			timer->wheel = NULL;
+			wheel->pending--;
+			fired++;
+			timer->func(timer, timer->arg);
+		}
+	}
+	return fired;
+}
+
+int NTPTimerWheelTimeout(NTPTimerWheel *wheel) {
+	uint64_t now, tick;
+	NTPTimer *slot;
+	int64_t ms;
+	int i;
+
+	if(wheel->pending==0) return -1;
+
+	now = tickAt(wheel, NTPMonotonicMillis());
+	if(wheel->current<=now) return 0;  //behind already
+
+	//Look for the first busy slot of the first level. We have to stop
+	//where it wraps around, since timers from the levels above could
+	//cascade into the slots after that.
+	for(i=0;i<WHEEL_SLOTS0;i++) {
+		tick = wheel->current + i;
+		if((tick & (WHEEL_SLOTS0-1))==0) break;
+		slot = &wheel->first[tick & (WHEEL_SLOTS0-1)];
+		if(slot->next!=slot) break;
+	}
+	tick = wheel->current + i;
+
+	//until that tick starts
+	ms = (int64_t)tick*wheel->tickMS + wheel->start - NTPMonotonicMillis();
+	if(ms<0) return 0;
+	if(ms>1000000000) return 1000000000;
+	return (int)ms;
+}
@@ -0,0 +1,149 @@
+/******************************************************************
+ * queueBench.c                                                   *
+ * Measures how many items a second we can hand from one thread   *
+ * to another through the lock-free queues, compared to a plain   *
+ * ring protected by an NTPLock. Run it with 'make bench'.        *
+ ******************************************************************/
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <notrap/notrap.h>
+
+#define ITEMS   10000000
+#define BATCH   32
+#define THREADS 4
+
+static double nowSeconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+//Runs producer and consumer on NTPThreads with the same arg, and
+//prints the throughput
+static void run(const char *name, void *(*producer)(void*),
+                void *(*consumer)(void*), void *arg, int threads) {
+	NTPThread *p[THREADS], *c[THREADS];
+	double start = nowSeconds(), secs;
+	int i;
+
+	for(i=0;i<threads;i++) {
+		p[i] = NTPNewThread(producer, arg, NULL);
+		c[i] = NTPNewThread(consumer, arg, NULL);
+	}
+	for(i=0;i<threads;i++) {
+		NTPJoinThread(&p[i], NULL);
+		NTPJoinThread(&c[i], NULL);
+	}
+	secs = nowSeconds() - start;
+	printf("%-36s %8.2f M items/sec\n", name, ITEMS/secs/1e6);
+}
+
+//---------------- the baseline: a ring with a lock ----------------
+typedef struct {
+	NTPLock lock;
+	NTPCondition changed;
+	void *slots[1024];
+	int head, len;
+} LockedRing;
+
+static void *lockedProducer(void *arg) {
+	LockedRing *r = (LockedRing*)arg;
+	intptr_t i;
+	for(i=0;i<ITEMS;i++) {
+		NTPAcquireLock(&r->lock);
+		while(r->len==1024) NTPWaitCondition(&r->changed, &r->lock);
+		r->slots[(r->head+r->len++) % 1024] = (void*)i;
+		NTPSignalCondition(&r->changed);
+		NTPReleaseLock(&r->lock);
+	}
+	return NULL;
+}
+
+static void *lockedConsumer(void *arg) {
+	LockedRing *r = (LockedRing*)arg;
+	int i;
+	for(i=0;i<ITEMS;i++) {
+		NTPAcquireLock(&r->lock);
+		while(r->len==0) NTPWaitCondition(&r->changed, &r->lock);
+		r->head = (r->head+1) % 1024;
+		r->len--;
+		NTPSignalCondition(&r->changed);
+		NTPReleaseLock(&r->lock);
+	}
+	return NULL;
+}
+
+//---------------- SPSC ----------------
+static void *spscProducer(void *arg) {
+	intptr_t i;
+	for(i=0;i<ITEMS;i++) NTPSPSCQueuePush((NTPSPSCQueue*)arg, (void*)i);
+	return NULL;
+}
+
+static void *spscConsumer(void *arg) {
+	int i;
+	for(i=0;i<ITEMS;i++) NTPSPSCQueuePop((NTPSPSCQueue*)arg);
+	return NULL;
+}
+
+static void *spscBatchProducer(void *arg) {
+	void *batch[BATCH] = {0};
+	int n, done = 0;
+	while(done<ITEMS) {
+		n = NTPSPSCQueuePushMany((NTPSPSCQueue*)arg, batch,
+		                         ITEMS-done<BATCH ? ITEMS-done : BATCH);
+		if(n==0) NTPSPSCQueuePush((NTPSPSCQueue*)arg, batch[n++]);
+		done += n;
+	}
+	return NULL;
+}
+
+static void *spscBatchConsumer(void *arg) {
+	void *batch[BATCH];
+	int n, done = 0;
+	while(done<ITEMS) {
+		n = NTPSPSCQueuePopMany((NTPSPSCQueue*)arg, batch, BATCH);
+		if(n==0) batch[n++] = NTPSPSCQueuePop((NTPSPSCQueue*)arg);
+		done += n;
+	}
+	return NULL;
+}
+
+//---------------- MPMC, with mpmcThreads of each ----------------
+static int mpmcThreads = 1;
+
+static void *mpmcProducer(void *arg) {
+	intptr_t i;
+	for(i=0;i<ITEMS/mpmcThreads;i++) NTPMPMCQueuePush((NTPMPMCQueue*)arg, (void*)i);
+	return NULL;
+}
+
+static void *mpmcConsumer(void *arg) {
+	int i;
+	for(i=0;i<ITEMS/mpmcThreads;i++) NTPMPMCQueuePop((NTPMPMCQueue*)arg);
+	return NULL;
+}
+
+int main(void) {
+	LockedRing ring;
+	NTPSPSCQueue *spsc = NTPNewSPSCQueue(1024);
+	NTPMPMCQueue *mpmc = NTPNewMPMCQueue(1024);
+
+	NTPInitLock(&ring.lock);
+	NTPInitCondition(&ring.changed);
+	ring.head = ring.len = 0;
+
+	run("NTPLock ring, 1 to 1",     lockedProducer, lockedConsumer, &ring, 1);
+	run("SPSC, 1 to 1",             spscProducer, spscConsumer, spsc, 1);
+	run("SPSC batches of 32, 1 to 1", spscBatchProducer, spscBatchConsumer, spsc, 1);
+	run("MPMC, 1 to 1",             mpmcProducer, mpmcConsumer, mpmc, 1);
+	mpmcThreads = THREADS;
+	run("MPMC, 4 to 4",             mpmcProducer, mpmcConsumer, mpmc, THREADS);
+
+	NTPFreeSPSCQueue(&spsc);
+	NTPFreeMPMCQueue(&mpmc);
+	NTPDestroyCondition(&ring.changed);
+	NTPDestroyLock(&ring.lock);
+	return 0;
+}
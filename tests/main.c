@@ -2,6 +2,10 @@
 #include <CuTest.h>
 
 CuSuite *getNetworkSuite();
+CuSuite *getThreadSuite();
+CuSuite *getMemorySuite();
+CuSuite *getTimeSuite();
+CuSuite *getShmSuite();
 
 //returns 1 on failure, 0 on success (like unix command line)
 int runAllTests(void) {
@@ -10,6 +14,10 @@ int runAllTests(void) {
 	CuSuite *suite   = CuSuiteNew();
 
 	CuSuiteAddSuite(suite, getNetworkSuite());
+	CuSuiteAddSuite(suite, getThreadSuite());
+	CuSuiteAddSuite(suite, getMemorySuite());
+	CuSuiteAddSuite(suite, getTimeSuite());
+	CuSuiteAddSuite(suite, getShmSuite());
 
 	CuSuiteRun(suite);
 	CuSuiteSummary(suite, output);
@@ -0,0 +1,152 @@
+#include <CuTest.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <notrap/notrap.h>
+
+static void testArena(CuTest *tc) {
+	NTPArena *arena = NTPNewArena(1024);
+	char *a, *b, *big, *again;
+	int i;
+
+	CuAssertPtrNotNull(tc, arena);
+	a = NTPArenaAlloc(arena, 10);
+	b = NTPArenaAlloc(arena, 1);
+	CuAssertPtrNotNull(tc, a);
+	CuAssertPtrNotNull(tc, b);
+	CuAssertTrue(tc, b >= a+10);
+	CuAssertIntEquals(tc, 0, (int)((uintptr_t)b % sizeof(void*)));
+	memset(a, 'a', 10);
+	memset(b, 'b', 1);
+
+	//Fill up several chunks, and get one bigger than a chunk
+	for(i=0;i<100;i++)
+		CuAssertPtrNotNull(tc, NTPArenaAlloc(arena, 100));
+	big = NTPArenaAlloc(arena, 10000);
+	CuAssertPtrNotNull(tc, big);
+	memset(big, 'c', 10000);
+	CuAssertTrue(tc, NTPArenaBytes(arena) >= 100*100 + 10000);
+	CuAssertTrue(tc, a[9]=='a' && b[0]=='b');
+
+	//After a reset we start over at the beginning
+	NTPArenaReset(arena);
+	CuAssertIntEquals(tc, 0, (int)NTPArenaBytes(arena));
+	again = NTPArenaAlloc(arena, 10);
+	CuAssertPtrEquals(tc, a, again);
+	for(i=0;i<100;i++)
+		CuAssertPtrNotNull(tc, NTPArenaAlloc(arena, 100));
+
+	NTPFreeArena(&arena);
+	CuAssertPtrEquals(tc, NULL, arena);
+	NTPFreeArena(&arena);
+}
+
+#define POOL_THREADS 4
+#define POOL_ROUNDS  20000
+
+//Each thread keeps a few objects alive at once, and writes its
+//mark in them to catch two threads getting the same object
+static void *poolThread(void *arg) {
+	NTPPool *pool = (NTPPool*)arg;
+	long *held[16];
+	long mark = (long)(uintptr_t)&held;
+	int i, j;
+
+	memset(held, 0, sizeof(held));
+	for(i=0;i<POOL_ROUNDS;i++) {
+		j = i%16;
+		if(held[j]!=NULL) {
+			if(held[j][0]!=mark || held[j][2]!=i) return (void*)1;
+			NTPPoolFree(pool, held[j]);
+		}
+		held[j] = NTPPoolAlloc(pool);
+		if(held[j]==NULL) return (void*)1;
+		held[j][0] = mark;
+		held[j][2] = i+16;
+	}
+	for(j=0;j<16;j++) NTPPoolFree(pool, held[j]);
+	return NULL;
+}
+
+static void testPool(CuTest *tc) {
+	NTPPool *pool = NTPNewPool(3*sizeof(long), 8);
+	NTPThread *threads[POOL_THREADS];
+	void *objs[100];
+	void *result;
+	int i;
+
+	CuAssertPtrNotNull(tc, pool);
+	CuAssertIntEquals(tc, 0, (int)NTPPoolCapacity(pool));
+
+	//Every object is different, and they can be reused
+	for(i=0;i<100;i++) {
+		objs[i] = NTPPoolAlloc(pool);
+		CuAssertPtrNotNull(tc, objs[i]);
+		memset(objs[i], i, 3*sizeof(long));
+	}
+	for(i=0;i<100;i++)
+		CuAssertIntEquals(tc, i, ((unsigned char*)objs[i])[3*sizeof(long)-1]);
+	CuAssertTrue(tc, NTPPoolCapacity(pool) >= 100);
+	for(i=0;i<100;i++) NTPPoolFree(pool, objs[i]);
+	NTPPoolFree(pool, NULL);
+	for(i=0;i<100;i++) objs[i] = NTPPoolAlloc(pool);
+	CuAssertTrue(tc, NTPPoolCapacity(pool) < 200);
+	for(i=0;i<100;i++) NTPPoolFree(pool, objs[i]);
+
+	//Threads exiting give their caches back
+	for(i=0;i<POOL_THREADS;i++) {
+		threads[i] = NTPNewThread(poolThread, pool, NULL);
+		CuAssertPtrNotNull(tc, threads[i]);
+	}
+	for(i=0;i<POOL_THREADS;i++) {
+		CuAssertTrue(tc, NTPJoinThread(&threads[i], &result));
+		CuAssertPtrEquals(tc, NULL, result);
+	}
+	CuAssertTrue(tc, NTPPoolCapacity(pool) <= 100 + POOL_THREADS*(16+64+8));
+
+	NTPFreePool(&pool);
+	CuAssertPtrEquals(tc, NULL, pool);
+}
+
+static void testMallocStats(CuTest *tc) {
+	NTPMallocStats before, after;
+	char *p, *q;
+
+	NTPGetMallocStats(&before);
+	p = NTPInstrumentedMalloc(1000);
+	q = NTPInstrumentedMalloc(24);
+	CuAssertPtrNotNull(tc, p);
+	CuAssertPtrNotNull(tc, q);
+	CuAssertIntEquals(tc, 0, (int)((uintptr_t)p % sizeof(void*)));
+	memset(p, 1, 1000);
+	NTPGetMallocStats(&after);
+	CuAssertTrue(tc, after.bytesInUse  == before.bytesInUse + 1024);
+	CuAssertTrue(tc, after.allocations == before.allocations + 2);
+	CuAssertTrue(tc, after.peakBytes   >= after.bytesInUse);
+
+	NTPInstrumentedFree(p);
+	NTPInstrumentedFree(q);
+	NTPInstrumentedFree(NULL);
+	NTPGetMallocStats(&after);
+	CuAssertTrue(tc, after.bytesInUse == before.bytesInUse);
+	CuAssertTrue(tc, after.frees      == before.frees + 2);
+	CuAssertTrue(tc, after.peakBytes  >= before.bytesInUse + 1024);
+
+#ifdef NTP_MALLOC_STATS
+	//NTPmalloc() is counted too
+	p = NTPmalloc(100);
+	NTPGetMallocStats(&after);
+	CuAssertTrue(tc, after.bytesInUse == before.bytesInUse + 100);
+	NTPfree(p);
+#endif
+}
+
+CuSuite *getMemorySuite(void) {
+	CuSuite *suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, testArena);
+	SUITE_ADD_TEST(suite, testPool);
+	SUITE_ADD_TEST(suite, testMallocStats);
+
+	return suite;
+}
@@ -1,5 +1,11 @@
 #include <CuTest.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <notrap/notrap.h>
 
 static void testDisconnectWhileConnecting(CuTest *tc) {
@@ -16,6 +22,114 @@ static void testDisconnectWhileConnecting(CuTest *tc) {
 	}
 }
 
+static void testConnectPool(CuTest *tc) {
+	NTPSock *socks[20];
+	int i, status;
+
+	//With a tiny pool, most of these connects have to wait, and
+	//some of them fail right away because too many are waiting.
+	CuAssert(tc, "bad pool size", !NTPSetConnectPool(0, 1));
+	CuAssert(tc, "pool size", NTPSetConnectPool(1, 5));
+	for(i=0;i<20;i++) {
+		socks[i] = NTPConnectTCP("asdfasdfasdf.com",4444);
+		CuAssertPtrNotNull(tc, socks[i]);
+		status = NTPSockStatus(socks[i]);
+		CuAssert(tc, "connecting or failed",
+		         status==NTPSOCK_CONNECTING || status==NTPSOCK_ERROR);
+	}
+
+	//disconnecting cleans up the waiting ones too
+	for(i=0;i<20;i++) {
+		NTPDisconnect(&socks[i]);
+		CuAssert(tc, "Cleared sock", socks[i]==NULL);
+	}
+	CuAssert(tc, "pool size", NTPSetConnectPool(16, 1024));
+}
+
+#define REUSED_SOCKS 8
+
+static void testSockReuse(CuTest *tc) {
+	NTPSock *socks[REUSED_SOCKS];
+	char paths[REUSED_SOCKS][64], noErr[100];
+	int i, fds[2];
+
+	CuAssertTrue(tc, pipe(fds)==0);
+	socks[0] = NTPSockFromFD(dup(fds[0]));
+	CuAssertPtrNotNull(tc, socks[0]);
+	snprintf(noErr, sizeof(noErr), "%s", NTPSockErr(socks[0]));
+	NTPDisconnect(&socks[0]);
+
+	//Freed socks go back on the free list, so leave some behind with
+	//an error, a destination, and a socket file to remove
+	for(i=0;i<REUSED_SOCKS;i++) {
+		sprintf(paths[i], "/tmp/notrapTestReuse%d-%d", (int)getpid(), i);
+		socks[i] = i%2 ? NTPConnectUnix(paths[i], NTPUNIX_STREAM)
+		               : NTPListenUnix(paths[i], NTPUNIX_STREAM);
+		CuAssertPtrNotNull(tc, socks[i]);
+		CuAssertIntEquals(tc, i%2 ? NTPSOCK_ERROR : NTPSOCK_LISTENING,
+		                  NTPSockStatus(socks[i]));
+	}
+	for(i=0;i<REUSED_SOCKS;i++) NTPDisconnect(&socks[i]);
+
+	//A file somebody else put there must survive the socks that take
+	//those slots next
+	for(i=0;i<REUSED_SOCKS;i++) close(open(paths[i], O_CREAT | O_WRONLY, 0600));
+	for(i=0;i<REUSED_SOCKS;i++) {
+		socks[i] = NTPSockFromFD(dup(fds[0]));
+		CuAssertPtrNotNull(tc, socks[i]);
+		CuAssertIntEquals(tc, NTPSOCK_CONNECTED, NTPSockStatus(socks[i]));
+		CuAssertStrEquals(tc, noErr, NTPSockErr(socks[i]));
+		CuAssert(tc, "not timed out", !NTPSockTimedOut(socks[i]));
+	}
+	for(i=0;i<REUSED_SOCKS;i++) NTPDisconnect(&socks[i]);
+	for(i=0;i<REUSED_SOCKS;i++) {
+		CuAssert(tc, "file left alone", access(paths[i], F_OK)==0);
+		unlink(paths[i]);
+	}
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void testDNSCache(CuTest *tc) {
+	uint64_t hits, misses, moreHits;
+	int entries;
+	NTPSock *sock;
+
+	NTPDNSFlush();
+	NTPDNSCacheStats(NULL, NULL, &entries);
+	CuAssert(tc, "flushed", entries==0);
+	CuAssert(tc, "not cached", NTPDNSCached("localhost", 1234)==-1);
+
+	CuAssert(tc, "prefill", NTPDNSPrefill("localhost", 1234));
+	CuAssert(tc, "cached", NTPDNSCached("localhost", 1234)>0);
+	CuAssert(tc, "port is part of the key", NTPDNSCached("localhost", 1235)==-1);
+
+	//a connect should use the cached answer
+	NTPDNSCacheStats(&hits, &misses, NULL);
+	sock = NTPConnectTCP("localhost", 1234);
+	CuAssertPtrNotNull(tc, sock);
+	NTPWaitConnected(sock, -1);
+	NTPDNSCacheStats(&moreHits, NULL, NULL);
+	CuAssert(tc, "cache hit", moreHits==hits+1);
+	NTPDisconnect(&sock);
+
+	//IP addresses skip the cache entirely
+	sock = NTPConnectTCP("127.0.0.1", 1234);
+	CuAssertPtrNotNull(tc, sock);
+	NTPWaitConnected(sock, -1);
+	CuAssert(tc, "IPs aren't cached", NTPDNSCached("127.0.0.1", 1234)==-1);
+	NTPDisconnect(&sock);
+
+	//entries go away after their TTL
+	NTPSetDNSCacheTTL(1, 1);
+	CuAssert(tc, "prefill", NTPDNSPrefill("localhost", 1234));
+	usleep(5000);
+	CuAssert(tc, "expired", NTPDNSCached("localhost", 1234)==-1);
+
+	NTPSetDNSCacheTTL(60000, 5000);
+	NTPDNSFlush();
+}
+
 static void testConnectSendRecv(CuTest *tc) {
 	int port = 34593;
 	int sent,bytesSent, recvd, bytesRecvd;
@@ -36,7 +150,7 @@ static void testConnectSendRecv(CuTest *tc) {
 	CuAssertPtrNotNull(tc, cSock);
 	
 	//wait for connect to succeed or fail
-	while(NTPSockStatus(cSock)==NTPSOCK_CONNECTING);
+	NTPWaitConnected(cSock, -1);
 	if(NTPSockStatus(cSock)!=NTPSOCK_CONNECTED)
 		printf("Connect error: %s\n", NTPSockErr(cSock));
 	CuAssert(tc, "Testing connect", NTPSockStatus(cSock)==NTPSOCK_CONNECTED);
@@ -83,7 +197,7 @@ static void connectUtil(CuTest *tc, NTPSock**listenSock, NTPSock**connectSock,
 	//connect
 	*connectSock = NTPConnectTCP("localhost", port);
 	CuAssertPtrNotNull(tc, *connectSock);
-	while(NTPSockStatus(*connectSock)==NTPSOCK_CONNECTING);
+	NTPWaitConnected(*connectSock, -1);
 	CuAssert(tc,"Connect fail",NTPSockStatus(*connectSock)==NTPSOCK_CONNECTED);
 
 	//accept
@@ -92,6 +206,431 @@ static void connectUtil(CuTest *tc, NTPSock**listenSock, NTPSock**connectSock,
 	CuAssert(tc, "Accept fail", NTPSockStatus(*acceptedSock)==NTPSOCK_CONNECTED);
 }
 
+static void testConnectAttempts(CuTest *tc) {
+	NTPSock *listenSock;
+	NTPSock *connectSock;
+	NTPSock *acceptSock;
+	NTPConnectAttempt attempts[8];
+	int i, n, won = 0;
+
+	connectUtil(tc, &listenSock, &connectSock, &acceptSock, 45646);
+
+	//exactly one address should have won the race
+	n = NTPConnectAttempts(connectSock, attempts, 8);
+	CuAssert(tc, "at least one attempt", n>=1);
+	for(i=0;i<n && i<8;i++) {
+		CuAssert(tc, "has address", strlen(attempts[i].address)>0);
+		CuAssert(tc, "has time", attempts[i].durationMS>=0);
+		if(attempts[i].result==NTPATTEMPT_CONNECTED) won++;
+	}
+	CuAssert(tc, "one winner", won==1);
+
+	//a refused connect records its failure
+	NTPDisconnect(&connectSock);
+	connectSock = NTPConnectTCP("127.0.0.1", 45647);
+	CuAssertPtrNotNull(tc, connectSock);
+	NTPWaitConnected(connectSock, -1);
+	CuAssert(tc, "refused", NTPSockStatus(connectSock)==NTPSOCK_ERROR);
+	CuAssert(tc, "one attempt", NTPConnectAttempts(connectSock, attempts, 8)==1);
+	CuAssert(tc, "failed", attempts[0].result==NTPATTEMPT_FAILED);
+	CuAssert(tc, "ipv4", !attempts[0].ipv6);
+	CuAssert(tc, "address", NTPstrcmp(attempts[0].address, "127.0.0.1")==0);
+
+	NTPDisconnect(&listenSock);
+	NTPDisconnect(&connectSock);
+	NTPDisconnect(&acceptSock);
+}
+
+//Makes a listening socket that never accepts, and fills its backlog,
+//so any more connects to it just hang. Returns the sockets to close.
+static void blackholeUtil(CuTest *tc, uint16_t port, int fds[3]) {
+	struct sockaddr_in addr;
+	int i, one = 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family      = AF_INET;
+	addr.sin_port        = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(fds[0], SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	CuAssert(tc, "bind", bind(fds[0], (struct sockaddr*)&addr, sizeof(addr))==0);
+	CuAssert(tc, "listen", listen(fds[0], 0)==0);
+	for(i=1;i<3;i++) {
+		fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+		fcntl(fds[i], F_SETFL, O_NONBLOCK);
+		connect(fds[i], (struct sockaddr*)&addr, sizeof(addr));
+	}
+	usleep(10000);
+}
+
+static void testConnectTimeout(CuTest *tc) {
+	NTPSock *sock;
+	int fds[3], i;
+	uint16_t port = 45648;
+
+	blackholeUtil(tc, port, fds);
+
+	sock = NTPConnectTCPWithTimeout("127.0.0.1", port, 200);
+	CuAssertPtrNotNull(tc, sock);
+	CuAssert(tc, "still connecting", NTPSockStatus(sock)==NTPSOCK_CONNECTING);
+	CuAssert(tc, "not timed out yet", !NTPSockTimedOut(sock));
+
+	//waiting doesn't go past the connect's own timeout
+	CuAssert(tc, "gave up", NTPWaitConnected(sock, 5000)==NTPSOCK_ERROR);
+	CuAssert(tc, "timed out", NTPSockTimedOut(sock));
+	NTPDisconnect(&sock);
+
+	//a connect that works isn't affected by the timeout
+	NTPSock *lSock = NTPListen(port+1);
+	sock = NTPConnectTCPWithTimeout("localhost", port+1, 10000);
+	NTPWaitConnected(sock, -1);
+	CuAssert(tc, "connected", NTPSockStatus(sock)==NTPSOCK_CONNECTED);
+	CuAssert(tc, "not timed out", !NTPSockTimedOut(sock));
+	NTPDisconnect(&sock);
+	NTPDisconnect(&lSock);
+
+	for(i=0;i<3;i++) close(fds[i]);
+}
+
+static void testSendvRecvv(CuTest *tc) {
+	NTPSock *listenSock;
+	NTPSock *connectSock;
+	NTPSock *acceptSock;
+	char header[] = "HDR:";
+	char payload[] = "I've been thinking a long time, my darling";
+	char recvHeader[5] = {0};
+	char recvPayload[100] = {0};
+	NTPIOVec sendVecs[2], recvVecs[2], *vecs;
+	int count, done;
+
+	connectUtil(tc, &listenSock, &connectSock, &acceptSock, 45649);
+
+	sendVecs[0].base = header;
+	sendVecs[0].len  = strlen(header);
+	sendVecs[1].base = payload;
+	sendVecs[1].len  = strlen(payload);
+	for(vecs=sendVecs,count=2;count>0;) {
+		done = NTPSendv(connectSock, vecs, count);
+		CuAssert(tc, "Checking bytes sent didn't fail", done>0);
+		NTPIOVecAdvance(&vecs, &count, done);
+	}
+
+	recvVecs[0].base = recvHeader;
+	recvVecs[0].len  = strlen(header);
+	recvVecs[1].base = recvPayload;
+	recvVecs[1].len  = strlen(payload);
+	for(vecs=recvVecs,count=2;count>0;) {
+		done = NTPRecvv(acceptSock, vecs, count);
+		CuAssert(tc, "Checking recv didn't fail", done>0);
+		NTPIOVecAdvance(&vecs, &count, done);
+	}
+	CuAssert(tc, "header", NTPstrcmp(recvHeader, header)==0);
+	CuAssert(tc, "payload", NTPstrcmp(recvPayload, payload)==0);
+
+	//a partial advance moves into the middle of a vec
+	sendVecs[0].base = header;
+	sendVecs[0].len  = strlen(header);
+	sendVecs[1].base = payload;
+	sendVecs[1].len  = strlen(payload);
+	vecs  = sendVecs;
+	count = 2;
+	CuAssert(tc, "advance", NTPIOVecAdvance(&vecs, &count, strlen(header)+3)==1);
+	CuAssert(tc, "advance vec", vecs==&sendVecs[1]);
+	CuAssert(tc, "advance base", vecs->base==payload+3);
+	CuAssert(tc, "advance len", vecs->len==strlen(payload)-3);
+
+	NTPDisconnect(&listenSock);
+	NTPDisconnect(&connectSock);
+	NTPDisconnect(&acceptSock);
+}
+
+static void testSendFile(CuTest *tc) {
+	NTPSock *listenSock;
+	NTPSock *connectSock;
+	NTPSock *acceptSock;
+	char path[] = "/tmp/notrapTestXXXXXX";
+	char contents[20000];
+	char recvd[20000];
+	int64_t offset;
+	int fd, i, total, got;
+
+	connectUtil(tc, &listenSock, &connectSock, &acceptSock, 45650);
+
+	for(i=0;i<sizeof(contents);i++) contents[i] = 'a' + i%26;
+	fd = mkstemp(path);
+	CuAssert(tc, "temp file", fd>=0);
+	CuAssert(tc, "write file", write(fd, contents, sizeof(contents))==sizeof(contents));
+
+	//send the second half, in as many pieces as it takes
+	for(offset=10000;offset<20000;) {
+		CuAssert(tc, "send file", NTPSendFile(connectSock, fd, &offset, 20000-offset)>0);
+	}
+	for(total=0;total<10000;total+=got) {
+		got = NTPRecv(acceptSock, recvd+total, 10000-total);
+		CuAssert(tc, "Checking recv didn't fail", got>0);
+	}
+	CuAssert(tc, "second half", memcmp(recvd, contents+10000, 10000)==0);
+
+	//going past the end of the file is an error
+	offset = 19990;
+	CuAssert(tc, "some bytes", NTPSendFile(connectSock, fd, &offset, 100)==10);
+	CuAssert(tc, "past the end", NTPSendFile(connectSock, fd, &offset, 90)==-1);
+	for(total=0;total<10;total+=got) {
+		got = NTPRecv(acceptSock, recvd+total, 10-total);
+		CuAssert(tc, "Checking recv didn't fail", got>0);
+	}
+
+	//and the whole thing by path
+	CuAssert(tc, "send path", NTPSendFilePath(connectSock, path));
+	for(total=0;total<sizeof(contents);total+=got) {
+		got = NTPRecv(acceptSock, recvd+total, sizeof(contents)-total);
+		CuAssert(tc, "Checking recv didn't fail", got>0);
+	}
+	CuAssert(tc, "whole file", memcmp(recvd, contents, sizeof(contents))==0);
+	CuAssert(tc, "missing path", !NTPSendFilePath(connectSock, "/no/such/file"));
+
+	close(fd);
+	unlink(path);
+	NTPDisconnect(&listenSock);
+	NTPDisconnect(&connectSock);
+	NTPDisconnect(&acceptSock);
+}
+
+#define BIG_FILE (4*1024*1024)
+
+typedef struct {
+	NTPSock *sock;
+	int total;
+	int wrong;
+} FileReader;
+
+//reads until the sender closes, checking the pattern
+static void *readFile(void *arg) {
+	FileReader *r = (FileReader*)arg;
+	char buf[65536];
+	int i, got;
+
+	while((got = NTPRecv(r->sock, buf, sizeof(buf)))>0) {
+		for(i=0;i<got;i++)
+			if(buf[i]!='a' + (r->total+i)%26) r->wrong++;
+		r->total += got;
+		if(r->total>=BIG_FILE) break;
+	}
+	return NULL;
+}
+
+static void testSendFileNonBlocking(CuTest *tc) {
+	NTPSock *listenSock, *connectSock;
+	NTPAccepted accepted[1];
+	NTP_FD_SET readSet;
+	NTPThread *reader;
+	FileReader r = {NULL, 0, 0};
+	char path[] = "/tmp/notrapTestXXXXXX";
+	char *contents = malloc(BIG_FILE);
+	int fd, i;
+
+	CuAssertPtrNotNull(tc, contents);
+	for(i=0;i<BIG_FILE;i++) contents[i] = 'a' + i%26;
+	fd = mkstemp(path);
+	CuAssert(tc, "temp file", fd>=0);
+	CuAssert(tc, "write file", write(fd, contents, BIG_FILE)==BIG_FILE);
+	close(fd);
+	free(contents);
+
+	//socks from NTPAcceptMany() are non-blocking, so this fills the
+	//socket over and over, and has to wait for the reader each time
+	listenSock = NTPListen(45658);
+	CuAssertIntEquals(tc, NTPSOCK_LISTENING, NTPSockStatus(listenSock));
+	connectSock = NTPConnectTCP("127.0.0.1", 45658);
+	CuAssertIntEquals(tc, NTPSOCK_CONNECTED, NTPWaitConnected(connectSock, 5000));
+	NTP_ZERO_SET(&readSet);
+	NTP_FD_ADD(listenSock, &readSet);
+	CuAssert(tc, "select listen", NTPSelect(&readSet, NULL, 5000)>0);
+	CuAssertIntEquals(tc, 1, NTPAcceptMany(listenSock, accepted, 1));
+
+	r.sock = connectSock;
+	reader = NTPNewThread(&readFile, &r, NULL);
+	CuAssertPtrNotNull(tc, reader);
+	CuAssert(tc, "send path", NTPSendFilePath(accepted[0].sock, path));
+	NTPJoinThread(&reader, NULL);
+	CuAssertIntEquals(tc, BIG_FILE, r.total);
+	CuAssertIntEquals(tc, 0, r.wrong);
+
+	unlink(path);
+	NTPDisconnect(&accepted[0].sock);
+	NTPDisconnect(&listenSock);
+	NTPDisconnect(&connectSock);
+}
+
+//counts up how many zero-copy sends have finished
+static void zeroCopyDone(NTPSock *sock, uint32_t firstId, uint32_t lastId,
+                         BOOL copied, void *userData) {
+	uint32_t *finished = (uint32_t*)userData;
+	*finished += lastId - firstId + 1;
+}
+
+//remembers the last id that finished
+static void zeroCopyLast(NTPSock *sock, uint32_t firstId, uint32_t lastId,
+                         BOOL copied, void *userData) {
+	*(uint32_t*)userData = lastId;
+}
+
+static void testZeroCopy(CuTest *tc) {
+	NTPSock *listenSock;
+	NTPSock *connectSock;
+	NTPSock *acceptSock;
+	NTPPoller *poller;
+	NTPPollEvent events[1];
+	static char buf[65536];
+	static char recvd[65536];
+	uint32_t id, last, finished = 0;
+	int i, total, got;
+	BOOL on;
+
+	connectUtil(tc, &listenSock, &connectSock, &acceptSock, 45651);
+	memset(buf, 'z', sizeof(buf));
+
+	//it's fine if the platform can't do it, sends are just copied
+	on = NTPSetZeroCopy(connectSock, TRUE);
+	for(i=0;i<4;i++) {
+		CuAssert(tc, "send", NTPSendZeroCopy(connectSock, buf, 16384, &id)>0);
+		CuAssert(tc, "ids count up", id==(on ? i : NTPZEROCOPY_NONE));
+		for(total=0;total<16384;total+=got) {
+			got = NTPRecv(acceptSock, recvd, 16384-total);
+			CuAssert(tc, "Checking recv didn't fail", got>0);
+		}
+	}
+	if(!on) {
+		CuAssert(tc, "nothing to reap", NTPReapZeroCopy(connectSock, zeroCopyDone, &finished)==0);
+		goto DONE;
+	}
+
+	//the OS still has those buffers, so it can't be turned off yet
+	CuAssert(tc, "outstanding", !NTPSetZeroCopy(connectSock, FALSE));
+
+	//the completions show up as an error event
+	poller = NTPNewPoller();
+	CuAssert(tc, "add", NTPPollerAdd(poller, connectSock, 0, NULL));
+	for(i=0;i<100 && finished<4;i++) {
+		NTPPollerWait(poller, events, 1, 100);
+		CuAssert(tc, "reap", NTPReapZeroCopy(connectSock, zeroCopyDone, &finished)>=0);
+	}
+	CuAssert(tc, "all finished", finished==4);
+	CuAssert(tc, "nothing left", NTPReapZeroCopy(connectSock, zeroCopyDone, &finished)==0);
+
+	//copied sends in between don't use up ids, so the next zero-copy
+	//send has the id the OS reports for it
+	CuAssert(tc, "off", NTPSetZeroCopy(connectSock, FALSE));
+	for(i=0;i<3;i++) {
+		CuAssert(tc, "send", NTPSendZeroCopy(connectSock, buf, 16384, &id)>0);
+		CuAssert(tc, "copied", id==NTPZEROCOPY_NONE);
+	}
+	CuAssert(tc, "on", NTPSetZeroCopy(connectSock, TRUE));
+	CuAssert(tc, "send", NTPSendZeroCopy(connectSock, buf, 16384, &id)>0);
+	CuAssert(tc, "next id", id==4);
+	for(total=0;total<4*16384;total+=got) {
+		got = NTPRecv(acceptSock, recvd, sizeof(recvd) < 4*16384-total ? sizeof(recvd) : 4*16384-total);
+		CuAssert(tc, "Checking recv didn't fail", got>0);
+	}
+	last = NTPZEROCOPY_NONE;
+	for(i=0;i<100 && last!=4;i++) {
+		NTPPollerWait(poller, events, 1, 100);
+		CuAssert(tc, "reap", NTPReapZeroCopy(connectSock, zeroCopyLast, &last)>=0);
+	}
+	CuAssert(tc, "reported", last==4);
+	CuAssert(tc, "off again", NTPSetZeroCopy(connectSock, FALSE));
+
+	NTPPollerRemove(poller, connectSock);
+	NTPFreePoller(&poller);
+DONE:
+	NTPDisconnect(&listenSock);
+	NTPDisconnect(&connectSock);
+	NTPDisconnect(&acceptSock);
+}
+
+static void testAcceptMany(CuTest *tc) {
+	NTPSock *listenSock;
+	NTPSock *connectSocks[5];
+	NTPAccepted accepted[8];
+	int i, n, total;
+	uint16_t port = 45652;
+
+	listenSock = NTPListenWithBacklog(port, 16);
+	CuAssertPtrNotNull(tc, listenSock);
+	CuAssert(tc, "listening", NTPSockStatus(listenSock)==NTPSOCK_LISTENING);
+
+	//nobody waiting, so we get nothing right away
+	CuAssert(tc, "empty", NTPAcceptMany(listenSock, accepted, 8)==0);
+
+	for(i=0;i<5;i++) {
+		connectSocks[i] = NTPConnectTCP("127.0.0.1", port);
+		NTPWaitConnected(connectSocks[i], -1);
+		CuAssert(tc, "connected", NTPSockStatus(connectSocks[i])==NTPSOCK_CONNECTED);
+	}
+
+	//they should all be waiting, but let them in a few at a time
+	for(total=0;total<5;) {
+		n = NTPAcceptMany(listenSock, accepted, 2);
+		CuAssert(tc, "accept many", n>=0 && n<=2);
+		for(i=0;i<n;i++) {
+			CuAssert(tc, "connected", NTPSockStatus(accepted[i].sock)==NTPSOCK_CONNECTED);
+			CuAssert(tc, "address", NTPstrcmp(accepted[i].address, "127.0.0.1")==0);
+			CuAssert(tc, "port", accepted[i].port!=0);
+			NTPDisconnect(&accepted[i].sock);
+		}
+		total += n;
+		if(n==0) usleep(1000);
+	}
+	CuAssert(tc, "empty again", NTPAcceptMany(listenSock, accepted, 8)==0);
+
+	for(i=0;i<5;i++) NTPDisconnect(&connectSocks[i]);
+	NTPDisconnect(&listenSock);
+}
+
+static void testListenSharded(CuTest *tc) {
+	NTPSock *shards[4];
+	NTPSock *connectSocks[8];
+	NTPAccepted accepted[8];
+	int i, n, total, tries;
+	uint16_t port = 45653;
+
+	shards[0] = NULL;
+	CuAssert(tc, "no shards", !NTPListenSharded(port, 0, TRUE, shards));
+	CuAssert(tc, "untouched", shards[0]==NULL);
+
+	CuAssert(tc, "sharded", NTPListenSharded(port, 4, TRUE, shards));
+	for(i=0;i<4;i++)
+		CuAssert(tc, "listening", NTPSockStatus(shards[i])==NTPSOCK_LISTENING);
+
+	for(i=0;i<8;i++) {
+		connectSocks[i] = NTPConnectTCP("127.0.0.1", port);
+		NTPWaitConnected(connectSocks[i], -1);
+		CuAssert(tc, "connected", NTPSockStatus(connectSocks[i])==NTPSOCK_CONNECTED);
+	}
+
+	//every connection shows up on exactly one of the shards
+	for(total=0,tries=0;total<8 && tries<1000;tries++) {
+		for(i=0;i<4;i++) {
+			int j;
+			n = NTPAcceptMany(shards[i], accepted, 8);
+			CuAssert(tc, "accept", n>=0);
+			for(j=0;j<n;j++) NTPDisconnect(&accepted[j].sock);
+			total += n;
+		}
+		if(total<8) usleep(1000);
+	}
+	CuAssert(tc, "all accepted", total==8);
+
+	//another plain listener on the same port isn't allowed in
+	NTPSock *other = NTPListen(port);
+	CuAssert(tc, "port taken", NTPSockStatus(other)==NTPSOCK_ERROR);
+	NTPDisconnect(&other);
+
+	for(i=0;i<8;i++) NTPDisconnect(&connectSocks[i]);
+	for(i=0;i<4;i++) NTPDisconnect(&shards[i]);
+}
+
 static void testRecvFail(CuTest *tc) {
 	NTPSock*listenSock;
 	NTPSock*connectSock;
@@ -206,14 +745,515 @@ static void testSelect(CuTest *tc) {
 	CuAssert(tc, "should be NULL", acceptSock==NULL);
 }
 
+static void testPoller(CuTest *tc) {
+	NTPSock *listenSock;
+	NTPSock *acceptSock;
+	NTPSock *connectSock;
+	NTPPoller *poller;
+	NTPPollEvent events[4];
+	int tag1, tag2;
+	uint16_t port = 45644;
+	char buf[] = "Come and sit by my side if you love me";
+
+	//connect the sockets
+	connectUtil(tc, &listenSock, &connectSock, &acceptSock, port);
+
+	poller = NTPNewPoller();
+	CuAssertPtrNotNull(tc, poller);
+
+	//nothing to read yet, so we should time out
+	CuAssert(tc, "add", NTPPollerAdd(poller, acceptSock, NTPPOLL_READ, &tag1));
+	CuAssert(tc, "add", NTPPollerAdd(poller, connectSock, NTPPOLL_READ, &tag2));
+	CuAssert(tc, "double add fails",
+	         !NTPPollerAdd(poller, connectSock, NTPPOLL_READ, &tag2));
+	CuAssert(tc, "poll timeout", NTPPollerWait(poller, events, 4, 100)==0);
+
+	//after a send, only the accepted sock should be ready, with its tag
+	CuAssert(tc, "send", NTPSend(connectSock, buf, strlen(buf))>0);
+	CuAssert(tc, "poll read", NTPPollerWait(poller, events, 4, 10000)==1);
+	CuAssert(tc, "read sock",  events[0].sock==acceptSock);
+	CuAssert(tc, "read tag",   events[0].userData==&tag1);
+	CuAssert(tc, "read event", events[0].events & NTPPOLL_READ);
+
+	//ask for write on the connecting sock instead
+	CuAssert(tc, "modify",
+	         NTPPollerModify(poller, connectSock, NTPPOLL_WRITE, &tag1));
+	CuAssert(tc, "remove", NTPPollerRemove(poller, acceptSock));
+	CuAssert(tc, "poll write", NTPPollerWait(poller, events, 4, 10000)==1);
+	CuAssert(tc, "write sock",  events[0].sock==connectSock);
+	CuAssert(tc, "write tag",   events[0].userData==&tag1);
+	CuAssert(tc, "write event", events[0].events & NTPPOLL_WRITE);
+	CuAssert(tc, "remove", NTPPollerRemove(poller, connectSock));
+	CuAssert(tc, "double remove fails", !NTPPollerRemove(poller, connectSock));
+
+	//cleanup
+	NTPFreePoller(&poller);
+	NTPDisconnect(&listenSock);
+	NTPDisconnect(&connectSock);
+	NTPDisconnect(&acceptSock);
+	CuAssert(tc, "should be NULL", poller==NULL);
+}
+
+static void testWaitConnected(CuTest *tc) {
+	NTPSock *sock, *listenSock;
+	NTPPoller *poller;
+	NTPPollEvent events[4];
+	NTP_FD_SET readSet, writeSet;
+	int fds[3], i, tag;
+	uint16_t port = 45654;
+
+	poller = NTPNewPoller();
+	CuAssertPtrNotNull(tc, poller);
+
+	//a connect that never finishes
+	blackholeUtil(tc, port, fds);
+	sock = NTPConnectTCP("127.0.0.1", port);
+	CuAssertPtrNotNull(tc, sock);
+	CuAssert(tc, "wait times out", NTPWaitConnected(sock, 50)==NTPSOCK_CONNECTING);
+
+	NTP_ZERO_SET(&readSet);
+	NTP_ZERO_SET(&writeSet);
+	NTP_FD_ADD(sock, &readSet);
+	NTP_FD_ADD(sock, &writeSet);
+	CuAssert(tc, "select times out", NTPSelect(&readSet, &writeSet, 50)==0);
+
+	CuAssert(tc, "add connecting",
+	         NTPPollerAdd(poller, sock, NTPPOLL_READ|NTPPOLL_WRITE, &tag));
+	CuAssert(tc, "poll times out", NTPPollerWait(poller, events, 4, 50)==0);
+	CuAssert(tc, "modify connecting",
+	         NTPPollerModify(poller, sock, NTPPOLL_WRITE, &tag));
+	CuAssert(tc, "remove connecting", NTPPollerRemove(poller, sock));
+	NTPDisconnect(&sock);
+	for(i=0;i<3;i++) close(fds[i]);
+
+	//a connect that works shows up as writable, then the poller
+	//carries on watching the connected sock
+	listenSock = NTPListen(port+1);
+	sock = NTPConnectTCP("127.0.0.1", port+1);
+	CuAssert(tc, "add", NTPPollerAdd(poller, sock, NTPPOLL_WRITE, &tag));
+	CuAssert(tc, "poll connect", NTPPollerWait(poller, events, 4, 10000)==1);
+	CuAssert(tc, "connect sock",  events[0].sock==sock);
+	CuAssert(tc, "connect tag",   events[0].userData==&tag);
+	CuAssert(tc, "connect event", events[0].events==NTPPOLL_WRITE);
+	CuAssert(tc, "connected", NTPSockStatus(sock)==NTPSOCK_CONNECTED);
+	CuAssert(tc, "still watched", NTPPollerWait(poller, events, 4, 10000)==1);
+	CuAssert(tc, "remove", NTPPollerRemove(poller, sock));
+	NTPDisconnect(&sock);
+
+	//same thing with select
+	sock = NTPConnectTCP("127.0.0.1", port+1);
+	NTP_ZERO_SET(&writeSet);
+	NTP_FD_ADD(sock, &writeSet);
+	CuAssert(tc, "select connect", NTPSelect(NULL, &writeSet, 10000)==1);
+	CuAssert(tc, "isset", NTP_FD_ISSET(sock, &writeSet));
+	CuAssert(tc, "connected", NTPSockStatus(sock)==NTPSOCK_CONNECTED);
+	NTPDisconnect(&sock);
+	NTPDisconnect(&listenSock);
+
+	//a connect that fails shows up as an error
+	sock = NTPConnectTCP("127.0.0.1", 45647);
+	CuAssert(tc, "add", NTPPollerAdd(poller, sock, NTPPOLL_READ, &tag));
+	CuAssert(tc, "poll failure", NTPPollerWait(poller, events, 4, 10000)==1);
+	CuAssert(tc, "error event", events[0].events==NTPPOLL_ERROR);
+	CuAssert(tc, "failed", NTPWaitConnected(sock, -1)==NTPSOCK_ERROR);
+	CuAssert(tc, "remove", NTPPollerRemove(poller, sock));
+	NTPDisconnect(&sock);
+
+	NTPFreePoller(&poller);
+}
+
+#define UNIX_WAITING 300
+
+static void testUnixSockets(CuTest *tc) {
+	NTPSock *listenSock, *connectSock, *acceptSock, *again, *a, *b;
+	NTPSock *waiting[UNIX_WAITING];
+	NTPAccepted accepted[2];
+	struct sockaddr_un addr;
+	char path[64], buf[100];
+	int i, n, fd;
+
+	//a file in /tmp, which goes away when we stop listening
+	sprintf(path, "/tmp/notrapTest%d.sock", (int)getpid());
+	listenSock = NTPListenUnix(path, NTPUNIX_STREAM);
+	CuAssertPtrNotNull(tc, listenSock);
+	CuAssertIntEquals(tc, NTPSOCK_LISTENING, NTPSockStatus(listenSock));
+	CuAssertTrue(tc, access(path, F_OK)==0);
+
+	connectSock = NTPConnectUnix(path, NTPUNIX_STREAM);
+	CuAssertPtrNotNull(tc, connectSock);
+	CuAssertIntEquals(tc, NTPSOCK_CONNECTED, NTPSockStatus(connectSock));
+	acceptSock = NTPAccept(listenSock);
+	CuAssertPtrNotNull(tc, acceptSock);
+	CuAssertIntEquals(tc, 5, NTPSend(connectSock, "hello", 5));
+	CuAssertIntEquals(tc, 5, NTPRecv(acceptSock, buf, sizeof(buf)));
+	CuAssertTrue(tc, memcmp(buf, "hello", 5)==0);
+	NTPDisconnect(&connectSock);
+	NTPDisconnect(&acceptSock);
+
+	//somebody is listening, so it isn't taken over
+	again = NTPListenUnix(path, NTPUNIX_STREAM);
+	CuAssertPtrNotNull(tc, again);
+	CuAssertIntEquals(tc, NTPSOCK_ERROR, NTPSockStatus(again));
+	NTPDisconnect(&again);
+	CuAssertTrue(tc, access(path, F_OK)==0);
+
+	//once nobody accepts and the backlog fills up, connecting fails
+	//instead of waiting
+	for(n=0;n<UNIX_WAITING;) {
+		waiting[n] = NTPConnectUnix(path, NTPUNIX_STREAM);
+		CuAssertPtrNotNull(tc, waiting[n]);
+		if(NTPSockStatus(waiting[n++])==NTPSOCK_ERROR) break;
+	}
+	CuAssertIntEquals(tc, NTPSOCK_ERROR, NTPSockStatus(waiting[n-1]));
+	CuAssertTrue(tc, n>1);
+
+	//it's still somebody's, even though it's too busy to answer
+	again = NTPListenUnix(path, NTPUNIX_STREAM);
+	CuAssertPtrNotNull(tc, again);
+	CuAssertIntEquals(tc, NTPSOCK_ERROR, NTPSockStatus(again));
+	NTPDisconnect(&again);
+	CuAssertTrue(tc, access(path, F_OK)==0);
+	for(i=0;i<n;i++) NTPDisconnect(&waiting[i]);
+
+	NTPDisconnect(&listenSock);
+	CuAssertTrue(tc, access(path, F_OK)!=0);
+	connectSock = NTPConnectUnix(path, NTPUNIX_STREAM);
+	CuAssertPtrNotNull(tc, connectSock);
+	CuAssertIntEquals(tc, NTPSOCK_ERROR, NTPSockStatus(connectSock));
+	NTPDisconnect(&connectSock);
+
+	//a file left behind by someone who didn't clean up is replaced
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	CuAssertTrue(tc, bind(fd, (struct sockaddr*)&addr, sizeof(addr))==0);
+	close(fd);
+	listenSock = NTPListenUnix(path, NTPUNIX_STREAM);
+	CuAssertIntEquals(tc, NTPSOCK_LISTENING, NTPSockStatus(listenSock));
+	NTPDisconnect(&listenSock);
+	CuAssertTrue(tc, access(path, F_OK)!=0);
+
+	//abstract, with message boundaries kept
+	sprintf(path, "@notrapTest%d", (int)getpid());
+	listenSock = NTPListenUnix(path, NTPUNIX_SEQPACKET);
+	CuAssertIntEquals(tc, NTPSOCK_LISTENING, NTPSockStatus(listenSock));
+	connectSock = NTPConnectUnix(path, NTPUNIX_SEQPACKET);
+	CuAssertIntEquals(tc, NTPSOCK_CONNECTED, NTPSockStatus(connectSock));
+	while((i = NTPAcceptMany(listenSock, accepted, 2))==0)
+		NTPSelect(NULL, NULL, 1);
+	CuAssertIntEquals(tc, 1, i);
+	CuAssertIntEquals(tc, 0, accepted[0].port);
+	CuAssertIntEquals(tc, 3, NTPSend(connectSock, "one", 3));
+	CuAssertIntEquals(tc, 3, NTPSend(connectSock, "two", 3));
+	CuAssertIntEquals(tc, 3, NTPRecv(accepted[0].sock, buf, sizeof(buf)));
+	CuAssertTrue(tc, memcmp(buf, "one", 3)==0);
+	CuAssertIntEquals(tc, 3, NTPRecv(accepted[0].sock, buf, sizeof(buf)));
+	CuAssertTrue(tc, memcmp(buf, "two", 3)==0);
+	NTPDisconnect(&accepted[0].sock);
+	NTPDisconnect(&connectSock);
+	NTPDisconnect(&listenSock);
+
+	//a pair, both ways
+	CuAssertTrue(tc, NTPSocketPair(NTPUNIX_STREAM, &a, &b));
+	CuAssertIntEquals(tc, NTPSOCK_CONNECTED, NTPSockStatus(a));
+	CuAssertIntEquals(tc, 4, NTPSend(a, "ping", 4));
+	CuAssertIntEquals(tc, 4, NTPRecv(b, buf, sizeof(buf)));
+	CuAssertIntEquals(tc, 4, NTPSend(b, "pong", 4));
+	CuAssertIntEquals(tc, 4, NTPRecv(a, buf, sizeof(buf)));
+	CuAssertTrue(tc, memcmp(buf, "pong", 4)==0);
+	NTPDisconnect(&a);
+	CuAssertIntEquals(tc, 0, NTPRecv(b, buf, sizeof(buf)));
+	NTPDisconnect(&b);
+}
+
+static void testUDP(CuTest *tc) {
+	NTPSock *receiver, *sender, *connected, *taken;
+	NTPAddress to, from;
+	NTPDatagram dgrams[10];
+	char bufs[10][100], buf[100], text[64];
+	char big[350], bigRecv[1000];
+	uint16_t port = 45657, fromPort;
+	int i, n, total;
+
+	receiver = NTPUDPBind(port);
+	CuAssertPtrNotNull(tc, receiver);
+	CuAssertIntEquals(tc, NTPSOCK_CONNECTED, NTPSockStatus(receiver));
+	CuAssertIntEquals(tc, port, NTPSockLocalPort(receiver));
+	sender = NTPUDPBind(0);
+	CuAssertPtrNotNull(tc, sender);
+	CuAssertTrue(tc, NTPSockLocalPort(sender)!=0);
+
+	//the port is taken
+	taken = NTPUDPBind(port);
+	CuAssertPtrNotNull(tc, taken);
+	CuAssertIntEquals(tc, NTPSOCK_ERROR, NTPSockStatus(taken));
+	NTPDisconnect(&taken);
+
+	CuAssertTrue(tc, NTPResolveAddress("127.0.0.1", port, &to));
+	CuAssertIntEquals(tc, 5, NTPUDPSendTo(sender, "hello", 5, &to));
+	CuAssertIntEquals(tc, 5, NTPUDPRecvFrom(receiver, buf, sizeof(buf), &from));
+	CuAssertTrue(tc, memcmp(buf, "hello", 5)==0);
+	NTPAddressToString(&from, text, sizeof(text), &fromPort);
+	CuAssertStrEquals(tc, "127.0.0.1", text);
+	CuAssertIntEquals(tc, NTPSockLocalPort(sender), fromPort);
+
+	//a batch each way
+	for(i=0;i<10;i++) {
+		dgrams[i].buf = bufs[i];
+		dgrams[i].len = sprintf(bufs[i], "datagram %d", i);
+		dgrams[i].address = &to;
+	}
+	CuAssertIntEquals(tc, 10, NTPUDPSendMany(sender, dgrams, 10));
+	memset(bufs, 0, sizeof(bufs));
+	for(total=0;total<10;total+=n) {
+		for(i=total;i<10;i++) {
+			dgrams[i].buf  = bufs[i];
+			dgrams[i].size = sizeof(bufs[i]);
+			dgrams[i].address = &from;
+		}
+		n = NTPUDPRecvMany(receiver, &dgrams[total], 10-total, TRUE);
+		CuAssertTrue(tc, n>0);
+	}
+	for(i=0;i<10;i++) {
+		sprintf(buf, "datagram %d", i);
+		CuAssertStrEquals(tc, buf, bufs[i]);
+		CuAssertIntEquals(tc, (int)strlen(buf), dgrams[i].len);
+	}
+	CuAssertIntEquals(tc, 0, NTPUDPRecvMany(receiver, dgrams, 10, FALSE));
+
+	//connected, so the normal send works
+	connected = NTPUDPConnect("localhost", port);
+	CuAssertPtrNotNull(tc, connected);
+	CuAssertIntEquals(tc, NTPSOCK_CONNECTED, NTPSockStatus(connected));
+	CuAssertIntEquals(tc, 3, NTPSend(connected, "abc", 3));
+	CuAssertIntEquals(tc, 3, NTPUDPRecvFrom(receiver, buf, sizeof(buf), NULL));
+	CuAssertTrue(tc, memcmp(buf, "abc", 3)==0);
+
+	//With segmentation offload one send is four datagrams. With receive
+	//offload as well they may come back as one bundle.
+	if(NTPUDPSetSegmentSize(sender, 100)) {
+		NTPUDPSetGRO(receiver, TRUE);
+		memset(big, 'x', sizeof(big));
+		CuAssertIntEquals(tc, 350, NTPUDPSendTo(sender, big, sizeof(big), &to));
+		for(total=0;total<350;total+=dgrams[0].len) {
+			dgrams[0].buf  = bigRecv;
+			dgrams[0].size = sizeof(bigRecv);
+			dgrams[0].address = NULL;
+			CuAssertIntEquals(tc, 1, NTPUDPRecvMany(receiver, dgrams, 1, TRUE));
+			if(dgrams[0].segmentSize>0)
+				CuAssertIntEquals(tc, 100, dgrams[0].segmentSize);
+			else
+				CuAssertIntEquals(tc, total<300 ? 100 : 50, dgrams[0].len);
+		}
+		CuAssertIntEquals(tc, 350, total);
+	}
+
+	NTPDisconnect(&connected);
+	NTPDisconnect(&sender);
+	NTPDisconnect(&receiver);
+}
+
+static void testSockReaderWriter(CuTest *tc) {
+	NTPSock *listenSock;
+	NTPSock *connectSock;
+	NTPSock *acceptSock;
+	NTPSockReader *reader;
+	NTPSockWriter *writer;
+	char blob[20], big[200], buf[256];
+	char line[32];
+	int i;
+
+	connectUtil(tc, &listenSock, &connectSock, &acceptSock, 45656);
+	for(i=0;i<(int)sizeof(blob);i++) blob[i] = i;
+	for(i=0;i<(int)sizeof(big);i++)  big[i]  = 'z'-i%26;
+
+	//Small writes are held until the buffer fills or we flush,
+	//the big one goes straight out along with them
+	writer = NTPNewSockWriter(connectSock, 64);
+	CuAssertPtrNotNull(tc, writer);
+	CuAssertIntEquals(tc, 7,  NTPWrite(writer, "HELLO\r\n", 7));
+	CuAssertIntEquals(tc, 12, NTPWrite(writer, "second line\n", 12));
+	CuAssertIntEquals(tc, 20, NTPWrite(writer, blob, sizeof(blob)));
+	CuAssertIntEquals(tc, 39, NTPWriterBuffered(writer));
+	CuAssertIntEquals(tc, 6,  NTPWrite(writer, "a,b,c;", 6));
+	CuAssertIntEquals(tc, 200, NTPWrite(writer, big, sizeof(big)));
+	CuAssertIntEquals(tc, 0,  NTPWriterBuffered(writer));
+	CuAssertIntEquals(tc, 8,  NTPWrite(writer, "abcdefgh", 8));
+	CuAssertTrue(tc, NTPFlush(writer));
+	CuAssertTrue(tc, NTPFlush(writer));
+	NTPFreeSockWriter(&writer);
+	CuAssertPtrEquals(tc, NULL, writer);
+
+	//A tiny buffer, so everything wraps around
+	reader = NTPNewSockReader(acceptSock, 16);
+	CuAssertPtrNotNull(tc, reader);
+	CuAssertIntEquals(tc, 5, NTPReadLine(reader, line, sizeof(line)));
+	CuAssertStrEquals(tc, "HELLO", line);
+	CuAssertIntEquals(tc, 11, NTPReadLine(reader, line, sizeof(line)));
+	CuAssertStrEquals(tc, "second line", line);
+
+	CuAssertTrue(tc, NTPPeek(reader, buf, 4)>0);
+	CuAssertIntEquals(tc, 0, buf[0]);
+	CuAssertIntEquals(tc, 20, NTPReadExact(reader, buf, sizeof(blob)));
+	CuAssertTrue(tc, memcmp(buf, blob, sizeof(blob))==0);
+
+	CuAssertIntEquals(tc, 6, NTPReadUntil(reader, ';', buf, sizeof(buf)));
+	CuAssertTrue(tc, memcmp(buf, "a,b,c;", 6)==0);
+	CuAssertIntEquals(tc, 200, NTPReadExact(reader, buf, sizeof(big)));
+	CuAssertTrue(tc, memcmp(buf, big, sizeof(big))==0);
+
+	//No delimiter in time, and nothing is lost
+	CuAssertIntEquals(tc, -1, NTPReadUntil(reader, '!', buf, 4));
+	CuAssertIntEquals(tc, 8, NTPReadExact(reader, buf, 8));
+	CuAssertTrue(tc, memcmp(buf, "abcdefgh", 8)==0);
+	CuAssertIntEquals(tc, 0, NTPReaderBuffered(reader));
+
+	//The other end going away is an error
+	NTPDisconnect(&connectSock);
+	CuAssertIntEquals(tc, -1, NTPReadExact(reader, buf, 1));
+	CuAssertIntEquals(tc, -1, NTPReadLine(reader, line, sizeof(line)));
+	NTPFreeSockReader(&reader);
+	CuAssertPtrEquals(tc, NULL, reader);
+
+	NTPDisconnect(&listenSock);
+	NTPDisconnect(&acceptSock);
+}
+
+//Counts the TCP sockets we've accepted on port, and fails
+//if any of them would be inherited by a program we exec()
+static int countAccepted(CuTest *tc, uint16_t port) {
+	struct sockaddr_storage addr;
+	socklen_t len;
+	int fd, listening, count = 0;
+	uint16_t found;
+
+	for(fd=3;fd<1024;fd++) {
+		len = sizeof(addr);
+		if(getsockname(fd, (struct sockaddr*)&addr, &len)<0) continue;
+		if(addr.ss_family==AF_INET)
+			found = ntohs(((struct sockaddr_in*)&addr)->sin_port);
+		else if(addr.ss_family==AF_INET6)
+			found = ntohs(((struct sockaddr_in6*)&addr)->sin6_port);
+		else
+			continue;
+		if(found!=port) continue;
+		len = sizeof(listening);
+		if(getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len)<0 ||
+		   listening)
+			continue;
+		CuAssert(tc, "close on exec", fcntl(fd, F_GETFD) & FD_CLOEXEC);
+		count++;
+	}
+	return count;
+}
+
+static void testIORing(CuTest *tc) {
+	NTPSock *listenSock;
+	NTPSock *acceptSock;
+	NTPSock *connectSock;
+	NTPSock *secondSock;
+	NTPIORing *ring;
+	NTPIOCompletion done[4];
+	char msg[] = "Just remember the Red River Valley";
+	char regBuf[100] = {0};
+	char msgRecv[100] = {0};
+	void *bufs[1];
+	int lens[1];
+	int tag, i, n, total, portSocks;
+	uint16_t port = 45645;
+
+	connectUtil(tc, &listenSock, &connectSock, &acceptSock, port);
+
+	ring = NTPNewIORing(8);
+	CuAssertPtrNotNull(tc, ring);
+	CuAssert(tc, "register sock", NTPIORingRegisterSock(ring, acceptSock));
+	bufs[0] = regBuf;
+	lens[0] = sizeof(regBuf);
+	CuAssert(tc, "register bufs", NTPIORingRegisterBuffers(ring, bufs, lens, 1));
+
+	//nothing has been sent, so the recv can't complete yet
+	CuAssert(tc, "queue recv",
+	         NTPIORingRecv(ring, acceptSock, regBuf, sizeof(regBuf), &tag));
+	CuAssert(tc, "submit", NTPIORingSubmit(ring)==1);
+	CuAssert(tc, "nothing yet", NTPIORingReap(ring, done, 4, 100)==0);
+
+	//send from the other side, with a second connection in the backlog
+	secondSock = NTPConnectTCP("localhost", port);
+	CuAssertPtrNotNull(tc, secondSock);
+	CuAssert(tc, "queue send",
+	         NTPIORingSend(ring, connectSock, msg, strlen(msg), NULL));
+	portSocks = countAccepted(tc, port);
+	CuAssert(tc, "queue accept", NTPIORingAccept(ring, listenSock, NULL));
+	CuAssert(tc, "submit", NTPIORingSubmit(ring)==2);
+
+	for(n=0,total=0;n<3;) {
+		int got = NTPIORingReap(ring, done, 4, 10000);
+		CuAssert(tc, "reap", got>0);
+		for(i=0;i<got;i++,n++) {
+			if(done[i].op==NTPIO_RECV) {
+				CuAssert(tc, "recv sock", done[i].sock==acceptSock);
+				CuAssert(tc, "recv tag",  done[i].userData==&tag);
+				CuAssert(tc, "recv result", done[i].result>0);
+				memcpy(msgRecv+total, regBuf, done[i].result);
+				total += done[i].result;
+			}
+			else if(done[i].op==NTPIO_SEND) {
+				CuAssert(tc, "send result", done[i].result==strlen(msg));
+			}
+			else {
+				CuAssert(tc, "accept result", done[i].result==0);
+				CuAssertPtrNotNull(tc, done[i].accepted);
+				//the same as NTPAccept() gives, whichever way the ring works
+				CuAssertIntEquals(tc, portSocks+1, countAccepted(tc, port));
+				NTPDisconnect(&done[i].accepted);
+			}
+		}
+	}
+
+	//short reads are possible, pick up the rest the plain way
+	while(total<strlen(msg)) {
+		int got = NTPRecv(acceptSock, msgRecv+total, strlen(msg)-total);
+		CuAssert(tc, "Checking recv didn't fail", got>0);
+		total += got;
+	}
+	CuAssert(tc, "Checking message correct", NTPstrcmp(msgRecv, msg)==0);
+
+	//cleanup
+	CuAssert(tc, "unregister sock", NTPIORingUnregisterSock(ring, acceptSock));
+	NTPFreeIORing(&ring);
+	NTPDisconnect(&secondSock);
+	NTPDisconnect(&listenSock);
+	NTPDisconnect(&connectSock);
+	NTPDisconnect(&acceptSock);
+	CuAssert(tc, "should be NULL", ring==NULL);
+}
+
 CuSuite *getNetworkSuite(void) {
 	CuSuite *suite = CuSuiteNew();
 
 	SUITE_ADD_TEST(suite, testDisconnectWhileConnecting);
+	SUITE_ADD_TEST(suite, testConnectPool);
+	SUITE_ADD_TEST(suite, testSockReuse);
+	SUITE_ADD_TEST(suite, testDNSCache);
 	SUITE_ADD_TEST(suite, testConnectSendRecv);
+	SUITE_ADD_TEST(suite, testConnectAttempts);
+	SUITE_ADD_TEST(suite, testConnectTimeout);
+	SUITE_ADD_TEST(suite, testSendvRecvv);
+	SUITE_ADD_TEST(suite, testSendFile);
+	SUITE_ADD_TEST(suite, testSendFileNonBlocking);
+	SUITE_ADD_TEST(suite, testZeroCopy);
+	SUITE_ADD_TEST(suite, testAcceptMany);
+	SUITE_ADD_TEST(suite, testListenSharded);
 	SUITE_ADD_TEST(suite, testRecvFail);
 	SUITE_ADD_TEST(suite, testSendFail);
 	SUITE_ADD_TEST(suite, testSelect);
+	SUITE_ADD_TEST(suite, testPoller);
+	SUITE_ADD_TEST(suite, testWaitConnected);
+	SUITE_ADD_TEST(suite, testIORing);
+	SUITE_ADD_TEST(suite, testSockReaderWriter);
+	SUITE_ADD_TEST(suite, testUDP);
+	SUITE_ADD_TEST(suite, testUnixSockets);
 	return suite;
 }
 
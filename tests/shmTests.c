@@ -0,0 +1,256 @@
+#include <CuTest.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <notrap/notrap.h>
+
+#define SHM_MESSAGES 20000
+
+//Every message says who sent it and its number, then is filled out to
+//a length that changes, so messages land all over the ring
+static int makeMessage(char *buf, int sender, int n) {
+	int len = 8 + (n*37)%300;
+	memset(buf, 'a' + n%26, len);
+	memcpy(buf, &sender, 4);
+	memcpy(buf+4, &n, 4);
+	return len;
+}
+
+static BOOL checkMessage(char *buf, int len, int *sender, int *n) {
+	int i;
+	if(len<8) return FALSE;
+	memcpy(sender, buf, 4);
+	memcpy(n, buf+4, 4);
+	if(len!=8 + (*n*37)%300) return FALSE;
+	for(i=8;i<len;i++)
+		if(buf[i]!='a' + *n%26) return FALSE;
+	return TRUE;
+}
+
+typedef struct {
+	char *name;
+	int id;
+	int count;
+} ShmProducerArg;
+
+static void *shmProducer(void *arg) {
+	ShmProducerArg *a = (ShmProducerArg*)arg;
+	NTPShmChannel *ch = NTPOpenShmChannel(a->name);
+	char buf[400];
+	int i;
+
+	if(ch==NULL) return NULL;
+	for(i=0;i<a->count;i++) NTPShmSend(ch, buf, makeMessage(buf, a->id, i));
+	NTPFreeShmChannel(&ch);
+	return NULL;
+}
+
+static void testShmSPSC(CuTest *tc) {
+	NTPShmChannel *ch, *opened;
+	NTPThread *producer;
+	ShmProducerArg arg;
+	char name[64], buf[400], big[3000];
+	int i, len, sender, n, bad = 0;
+
+	sprintf(name, "/tmp/notrapTestShm%d", (int)getpid());
+	CuAssertTrue(tc, NTPOpenShmChannel(name)==NULL);
+	ch = NTPNewShmChannel(name, 100, NTPSHM_SPSC);
+	CuAssertPtrNotNull(tc, ch);
+
+	//rounded up to 4096, and half that is the biggest message
+	CuAssertIntEquals(tc, 2048-8, NTPShmMaxMessage(ch));
+	CuAssertIntEquals(tc, 0, NTPShmRecv(ch, buf, sizeof(buf), 0));
+	CuAssertIntEquals(tc, 0, NTPShmRecv(ch, buf, sizeof(buf), 20));
+	CuAssert(tc, "too long", !NTPShmTrySend(ch, big, 2048));
+	CuAssert(tc, "empty", !NTPShmTrySend(ch, big, 0));
+
+	//fill it up, without anyone taking them out
+	opened = NTPOpenShmChannel(name);
+	CuAssertPtrNotNull(tc, opened);
+	memset(big, 'x', sizeof(big));
+	CuAssert(tc, "fits", NTPShmTrySend(opened, big, 2040));
+	CuAssert(tc, "fits", NTPShmTrySend(opened, big, 1000));
+	CuAssert(tc, "full", !NTPShmTrySend(opened, big, 1500));
+
+	//too long for buf stays in there
+	CuAssertIntEquals(tc, -1, NTPShmRecv(ch, buf, sizeof(buf), 0));
+	CuAssertIntEquals(tc, 2040, NTPShmRecv(ch, big, sizeof(big), 0));
+	CuAssertIntEquals(tc, 1000, NTPShmRecv(ch, big, sizeof(big), 0));
+	CuAssertIntEquals(tc, 0, NTPShmRecv(ch, big, sizeof(big), 0));
+	NTPFreeShmChannel(&opened);
+	CuAssert(tc, "should be NULL", opened==NULL);
+
+	//lots of them from another thread, wrapping around many times
+	arg.name  = name;
+	arg.id    = 7;
+	arg.count = SHM_MESSAGES;
+	producer = NTPNewThread(&shmProducer, &arg, NULL);
+	CuAssertPtrNotNull(tc, producer);
+	for(i=0;i<SHM_MESSAGES;i++) {
+		len = NTPShmRecv(ch, buf, sizeof(buf), 10000);
+		if(!checkMessage(buf, len, &sender, &n) || sender!=7 || n!=i) bad++;
+	}
+	NTPJoinThread(&producer, NULL);
+	CuAssertIntEquals(tc, 0, bad);
+	CuAssertIntEquals(tc, 0, NTPShmRecv(ch, buf, sizeof(buf), 0));
+
+	//the maker removes the files
+	NTPFreeShmChannel(&ch);
+	CuAssert(tc, "should be NULL", ch==NULL);
+	CuAssertTrue(tc, access(name, F_OK)!=0);
+	CuAssertTrue(tc, NTPOpenShmChannel(name)==NULL);
+}
+
+static void testShmReplace(CuTest *tc) {
+	NTPShmChannel *ch, *opened;
+	char name[64], fifo[80], buf[16];
+	int fd, status;
+	pid_t child;
+
+	//a file that isn't a channel is left alone
+	sprintf(name, "/tmp/notrapTestShmFile%d", (int)getpid());
+	fd = open(name, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+	CuAssertTrue(tc, fd>=0);
+	CuAssertIntEquals(tc, 5, (int)write(fd, "hello", 5));
+	close(fd);
+	CuAssertTrue(tc, NTPNewShmChannel(name, 4096, NTPSHM_SPSC)==NULL);
+	fd = open(name, O_RDONLY);
+	CuAssertIntEquals(tc, 5, (int)read(fd, buf, sizeof(buf)));
+	close(fd);
+	unlink(name);
+
+	//so is a channel someone is using
+	sprintf(name, "/tmp/notrapTestShmLive%d", (int)getpid());
+	ch = NTPNewShmChannel(name, 4096, NTPSHM_SPSC);
+	CuAssertPtrNotNull(tc, ch);
+	CuAssertTrue(tc, NTPNewShmChannel(name, 4096, NTPSHM_SPSC)==NULL);
+	opened = NTPOpenShmChannel(name);
+	CuAssertPtrNotNull(tc, opened);
+	CuAssert(tc, "still works", NTPShmTrySend(opened, "hi", 2));
+	CuAssertIntEquals(tc, 2, NTPShmRecv(ch, buf, sizeof(buf), 0));
+	NTPFreeShmChannel(&opened);
+	NTPFreeShmChannel(&ch);
+
+	//one left behind by a process that never freed it is replaced,
+	//once the last one using it lets go
+	child = fork();
+	CuAssertTrue(tc, child>=0);
+	if(child==0) {
+		NTPNewShmChannel(name, 4096, NTPSHM_SPSC);
+		_exit(0);
+	}
+	CuAssertTrue(tc, waitpid(child, &status, 0)==child);
+	CuAssertTrue(tc, access(name, F_OK)==0);
+	opened = NTPOpenShmChannel(name);
+	CuAssertPtrNotNull(tc, opened);
+	CuAssertTrue(tc, NTPNewShmChannel(name, 4096, NTPSHM_SPSC)==NULL);
+	NTPFreeShmChannel(&opened);
+	ch = NTPNewShmChannel(name, 4096, NTPSHM_SPSC);
+	CuAssertPtrNotNull(tc, ch);
+	NTPFreeShmChannel(&ch);
+	sprintf(fifo, "%s.notify", name);
+	CuAssertTrue(tc, access(name, F_OK)!=0);
+	CuAssertTrue(tc, access(fifo, F_OK)!=0);
+}
+
+#define SHM_PRODUCERS 3
+
+static void testShmMPSC(CuTest *tc) {
+	NTPShmChannel *ch;
+	NTPThread *producers[SHM_PRODUCERS];
+	ShmProducerArg args[SHM_PRODUCERS];
+	int next[SHM_PRODUCERS] = {0};
+	char name[64], buf[400];
+	int i, len, sender, n, bad = 0;
+
+	sprintf(name, "/tmp/notrapTestShmMPSC%d", (int)getpid());
+	ch = NTPNewShmChannel(name, 8192, NTPSHM_MPSC);
+	CuAssertPtrNotNull(tc, ch);
+
+	for(i=0;i<SHM_PRODUCERS;i++) {
+		args[i].name  = name;
+		args[i].id    = i;
+		args[i].count = SHM_MESSAGES/SHM_PRODUCERS;
+		producers[i] = NTPNewThread(&shmProducer, &args[i], NULL);
+		CuAssertPtrNotNull(tc, producers[i]);
+	}
+
+	//they're mixed together, but each sender's are in order
+	for(i=0;i<SHM_PRODUCERS*(SHM_MESSAGES/SHM_PRODUCERS);i++) {
+		len = NTPShmRecv(ch, buf, sizeof(buf), 10000);
+		if(!checkMessage(buf, len, &sender, &n) ||
+		   sender<0 || sender>=SHM_PRODUCERS || n!=next[sender]++)
+			bad++;
+	}
+	for(i=0;i<SHM_PRODUCERS;i++) NTPJoinThread(&producers[i], NULL);
+	CuAssertIntEquals(tc, 0, bad);
+	CuAssertIntEquals(tc, 0, NTPShmRecv(ch, buf, sizeof(buf), 0));
+	NTPFreeShmChannel(&ch);
+}
+
+static void testShmFork(CuTest *tc) {
+	NTPShmChannel *ch = NTPNewShmChannel(NULL, 4096, NTPSHM_SPSC);
+	NTP_FD_SET readSet;
+	NTPSock *sock;
+	char buf[400];
+	int i, len, sender, n, status, bad = 0;
+	pid_t child;
+
+	CuAssertPtrNotNull(tc, ch);
+	sock = NTPShmChannelSock(ch);
+	CuAssertPtrNotNull(tc, sock);
+	CuAssertTrue(tc, sock==NTPShmChannelSock(ch));
+
+	//nothing there
+	NTP_ZERO_SET(&readSet);
+	NTP_FD_ADD(sock, &readSet);
+	CuAssertIntEquals(tc, 0, NTPShmRecv(ch, buf, sizeof(buf), 0));
+	CuAssertIntEquals(tc, 0, NTPSelect(&readSet, NULL, 50));
+
+	//a child process sends, after a while, so we're asleep
+	child = fork();
+	CuAssertTrue(tc, child>=0);
+	if(child==0) {
+		NTPSelect(NULL, NULL, 50);
+		for(i=0;i<SHM_MESSAGES;i++) NTPShmSend(ch, buf, makeMessage(buf, 1, i));
+		_exit(0);
+	}
+
+	//wait the way an event loop would
+	i = 0;
+	while(i<SHM_MESSAGES) {
+		NTP_ZERO_SET(&readSet);
+		NTP_FD_ADD(sock, &readSet);
+		if(NTPSelect(&readSet, NULL, 10000)<=0) break;
+		while((len = NTPShmRecv(ch, buf, sizeof(buf), 0))>0) {
+			if(!checkMessage(buf, len, &sender, &n) || n!=i) bad++;
+			i++;
+		}
+	}
+	CuAssertIntEquals(tc, SHM_MESSAGES, i);
+	CuAssertIntEquals(tc, 0, bad);
+	CuAssertTrue(tc, waitpid(child, &status, 0)==child);
+	CuAssertTrue(tc, WIFEXITED(status) && WEXITSTATUS(status)==0);
+
+	//once it's empty, the sock isn't readable anymore. The child could
+	//have woken us once more after we last looked, so look again.
+	CuAssertIntEquals(tc, 0, NTPShmRecv(ch, buf, sizeof(buf), 0));
+	NTP_ZERO_SET(&readSet);
+	NTP_FD_ADD(sock, &readSet);
+	CuAssertIntEquals(tc, 0, NTPSelect(&readSet, NULL, 0));
+	NTPFreeShmChannel(&ch);
+}
+
+CuSuite *getShmSuite(void) {
+	CuSuite *suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, testShmSPSC);
+	SUITE_ADD_TEST(suite, testShmReplace);
+	SUITE_ADD_TEST(suite, testShmMPSC);
+	SUITE_ADD_TEST(suite, testShmFork);
+
+	return suite;
+}
@@ -0,0 +1,568 @@
+//for pthread_getname_np() and sched_getcpu()
+#define _GNU_SOURCE
+#include <CuTest.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <notrap/notrap.h>
+
+static int counter;
+
+static void countTask(void *arg) {
+	__atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+}
+
+//Each one submits two more, until depth runs out, then waits for them
+typedef struct {
+	NTPThreadPool *pool;
+	int depth;
+} TreeArg;
+
+static void treeTask(void *arg) {
+	TreeArg *me = (TreeArg*)arg;
+	TreeArg children[2];
+	NTPTaskGroup *group;
+	int i;
+
+	__atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+	if(me->depth==0) return;
+
+	group = NTPNewTaskGroup();
+	for(i=0;i<2;i++) {
+		children[i].pool  = me->pool;
+		children[i].depth = me->depth-1;
+		NTPSubmitTask(me->pool, &treeTask, &children[i], group);
+	}
+	NTPWaitTaskGroup(group);
+	NTPFreeTaskGroup(&group);
+}
+
+static void testThreadPool(CuTest *tc) {
+	NTPThreadPool *pool = NTPNewThreadPool(4);
+	NTPTaskGroup *group = NTPNewTaskGroup();
+	TreeArg root;
+	int i;
+
+	CuAssertPtrNotNull(tc, pool);
+	CuAssertPtrNotNull(tc, group);
+
+	//lots of tasks from outside the pool
+	counter = 0;
+	for(i=0;i<100000;i++)
+		CuAssert(tc, "submit", NTPSubmitTask(pool, &countTask, NULL, group));
+	NTPWaitTaskGroup(group);
+	CuAssertIntEquals(tc, 100000, __atomic_load_n(&counter, __ATOMIC_RELAXED));
+
+	//tasks submitting tasks, and waiting on them, from inside the pool
+	counter = 0;
+	root.pool  = pool;
+	root.depth = 12;
+	NTPSubmitTask(pool, &treeTask, &root, group);
+	NTPWaitTaskGroup(group);
+	CuAssertIntEquals(tc, (1<<13)-1, __atomic_load_n(&counter, __ATOMIC_RELAXED));
+
+	//freeing the pool runs whatever is left
+	counter = 0;
+	for(i=0;i<1000;i++)
+		NTPSubmitTask(pool, &countTask, NULL, NULL);
+	NTPFreeThreadPool(&pool);
+	CuAssert(tc, "should be NULL", pool==NULL);
+	CuAssertIntEquals(tc, 1000, counter);
+
+	NTPFreeTaskGroup(&group);
+	CuAssert(tc, "should be NULL", group==NULL);
+
+	//one per CPU
+	pool = NTPNewThreadPool(0);
+	CuAssertPtrNotNull(tc, pool);
+	NTPFreeThreadPool(&pool);
+}
+
+typedef struct {
+	char name[16];
+	int  cpu;
+	int  nice;
+	char big[1000];  //make sure we can use a little stack
+} ThreadInfo;
+
+static void *infoThread(void *arg) {
+	ThreadInfo *info = (ThreadInfo*)arg;
+	memset(info->big, 1, sizeof(info->big));
+#ifdef __linux__
+	pthread_getname_np(pthread_self(), info->name, sizeof(info->name));
+	info->cpu  = sched_getcpu();
+	info->nice = getpriority(PRIO_PROCESS, 0);
+#endif
+	return info;
+}
+
+static ThreadInfo detachedInfo;  //outlives the test
+
+static void testThreads(CuTest *tc) {
+	NTPThreadOptions options;
+	NTPThread *thread;
+	ThreadInfo info;
+	int cpu = 0;
+	void *result = NULL;
+
+	//defaults
+	thread = NTPNewThread(&infoThread, &info, NULL);
+	CuAssertPtrNotNull(tc, thread);
+	CuAssert(tc, "join", NTPJoinThread(&thread, &result));
+	CuAssert(tc, "should be NULL", thread==NULL);
+	CuAssertPtrEquals(tc, &info, result);
+
+	memset(&options, 0, sizeof(options));
+	options.stackSize = 32*1024;
+	options.name      = "ntp-test-thread-long-name";
+#ifdef __linux__
+	options.cpus      = &cpu;
+	options.numCPUs   = 1;
+	options.priority  = 5;
+#endif
+	memset(&info, 0, sizeof(info));
+	thread = NTPNewThread(&infoThread, &info, &options);
+	CuAssertPtrNotNull(tc, thread);
+	CuAssert(tc, "join", NTPJoinThread(&thread, NULL));
+#ifdef __linux__
+	CuAssertStrEquals(tc, "ntp-test-thread", info.name);
+	CuAssertIntEquals(tc, 0, info.cpu);
+	CuAssertIntEquals(tc, 5, info.nice);
+#endif
+
+	//bad CPU
+	options.cpus = &cpu;
+	options.numCPUs = 1;
+	cpu = -1;
+	CuAssert(tc, "bad cpu", NTPNewThread(&infoThread, &info, &options)==NULL);
+
+	//naming the current thread, and detaching
+	CuAssert(tc, "name", NTPSetThreadName(NULL, "notrapTests"));
+	thread = NTPNewThread(&infoThread, &detachedInfo, NULL);
+	CuAssert(tc, "detach", NTPDetachThread(&thread));
+	CuAssert(tc, "should be NULL", thread==NULL);
+	CuAssert(tc, "join NULL", !NTPJoinThread(&thread, NULL));
+}
+
+typedef struct {
+	NTPLock lock;
+	int count;
+} LockedCount;
+
+static void *lockThread(void *arg) {
+	LockedCount *lc = (LockedCount*)arg;
+	int i;
+	for(i=0;i<100000;i++) {
+		NTPAcquireLock(&lc->lock);
+		lc->count++;
+		NTPReleaseLock(&lc->lock);
+	}
+	return NULL;
+}
+
+static NTPLock staticLock = NTP_LOCK_INITIALIZER;
+
+static void *trackThread(void *arg) {
+	NTPTrackLock((NTPLock*)arg, "raced lock");
+	return NULL;
+}
+
+//How many lines of NTPDumpLockStats() mention name
+static int dumpedLines(const char *name) {
+	FILE *out = tmpfile();
+	char line[256];
+	int rv = 0;
+
+	NTPDumpLockStats(out);
+	rewind(out);
+	while(fgets(line, sizeof(line), out)!=NULL)
+		if(strstr(line, name)!=NULL) rv++;
+	fclose(out);
+	return rv;
+}
+
+static void testLock(CuTest *tc) {
+	LockedCount lc;
+	NTPThread *threads[4];
+	NTPLockStats stats;
+	FILE *out;
+	char line[256];
+	int i, round;
+
+	CuAssert(tc, "init", NTPInitLock(&lc.lock));
+	CuAssert(tc, "not tracked", !NTPGetLockStats(&lc.lock, &stats));
+	CuAssert(tc, "track", NTPTrackLock(&lc.lock, "counter lock"));
+	lc.count = 0;
+
+	for(i=0;i<4;i++) {
+		threads[i] = NTPNewThread(&lockThread, &lc, NULL);
+		CuAssertPtrNotNull(tc, threads[i]);
+	}
+	for(i=0;i<4;i++) NTPJoinThread(&threads[i], NULL);
+	CuAssertIntEquals(tc, 400000, lc.count);
+
+	CuAssert(tc, "stats", NTPGetLockStats(&lc.lock, &stats));
+	CuAssert(tc, "acquisitions", stats.acquisitions==400000);
+	CuAssert(tc, "contended", stats.contended<=stats.acquisitions);
+	CuAssert(tc, "wait", stats.contended==0 || stats.waitNanos>0);
+
+	out = tmpfile();
+	NTPDumpLockStats(out);
+	rewind(out);
+	CuAssertPtrNotNull(tc, fgets(line, sizeof(line), out));  //header
+	CuAssertPtrNotNull(tc, fgets(line, sizeof(line), out));
+	CuAssert(tc, "dumped", strstr(line, "counter lock")!=NULL);
+	fclose(out);
+
+	NTPDestroyLock(&lc.lock);
+	CuAssertIntEquals(tc, 0, dumpedLines("counter lock"));
+
+	//tracking the same lock from several threads at once lists it once
+	for(round=0;round<20;round++) {
+		CuAssert(tc, "init", NTPInitLock(&lc.lock));
+		for(i=0;i<4;i++) threads[i] = NTPNewThread(&trackThread, &lc.lock, NULL);
+		for(i=0;i<4;i++) NTPJoinThread(&threads[i], NULL);
+		CuAssertIntEquals(tc, 1, dumpedLines("raced lock"));
+		NTPDestroyLock(&lc.lock);
+		CuAssertIntEquals(tc, 0, dumpedLines("raced lock"));
+	}
+
+	CuAssert(tc, "static", NTPAcquireLock(&staticLock));
+	NTPReleaseLock(&staticLock);
+}
+
+typedef struct {
+	NTPLock lock;
+	NTPCondition cond;
+	NTPSemaphore sem;
+	int ready;
+} Handoff;
+
+static void *handoffThread(void *arg) {
+	Handoff *h = (Handoff*)arg;
+
+	NTPAcquireLock(&h->lock);
+	h->ready = 1;
+	NTPSignalCondition(&h->cond);
+	NTPReleaseLock(&h->lock);
+
+	NTPPostSemaphore(&h->sem);
+	NTPPostSemaphore(&h->sem);
+	return NULL;
+}
+
+static void testConditionSemaphore(CuTest *tc) {
+	Handoff h;
+	NTPThread *thread;
+	NTPSemaphore *sem;
+
+	CuAssert(tc, "lock", NTPInitLock(&h.lock));
+	CuAssert(tc, "cond", NTPInitCondition(&h.cond));
+	CuAssert(tc, "sem",  NTPInitSemaphore(&h.sem, 0));
+	h.ready = 0;
+
+	//nobody signals, so this times out
+	NTPAcquireLock(&h.lock);
+	CuAssert(tc, "timeout", !NTPWaitConditionTimeout(&h.cond, &h.lock, 20));
+	NTPReleaseLock(&h.lock);
+	CuAssert(tc, "sem timeout", !NTPWaitSemaphoreTimeout(&h.sem, 20));
+	CuAssert(tc, "sem try", !NTPTryWaitSemaphore(&h.sem));
+
+	thread = NTPNewThread(&handoffThread, &h, NULL);
+	CuAssertPtrNotNull(tc, thread);
+
+	NTPAcquireLock(&h.lock);
+	while(!h.ready)
+		NTPWaitCondition(&h.cond, &h.lock);
+	NTPReleaseLock(&h.lock);
+
+	NTPWaitSemaphore(&h.sem);
+	CuAssert(tc, "sem wait", NTPWaitSemaphoreTimeout(&h.sem, 5000));
+	NTPJoinThread(&thread, NULL);
+	CuAssert(tc, "sem empty", !NTPTryWaitSemaphore(&h.sem));
+
+	NTPDestroySemaphore(&h.sem);
+	NTPDestroyCondition(&h.cond);
+	NTPDestroyLock(&h.lock);
+
+	CuAssert(tc, "negative", NTPNewSemaphore(-1)==NULL);
+	sem = NTPNewSemaphore(1);
+	CuAssert(tc, "initial", NTPTryWaitSemaphore(sem));
+	NTPFreeSemaphore(&sem);
+	CuAssert(tc, "should be NULL", sem==NULL);
+}
+
+//Writers keep both halves equal, readers check that they are
+typedef struct {
+	NTPRWLock *lock;
+	int a, b;
+	int torn;
+} RWShared;
+
+static void *rwReader(void *arg) {
+	RWShared *sh = (RWShared*)arg;
+	int i;
+	for(i=0;i<100000;i++) {
+		NTPAcquireReadLock(sh->lock);
+		if(sh->a!=sh->b) __atomic_store_n(&sh->torn, 1, __ATOMIC_RELAXED);
+		NTPReleaseReadLock(sh->lock);
+	}
+	return NULL;
+}
+
+static void *rwWriter(void *arg) {
+	RWShared *sh = (RWShared*)arg;
+	int i;
+	for(i=0;i<10000;i++) {
+		NTPAcquireWriteLock(sh->lock);
+		sh->a++;
+		sh->b++;
+		NTPReleaseWriteLock(sh->lock);
+	}
+	return NULL;
+}
+
+static void testRWLock(CuTest *tc) {
+	RWShared sh;
+	NTPThread *threads[6];
+	int i;
+
+	sh.lock = NTPNewRWLock();
+	CuAssertPtrNotNull(tc, sh.lock);
+	sh.a = sh.b = sh.torn = 0;
+
+	for(i=0;i<6;i++) {
+		threads[i] = NTPNewThread(i<4 ? &rwReader : &rwWriter, &sh, NULL);
+		CuAssertPtrNotNull(tc, threads[i]);
+	}
+	for(i=0;i<6;i++) NTPJoinThread(&threads[i], NULL);
+
+	CuAssertIntEquals(tc, 0, sh.torn);
+	CuAssertIntEquals(tc, 20000, sh.a);
+	CuAssertIntEquals(tc, 20000, sh.b);
+	NTPFreeRWLock(&sh.lock);
+	CuAssert(tc, "should be NULL", sh.lock==NULL);
+}
+
+#define QUEUE_ITEMS 1000000
+
+static void *spscProducer(void *arg) {
+	NTPSPSCQueue *q = (NTPSPSCQueue*)arg;
+	void *batch[16];
+	intptr_t next = 1;
+	int i, n;
+
+	while(next<=QUEUE_ITEMS) {
+		if(next%3==0) {
+			//a batch, as much as fits
+			for(i=0;i<16 && next+i<=QUEUE_ITEMS;i++) batch[i] = (void*)(next+i);
+			n = NTPSPSCQueuePushMany(q, batch, i);
+			if(n==0) NTPSPSCQueuePush(q, batch[n++]);  //full, so wait
+			next += n;
+		}
+		else NTPSPSCQueuePush(q, (void*)next++);
+	}
+	return NULL;
+}
+
+static void testSPSCQueue(CuTest *tc) {
+	NTPSPSCQueue *q = NTPNewSPSCQueue(3);
+	NTPThread *producer;
+	void *items[8], *item;
+	intptr_t expected = 1;
+	int i, n, outOfOrder = 0;
+
+	//rounded up to 4
+	CuAssertPtrNotNull(tc, q);
+	CuAssert(tc, "empty", !NTPSPSCQueueTryPop(q, &item));
+	for(i=0;i<4;i++) CuAssert(tc, "push", NTPSPSCQueueTryPush(q, (void*)(intptr_t)i));
+	CuAssert(tc, "full", !NTPSPSCQueueTryPush(q, NULL));
+	CuAssertIntEquals(tc, 2, NTPSPSCQueuePopMany(q, items, 2));
+	CuAssert(tc, "order", items[0]==(void*)0 && items[1]==(void*)1);
+	CuAssertIntEquals(tc, 2, NTPSPSCQueuePushMany(q, items, 8));
+	CuAssertIntEquals(tc, 4, NTPSPSCQueuePopMany(q, items, 8));
+	CuAssert(tc, "order", items[0]==(void*)2 && items[3]==(void*)1);
+	NTPFreeSPSCQueue(&q);
+	CuAssert(tc, "should be NULL", q==NULL);
+
+	//everything comes out in order, across threads
+	q = NTPNewSPSCQueue(256);
+	producer = NTPNewThread(&spscProducer, q, NULL);
+	CuAssertPtrNotNull(tc, producer);
+	while(expected<=QUEUE_ITEMS) {
+		if(expected%2==0) {
+			n = NTPSPSCQueuePopMany(q, items, 8);
+			if(n==0) items[n++] = NTPSPSCQueuePop(q);  //empty, so wait
+			for(i=0;i<n;i++)
+				if(items[i]!=(void*)expected++) outOfOrder++;
+		}
+		else if(NTPSPSCQueuePop(q)!=(void*)expected++) outOfOrder++;
+	}
+	NTPJoinThread(&producer, NULL);
+	CuAssertIntEquals(tc, 0, outOfOrder);
+	CuAssert(tc, "drained", !NTPSPSCQueueTryPop(q, &item));
+	NTPFreeSPSCQueue(&q);
+}
+
+#define MPMC_THREADS 4
+
+typedef struct {
+	NTPMPMCQueue *q;
+	int id;
+	char *seen;     //one per item, across all producers
+	int duplicates;
+} MPMCArg;
+
+static void *mpmcProducer(void *arg) {
+	MPMCArg *a = (MPMCArg*)arg;
+	void *batch[8];
+	intptr_t next = a->id*QUEUE_ITEMS, end = next+QUEUE_ITEMS/MPMC_THREADS;
+	int i;
+
+	while(next<end) {
+		if(next%2==0) {
+			for(i=0;i<8 && next+i<end;i++) batch[i] = (void*)(next+i);
+			i = NTPMPMCQueuePushMany(a->q, batch, i);
+			if(i==0) NTPMPMCQueuePush(a->q, batch[i++]);  //full, so wait
+			next += i;
+		}
+		else NTPMPMCQueuePush(a->q, (void*)next++);
+	}
+	return NULL;
+}
+
+static void markSeen(MPMCArg *a, void *item) {
+	intptr_t v = (intptr_t)item;
+	int index = (v/QUEUE_ITEMS)*(QUEUE_ITEMS/MPMC_THREADS) + v%QUEUE_ITEMS;
+	if(__atomic_exchange_n(&a->seen[index], 1, __ATOMIC_RELAXED))
+		a->duplicates++;
+}
+
+static void *mpmcConsumer(void *arg) {
+	MPMCArg *a = (MPMCArg*)arg;
+	void *batch[8];
+	int i, n, left = QUEUE_ITEMS/MPMC_THREADS;
+
+	//everyone pops exactly as many as each producer pushes
+	while(left>0) {
+		n = NTPMPMCQueuePopMany(a->q, batch, left<8 ? left : 8);
+		if(n==0) {
+			markSeen(a, NTPMPMCQueuePop(a->q));
+			n = 1;
+		}
+		else for(i=0;i<n;i++) markSeen(a, batch[i]);
+		left -= n;
+	}
+	return NULL;
+}
+
+static void testMPMCQueue(CuTest *tc) {
+	NTPMPMCQueue *q = NTPNewMPMCQueue(100);
+	NTPThread *threads[MPMC_THREADS*2];
+	MPMCArg args[MPMC_THREADS*2];
+	void *items[8], *item;
+	char *seen = calloc(QUEUE_ITEMS, 1);
+	int i, missing = 0, duplicates = 0;
+
+	//rounded up to 128
+	CuAssertPtrNotNull(tc, q);
+	CuAssert(tc, "empty", !NTPMPMCQueueTryPop(q, &item));
+	for(i=0;i<128;i++) CuAssert(tc, "push", NTPMPMCQueueTryPush(q, (void*)(intptr_t)i));
+	CuAssert(tc, "full", !NTPMPMCQueueTryPush(q, NULL));
+	CuAssertIntEquals(tc, 0, NTPMPMCQueuePushMany(q, items, 8));
+	CuAssertIntEquals(tc, 8, NTPMPMCQueuePopMany(q, items, 8));
+	CuAssert(tc, "order", items[0]==(void*)0 && items[7]==(void*)7);
+	CuAssertIntEquals(tc, 8, NTPMPMCQueuePushMany(q, items, 8));
+	for(i=0;i<120;i++) NTPMPMCQueuePop(q);
+	CuAssertIntEquals(tc, 8, NTPMPMCQueuePopMany(q, items, 100));
+	CuAssert(tc, "order", items[0]==(void*)0 && items[7]==(void*)7);
+
+	//every item comes out exactly once
+	for(i=0;i<MPMC_THREADS*2;i++) {
+		args[i].q    = q;
+		args[i].id   = i%MPMC_THREADS;
+		args[i].seen = seen;
+		args[i].duplicates = 0;
+		threads[i] = NTPNewThread(i<MPMC_THREADS ? &mpmcProducer : &mpmcConsumer,
+		                          &args[i], NULL);
+		CuAssertPtrNotNull(tc, threads[i]);
+	}
+	for(i=0;i<MPMC_THREADS*2;i++) {
+		NTPJoinThread(&threads[i], NULL);
+		duplicates += args[i].duplicates;
+	}
+	for(i=0;i<QUEUE_ITEMS;i++) if(!seen[i]) missing++;
+	CuAssertIntEquals(tc, 0, duplicates);
+	CuAssertIntEquals(tc, 0, missing);
+	CuAssert(tc, "drained", !NTPMPMCQueueTryPop(q, &item));
+
+	free(seen);
+	NTPFreeMPMCQueue(&q);
+	CuAssert(tc, "should be NULL", q==NULL);
+}
+
+#define ATOMIC_THREADS 4
+#define ATOMIC_ADDS    100000
+
+static NTPAtomicInt64 atomicCounter = NTP_ATOMIC_INIT(0);
+
+static void *atomicAdder(void *arg) {
+	int i;
+	for(i=0;i<ATOMIC_ADDS;i++)
+		NTPAtomicFetchAddInt64(&atomicCounter, 1, NTP_ORDER_RELAXED);
+	return NULL;
+}
+
+static void testAtomics(CuTest *tc) {
+	NTPAtomicInt a = NTP_ATOMIC_INIT(5);
+	NTPAtomicPtr p = NTP_ATOMIC_INIT(NULL);
+	NTPThread *threads[ATOMIC_THREADS];
+	int expected, x;
+	void *ep;
+	int i;
+
+	CuAssertIntEquals(tc, 5, NTPAtomicLoadInt(&a, NTP_ORDER_ACQUIRE));
+	NTPAtomicStoreInt(&a, 7, NTP_ORDER_RELEASE);
+	CuAssertIntEquals(tc, 7, NTPAtomicExchangeInt(&a, 9, NTP_ORDER_ACQ_REL));
+	CuAssertIntEquals(tc, 9, NTPAtomicFetchAddInt(&a, 3, NTP_ORDER_SEQ_CST));
+	CuAssertIntEquals(tc, 12, NTPAtomicLoadInt(&a, NTP_ORDER_RELAXED));
+
+	//a failed swap tells us what was there instead
+	expected = 4;
+	CuAssertTrue(tc, !NTPAtomicCompareExchangeInt(&a, &expected, 20, NTP_ORDER_ACQ_REL));
+	CuAssertIntEquals(tc, 12, expected);
+	CuAssertTrue(tc, NTPAtomicCompareExchangeInt(&a, &expected, 20, NTP_ORDER_RELEASE));
+	CuAssertIntEquals(tc, 20, NTPAtomicLoadInt(&a, NTP_ORDER_RELAXED));
+
+	ep = NULL;
+	CuAssertTrue(tc, NTPAtomicCompareExchangePtr(&p, &ep, &x, NTP_ORDER_ACQ_REL));
+	CuAssertPtrEquals(tc, &x, NTPAtomicLoadPtr(&p, NTP_ORDER_ACQUIRE));
+	CuAssertPtrEquals(tc, &x, NTPAtomicExchangePtr(&p, NULL, NTP_ORDER_SEQ_CST));
+	NTPAtomicFence(NTP_ORDER_SEQ_CST);
+
+	for(i=0;i<ATOMIC_THREADS;i++) {
+		threads[i] = NTPNewThread(atomicAdder, NULL, NULL);
+		CuAssertPtrNotNull(tc, threads[i]);
+	}
+	for(i=0;i<ATOMIC_THREADS;i++)
+		CuAssertTrue(tc, NTPJoinThread(&threads[i], NULL));
+	CuAssertTrue(tc, NTPAtomicLoadInt64(&atomicCounter, NTP_ORDER_RELAXED) ==
+	                 (int64_t)ATOMIC_THREADS*ATOMIC_ADDS);
+}
+
+CuSuite *getThreadSuite(void) {
+	CuSuite *suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, testThreadPool);
+	SUITE_ADD_TEST(suite, testThreads);
+	SUITE_ADD_TEST(suite, testLock);
+	SUITE_ADD_TEST(suite, testConditionSemaphore);
+	SUITE_ADD_TEST(suite, testRWLock);
+	SUITE_ADD_TEST(suite, testSPSCQueue);
+	SUITE_ADD_TEST(suite, testMPMCQueue);
+	SUITE_ADD_TEST(suite, testAtomics);
+	return suite;
+}
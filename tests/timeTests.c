@@ -0,0 +1,114 @@
+#include <CuTest.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <notrap/notrap.h>
+
+static void testClocks(CuTest *tc) {
+	int64_t nanos = NTPMonotonicNanos();
+	int64_t millis = NTPMonotonicMillis();
+	int64_t coarse = NTPCoarseMillis();
+	time_t wall = NTPcurrentTimeMillis();
+
+	//sometime after 2013, in milliseconds
+	CuAssertTrue(tc, wall > (time_t)1356998400*1000);
+	CuAssertTrue(tc, nanos/1000000 <= millis);
+	CuAssertTrue(tc, millis - coarse < 100 && coarse - millis < 100);
+
+	NTPSelect(NULL, NULL, 20);
+	CuAssertTrue(tc, NTPMonotonicNanos() - nanos >= 20*1000000);
+	CuAssertTrue(tc, NTPMonotonicMillis() - millis >= 20);
+	CuAssertTrue(tc, NTPMonotonicMillis() >= millis);
+}
+
+typedef struct {
+	NTPTimerWheel *wheel;
+	int64_t due;     //NTPMonotonicMillis() it should go off at
+	int64_t firedAt;
+	int fired;
+	int again;       //how many more times to start itself
+} TimerArg;
+
+static void timerFired(NTPTimer *timer, void *arg) {
+	TimerArg *t = (TimerArg*)arg;
+	t->firedAt = NTPMonotonicMillis();
+	t->fired++;
+	if(t->again>0) {
+		t->again--;
+		t->due = t->firedAt + 5;
+		NTPStartTimer(t->wheel, timer, 5);
+	}
+}
+
+#define MANY_TIMERS 100000
+
+static void testTimerWheel(CuTest *tc) {
+	NTPTimerWheel *wheel = NTPNewTimerWheel(1);
+	NTPTimer timers[5], *many;
+	TimerArg args[5];
+	int delays[5] = {0, 5, 20, 300, 3600000};
+	int i, timeout;
+
+	CuAssertPtrNotNull(tc, wheel);
+	CuAssertIntEquals(tc, -1, NTPTimerWheelTimeout(wheel));
+	CuAssertIntEquals(tc, 0, NTPRunTimers(wheel));
+
+	for(i=0;i<5;i++) {
+		args[i].wheel = wheel;
+		args[i].fired = 0;
+		args[i].again = 0;
+		args[i].due   = NTPMonotonicMillis() + delays[i];
+		NTPInitTimer(&timers[i], timerFired, &args[i]);
+		CuAssertTrue(tc, !NTPTimerPending(&timers[i]));
+		NTPStartTimer(wheel, &timers[i], delays[i]);
+		CuAssertTrue(tc, NTPTimerPending(&timers[i]));
+	}
+	args[1].again = 2;
+	CuAssertIntEquals(tc, 5, NTPTimersPending(wheel));
+	CuAssertTrue(tc, NTPTimerWheelTimeout(wheel) <= 1);
+
+	//The hour long one gets stopped, and then the rest go off
+	NTPStopTimer(&timers[4]);
+	NTPStopTimer(&timers[4]);
+	CuAssertTrue(tc, !NTPTimerPending(&timers[4]));
+	while(NTPTimersPending(wheel)>0) {
+		timeout = NTPTimerWheelTimeout(wheel);
+		CuAssertTrue(tc, timeout>=0 && timeout<=300);
+		NTPSelect(NULL, NULL, timeout);
+		NTPRunTimers(wheel);
+	}
+	for(i=0;i<4;i++) {
+		CuAssertIntEquals(tc, i==1 ? 3 : 1, args[i].fired);
+		CuAssertTrue(tc, args[i].firedAt >= args[i].due);
+		CuAssertTrue(tc, args[i].firedAt <  args[i].due + 100);
+	}
+	CuAssertIntEquals(tc, 0, args[4].fired);
+
+	//Lots of them, spread over every level, all stopped again
+	many = malloc(MANY_TIMERS*sizeof(NTPTimer));
+	CuAssertPtrNotNull(tc, many);
+	for(i=0;i<MANY_TIMERS;i++) {
+		NTPInitTimer(&many[i], timerFired, &args[4]);
+		NTPStartTimer(wheel, &many[i], 1000 + ((int64_t)i*7919)%(1<<30));
+	}
+	CuAssertIntEquals(tc, MANY_TIMERS, NTPTimersPending(wheel));
+	for(i=0;i<MANY_TIMERS;i+=2) NTPStopTimer(&many[i]);
+	CuAssertIntEquals(tc, MANY_TIMERS/2, NTPTimersPending(wheel));
+	CuAssertIntEquals(tc, 0, NTPRunTimers(wheel));
+	for(i=1;i<MANY_TIMERS;i+=2) NTPStartTimer(wheel, &many[i], 100000);
+	CuAssertIntEquals(tc, MANY_TIMERS/2, NTPTimersPending(wheel));
+
+	NTPFreeTimerWheel(&wheel);
+	CuAssertPtrEquals(tc, NULL, wheel);
+	CuAssertTrue(tc, !NTPTimerPending(&many[1]));
+	CuAssertIntEquals(tc, 0, args[4].fired);
+	free(many);
+}
+
+CuSuite *getTimeSuite(void) {
+	CuSuite *suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, testClocks);
+	SUITE_ADD_TEST(suite, testTimerWheel);
+
+	return suite;
+}